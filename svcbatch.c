@@ -15,6 +15,7 @@
 
 #include <windows.h>
 #include <bcrypt.h>
+#include <sddl.h>
 #include <tlhelp32.h>
 
 #include <stdio.h>
@@ -36,6 +37,12 @@
 #define HAVE_LOGDIR_MUTEX       1
 #define HAVE_LOGDIR_LOCK        0
 
+#if defined(FSCTL_DUPLICATE_EXTENTS_TO_FILE)
+# define HAVE_BLOCK_CLONE       1
+#else
+# define HAVE_BLOCK_CLONE       0
+#endif
+
 #if defined(DEBUG_TRACE)
 # define HAVE_DEBUG_TRACE       1
 #else
@@ -70,6 +77,12 @@ static void                     xtracefopen(void);
 
 #define xsvcstatus(_s, _p)      if (servicemode) reportsvcstatus(__FUNCTION__, __LINE__, _s, _p)
 
+static void                    *xmmalloc(size_t);
+static void                    *xmcalloc(size_t);
+static void                     xfree(void *);
+
+#include "svcutil.h"
+
 #define SZ_STATUS_PROCESS_INFO  sizeof(SERVICE_STATUS_PROCESS)
 #define SYSTEM_SVC_SUBKEY       L"SYSTEM\\CurrentControlSet\\Services\\"
 #define IS_LEAP_YEAR(_y)        ((!(_y % 4)) ? (((_y % 400) && !(_y % 100)) ? 0 : 1) : 0)
@@ -100,6 +113,11 @@ typedef enum {
     SVCBATCH_STDIN_THREAD,
     SVCBATCH_STOP_THREAD,
     SVCBATCH_ROTATE_THREAD,
+    SVCBATCH_WRITER_THREAD,
+    SVCBATCH_SYNC_THREAD,
+    SVCBATCH_ZIP_THREAD,
+    SVCBATCH_RETAIN_THREAD,
+    SVCBATCH_CONTROL_THREAD,
     SVCBATCH_MAX_THREADS
 } SVCBATCH_THREAD_ID;
 
@@ -186,7 +204,10 @@ typedef struct _SVCBATCH_PIPE {
     HANDLE                  pipe;
     DWORD                   read;
     DWORD                   state;
-    BYTE                    buffer[SVCBATCH_PIPE_LEN];
+    DWORD                   stream;
+    int                     full;
+    int                     empty;
+    LPSVCBATCH_BUFFER       buffer;
 } SVCBATCH_PIPE, *LPSVCBATCH_PIPE;
 
 typedef struct _SVCBATCH_PROCESS {
@@ -233,17 +254,113 @@ typedef struct _SVCBATCH_SERVICE {
 
 } SVCBATCH_SERVICE, *LPSVCBATCH_SERVICE;
 
+typedef struct _SVCBATCH_ZIPJOB {
+    struct _SVCBATCH_ZIPJOB *next;
+    HANDLE                  fd;
+    LPWSTR                  name;
+} SVCBATCH_ZIPJOB, *LPSVCBATCH_ZIPJOB;
+
+typedef struct _SVCBATCH_ZIPQUEUE {
+    CRITICAL_SECTION        cs;
+    HANDLE                  event;
+    volatile LONG           state;
+    volatile LONG           count;
+    LPSVCBATCH_ZIPJOB       head;
+    LPSVCBATCH_ZIPJOB       tail;
+    ULONGLONG               files;
+    ULONGLONG               ibytes;
+    ULONGLONG               obytes;
+    ULONGLONG               ticks;
+} SVCBATCH_ZIPQUEUE, *LPSVCBATCH_ZIPQUEUE;
+
+typedef struct _SVCBATCH_RETAIN {
+    HANDLE                  event;
+    volatile LONG           state;
+    DWORD                   days;
+    ULONGLONG               bytes;
+    ULONGLONG               total;
+    ULONGLONG               freed;
+    DWORD                   removed;
+    DWORD                   rescans;
+    DWORD                   count;
+    DWORD                   size;
+    LPSVCBATCH_RETAIN_FILE  files;
+    int                     npatterns;
+    LPWSTR                  patterns[3];
+} SVCBATCH_RETAIN, *LPSVCBATCH_RETAIN;
+
+typedef struct _SVCBATCH_CONTROL {
+    HANDLE                  pipe;
+    HANDLE                  event;
+    HANDLE                  flushed;
+    HANDLE                  rotated;
+    volatile LONG           flush;
+    volatile LONG           rotaterc;
+    DWORD                   commands;
+    LPWSTR                  name;
+} SVCBATCH_CONTROL, *LPSVCBATCH_CONTROL;
+
+typedef struct _SVCBATCH_LOGGEN {
+    HANDLE                  fd;
+    SVCBATCH_GENLIST        gl;
+    LPWSTR                  base;
+    LPWSTR                  manifest;
+    LPSTR                   name;
+} SVCBATCH_LOGGEN, *LPSVCBATCH_LOGGEN;
+
 typedef struct _SVCBATCH_LOG {
     volatile LONG64         size;
     volatile HANDLE         fd;
     volatile LONG           state;
+    volatile LONG           rotate;
     int                     maxLogs;
     CRITICAL_SECTION        cs;
 
+    HANDLE                  map;
+    SVCBATCH_SEGMENT        seg;
+
+    HANDLE                  idx;
+    BOOL                    sol;
+    SVCBATCH_INDEXER        ix;
+
+    ULONGLONG               snaps;
+    ULONGLONG               snaplast;
+    ULONGLONG               snapmax;
+
+    struct _SVCBATCH_LOG   *next;
+    DWORD                   cutbytes;
+    BOOL                    cutsol;
+    BOOL                    cutempty;
+
+    LPSVCBATCH_LOGGEN       gen;
     LPCWSTR                 logName;
     LPWSTR                  logFile;
 } SVCBATCH_LOG, *LPSVCBATCH_LOG;
 
+typedef struct _SVCBATCH_ICONV {
+    SVCBATCH_DBCS           dc;
+    DWORD                   size;
+    LPWSTR                  wide;
+    LPSVCBATCH_BUFFER       out;
+} SVCBATCH_ICONV, *LPSVCBATCH_ICONV;
+
+typedef struct _SVCBATCH_FLUSH {
+    LPSVCBATCH_LOG          log;
+    SVCBATCH_COALESCE       co;
+    ULONGLONG               now;
+    LPSVCBATCH_BUFFER       line;
+    DWORD                   stream;
+    SVCBATCH_FRAMER         frame;
+    SVCBATCH_FRAMER         filter;
+    BOOL                    split;
+    BOOL                    reject;
+    ULONGLONG               filtered;
+    LPSVCBATCH_DEFLATE      zip;
+    ULONGLONG               zin;
+    ULONGLONG               zout;
+    ULONGLONG               ztime;
+} SVCBATCH_FLUSH, *LPSVCBATCH_FLUSH;
+
 /**
  * Length of the shared memory data.
  * Adjust this number so that SVCBATCH_IPC
@@ -318,6 +435,9 @@ static LPSVCBATCH_PROCESS    program        = NULL;
 static LPSVCBATCH_PROCESS    cmdproc        = NULL;
 static LPSVCBATCH_PROCESS    svcstop        = NULL;
 static LPSVCBATCH_LOG        outputlog      = NULL;
+static LPSVCBATCH_LOG        errorlog       = NULL;
+static LPSVCBATCH_QUEUE      logqueue       = NULL;
+static LPSVCBATCH_QUEUE      freequeue      = NULL;
 static LPSVCBATCH_IPC        sharedmem      = NULL;
 static LPSVCBATCH_VARIABLES  svariables     = NULL;
 static LPSVCBATCH_SCM_PARAMS scmpparams     = NULL;
@@ -332,9 +452,51 @@ static volatile LONG         runcounter     = 0;
 static volatile LONG         uidcounter     = 0;
 static volatile LONG         svcoptions     = 0;
 static volatile LONG         errorreported  = 0;
+static volatile LONG         logbuffers     = 0;
+static LPSVCBATCH_FILTER     loginclude     = NULL;
+static LPSVCBATCH_FILTER     logexclude     = NULL;
+static UINT                  logencoding    = 0;
+static DWORD                 logindex       = 0;
+static DWORD                 loggenerations = 0;
+static BOOL                  logsnapshot    = FALSE;
+static LPSVCBATCH_ZIPQUEUE   zipqueue       = NULL;
+static LPSVCBATCH_RETAIN     logretain      = NULL;
+static DWORD                 logratebytes   = 0;
+static DWORD                 logratelines   = 0;
+static DWORD                 lograteburst   = SVCBATCH_DEF_BURST;
+static SVCBATCH_BUCKET       bytesbucket;
+static SVCBATCH_BUCKET       linesbucket;
+static DWORD                 suppressedlines = 0;
+static ULONGLONG             suppressedbytes = 0;
+static SVCBATCH_CRASH        crashring;
+static DWORD                 crashsize      = SVCBATCH_CRASH_LEN;
+static LPWSTR                crashtail      = NULL;
+static CRITICAL_SECTION      crashsync;
+static LPSVCBATCH_CONTROL    svccontrol     = NULL;
+static DWORD                 backpressure   = SVCBATCH_BACKPRESSURE_BLOCK;
+static DWORD                 logspillmax    = SVCBATCH_DEF_SPILL;
+static SVCBATCH_SPILL        logspill;
+static DWORD                 pipebufsize    = SVCBATCH_PIPE_SIZ;
+static DWORD                 readbufsize    = SVCBATCH_PIPE_LEN;
+static DWORD                 readbufmin     = SVCBATCH_PIPE_LEN;
+static DWORD                 readbufmax     = SVCBATCH_PIPE_LEN;
+static DWORD                 logflushint    = 0;
+static DWORD                 logsegsize     = 0;
+static DWORD                 logsync        = SVCBATCH_SYNC_NONE;
+static DWORD                 logcutmode     = SVCBATCH_CUT_NONE;
+static DWORD                 logcutmax      = SVCBATCH_DEF_CUT_SIZ;
+static DWORD                 logcutplen     = 0;
+static LPSTR                 logcutprefix   = NULL;
+static DWORD                 logsyncint     = SVCBATCH_DEF_SYNC_INT;
+static LONG                  logsyncsize    = 0;
+static SVCBATCH_SYNC         logsyncgroup;
+static volatile LONG         logsyncstate   = 0;
+static DWORD                 stderrmode     = SVCBATCH_STDERR_SHARED;
 static LONGLONG              rotateinterval = INT64_ZERO;
 static LONGLONG              rotatesize     = INT64_ZERO;
 static LARGE_INTEGER         rotatetime     = {{ 0, 0 }};
+static DWORD                 rotateschedn   = 0;
+static SVCBATCH_SCHEDULE     rotatesched[SVCBATCH_MAX_SCHEDULE];
 
 static DWORD     svceventid     = 2300;
 
@@ -344,9 +506,12 @@ static HANDLE    stopstarted    = NULL;
 static HANDLE    svcstopdone    = NULL;
 static HANDLE    workerended    = NULL;
 static HANDLE    dologrotate    = NULL;
+static HANDLE    dologsync      = NULL;
+static HANDLE    dologcut       = NULL;
 static HANDLE    sharedmmap     = NULL;
 static HANDLE    svclogmutex    = NULL;
 static LPCWSTR   stoplogname    = NULL;
+static LPCWSTR   errorlogname   = NULL;
 
 static LPCWSTR   allexportvars  = L"ABDHLNRUVW";
 static LPCWSTR   defexportvars  = L"HLNUW";
@@ -358,11 +523,29 @@ static LPCWSTR   hexwchars      = L"0123456789abcdef";
 static LPCWSTR   hexuchars      = L"0123456789ABCDEF";
 static WCHAR     zerostring[]   = {  0,  0,  0,  0 };
 static BYTE      YCRLF[]        = { 89, 13, 10,  0 };
+static BYTE      CRLFA[]        = { 13, 10,  0,  0 };
 static WCHAR     CRLFW[]        = { 13, 10,  0,  0 };
 
 static LPBYTE   stdindata       = YCRLF;
 static int      stdinsize       = 3;
 
+static const char *streamtags[] = {
+    "[---] ",
+    "[out] ",
+    "[err] "
+};
+
+static const char *jsonstreams[] = {
+    "",
+    "stdout",
+    "stderr"
+};
+
+static BYTE      JSONEOR[]      = { 34, 125, 13, 10 };
+static LPSTR     jsontails[3]   = { NULL, NULL, NULL };
+static int       jsontaillen[3] = { 0, 0, 0 };
+static ULONGLONG jsonsequence   = 0;
+
 static int      xwoptind        = 1;
 static int      xwoptend        = 0;
 static int      xwoptarr        = 0;
@@ -395,6 +578,7 @@ typedef enum {
     SVCBATCH_CFG_ENVPREFIX,
     SVCBATCH_CFG_ENVEXPORT,
 
+    SVCBATCH_CFG_CRASHSIZE,
     SVCBATCH_CFG_NOLOGGING,
     SVCBATCH_CFG_LOGNAME,
     SVCBATCH_CFG_LOGROTATE,
@@ -402,8 +586,38 @@ typedef enum {
     SVCBATCH_CFG_ROTATEINT,
     SVCBATCH_CFG_ROTATESIZE,
     SVCBATCH_CFG_ROTATETIME,
+    SVCBATCH_CFG_ROTATECUT,
+    SVCBATCH_CFG_ROTATECUTMAX,
     SVCBATCH_CFG_MAXLOGS,
+    SVCBATCH_CFG_GENERATIONS,
+    SVCBATCH_CFG_ZIPROTATED,
+    SVCBATCH_CFG_RETAINBYTES,
+    SVCBATCH_CFG_RETAINDAYS,
     SVCBATCH_CFG_TRUNCATE,
+    SVCBATCH_CFG_PIPEBUFSIZE,
+    SVCBATCH_CFG_READBUFSIZE,
+    SVCBATCH_CFG_READBUFADAPT,
+    SVCBATCH_CFG_FLUSHINT,
+    SVCBATCH_CFG_STDERR,
+    SVCBATCH_CFG_ELOGNAME,
+    SVCBATCH_CFG_TIMESTAMPS,
+    SVCBATCH_CFG_COMPRESS,
+    SVCBATCH_CFG_FORMAT,
+    SVCBATCH_CFG_ENCODING,
+    SVCBATCH_CFG_INDEX,
+    SVCBATCH_CFG_RATEBYTES,
+    SVCBATCH_CFG_RATELINES,
+    SVCBATCH_CFG_RATEBURST,
+    SVCBATCH_CFG_INCLUDE,
+    SVCBATCH_CFG_EXCLUDE,
+    SVCBATCH_CFG_SEGMENT,
+    SVCBATCH_CFG_BACKPRESSURE,
+    SVCBATCH_CFG_SPILLSIZE,
+    SVCBATCH_CFG_SYNC,
+    SVCBATCH_CFG_SYNCINT,
+    SVCBATCH_CFG_SYNCSIZE,
+    SVCBATCH_CFG_CTLPIPE,
+    SVCBATCH_CFG_SNAPSHOT,
 
     SVCBATCH_CFG_STOP,
     SVCBATCH_CFG_SLOGNAME,
@@ -433,6 +647,7 @@ static SVCBATCH_NAME_MAP svccparams[] = {
     { L"EnvironmentPrefix",     SVCBATCH_REG_TYPE_SZ,   SVCBATCH_CFG_ENVPREFIX    },
     { L"Export",                SVCBATCH_REG_TYPE_SZ,   SVCBATCH_CFG_ENVEXPORT    },
 
+    { L"CrashBufferSize",       SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_CRASHSIZE    },
     { L"DisableLogging",        SVCBATCH_REG_TYPE_BOOL, SVCBATCH_CFG_NOLOGGING    },
     { L"LogName",               SVCBATCH_REG_TYPE_SZ,   SVCBATCH_CFG_LOGNAME      },
     { L"LogRotate",             SVCBATCH_REG_TYPE_BOOL, SVCBATCH_CFG_LOGROTATE    },
@@ -440,8 +655,38 @@ static SVCBATCH_NAME_MAP svccparams[] = {
     { L"LogRotateInterval",     SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_ROTATEINT    },
     { L"LogRotateSize",         SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_ROTATESIZE   },
     { L"LogRotateTime",         SVCBATCH_REG_TYPE_SZ,   SVCBATCH_CFG_ROTATETIME   },
+    { L"LogRotateBoundary",     SVCBATCH_REG_TYPE_SZ,   SVCBATCH_CFG_ROTATECUT    },
+    { L"LogRotateBoundaryMax",  SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_ROTATECUTMAX },
     { L"MaxLogs",               SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_MAXLOGS      },
+    { L"LogGenerations",        SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_GENERATIONS  },
+    { L"CompressRotatedLogs",   SVCBATCH_REG_TYPE_BOOL, SVCBATCH_CFG_ZIPROTATED   },
+    { L"LogRetainBytes",        SVCBATCH_REG_TYPE_SZ,   SVCBATCH_CFG_RETAINBYTES  },
+    { L"LogRetainDays",         SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_RETAINDAYS   },
     { L"TruncateLogs",          SVCBATCH_REG_TYPE_BOOL, SVCBATCH_CFG_TRUNCATE     },
+    { L"PipeBufferSize",        SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_PIPEBUFSIZE  },
+    { L"ReadBufferSize",        SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_READBUFSIZE  },
+    { L"ReadBufferAdaptive",    SVCBATCH_REG_TYPE_BOOL, SVCBATCH_CFG_READBUFADAPT },
+    { L"LogFlushInterval",      SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_FLUSHINT     },
+    { L"LogStdError",           SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_STDERR       },
+    { L"StdErrorLogName",       SVCBATCH_REG_TYPE_SZ,   SVCBATCH_CFG_ELOGNAME     },
+    { L"LogTimestamps",         SVCBATCH_REG_TYPE_BOOL, SVCBATCH_CFG_TIMESTAMPS   },
+    { L"LogCompress",           SVCBATCH_REG_TYPE_BOOL, SVCBATCH_CFG_COMPRESS     },
+    { L"LogFormat",             SVCBATCH_REG_TYPE_SZ,   SVCBATCH_CFG_FORMAT       },
+    { L"LogEncoding",           SVCBATCH_REG_TYPE_SZ,   SVCBATCH_CFG_ENCODING     },
+    { L"LogIndex",              SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_INDEX        },
+    { L"LogRateBytes",          SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_RATEBYTES    },
+    { L"LogRateLines",          SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_RATELINES    },
+    { L"LogRateBurst",          SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_RATEBURST    },
+    { L"LogInclude",            SVCBATCH_REG_TYPE_MSZ,  SVCBATCH_CFG_INCLUDE      },
+    { L"LogExclude",            SVCBATCH_REG_TYPE_MSZ,  SVCBATCH_CFG_EXCLUDE      },
+    { L"LogSegmentSize",        SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_SEGMENT      },
+    { L"LogBackpressure",       SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_BACKPRESSURE },
+    { L"LogSpillSize",          SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_SPILLSIZE    },
+    { L"LogSync",               SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_SYNC         },
+    { L"LogSyncInterval",       SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_SYNCINT      },
+    { L"LogSyncSize",           SVCBATCH_REG_TYPE_NUM,  SVCBATCH_CFG_SYNCSIZE     },
+    { L"ControlPipe",           SVCBATCH_REG_TYPE_BOOL, SVCBATCH_CFG_CTLPIPE      },
+    { L"LogSnapshot",           SVCBATCH_REG_TYPE_BOOL, SVCBATCH_CFG_SNAPSHOT     },
 
 
     { L"Stop",                  SVCBATCH_REG_TYPE_MSZ,  SVCBATCH_CFG_STOP         },
@@ -850,6 +1095,17 @@ static LPWSTR xwcsndup(LPCWSTR s, size_t n)
     return wmemcpy(d, s, n);
 }
 
+static __inline int xsetdigits(LPSTR d, int v, int n)
+{
+    int i;
+
+    for (i = n - 1; i >= 0; i--) {
+        d[i] = v % 10 + '0';
+        v /= 10;
+    }
+    return n;
+}
+
 static __inline void xmemzero(void *mem, size_t number, size_t size)
 {
     memset(mem, 0, number * size);
@@ -1265,6 +1521,37 @@ static int xwcsequals(LPCWSTR str, LPCWSTR src)
     return 0;
 }
 
+/**
+ * Case insensitive match of the string
+ * with the pattern containing '*' and '?'
+ */
+static int xwcsmatch(LPCWSTR p, LPCWSTR s)
+{
+    LPCWSTR bp = NULL;
+    LPCWSTR bs = NULL;
+
+    while (*s) {
+        if (*p == L'*') {
+            bp = ++p;
+            bs = s;
+        }
+        else if ((*p == L'?') || (xtolower(*p) == xtolower(*s))) {
+            p++;
+            s++;
+        }
+        else if (bp) {
+            p = bp;
+            s = ++bs;
+        }
+        else {
+            return 0;
+        }
+    }
+    while (*p == L'*')
+        p++;
+    return *p == WNUL;
+}
+
 /**
  * Count the number of tokens delimited by d
  */
@@ -1526,6 +1813,50 @@ static DWORD xwcstod(LPCWSTR sp, DWORD *rp)
     return ERROR_SUCCESS;
 }
 
+/**
+ * Parse the size with optional K, M or G suffix
+ */
+static DWORD xwcstosize(LPCWSTR sp, ULONGLONG *rp)
+{
+    ULONGLONG rv = UINT64_ZERO;
+    int dc = 0;
+
+    sp = xskipblanks(sp);
+    ASSERT_WSTR(sp, ERROR_INVALID_PARAMETER);
+    while (xisdigit(*sp)) {
+        rv = rv * 10 + (*sp - L'0');
+        if (rv >= UINT_MAX)
+            return ERROR_INVALID_DATA;
+        dc++;
+        sp++;
+    }
+    if (dc == 0)
+        return ERROR_INVALID_PARAMETER;
+    switch (xtolower(*sp)) {
+        case L'k':
+            rv *= CPP_UINT64_C(1024);
+            sp++;
+        break;
+        case L'm':
+            rv *= CPP_UINT64_C(1048576);
+            sp++;
+        break;
+        case L'g':
+            rv *= CPP_UINT64_C(1073741824);
+            sp++;
+        break;
+        default:
+        break;
+    }
+    if (xtolower(*sp) == L'b')
+        sp++;
+    sp = xskipblanks(sp);
+    if (*sp != WNUL)
+        return ERROR_INVALID_PARAMETER;
+    *rp = rv;
+    return ERROR_SUCCESS;
+}
+
 static DWORD xwcxtoq(LPCWSTR sp, LPHANDLE h)
 {
     LPCWSTR   pp;
@@ -2459,6 +2790,11 @@ static const char *threadnames[] = {
     "stdinthread",
     "stopthread",
     "rotatethread",
+    "writerthread",
+    "syncthread",
+    "zipthread",
+    "retainthread",
+    "controlthread",
     NULL
 };
 
@@ -2481,23 +2817,15 @@ static void xtraceprintf(LPCSTR funcname, int line, int type, LPCSTR format, ...
     i += xsnprintf(b + i, n, "%lu", GetCurrentThreadId());
     o[1]   = i;
     b[i++] = sep;
-    b[i++] = tm.wMonth  / 10 + '0';
-    b[i++] = tm.wMonth  % 10 + '0';
-    b[i++] = tm.wDay    / 10 + '0';
-    b[i++] = tm.wDay    % 10 + '0';
-    b[i++] = tm.wYear   % 100 / 10 + '0';
-    b[i++] = tm.wYear   % 10 + '0';
+    i += xsetdigits(b + i, tm.wMonth,  2);
+    i += xsetdigits(b + i, tm.wDay,    2);
+    i += xsetdigits(b + i, tm.wYear,   2);
     b[i++] = '/';
-    b[i++] = tm.wHour   / 10 + '0';
-    b[i++] = tm.wHour   % 10 + '0';
-    b[i++] = tm.wMinute / 10 + '0';
-    b[i++] = tm.wMinute % 10 + '0';
-    b[i++] = tm.wSecond / 10 + '0';
-    b[i++] = tm.wSecond % 10 + '0';
+    i += xsetdigits(b + i, tm.wHour,   2);
+    i += xsetdigits(b + i, tm.wMinute, 2);
+    i += xsetdigits(b + i, tm.wSecond, 2);
     b[i++] = '.';
-    b[i++] = tm.wMilliseconds / 100 + '0';
-    b[i++] = tm.wMilliseconds % 100 / 10 + '0';
-    b[i++] = tm.wMilliseconds % 10 + '0';
+    i += xsetdigits(b + i, tm.wMilliseconds, 3);
     o[2]   = i;
     b[i++] = sep;
     i += xsnprintf(b + i, n - i, "%s",
@@ -2624,6 +2952,28 @@ finished:
 
 
 
+/**
+ * Append the last output of the child process
+ * to the last event log message string
+ */
+static int xcrashtailcat(LPWSTR buf, int siz, int c)
+{
+    LPCWSTR t = crashtail;
+    int     n;
+
+    if ((t == NULL) || (c < 1) || ((siz - c) < SBUFSIZ))
+        return c;
+    c = xwcslcat(buf, siz, c - 1, L"\r\n\r\nLast output:\r\n");
+    n = (int)wcslen(t);
+    if (n > (siz - c - 2))
+        t += n - (siz - c - 2);
+    c = xwcslcat(buf, siz, c, t);
+    if (c >= siz)
+        c = siz - 1;
+    buf[c++] = WNUL;
+    return c;
+}
+
 static DWORD svcsyserror(LPCSTR fn, int line, WORD typ, DWORD ern, LPCWSTR err, LPCWSTR eds, LPCWSTR erp)
 {
     WCHAR   buf[SVCBATCH_LINE_MAX];
@@ -2733,6 +3083,7 @@ static DWORD svcsyserror(LPCSTR fn, int line, WORD typ, DWORD ern, LPCWSTR err,
             c += xsnwprintf(buf + c, bsz - c, L" (%lu)", ern);
         buf[c++] = WNUL;
     }
+    c = xcrashtailcat(buf, bsz, c);
     if (service->name) {
         HANDLE es = RegisterEventSourceW(NULL, service->name);
         if (IS_VALID_HANDLE(es)) {
@@ -2829,6 +3180,7 @@ static DWORD xerrvprintf(LPCSTR fn, int line, WORD typ,
             c += xsnwprintf(buf + c, bsz - c, L" (%lu)", err);
         buf[c++] = WNUL;
     }
+    c = xcrashtailcat(buf, bsz, c);
     if (service->name) {
         es = RegisterEventSourceW(NULL, service->name);
         if (IS_VALID_HANDLE(es)) {
@@ -2884,6 +3236,9 @@ static void closeprocess(LPSVCBATCH_PROCESS p)
     SAFE_CLOSE_HANDLE(p->pInfo.hProcess);
     SAFE_CLOSE_HANDLE(p->pInfo.hThread);
     SAFE_CLOSE_HANDLE(p->sInfo.hStdInput);
+    if (p->sInfo.hStdOutput != p->sInfo.hStdError) {
+        SAFE_CLOSE_HANDLE(p->sInfo.hStdOutput);
+    }
     SAFE_CLOSE_HANDLE(p->sInfo.hStdError);
     SAFE_MEM_FREE(p->commandLine);
 }
@@ -3583,7 +3938,7 @@ finished:
     SVCBATCH_CS_LEAVE(service);
 }
 
-static BOOL createstdpipe(LPHANDLE rd, LPHANDLE wr, DWORD mode)
+static BOOL createstdpipe(LPHANDLE rd, LPHANDLE wr, DWORD mode, DWORD size)
 {
     DWORD i;
     BYTE  b;
@@ -3604,14 +3959,14 @@ static BOOL createstdpipe(LPHANDLE rd, LPHANDLE wr, DWORD mode)
         return FALSE;
     InterlockedIncrement(&uidcounter);
 
-    DBG_PRINTF("%d %S", mode ? 1 : 0, name);
+    DBG_PRINTF("%d %lu %S", mode ? 1 : 0, size, name);
 
     *rd = CreateNamedPipeW(name,
                            PIPE_ACCESS_INBOUND | mode,
                            PIPE_TYPE_BYTE,
                            1,
                            0,
-                           65536,
+                           size,
                            0,
                            &sa);
     if (IS_INVALID_HANDLE(*rd))
@@ -3654,6 +4009,7 @@ static BOOL createnulpipe(LPHANDLE ph)
 static DWORD createiopipes(LPSTARTUPINFOW si,
                            LPHANDLE iwrs,
                            LPHANDLE ords,
+                           LPHANDLE erds,
                            DWORD mode)
 {
     HANDLE cp = program->pInfo.hProcess;
@@ -3668,7 +4024,7 @@ static DWORD createiopipes(LPSTARTUPINFOW si,
          * Create stdin pipe, with write side
          * of the pipe as non inheritable.
          */
-        if (!createstdpipe(&rd, &wr, 0))
+        if (!createstdpipe(&rd, &wr, 0, SVCBATCH_PIPE_SIZ))
             return GetLastError();
         if (!DuplicateHandle(cp, wr, cp,
                              iwrs, 0, FALSE,
@@ -3685,7 +4041,7 @@ static DWORD createiopipes(LPSTARTUPINFOW si,
          * Create stdout/stderr pipe, with read side
          * of the pipe as non inheritable
          */
-        if (!createstdpipe(&rd, &wr, mode))
+        if (!createstdpipe(&rd, &wr, mode, pipebufsize))
             return GetLastError();
         if (!DuplicateHandle(cp, rd, cp,
                              ords, 0, FALSE,
@@ -3698,6 +4054,19 @@ static DWORD createiopipes(LPSTARTUPINFOW si,
     }
     si->hStdOutput = wr;
     si->hStdError  = wr;
+    if (ords && erds) {
+        /**
+         * Create separate stderr pipe, with read side
+         * of the pipe as non inheritable
+         */
+        if (!createstdpipe(&rd, &wr, mode, pipebufsize))
+            return GetLastError();
+        if (!DuplicateHandle(cp, rd, cp,
+                             erds, 0, FALSE,
+                             DUPLICATE_CLOSE_SOURCE | DUPLICATE_SAME_ACCESS))
+            return GetLastError();
+        si->hStdError = wr;
+    }
 
     return 0;
 }
@@ -3717,6 +4086,18 @@ static BOOL canrotatelogs(LPSVCBATCH_LOG log)
     return rv;
 }
 
+static void setrotatestate(LONG state)
+{
+    SVCBATCH_CS_ENTER(outputlog);
+    InterlockedExchange(&outputlog->state, state);
+    SVCBATCH_CS_LEAVE(outputlog);
+    if (errorlog) {
+        SVCBATCH_CS_ENTER(errorlog);
+        InterlockedExchange(&errorlog->state, state);
+        SVCBATCH_CS_LEAVE(errorlog);
+    }
+}
+
 static LPWSTR createsvcdir(LPCWSTR dir)
 {
     WCHAR  b[SVCBATCH_PATH_MAX];
@@ -3763,7 +4144,252 @@ static LPWSTR createsvcdir(LPCWSTR dir)
     return xwcsdup(b);
 }
 
-static DWORD rotateprevlogs(LPSVCBATCH_LOG log, BOOL ssp)
+/**
+ * The log and the file handle being mapped
+ */
+typedef struct _SVCBATCH_LOGMAP {
+    LPSVCBATCH_LOG          log;
+    HANDLE                  h;
+} SVCBATCH_LOGMAP, *LPSVCBATCH_LOGMAP;
+
+/**
+ * Map the log file segment at base.
+ * Creating the mapping larger than the file
+ * extends the file to the new segment end.
+ */
+static DWORD logmapview(LPVOID ctx, LONGLONG base, LPBYTE *view)
+{
+    LPSVCBATCH_LOGMAP m   = (LPSVCBATCH_LOGMAP)ctx;
+    LPSVCBATCH_LOG    log = m->log;
+    LARGE_INTEGER     ms;
+    LARGE_INTEGER     mb;
+
+    if (*view)
+        UnmapViewOfFile(*view);
+    SAFE_CLOSE_HANDLE(log->map);
+    *view = NULL;
+
+    ms.QuadPart = base + logsegsize;
+    mb.QuadPart = base;
+    log->map = CreateFileMappingW(m->h, NULL, PAGE_READWRITE,
+                                  ms.HighPart, ms.LowPart, NULL);
+    if (log->map == NULL)
+        return GetLastError();
+    *view = (LPBYTE)MapViewOfFile(log->map, FILE_MAP_WRITE,
+                                  mb.HighPart, mb.LowPart, logsegsize);
+    if (*view == NULL) {
+        DWORD rc = GetLastError();
+
+        SAFE_CLOSE_HANDLE(log->map);
+        return rc;
+    }
+    DBG_PRINTF("segment %lld %S", base, log->logFile);
+    return 0;
+}
+
+static DWORD logmapflush(LPVOID ctx, LPBYTE buf, DWORD len)
+{
+    if (!FlushViewOfFile(buf, len))
+        return GetLastError();
+    return 0;
+}
+
+static DWORD logmapnext(LPSVCBATCH_LOG log, HANDLE h, LONGLONG base)
+{
+    SVCBATCH_LOGMAP m;
+
+    m.log = log;
+    m.h   = h;
+    return xsegmentmap(&log->seg, &m, base);
+}
+
+/**
+ * Unmap the current segment and trim
+ * the file to the size of the written data
+ */
+static DWORD logmapclose(LPSVCBATCH_LOG log, HANDLE h)
+{
+    LARGE_INTEGER ee;
+
+    if (log->seg.view == NULL)
+        return 0;
+    UnmapViewOfFile(log->seg.view);
+    SAFE_CLOSE_HANDLE(log->map);
+    log->seg.view = NULL;
+    ee.QuadPart   = log->size;
+    if (!SetFilePointerEx(h, ee, NULL, FILE_BEGIN) || !SetEndOfFile(h))
+        return GetLastError();
+    DBG_PRINTF("trimmed %lld %S", ee.QuadPart, log->logFile);
+    return 0;
+}
+
+static DWORD logmapwrite(LPSVCBATCH_LOG log, HANDLE h, const BYTE *buf, DWORD len)
+{
+    SVCBATCH_LOGMAP m;
+
+    m.log = log;
+    m.h   = h;
+    return xsegmentwrite(&log->seg, &m, &log->size, buf, len);
+}
+
+/**
+ * Move the sibling file together with the log file.
+ * Stale sibling of the target is removed if the
+ * source log has no such sibling.
+ */
+static void logsiblingmove(LPCWSTR src, LPCWSTR dst, LPCWSTR ext)
+{
+    WCHAR sn[SVCBATCH_PATH_MAX];
+    WCHAR dn[SVCBATCH_PATH_MAX];
+    int   n;
+
+    n = xwcslcpy(sn, SVCBATCH_PATH_MAX, src);
+    n = xwcslcat(sn, SVCBATCH_PATH_MAX, n, ext);
+    if (n >= SVCBATCH_PATH_MAX)
+        return;
+    n = xwcslcpy(dn, SVCBATCH_PATH_MAX, dst);
+    n = xwcslcat(dn, SVCBATCH_PATH_MAX, n, ext);
+    if (n >= SVCBATCH_PATH_MAX)
+        return;
+    if (!MoveFileExW(sn, dn, MOVEFILE_REPLACE_EXISTING)) {
+        if (GetLastError() == ERROR_FILE_NOT_FOUND)
+            DeleteFileW(dn);
+    }
+}
+
+static void logindexmove(LPCWSTR src, LPCWSTR dst)
+{
+    if (logindex)
+        logsiblingmove(src, dst, SVCBATCH_LOGINDEX);
+    if (zipqueue)
+        logsiblingmove(src, dst, SVCBATCH_LOGGZIP);
+}
+
+/**
+ * Queue the rotated log file for compression.
+ * The zipthread takes the ownership of the handle
+ * and follows the file if it gets renamed.
+ */
+static void logzipqueue(HANDLE h, LPCWSTR name)
+{
+    LPSVCBATCH_ZIPJOB j;
+    LONG n;
+
+    j = (LPSVCBATCH_ZIPJOB)xmcalloc(sizeof(SVCBATCH_ZIPJOB));
+    j->fd   = h;
+    j->name = xwcsdup(name);
+    SVCBATCH_CS_ENTER(zipqueue);
+    if (zipqueue->tail)
+        zipqueue->tail->next = j;
+    else
+        zipqueue->head = j;
+    zipqueue->tail = j;
+    n = InterlockedIncrement(&zipqueue->count);
+    SVCBATCH_CS_LEAVE(zipqueue);
+    DBG_PRINTF("backlog %ld %S", n, name);
+    SetEvent(zipqueue->event);
+}
+
+/**
+ * Queue the log file left by the previous run
+ */
+static void logzipprev(LPCWSTR fn)
+{
+    HANDLE h;
+    LARGE_INTEGER fs;
+
+    h = CreateFileW(fn, GENERIC_READ,
+                    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                    NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (IS_INVALID_HANDLE(h))
+        return;
+    if (GetFileSizeEx(h, &fs) && fs.QuadPart)
+        logzipqueue(h, fn);
+    else
+        CloseHandle(h);
+}
+
+static DWORD logindexwrite(LPVOID ctx, LPSVCBATCH_INDEX ir, DWORD n)
+{
+    LPSVCBATCH_LOG log = (LPSVCBATCH_LOG)ctx;
+    DWORD wr;
+
+    if (!WriteFile(log->idx, ir, n * sizeof(SVCBATCH_INDEX), &wr, NULL))
+        return GetLastError();
+    return 0;
+}
+
+static DWORD logindexopen(LPSVCBATCH_LOG log)
+{
+    LPWSTR fn;
+    DWORD  wr;
+
+    log->sol = TRUE;
+    xindexinit(&log->ix, logindex, logindexwrite);
+    if (logindex == 0)
+        return 0;
+    fn = xwcsconcat(log->logFile, SVCBATCH_LOGINDEX);
+    log->idx = CreateFileW(fn, GENERIC_WRITE,
+                           FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                           CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (IS_INVALID_HANDLE(log->idx)) {
+        DWORD rc = GetLastError();
+
+        log->idx = NULL;
+        xsyserror(rc, fn, NULL);
+        xfree(fn);
+        return rc;
+    }
+    DBG_PRINTF("%S", fn);
+    xfree(fn);
+    WriteFile(log->idx, SVCBATCH_INDEX_MAGIC, 8, &wr, NULL);
+    return 0;
+}
+
+static void logindexclose(LPSVCBATCH_LOG log)
+{
+    if (log->idx == NULL)
+        return;
+    CloseHandle(log->idx);
+    log->idx = NULL;
+}
+
+/**
+ * Add index records for the lines that start
+ * inside the data written at the offset off
+ */
+static void logindexdata(LPSVCBATCH_LOG log, LONGLONG off, LPBYTE buf, DWORD len)
+{
+    ULONGLONG t;
+    FILETIME  ft;
+
+    GetSystemTimeAsFileTime(&ft);
+    t = ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    xindexdata(&log->ix, log, log->sol, t, off, buf, len);
+}
+
+/**
+ * Returns TRUE if the previous log file
+ * or its compressed copy exists
+ */
+static BOOL logprevexists(LPCWSTR fn)
+{
+    WIN32_FILE_ATTRIBUTE_DATA ad;
+    WCHAR zn[SVCBATCH_PATH_MAX];
+    int   n;
+
+    if (GetFileAttributesExW(fn, GetFileExInfoStandard, &ad))
+        return (ad.nFileSizeHigh || ad.nFileSizeLow);
+    if (zipqueue == NULL)
+        return FALSE;
+    n = xwcslcpy(zn, SVCBATCH_PATH_MAX, fn);
+    n = xwcslcat(zn, SVCBATCH_PATH_MAX, n, SVCBATCH_LOGGZIP);
+    if (n >= SVCBATCH_PATH_MAX)
+        return FALSE;
+    return GetFileAttributesExW(zn, GetFileExInfoStandard, &ad);
+}
+
+static DWORD rotateprevlogs(LPSVCBATCH_LOG log, LPCWSTR src, BOOL ssp)
 {
     DWORD rc;
     int   i;
@@ -3773,16 +4399,16 @@ static DWORD rotateprevlogs(LPSVCBATCH_LOG log, BOOL ssp)
     WCHAR logpn[SVCBATCH_PATH_MAX];
     WIN32_FILE_ATTRIBUTE_DATA ad;
 
-    if (GetFileAttributesExW(log->logFile, GetFileExInfoStandard, &ad)) {
+    if (GetFileAttributesExW(src, GetFileExInfoStandard, &ad)) {
         if ((ad.nFileSizeHigh == 0) && (ad.nFileSizeLow == 0)) {
-            DBG_PRINTF("empty log %S", log->logFile);
+            DBG_PRINTF("empty log %S", src);
             return 0;
         }
     }
     else {
         rc = GetLastError();
         if (rc != ERROR_FILE_NOT_FOUND)
-            return xsyserror(rc, log->logFile, NULL);
+            return xsyserror(rc, src, NULL);
         else
             return 0;
     }
@@ -3791,9 +4417,18 @@ static DWORD rotateprevlogs(LPSVCBATCH_LOG log, BOOL ssp)
     if (x >= SVCBATCH_PATH_SIZ)
         return xsyserror(ERROR_BAD_PATHNAME, log->logFile, NULL);
     x = xfixmaxpath(lognn, x, 0);
+    /**
+     * Do not allow zipthread to finish
+     * while the files are renamed
+     */
+    SVCBATCH_CS_ENTER(zipqueue);
+    rc = 0;
     DBG_PRINTF("0 %S", lognn);
-    if (!MoveFileExW(log->logFile, lognn, MOVEFILE_REPLACE_EXISTING))
-        return xsyserror(GetLastError(), log->logFile, lognn);
+    if (!MoveFileExW(src, lognn, MOVEFILE_REPLACE_EXISTING)) {
+        rc = xsyserror(GetLastError(), src, lognn);
+        goto finished;
+    }
+    logindexmove(src, lognn);
     if (ssp) {
         xsvcstatus(SERVICE_START_PENDING, 0);
     }
@@ -3803,9 +4438,7 @@ static DWORD rotateprevlogs(LPSVCBATCH_LOG log, BOOL ssp)
     for (i = 1; i < log->maxLogs; i++) {
         lognn[x] = L'0' + i;
 
-        if (!GetFileAttributesExW(lognn, GetFileExInfoStandard, &ad))
-            break;
-        if ((ad.nFileSizeHigh == 0) && (ad.nFileSizeLow == 0))
+        if (!logprevexists(lognn))
             break;
     }
     n = i;
@@ -3821,8 +4454,11 @@ static DWORD rotateprevlogs(LPSVCBATCH_LOG log, BOOL ssp)
             }
             else {
                 DBG_PRINTF("%d %S", i, lognn);
-                if (!MoveFileExW(logpn, lognn, MOVEFILE_REPLACE_EXISTING))
-                    return xsyserror(GetLastError(), logpn, lognn);
+                if (!MoveFileExW(logpn, lognn, MOVEFILE_REPLACE_EXISTING)) {
+                    rc = xsyserror(GetLastError(), logpn, lognn);
+                    goto finished;
+                }
+                logindexmove(logpn, lognn);
                 if (ssp) {
                     xsvcstatus(SERVICE_START_PENDING, 0);
                 }
@@ -3830,240 +4466,890 @@ static DWORD rotateprevlogs(LPSVCBATCH_LOG log, BOOL ssp)
         }
         else {
             rc = GetLastError();
-            if (rc != ERROR_FILE_NOT_FOUND)
-                return xsyserror(rc, logpn, NULL);
+            if (rc != ERROR_FILE_NOT_FOUND) {
+                rc = xsyserror(rc, logpn, NULL);
+                goto finished;
+            }
+            rc = 0;
+            if (zipqueue) {
+                /**
+                 * Only the compressed copy exists
+                 */
+                DBG_PRINTF("%d %S%S", i, lognn, SVCBATCH_LOGGZIP);
+                DeleteFileW(lognn);
+                logindexmove(logpn, lognn);
+            }
         }
     }
 
-    return 0;
+finished:
+    SVCBATCH_CS_LEAVE(zipqueue);
+    return rc;
 }
 
-static DWORD openlogfile(LPSVCBATCH_LOG log, BOOL ssp)
+/**
+ * Generation numbered logs.
+ * Each new log file gets the next generation suffix
+ * and is never renamed. The manifest lists the live
+ * generations, oldest first, one per line.
+ */
+static LPWSTR loggenfile(LPSVCBATCH_LOGGEN lg, ULONGLONG g)
 {
-    DWORD   rc;
-    HANDLE  fh = NULL;
-    LPWSTR  nf = NULL;
-    LPCWSTR nn = log->logName;
+    WCHAR sfx[32];
 
-    if (xwcschr(nn, L'@')) {
-        nf = xwcsftime(nn);
-        if (nf == NULL)
-            return xsyserror(GetLastError(), nn, NULL);
-        DBG_PRINTF("%S -> %S", nn, nf);
-        nn = nf;
-    }
-    xfree(log->logFile);
-    log->logFile = xwmakepath(service->logs, nn, NULL);
-    xfree(nf);
-    if (log->maxLogs) {
-        rc = rotateprevlogs(log, ssp);
-        if (rc)
-            return rc;
-    }
-    fh = CreateFileW(log->logFile,
-                     GENERIC_READ | GENERIC_WRITE,
-                     FILE_SHARE_READ, NULL,
-                     CREATE_ALWAYS,
-                     FILE_ATTRIBUTE_NORMAL, NULL);
-    rc = GetLastError();
-    if (IS_INVALID_HANDLE(fh))
-        return xsyserror(rc, log->logFile, NULL);
-    DBG_PRINTF("%S", log->logFile);
-    InterlockedExchange64(&log->size, 0);
-    InterlockedExchange(&log->state,  0);
-    InterlockedExchangePointer(&log->fd, fh);
-    return 0;
+    xsnwprintf(sfx, 32, L".%I64u", g);
+    return xwcsconcat(lg->base, sfx);
 }
 
-static DWORD rotatelogs(LPSVCBATCH_LOG log)
+static void loggendelete(LPSVCBATCH_LOGGEN lg, ULONGLONG g)
 {
-    DWORD  rc = 0;
-    HANDLE h;
+    LPWSTR fn;
+    LPWSTR xn;
 
-    ASSERT_NULL(log, 0);
-    SVCBATCH_CS_ENTER(log);
-    InterlockedExchange(&log->state, 0);
+    fn = loggenfile(lg, g);
+    DBG_PRINTF("%S", fn);
+    SVCBATCH_CS_ENTER(zipqueue);
+    if (!DeleteFileW(fn)) {
+        DWORD rc = GetLastError();
+
+        if (rc != ERROR_FILE_NOT_FOUND)
+            xsyserror(rc, fn, NULL);
+    }
+    xn = xwcsconcat(fn, SVCBATCH_LOGINDEX);
+    DeleteFileW(xn);
+    xfree(xn);
+    if (zipqueue) {
+        xn = xwcsconcat(fn, SVCBATCH_LOGGZIP);
+        DeleteFileW(xn);
+        xfree(xn);
+    }
+    SVCBATCH_CS_LEAVE(zipqueue);
+    xfree(fn);
+}
+
+/**
+ * Append the last generation to the manifest,
+ * or rewrite the manifest with all live generations.
+ */
+static DWORD loggenwrite(LPSVCBATCH_LOGGEN lg, BOOL compact)
+{
+    LARGE_INTEGER ee = {{ 0, 0 }};
+    ULONGLONG     i;
+    LPSTR         b;
+    DWORD         wr;
+    DWORD         rc = 0;
+    int           n;
+    int           s;
+
+    i = compact ? lg->gl.first : lg->gl.last;
+    s = (int)(lg->gl.last - i + 1) * (xstrlen(lg->name) + 48);
+    b = (LPSTR)xmmalloc(s);
+    n = xgenformat(&lg->gl, lg->name, compact, b, s);
+    if (!SetFilePointerEx(lg->fd, ee, NULL, compact ? FILE_BEGIN : FILE_END))
+        rc = GetLastError();
+    else if (!WriteFile(lg->fd, b, n, &wr, NULL))
+        rc = GetLastError();
+    else if (compact && !SetEndOfFile(lg->fd))
+        rc = GetLastError();
+    xfree(b);
+    DBG_PRINTF("%lu lines %S", lg->gl.lines, lg->manifest);
+    return rc;
+}
+
+/**
+ * Open the manifest and find the live generations
+ */
+static DWORD loggenopen(LPSVCBATCH_LOGGEN lg, LPCWSTR base)
+{
+    LARGE_INTEGER fs;
+    LPCWSTR       fn;
+    LPBYTE        b;
+    DWORD         rd;
+    DWORD         rc = 0;
+    int           n;
+
+    lg->base     = xwcsdup(base);
+    lg->manifest = xwcsconcat(base, SVCBATCH_LOGMANIFEST);
+    fn = xwcsrchr(base, L'\\');
+    fn = fn ? fn + 1 : base;
+    n  = WideCharToMultiByte(CP_UTF8, 0, fn, -1, NULL, 0, NULL, NULL);
+    lg->name = (LPSTR)xmcalloc(n + 1);
+    WideCharToMultiByte(CP_UTF8, 0, fn, -1, lg->name, n, NULL, NULL);
+
+    lg->fd = CreateFileW(lg->manifest, GENERIC_READ | GENERIC_WRITE,
+                         FILE_SHARE_READ, NULL,
+                         OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (IS_INVALID_HANDLE(lg->fd)) {
+        rc = GetLastError();
+        lg->fd = NULL;
+        return xsyserror(rc, lg->manifest, NULL);
+    }
+    if (!GetFileSizeEx(lg->fd, &fs))
+        return xsyserror(GetLastError(), lg->manifest, NULL);
+    if (fs.QuadPart == 0)
+        return 0;
+    if (fs.QuadPart > SVCBATCH_MAX_GENERATIONS * SVCBATCH_PATH_MAX)
+        return xsyserror(ERROR_FILE_TOO_LARGE, lg->manifest, NULL);
+    b = (LPBYTE)xmmalloc((DWORD)fs.QuadPart);
+    if (!ReadFile(lg->fd, b, (DWORD)fs.QuadPart, &rd, NULL)) {
+        rc = GetLastError();
+        xfree(b);
+        return xsyserror(rc, lg->manifest, NULL);
+    }
+    xgenparse(&lg->gl, b, rd);
+    xfree(b);
+    DBG_PRINTF("%I64u-%I64u %S", lg->gl.first, lg->gl.last, lg->manifest);
+    return 0;
+}
+
+/**
+ * Make the next generation live and
+ * remove the generations above the limit.
+ */
+static void loggencommit(LPSVCBATCH_LOGGEN lg)
+{
+    ULONGLONG g;
+    DWORD     rc;
+
+    for (g = xgennext(&lg->gl, loggenerations); g < lg->gl.first; g++)
+        loggendelete(lg, g);
+    rc = loggenwrite(lg, lg->gl.lines >= loggenerations * 2);
+    if (rc)
+        xsyserror(rc, lg->manifest, NULL);
+}
+
+static void loggenclose(LPSVCBATCH_LOGGEN lg)
+{
+    if (lg == NULL)
+        return;
+    if (lg->fd)
+        CloseHandle(lg->fd);
+    xfree(lg->base);
+    xfree(lg->manifest);
+    xfree(lg->name);
+    xfree(lg);
+}
+
+static LPWSTR logmakename(LPSVCBATCH_LOG log)
+{
+    LPWSTR  fn;
+    LPWSTR  nf = NULL;
+    LPCWSTR nn = log->logName;
+
+    if (xwcschr(nn, L'@')) {
+        nf = xwcsftime(nn);
+        if (nf == NULL)
+            return NULL;
+        DBG_PRINTF("%S -> %S", nn, nf);
+        nn = nf;
+    }
+    fn = xwmakepath(service->logs, nn,
+                    IS_OPT_SET(SVCBATCH_OPT_COMPRESS) ? SVCBATCH_LOGGZIP : NULL);
+    xfree(nf);
+    return fn;
+}
+
+static DWORD openlogfile(LPSVCBATCH_LOG log, BOOL ssp)
+{
+    DWORD   rc;
+    HANDLE  fh = NULL;
+
+    xfree(log->logFile);
+    log->logFile = logmakename(log);
+    if (log->logFile == NULL)
+        return xsyserror(GetLastError(), log->logName, NULL);
+    if (log->gen) {
+        if (log->gen->fd == NULL) {
+            rc = loggenopen(log->gen, log->logFile);
+            if (rc)
+                return rc;
+        }
+        xfree(log->logFile);
+        if (ssp && zipqueue && log->gen->gl.last) {
+            log->logFile = loggenfile(log->gen, log->gen->gl.last);
+            logzipprev(log->logFile);
+            xfree(log->logFile);
+        }
+        log->logFile = loggenfile(log->gen, log->gen->gl.last + 1);
+    }
+    else if (log->maxLogs) {
+        if (ssp && zipqueue)
+            logzipprev(log->logFile);
+        rc = rotateprevlogs(log, log->logFile, ssp);
+        if (rc)
+            return rc;
+    }
+    fh = CreateFileW(log->logFile,
+                     GENERIC_READ | GENERIC_WRITE,
+                     FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                     CREATE_ALWAYS,
+                     logsync == SVCBATCH_SYNC_WRITE ?
+                     FILE_ATTRIBUTE_NORMAL | FILE_FLAG_WRITE_THROUGH :
+                     FILE_ATTRIBUTE_NORMAL, NULL);
+    rc = GetLastError();
+    if (IS_INVALID_HANDLE(fh))
+        return xsyserror(rc, log->logFile, NULL);
+    DBG_PRINTF("%S", log->logFile);
+    InterlockedExchange64(&log->size, 0);
+    InterlockedExchange(&log->state,  0);
+    if (IS_OPT_SET(SVCBATCH_OPT_MAPPED)) {
+        xsegmentinit(&log->seg, logsegsize, logmapview,
+                     logsync == SVCBATCH_SYNC_WRITE ? logmapflush : NULL);
+        rc = logmapnext(log, fh, 0);
+        if (rc) {
+            CloseHandle(fh);
+            return xsyserror(rc, L"CreateFileMapping", log->logFile);
+        }
+    }
+    rc = logindexopen(log);
+    if (rc) {
+        logmapclose(log, fh);
+        CloseHandle(fh);
+        return rc;
+    }
+    if (log->gen)
+        loggencommit(log->gen);
+    InterlockedExchangePointer(&log->fd, fh);
+    return 0;
+}
+
+/**
+ * Exchange the open file state of two logs.
+ * Must be called while holding the log lock
+ */
+static void logswapfile(LPSVCBATCH_LOG log, LPSVCBATCH_LOG nl)
+{
+    SVCBATCH_LOG t;
+
+    t.size    = log->size;
+    t.fd      = log->fd;
+    t.map     = log->map;
+    t.seg     = log->seg;
+    t.idx     = log->idx;
+    t.sol     = log->sol;
+    t.ix      = log->ix;
+    t.logFile = log->logFile;
+
+    InterlockedExchange64(&log->size, nl->size);
+    InterlockedExchangePointer(&log->fd, nl->fd);
+    log->map     = nl->map;
+    log->seg     = nl->seg;
+    log->idx     = nl->idx;
+    log->sol     = nl->sol;
+    log->ix      = nl->ix;
+    log->logFile = nl->logFile;
+
+    nl->size    = t.size;
+    nl->fd      = t.fd;
+    nl->map     = t.map;
+    nl->seg     = t.seg;
+    nl->idx     = t.idx;
+    nl->sol     = t.sol;
+    nl->ix      = t.ix;
+    nl->logFile = t.logFile;
+}
+
+/**
+ * Truncate the log file.
+ * Must be called while holding the log lock.
+ * The cut is set if the file was truncated, even
+ * when the file could not be mapped again.
+ */
+static DWORD logtruncate(LPSVCBATCH_LOG log, LPBOOL cut)
+{
+    DWORD  rc = 0;
+    HANDLE h;
+    LARGE_INTEGER ee = {{ 0, 0 }};
 
+    if (cut)
+        *cut = FALSE;
     h = InterlockedExchangePointer(&log->fd, NULL);
     if (h == NULL) {
         rc = ERROR_INVALID_HANDLE;
         goto finished;
     }
-    if (IS_OPT_SET(SVCBATCH_OPT_TRUNCATE)) {
-        LARGE_INTEGER ee = {{ 0, 0 }};
-
-        if (SetFilePointerEx(h, ee, NULL, FILE_BEGIN)) {
-            if (SetEndOfFile(h)) {
-                DBG_PRINTF("truncated %S", log->logFile);
-                InterlockedExchangePointer(&log->fd, h);
-                goto finished;
-            }
+    logmapclose(log, h);
+    if (SetFilePointerEx(h, ee, NULL, FILE_BEGIN) && SetEndOfFile(h)) {
+        DBG_PRINTF("truncated %S", log->logFile);
+        if (cut)
+            *cut = TRUE;
+        InterlockedExchange64(&log->size, 0);
+        if (log->idx) {
+            LARGE_INTEGER ie;
+
+            ie.QuadPart = 8;
+            SetFilePointerEx(log->idx, ie, NULL, FILE_BEGIN);
+            SetEndOfFile(log->idx);
+        }
+        log->sol = TRUE;
+        xindexreset(&log->ix);
+        if (IS_OPT_SET(SVCBATCH_OPT_MAPPED))
+            rc = logmapnext(log, h, 0);
+        if (rc == 0) {
+            InterlockedExchangePointer(&log->fd, h);
+            goto finished;
         }
-        rc = GetLastError();
-        CloseHandle(h);
     }
     else {
-        FlushFileBuffers(h);
-        CloseHandle(h);
-        rc = openlogfile(log, FALSE);
+        rc = GetLastError();
     }
+    CloseHandle(h);
 
 finished:
     InterlockedExchange64(&log->size, 0);
-    SVCBATCH_CS_LEAVE(log);
     return rc;
 }
 
-static DWORD closelogfile(LPSVCBATCH_LOG log)
+/**
+ * Copy the log data from the current position
+ * of the sh up to the end offset
+ */
+static DWORD logsnapcopy(HANDLE sh, HANDLE dh, LPBYTE buf,
+                         ULONGLONG *pos, ULONGLONG end)
 {
-    HANDLE h;
-
-    if (log == NULL)
-        return ERROR_FILE_NOT_FOUND;
+    DWORD rd;
+    DWORD wr;
 
-    SVCBATCH_CS_ENTER(log);
-    DBG_PRINTF("%lu %S", log->state, log->logFile);
-    InterlockedExchange(&log->state, 0);
+    while (*pos < end) {
+        DWORD n = SVCBATCH_SNAP_BUFSIZ;
 
-    h = InterlockedExchangePointer(&log->fd, NULL);
-    if (h) {
-        FlushFileBuffers(h);
-        CloseHandle(h);
+        if ((end - *pos) < n)
+            n = (DWORD)(end - *pos);
+        if (!ReadFile(sh, buf, n, &rd, NULL))
+            return GetLastError();
+        if (rd == 0)
+            return ERROR_HANDLE_EOF;
+        if (!WriteFile(dh, buf, rd, &wr, NULL))
+            return GetLastError();
+        *pos += rd;
     }
-    xfree(log->logFile);
+    return 0;
+}
 
-    SVCBATCH_CS_LEAVE(log);
-    SVCBATCH_CS_CLOSE(log);
-    xfree(log);
+#if HAVE_BLOCK_CLONE
+/**
+ * Share the aligned part of the log data
+ * with the snapshot file using block cloning.
+ * Only ReFS volumes support that, so the first
+ * failure disables it for the rest of the run.
+ */
+static void logsnapclone(HANDLE sh, HANDLE dh, ULONGLONG *pos, ULONGLONG end)
+{
+    static BOOL cloneable = TRUE;
+    DUPLICATE_EXTENTS_DATA dd;
+    LARGE_INTEGER ee;
+    DWORD n;
 
-    return 0;
+    end &= ~((ULONGLONG)SVCBATCH_SNAP_ALIGN - 1);
+    if (!cloneable || (end == 0))
+        return;
+    ee.QuadPart = (LONGLONG)end;
+    if (!SetFilePointerEx(dh, ee, NULL, FILE_BEGIN) || !SetEndOfFile(dh)) {
+        cloneable = FALSE;
+        goto failed;
+    }
+    dd.FileHandle                = sh;
+    dd.SourceFileOffset.QuadPart = 0;
+    dd.TargetFileOffset.QuadPart = 0;
+    dd.ByteCount.QuadPart        = (LONGLONG)end;
+    if (!DeviceIoControl(dh, FSCTL_DUPLICATE_EXTENTS_TO_FILE,
+                         &dd, DSIZEOF(dd), NULL, 0, &n, NULL)) {
+        DBG_PRINTF("block clone failed %lu", GetLastError());
+        cloneable = FALSE;
+        goto failed;
+    }
+    if (SetFilePointerEx(sh, ee, NULL, FILE_BEGIN)) {
+        DBG_PRINTF("cloned %llu bytes", end);
+        *pos = end;
+        return;
+    }
+
+failed:
+    ee.QuadPart = 0;
+    SetFilePointerEx(dh, ee, NULL, FILE_BEGIN);
+    SetEndOfFile(dh);
 }
+#endif
 
-static void resolvetimeout(int hh, int mm, int ss, int od)
+/**
+ * Open the log index for reading and create the
+ * snapshot index, so the rotated log keeps its index.
+ * On failure the snapshot is rotated without the index.
+ */
+static void logsnapidxopen(LPSVCBATCH_LOG log, LPCWSTR sn, HANDLE *ih, HANDLE *xh)
 {
-    SYSTEMTIME     st;
-    FILETIME       ft;
-    ULARGE_INTEGER si;
-    ULARGE_INTEGER ui;
+    LPWSTR in;
+    LPWSTR xn;
 
-    rotateinterval = od ? ONE_DAY : ONE_HOUR;
-    if (IS_OPT_SET(SVCBATCH_OPT_LOCALTIME) && od)
-        GetLocalTime(&st);
-    else
-        GetSystemTime(&st);
-
-    SystemTimeToFileTime(&st, &ft);
-    si.HighPart = ft.dwHighDateTime;
-    si.LowPart  = ft.dwLowDateTime;
-    ui.QuadPart = si.QuadPart + rotateinterval;
-    ft.dwHighDateTime = ui.HighPart;
-    ft.dwLowDateTime  = ui.LowPart;
-    FileTimeToSystemTime(&ft, &st);
-    if (od)
-        st.wHour = hh;
-    st.wMinute = mm;
-    st.wSecond = ss;
-    SystemTimeToFileTime(&st, &ft);
-    rotatetime.HighPart = ft.dwHighDateTime;
-    rotatetime.LowPart  = ft.dwLowDateTime;
-    DBG_PRINTF("in %llu minutes", (rotatetime.QuadPart - si.QuadPart) / ONE_MINUTE);
+    *ih = NULL;
+    *xh = NULL;
+    if (log->idx == NULL)
+        return;
+    in = xwcsconcat(log->logFile, SVCBATCH_LOGINDEX);
+    xn = xwcsconcat(sn, SVCBATCH_LOGINDEX);
+    *ih = CreateFileW(in, GENERIC_READ,
+                      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                      OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (IS_INVALID_HANDLE(*ih)) {
+        xsyserror(GetLastError(), in, NULL);
+        *ih = NULL;
+        goto finished;
+    }
+    *xh = CreateFileW(xn, GENERIC_WRITE,
+                      FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                      CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (IS_INVALID_HANDLE(*xh)) {
+        xsyserror(GetLastError(), xn, NULL);
+        CloseHandle(*ih);
+        *ih = NULL;
+        *xh = NULL;
+    }
 
-    SVCOPT_SET(SVCBATCH_OPT_ROTATE_BY_TIME);
+finished:
+    xfree(in);
+    xfree(xn);
 }
 
-static BOOL xarotatetime(LPCWSTR param)
+/**
+ * Copy the index records written so far
+ */
+static DWORD logsnapidxcopy(HANDLE ih, HANDLE xh, LPBYTE buf, ULONGLONG *pos)
 {
-    LPWSTR  ep;
-    LPCWSTR rp = param;
+    LARGE_INTEGER sz;
 
-    if (IS_EMPTY_WCS(param))
-        return TRUE;
-    if (xiswcschar(param, L'0')) {
-        DBG_PRINTS("at midnight");
-        resolvetimeout(0, 0, 0, 1);
-        return TRUE;
+    if (!GetFileSizeEx(ih, &sz))
+        return GetLastError();
+    return logsnapcopy(ih, xh, buf, pos, (ULONGLONG)sz.QuadPart);
+}
+
+/**
+ * Copy the log content to the next rotated log file
+ * and truncate the log.
+ * Most of the data is copied without the log lock
+ * while the writer appends to the log. The lock is
+ * held only to copy the data written during the last
+ * copy pass and to truncate the file.
+ * The log index is copied the same way, and is
+ * rotated together with the snapshot.
+ */
+static DWORD logsnaptruncate(LPSVCBATCH_LOG log)
+{
+    DWORD     rc = 0;
+    DWORD     xc = 0;
+    HANDLE    sh;
+    HANDLE    dh;
+    HANDLE    ih;
+    HANDLE    xh;
+    LPBYTE    buf;
+    LPWSTR    sn;
+    BOOL      cut = FALSE;
+    ULONGLONG cp = 0;
+    ULONGLONG ic = 0;
+    ULONGLONG us;
+    LARGE_INTEGER f;
+    LARGE_INTEGER ps;
+    LARGE_INTEGER pe;
+    int       i;
+
+    if (InterlockedCompareExchange64(&log->size, 0, 0) == 0) {
+        DBG_PRINTF("empty log %S", log->logFile);
+        InterlockedExchange(&log->state, 0);
+        return 0;
+    }
+    sn = xwcsconcat(log->logFile, SVCBATCH_LOGSNAP);
+    sh = CreateFileW(log->logFile, GENERIC_READ,
+                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                     OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (IS_INVALID_HANDLE(sh)) {
+        rc = GetLastError();
+        xfree(sn);
+        return xsyserror(rc, log->logFile, NULL);
+    }
+    dh = CreateFileW(sn, GENERIC_READ | GENERIC_WRITE,
+                     FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                     CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (IS_INVALID_HANDLE(dh)) {
+        rc = GetLastError();
+        CloseHandle(sh);
+        xsyserror(rc, sn, NULL);
+        xfree(sn);
+        return rc;
     }
-    if (xwcschr(rp, L':')) {
-        int hh, mm, ss;
+    logsnapidxopen(log, sn, &ih, &xh);
+    buf = (LPBYTE)xmmalloc(SVCBATCH_SNAP_BUFSIZ);
+#if HAVE_BLOCK_CLONE
+    logsnapclone(sh, dh, &cp, (ULONGLONG)InterlockedCompareExchange64(&log->size, 0, 0));
+#endif
+    for (i = 0; (rc == 0) && (i < SVCBATCH_SNAP_PASSES); i++) {
+        ULONGLONG sz = (ULONGLONG)InterlockedCompareExchange64(&log->size, 0, 0);
 
-        hh = xwcstoi(rp, &ep);
-        if ((hh < 0) || (hh > 23))
-            return FALSE;
-        if (*ep != L':')
-            return FALSE;
-        rp = ep + 1;
-        mm = xwcstoi(rp, &ep);
-        if ((mm < 0) || (mm > 59))
-            return FALSE;
-        if (*ep != L':')
-            return FALSE;
-        rp = ep + 1;
-        ss = xwcstoi(rp, &ep);
-        if ((ss < 0) || (ss > 59))
-            return FALSE;
+        if ((sz - cp) <= SVCBATCH_SNAP_TAIL)
+            break;
+        rc = logsnapcopy(sh, dh, buf, &cp, sz);
+    }
+    if (ih)
+        xc = logsnapidxcopy(ih, xh, buf, &ic);
+    QueryPerformanceFrequency(&f);
+    SVCBATCH_CS_ENTER(log);
+    QueryPerformanceCounter(&ps);
+    InterlockedExchange(&log->state, 0);
+    if (rc == 0)
+        rc = logsnapcopy(sh, dh, buf, &cp, (ULONGLONG)log->size);
+    if (rc == 0) {
+        if (ih && (xc == 0))
+            xc = logsnapidxcopy(ih, xh, buf, &ic);
+        /**
+         * Keep the log data if the copy failed
+         */
+        rc = logtruncate(log, &cut);
+    }
+    QueryPerformanceCounter(&pe);
+    us = (pe.QuadPart - ps.QuadPart) * 1000000 / f.QuadPart;
+    log->snaps++;
+    log->snaplast = us;
+    if (us > log->snapmax)
+        log->snapmax = us;
+    SVCBATCH_CS_LEAVE(log);
+    DBG_PRINTF("copied %llu bytes paused %llu us", cp, us);
+
+    xfree(buf);
+    CloseHandle(sh);
+    if (ih) {
+        CloseHandle(ih);
+        CloseHandle(xh);
+        if ((xc != 0) || !cut) {
+            LPWSTR xn = xwcsconcat(sn, SVCBATCH_LOGINDEX);
 
-        DBG_PRINTF("at %.2d:%.2d:%.2d",
-                   hh, mm, ss);
-        resolvetimeout(hh, mm, ss, 1);
-        rp = ep;
+            if (cut)
+                xsyserror(xc, L"LogSnapshot", xn);
+            DeleteFileW(xn);
+            xfree(xn);
+        }
     }
-    if (*rp == WNUL)
-        return TRUE;
-    DBG_PRINTF("invalid %S", param);
-    return FALSE;
-}
+    if (rc)
+        xsyserror(rc, L"LogSnapshot", log->logFile);
+    if (cut) {
+        DWORD rv;
 
-static void xirotatetime(int mm)
-{
-    if (mm == 60) {
-        DBG_PRINTS("each full hour");
-        resolvetimeout(0, 0, 0, 0);
+        /**
+         * The snapshot holds the only copy of the data,
+         * even if the log could not be mapped again
+         */
+        FlushFileBuffers(dh);
+        /**
+         * Snapshot is opened with FILE_SHARE_DELETE,
+         * so it can be renamed while still open
+         */
+        rv = rotateprevlogs(log, sn, FALSE);
+        if ((rv == 0) && zipqueue) {
+            LPWSTR rn = xwcsconcat(log->logFile, L".1");
+
+            logzipqueue(dh, rn);
+            xfree(rn);
+        }
+        else {
+            CloseHandle(dh);
+        }
+        if (rc == 0)
+            rc = rv;
     }
     else {
-        rotateinterval = mm * ONE_MINUTE * CPP_INT64_C(-1);
-        rotatetime.QuadPart = rotateinterval;
-        SVCOPT_SET(SVCBATCH_OPT_ROTATE_BY_TIME);
-        DBG_PRINTF("each %d minutes", mm);
+        CloseHandle(dh);
+        DeleteFileW(sn);
     }
+    xfree(sn);
+    return rc;
 }
 
-static DWORD addshmemdata(LPWSTR d, LPDWORD x, const BYTE *s, DWORD n)
+/**
+ * Close the log file and open it again
+ * while holding the log lock
+ */
+static DWORD reopenlogfile(LPSVCBATCH_LOG log)
 {
-    DWORD p;
-    DWORD i = *x;
+    DWORD  rc;
+    HANDLE h;
 
-    if ((n == 0) || (s == NULL))
-        return 0;
-    p = MEM_ALIGN_WORD(n) / 2;
-    if ((i + p) >= SVCBATCH_DATA_LEN)
-        return 0;
-    memcpy(d + i, s, n);
-    *x = i + p;
-    return i;
+    SVCBATCH_CS_ENTER(log);
+    InterlockedExchange(&log->state, 0);
+    h = InterlockedExchangePointer(&log->fd, NULL);
+    if (h) {
+        logmapclose(log, h);
+        FlushFileBuffers(h);
+        CloseHandle(h);
+    }
+    logindexclose(log);
+    rc = openlogfile(log, FALSE);
+    SVCBATCH_CS_LEAVE(log);
+    DBG_PRINTF("reopened %S", log->logFile);
+    return rc;
 }
 
-static DWORD addshmemwstr(LPWSTR d, LPDWORD x, LPCWSTR s)
+static DWORD rotatelogs(LPSVCBATCH_LOG log)
 {
-    DWORD i = *x;
-    DWORD n;
-
-    if (IS_EMPTY_WCS(s))
-        return 0;
-    n = xwcslen(s) + 1;
-    if ((i + n) >= SVCBATCH_DATA_LEN)
-        return 0;
-    wmemcpy(d + i, s, n);
-    *x = i + n;
-    return i;
-}
+    DWORD  rc = 0;
+    HANDLE h;
+    SVCBATCH_LOG  ol;
 
-static DWORD runshutdown(void)
-{
-    WCHAR rb[BBUFSIZ];
-    DWORD i;
-    DWORD rc = 0;
-    DWORD x  = 4;
-    SECURITY_ATTRIBUTES sa;
+    ASSERT_NULL(log, 0);
+    if (IS_NOT_OPT(SVCBATCH_OPT_TRUNCATE)) {
+        /**
+         * Rename the previous logs and open the next
+         * log file without holding the lock.
+         * Log files are opened with FILE_SHARE_DELETE,
+         * so the writer keeps writing to the current
+         * log while it is renamed.
+         */
+        if (log->gen == NULL) {
+            LPWSTR nn = logmakename(log);
+            BOOL   sn = (nn == NULL) || xwcsequals(nn, log->logFile);
+
+            xfree(nn);
+            if (sn && (InterlockedCompareExchange64(&log->size, 0, 0) == 0)) {
+                /**
+                 * Empty log is not renamed, so the next
+                 * one cannot be created on the same path
+                 */
+                DBG_PRINTF("empty log %S", log->logFile);
+                InterlockedExchange(&log->state, 0);
+                return 0;
+            }
+            if (sn && (log->maxLogs == 0)) {
+                /**
+                 * The current log is not renamed, so the next
+                 * one can only be opened in place if its name
+                 * was changed by the '@' format.
+                 * Otherwise the current log has to be closed
+                 * before it is opened again.
+                 */
+                return reopenlogfile(log);
+            }
+        }
+        xmemzero(&ol, 1, sizeof(SVCBATCH_LOG));
+        ol.logName = log->logName;
+        ol.maxLogs = log->maxLogs;
+        ol.gen     = log->gen;
+        rc = openlogfile(&ol, FALSE);
+
+        SVCBATCH_CS_ENTER(log);
+        InterlockedExchange(&log->state, 0);
+        if (rc == 0) {
+            if ((logcutmode == SVCBATCH_CUT_NONE) ||
+                ((logcutmode == SVCBATCH_CUT_LINE) && log->sol)) {
+                logswapfile(log, &ol);
+            }
+            else {
+                /**
+                 * Let the writer switch to the next
+                 * log file at the line or record boundary
+                 */
+                ResetEvent(dologcut);
+                log->cutbytes = 0;
+                log->cutsol   = log->sol;
+                log->cutempty = log->sol;
+                log->next     = &ol;
+            }
+        }
+        SVCBATCH_CS_LEAVE(log);
+        if (rc)
+            return rc;
+        if (log->next) {
+            WaitForSingleObject(dologcut, SVCBATCH_CUT_WAIT);
+            SVCBATCH_CS_ENTER(log);
+            if (log->next) {
+                DBG_PRINTF("no boundary in %lu ms", SVCBATCH_CUT_WAIT);
+                logswapfile(log, &ol);
+                log->next = NULL;
+            }
+            SVCBATCH_CS_LEAVE(log);
+        }
+        /**
+         * The ol now holds the previous log file
+         */
+        h = ol.fd;
+        if (h) {
+            logmapclose(&ol, h);
+            FlushFileBuffers(h);
+            if (zipqueue)
+                logzipqueue(h, ol.logFile);
+            else
+                CloseHandle(h);
+        }
+        logindexclose(&ol);
+        DBG_PRINTF("rotated %S", ol.logFile);
+        xfree(ol.logFile);
+        return 0;
+    }
+    if (logsnapshot)
+        return logsnaptruncate(log);
+    SVCBATCH_CS_ENTER(log);
+    InterlockedExchange(&log->state, 0);
+    rc = logtruncate(log, NULL);
+    SVCBATCH_CS_LEAVE(log);
+    return rc;
+}
+
+static DWORD closelogfile(LPSVCBATCH_LOG log)
+{
+    HANDLE h;
+
+    if (log == NULL)
+        return ERROR_FILE_NOT_FOUND;
+
+    SVCBATCH_CS_ENTER(log);
+    DBG_PRINTF("%lu %S", log->state, log->logFile);
+    if (log->snaps) {
+        DBG_PRINTF("%llu snapshots max pause %llu us",
+                   log->snaps, log->snapmax);
+    }
+    InterlockedExchange(&log->state, 0);
+
+    h = InterlockedExchangePointer(&log->fd, NULL);
+    if (h) {
+        logmapclose(log, h);
+        FlushFileBuffers(h);
+        CloseHandle(h);
+    }
+    logindexclose(log);
+    loggenclose(log->gen);
+    xfree(log->logFile);
+
+    SVCBATCH_CS_LEAVE(log);
+    SVCBATCH_CS_CLOSE(log);
+    xfree(log);
+
+    return 0;
+}
+
+/**
+ * Convert the local wall clock time to UTC
+ */
+static BOOL xlocaltoutc(ULONGLONG w, ULONGLONG *u)
+{
+    SYSTEMTIME lt;
+    SYSTEMTIME st;
+    FILETIME   ft;
+
+    ft.dwHighDateTime = (DWORD)(w >> 32);
+    ft.dwLowDateTime  = (DWORD)(w);
+    if (!FileTimeToSystemTime(&ft, &lt))
+        return FALSE;
+    if (!TzSpecificLocalTimeToSystemTime(NULL, &lt, &st))
+        return FALSE;
+    if (!SystemTimeToFileTime(&st, &ft))
+        return FALSE;
+    *u = ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return TRUE;
+}
+
+/**
+ * Set the absolute rotatetime to the next
+ * scheduled time.
+ * Schedule is evaluated in the local wall clock
+ * time if LocalTime is set, so the rotation stays
+ * at the same hour across daylight saving changes.
+ */
+static BOOL resolverotatetime(void)
+{
+    SYSTEMTIME st;
+    FILETIME   ft;
+    ULONGLONG  ct;
+    ULONGLONG  wt;
+    ULONGLONG  ut;
+
+    GetSystemTimeAsFileTime(&ft);
+    ct = ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    wt = ct;
+    if (IS_OPT_SET(SVCBATCH_OPT_LOCALTIME)) {
+        GetLocalTime(&st);
+        if (!SystemTimeToFileTime(&st, &ft))
+            return FALSE;
+        wt = ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    }
+    ut = xschedresolve(rotatesched, rotateschedn, ct, wt,
+                       IS_OPT_SET(SVCBATCH_OPT_LOCALTIME) ? xlocaltoutc : NULL);
+    if (ut == 0) {
+        DBG_PRINTS("cannot resolve");
+        return FALSE;
+    }
+    rotatetime.QuadPart = (LONGLONG)ut;
+    DBG_PRINTF("in %llu seconds", (ut - ct) / ONE_FTSECOND);
+    return TRUE;
+}
+
+/**
+ * Parse the LogRotateTime schedule.
+ * See xschedparse for the syntax.
+ */
+static BOOL xarotatetime(LPCWSTR param)
+{
+    if (IS_EMPTY_WCS(param))
+        return TRUE;
+    if (xiswcschar(param, L'0')) {
+        DBG_PRINTS("at midnight");
+        param = L"00:00:00";
+    }
+    rotateschedn = xschedparse(param, rotatesched, SVCBATCH_MAX_SCHEDULE);
+    if (rotateschedn == 0) {
+        DBG_PRINTF("invalid %S", param);
+        return FALSE;
+    }
+    DBG_PRINTF("%lu entries", rotateschedn);
+    SVCOPT_SET(SVCBATCH_OPT_ROTATE_BY_TIME);
+    return TRUE;
+}
+
+static void xirotatetime(int mm)
+{
+    if (mm == 60) {
+        DBG_PRINTS("each full hour");
+        xarotatetime(L"*:00:00");
+    }
+    else {
+        rotateinterval = mm * ONE_MINUTE * CPP_INT64_C(-1);
+        rotatetime.QuadPart = rotateinterval;
+        SVCOPT_SET(SVCBATCH_OPT_ROTATE_BY_TIME);
+        DBG_PRINTF("each %d minutes", mm);
+    }
+}
+
+static DWORD addshmemdata(LPWSTR d, LPDWORD x, const BYTE *s, DWORD n)
+{
+    DWORD p;
+    DWORD i = *x;
+
+    if ((n == 0) || (s == NULL))
+        return 0;
+    p = MEM_ALIGN_WORD(n) / 2;
+    if ((i + p) >= SVCBATCH_DATA_LEN)
+        return 0;
+    memcpy(d + i, s, n);
+    *x = i + p;
+    return i;
+}
+
+static DWORD addshmemwstr(LPWSTR d, LPDWORD x, LPCWSTR s)
+{
+    DWORD i = *x;
+    DWORD n;
+
+    if (IS_EMPTY_WCS(s))
+        return 0;
+    n = xwcslen(s) + 1;
+    if ((i + n) >= SVCBATCH_DATA_LEN)
+        return 0;
+    wmemcpy(d + i, s, n);
+    *x = i + n;
+    return i;
+}
+
+static DWORD runshutdown(void)
+{
+    WCHAR rb[BBUFSIZ];
+    DWORD i;
+    DWORD rc = 0;
+    DWORD x  = 4;
+    SECURITY_ATTRIBUTES sa;
 
     DBG_PRINTS("started");
     sa.nLength              = DSIZEOF(SECURITY_ATTRIBUTES);
@@ -4114,7 +5400,7 @@ static DWORD runshutdown(void)
     if (x >= SVCBATCH_DATA_LEN)
         return ERROR_OUTOFMEMORY;
     DBG_PRINTF("shared memory size %lu", DSIZEOF(SVCBATCH_IPC));
-    rc = createiopipes(&svcstop->sInfo, NULL, NULL, 0);
+    rc = createiopipes(&svcstop->sInfo, NULL, NULL, NULL, 0);
     if (rc != 0) {
         DBG_PRINTF("createiopipes failed with %lu", rc);
         return rc;
@@ -4190,11 +5476,8 @@ static DWORD WINAPI stopthread(void *ssp)
         xsvcstatus(SERVICE_STOP_PENDING, service->timeout);
     }
     DBG_PRINTS("started");
-    if (outputlog) {
-        SVCBATCH_CS_ENTER(outputlog);
-        InterlockedExchange(&outputlog->state, 0);
-        SVCBATCH_CS_LEAVE(outputlog);
-    }
+    if (outputlog)
+        setrotatestate(0);
     if (svcstop) {
         rs = GetTickCount64();
 
@@ -4238,83 +5521,1791 @@ static DWORD WINAPI stopthread(void *ssp)
         DBG_PRINTS("worker process is still running ... terminating");
         killprocess(cmdproc, ws);
     }
-    else {
-        DBG_PRINTS("worker process ended");
-        cleanprocess(cmdproc);
+    else {
+        DBG_PRINTS("worker process ended");
+        cleanprocess(cmdproc);
+    }
+    xsvcstatus(SERVICE_STOP_PENDING, 0);
+    SetEvent(svcstopdone);
+    DBG_PRINTS("done");
+    return rc;
+}
+
+static void createstopthread(DWORD rc)
+{
+    DBG_PRINTF("status %lu", rc);
+    setsvcstatusexit(rc);
+    if (servicemode)
+        xcreatethread(SVCBATCH_STOP_THREAD, 0, stopthread, NULL);
+}
+
+static void stopshutdown(DWORD rt)
+{
+    DWORD ws;
+
+    DBG_PRINTS("started");
+    SetConsoleCtrlHandler(NULL, TRUE);
+    if (IS_OPT_SET(SVCBATCH_OPT_CTRL_BREAK)) {
+        DBG_PRINTS("generating CTRL_BREAK_EVENT");
+        GenerateConsoleCtrlEvent(CTRL_BREAK_EVENT, cmdproc->pInfo.dwProcessId);
+    }
+    else {
+        DBG_PRINTS("generating CTRL_C_EVENT");
+        GenerateConsoleCtrlEvent(CTRL_C_EVENT, 0);
+    }
+    ws = WaitForSingleObject(workerended, rt);
+    SetConsoleCtrlHandler(NULL, FALSE);
+    if (ws != WAIT_OBJECT_0) {
+        DBG_PRINTS("worker process is still running ... terminating");
+        killprocess(cmdproc, ws);
+    }
+    else {
+        DBG_PRINTS("worker process ended");
+        cleanprocess(cmdproc);
+    }
+    DBG_PRINTS("done");
+}
+
+static LPSVCBATCH_BUFFER xnewbuffer(DWORD size)
+{
+    LPSVCBATCH_BUFFER b;
+
+    b = (LPSVCBATCH_BUFFER)xmmalloc(sizeof(SVCBATCH_BUFFER) + size);
+    b->size = size;
+    b->data = (LPBYTE)(b + 1);
+    return b;
+}
+
+/**
+ * Find where to switch to the pending log file.
+ * Returns the number of bytes that belong to the
+ * current log file, or len + 1 if there is no boundary.
+ */
+static DWORD logcutfind(LPSVCBATCH_LOG log, LPBYTE buf, DWORD len)
+{
+    LPBYTE s = buf;
+    LPBYTE e = buf + len;
+    LPBYTE p;
+    LPBYTE q;
+    DWORD  k = len + 1;
+
+    while (s < e) {
+        if (log->cutsol && (logcutmode == SVCBATCH_CUT_RECORD)) {
+            if ((DWORD)(e - s) < logcutplen) {
+                /**
+                 * Line continues in the next write,
+                 * so this record cannot be split.
+                 */
+                log->cutsol = FALSE;
+                break;
+            }
+            if (memcmp(s, logcutprefix, logcutplen) == 0) {
+                k = (DWORD)(s - buf);
+                break;
+            }
+        }
+        p = xmemlf(s, e);
+        if (logcutmode == SVCBATCH_CUT_BLANK) {
+            for (q = s; log->cutempty && (q < (p ? p : e)); q++) {
+                if (*q != '\r')
+                    log->cutempty = FALSE;
+            }
+            if (p && log->cutempty) {
+                k = (DWORD)(p + 1 - buf);
+                break;
+            }
+        }
+        if (p == NULL) {
+            log->cutsol = FALSE;
+            break;
+        }
+        if (logcutmode == SVCBATCH_CUT_LINE) {
+            k = (DWORD)(p + 1 - buf);
+            break;
+        }
+        log->cutsol   = TRUE;
+        log->cutempty = TRUE;
+        s = p + 1;
+    }
+    if (k > len) {
+        if ((log->cutbytes + len) >= logcutmax) {
+            /**
+             * No boundary within the limit
+             */
+            k = logcutmax - log->cutbytes;
+        }
+        else {
+            log->cutbytes += len;
+        }
+    }
+    return k;
+}
+
+static DWORD logwrchunk(LPSVCBATCH_LOG log, HANDLE h, BYTE *buf, DWORD len)
+{
+    DWORD    rc = 0;
+    DWORD    wr = 0;
+    LONGLONG of = log->size;
+
+    if (len == 0)
+        return 0;
+    if (log->seg.view)
+        rc = logmapwrite(log, h, buf, len);
+    else if (WriteFile(h, buf, len, &wr, NULL) && (wr != 0))
+        InterlockedAdd64(&log->size, wr);
+    else
+        rc = GetLastError();
+    if (rc == 0) {
+        if (log->idx)
+            logindexdata(log, of, buf, len);
+        log->sol = buf[len - 1] == '\n';
+    }
+    return rc;
+}
+
+static DWORD logwrdata(LPSVCBATCH_LOG log, BYTE *buf, DWORD len)
+{
+    DWORD    rc = 0;
+    DWORD    k;
+    HANDLE   h;
+
+    ASSERT_NULL(log, 0);
+    SVCBATCH_CS_ENTER(log);
+    h = InterlockedExchangePointer(&log->fd, NULL);
+    if (h == NULL) {
+        SVCBATCH_CS_LEAVE(log);
+        DBG_PRINTS("logfile closed");
+        return ERROR_NO_MORE_FILES;
+    }
+    if (log->next) {
+        k = logcutfind(log, buf, len);
+        if (k <= len) {
+            rc = logwrchunk(log, h, buf, k);
+            if (rc == 0) {
+                /**
+                 * Switch to the next log file
+                 * and write the rest of the data
+                 */
+                InterlockedExchangePointer(&log->fd, h);
+                logswapfile(log, log->next);
+                log->next = NULL;
+                h = InterlockedExchangePointer(&log->fd, NULL);
+                SetEvent(dologcut);
+                DBG_PRINTF("cut at %lu of %lu", k, len);
+                buf += k;
+                len -= k;
+            }
+        }
+    }
+    if (rc == 0)
+        rc = logwrchunk(log, h, buf, len);
+
+    InterlockedExchangePointer(&log->fd, h);
+    SVCBATCH_CS_LEAVE(log);
+    if (rc)
+        return xsyserror(rc, L"LogWrite", NULL);
+    if (xsyncadd(&logsyncgroup, len))
+        SetEvent(dologsync);
+    if (IS_OPT_SET(SVCBATCH_OPT_ROTATE_BY_SIZE)) {
+        if (log->size >= rotatesize) {
+            if (canrotatelogs(log)) {
+                DBG_PRINTS("rotating by size");
+                InterlockedExchange(&log->rotate, 1);
+                SetEvent(dologrotate);
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Compile the multi string patterns into
+ * Aho-Corasick automaton.
+ * The patterns are converted to the encoding
+ * of the lines they are matched against.
+ */
+static LPSVCBATCH_FILTER xfiltercompile(LPCWSTR msz)
+{
+    LPSVCBATCH_FILTER f;
+    LPCWSTR  cp;
+    LPSTR   *pv;
+    DWORD    np = 0;
+    DWORD    i;
+    int      n;
+    UINT     fc = CP_ACP;
+
+    if (msz == NULL)
+        return NULL;
+    if (logencoding) {
+        /**
+         * Lines are matched after
+         * they are converted to UTF-8
+         */
+        fc = CP_UTF8;
+    }
+    for (cp = msz; *cp; cp++) {
+        np++;
+        while (*cp)
+            cp++;
+    }
+    f = (LPSVCBATCH_FILTER)xmcalloc(sizeof(SVCBATCH_FILTER));
+    f->count   = np;
+    f->names   = (LPCWSTR *)xmcalloc(np * sizeof(LPCWSTR));
+    f->hits    = (ULONGLONG *)xmcalloc(np * sizeof(ULONGLONG));
+    pv         = (LPSTR *)xmcalloc(np * sizeof(LPSTR));
+    for (i = 0, cp = msz; i < np; i++) {
+        f->names[i] = cp;
+        n = WideCharToMultiByte(fc, 0, cp, -1, NULL, 0, NULL, NULL);
+        if (n < 1)
+            n = 1;
+        pv[i] = (LPSTR)xmcalloc(n);
+        WideCharToMultiByte(fc, 0, cp, -1, pv[i], n, NULL, NULL);
+        while (*cp)
+            cp++;
+        cp++;
+    }
+    if (!xfilterbuild(f, (LPCSTR *)pv)) {
+        xfree(f->names);
+        xfree(f->hits);
+        xfree(f);
+        f = NULL;
+    }
+    for (i = 0; i < np; i++)
+        xfree(pv[i]);
+    xfree(pv);
+    if (f == NULL) {
+        SetLastError(ERROR_BUFFER_OVERFLOW);
+        return NULL;
+    }
+    DBG_PRINTF("%lu patterns %lu states %lu classes", np, f->states, f->classes);
+    return f;
+}
+
+/**
+ * Check if the bytes below 0x80 map to the same
+ * Unicode characters in the code page.
+ * This is not true for EBCDIC code pages like 037 or 500,
+ * even if they are single byte ones.
+ */
+static BOOL xiconvascii(UINT cp)
+{
+    BYTE  s[128];
+    WCHAR w[128];
+    int   i;
+
+    for (i = 0; i < 128; i++)
+        s[i] = (BYTE)i;
+    if (MultiByteToWideChar(cp, 0, (LPCSTR)s, 128, w, 128) != 128)
+        return FALSE;
+    for (i = 0; i < 128; i++) {
+        if (w[i] != (WCHAR)i)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL xiconvlead(UINT cp, BYTE c)
+{
+    return IsDBCSLeadByteEx(cp, c);
+}
+
+static LPSVCBATCH_ICONV xiconvinit(UINT cp)
+{
+    LPSVCBATCH_ICONV cv;
+    CPINFO ci;
+
+    cv = (LPSVCBATCH_ICONV)xmcalloc(sizeof(SVCBATCH_ICONV));
+    cv->dc.cp     = cp;
+    cv->dc.islead = xiconvlead;
+    if (GetCPInfo(cp, &ci))
+        cv->dc.dbcs = ci.MaxCharSize > 1;
+    cv->dc.ascii = xiconvascii(cp);
+    DBG_PRINTF("code page %u dbcs %d ascii %d", cp, cv->dc.dbcs, cv->dc.ascii);
+    return cv;
+}
+
+static void xiconvfree(LPSVCBATCH_ICONV cv)
+{
+    if (cv == NULL)
+        return;
+    xfree(cv->wide);
+    xfree(cv->out);
+    xfree(cv);
+}
+
+/**
+ * Convert the buffer data from the cv->dc.cp
+ * code page to UTF-8.
+ *
+ * Returns the original buffer if the data is ASCII
+ * and the code page is ASCII compatible.
+ * Lead byte at the end of the data is kept for
+ * the next buffer from the same stream.
+ */
+static LPSVCBATCH_BUFFER xiconv(LPSVCBATCH_ICONV cv, LPSVCBATCH_BUFFER b)
+{
+    LPBYTE s = b->data;
+    LPBYTE e = b->data + b->len;
+    BYTE   dc[2];
+    DWORD  dn;
+    int    wn = 0;
+    int    un;
+
+    if ((cv->dc.lead[b->stream] == 0) && cv->dc.ascii && (xmemascii(s, e) == NULL))
+        return b;
+    if (cv->size < (b->len + 2)) {
+        xfree(cv->wide);
+        xfree(cv->out);
+        cv->size = b->len + 2;
+        cv->wide = xwmalloc(cv->size);
+        cv->out  = xnewbuffer(cv->size * 3);
+    }
+    dn = xdbcssplit(&cv->dc, b->stream, &s, &e, dc);
+    if (dn)
+        wn = MultiByteToWideChar(cv->dc.cp, 0, (LPCSTR)dc, dn, cv->wide, 2);
+    if (s < e)
+        wn += MultiByteToWideChar(cv->dc.cp, 0, (LPCSTR)s, (int)(e - s),
+                                  cv->wide + wn, cv->size - wn);
+    un = WideCharToMultiByte(CP_UTF8, 0, cv->wide, wn,
+                             (LPSTR)cv->out->data, cv->out->size, NULL, NULL);
+    cv->out->len       = un > 0 ? un : 0;
+    cv->out->stream    = b->stream;
+    cv->out->time      = b->time;
+    cv->out->lost      = 0;
+    cv->out->lostbytes = 0;
+    return cv->out;
+}
+
+static DWORD logsyncfile(LPSVCBATCH_LOG log)
+{
+    HANDLE cp = GetCurrentProcess();
+    HANDLE h;
+    HANDLE d = NULL;
+
+    if (log == NULL)
+        return 0;
+    SVCBATCH_CS_ENTER(log);
+    h = InterlockedCompareExchangePointer(&log->fd, NULL, NULL);
+    if (h == NULL) {
+        /**
+         * The writer owns the handle.
+         * It will be flushed on the next sync
+         */
+        SVCBATCH_CS_LEAVE(log);
+        return 0;
+    }
+    if (log->seg.view)
+        FlushViewOfFile(log->seg.view, (SIZE_T)(log->size - log->seg.base));
+    /**
+     * Flush the duplicate handle outside the lock,
+     * so that rotation can close the original
+     */
+    if (!DuplicateHandle(cp, h, cp, &d, 0, FALSE, DUPLICATE_SAME_ACCESS))
+        d = NULL;
+    SVCBATCH_CS_LEAVE(log);
+    if (d == NULL)
+        return GetLastError();
+    if (!FlushFileBuffers(d)) {
+        DWORD rc = GetLastError();
+
+        CloseHandle(d);
+        return rc;
+    }
+    CloseHandle(d);
+    return 0;
+}
+
+static DWORD WINAPI syncthread(void *unused)
+{
+    DWORD     rc = 0;
+    LARGE_INTEGER f;
+    LARGE_INTEGER cs;
+    LARGE_INTEGER ce;
+
+    DBG_PRINTF("started %lu ms %ld bytes", logsyncint, logsyncsize);
+    QueryPerformanceFrequency(&f);
+    while (InterlockedCompareExchange(&logsyncstate, 0, 0)) {
+        WaitForSingleObject(dologsync, logsyncint);
+        xsyncstart(&logsyncgroup);
+        QueryPerformanceCounter(&cs);
+        rc = logsyncfile(outputlog);
+        if (rc == 0)
+            rc = logsyncfile(errorlog);
+        QueryPerformanceCounter(&ce);
+        if (rc) {
+            DBG_PRINTF("flush failed %lu", rc);
+            break;
+        }
+        xsyncdone(&logsyncgroup, (ce.QuadPart - cs.QuadPart) * 1000000 / f.QuadPart);
+    }
+    DBG_PRINTF("done %llu flushes avg %llu max %llu us", logsyncgroup.flushes,
+               logsyncgroup.flushes ? logsyncgroup.total / logsyncgroup.flushes : 0,
+               logsyncgroup.max);
+    return rc;
+}
+
+/**
+ * Compress the rotated log file to the .gz sibling.
+ * The compressed file is read back and verified
+ * before the original log file is deleted.
+ */
+static DWORD logzipfile(LPSVCBATCH_DEFLATE z, LPBYTE buf, LPSVCBATCH_ZIPJOB j)
+{
+    FILE_STANDARD_INFO si;
+    LARGE_INTEGER ee = {{ 0, 0 }};
+    LARGE_INTEGER fs;
+    WCHAR     pn[SVCBATCH_PATH_MAX];
+    LPWSTR    tn;
+    LPWSTR    gn = NULL;
+    HANDLE    zh;
+    ULONGLONG ib = 0;
+    ULONGLONG ob = 0;
+    ULONGLONG vb = 0;
+    ULONGLONG db = 0;
+    DWORD     crc = 0;
+    DWORD     dcr = 0;
+    DWORD     zn  = 0;
+    DWORD     rd;
+    DWORD     wr;
+    DWORD     rc = 0;
+    DWORD     n;
+
+    if (!GetFileSizeEx(j->fd, &fs))
+        return GetLastError();
+    if (fs.QuadPart == 0)
+        return 0;
+    if (!SetFilePointerEx(j->fd, ee, NULL, FILE_BEGIN))
+        return GetLastError();
+    tn = xwcsconcat(j->name, SVCBATCH_LOGGZTMP);
+    zh = CreateFileW(tn, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                     CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                     NULL);
+    if (IS_INVALID_HANDLE(zh)) {
+        rc = GetLastError();
+        xfree(tn);
+        return rc;
+    }
+    while (InterlockedCompareExchange(&zipqueue->state, 0, 0)) {
+        if (!ReadFile(j->fd, buf, SVCBATCH_DEFLATE_LEN, &rd, NULL)) {
+            rc = GetLastError();
+            break;
+        }
+        if (rd == 0)
+            break;
+        xzmember(z, buf, rd);
+        if (!WriteFile(zh, z->data, z->len, &wr, NULL)) {
+            rc = GetLastError();
+            break;
+        }
+        crc = xcrc32(crc, buf, rd);
+        ib += rd;
+        ob += z->len;
+    }
+    if ((rc == 0) && (ib != (ULONGLONG)fs.QuadPart))
+        rc = ERROR_OPERATION_ABORTED;
+    if (rc == 0) {
+        /**
+         * Verify what was written to the disk.
+         * Each member is decoded and checked against its
+         * CRC32 and ISIZE trailer, and the decoded data
+         * has to match the CRC32 of the source log.
+         */
+        FlushFileBuffers(zh);
+        if (!SetFilePointerEx(zh, ee, NULL, FILE_BEGIN))
+            rc = GetLastError();
+        for (n = 1; rc == 0; ) {
+            DWORD used;
+            DWORD olen;
+
+            while (n && (zn < z->size)) {
+                if (!ReadFile(zh, z->data + zn, z->size - zn, &n, NULL)) {
+                    rc = GetLastError();
+                    break;
+                }
+                zn += n;
+                vb += n;
+            }
+            if ((rc != 0) || (zn == 0))
+                break;
+            if (!xzinflate(z->data, zn, buf, SVCBATCH_DEFLATE_LEN, &used, &olen)) {
+                rc = ERROR_CRC;
+                break;
+            }
+            dcr = xcrc32(dcr, buf, olen);
+            db += olen;
+            zn -= used;
+            memmove(z->data, z->data + used, zn);
+        }
+        if ((rc == 0) && ((vb != ob) || (db != ib) || (dcr != crc)))
+            rc = ERROR_CRC;
+    }
+    CloseHandle(zh);
+    if (rc) {
+        DeleteFileW(tn);
+        xfree(tn);
+        return rc;
+    }
+    SVCBATCH_CS_ENTER(zipqueue);
+    if (GetFileInformationByHandleEx(j->fd, FileStandardInfo, &si, sizeof(si)) &&
+        si.DeletePending) {
+        /**
+         * The log was removed while compressing
+         */
+        DBG_PRINTF("removed %S", j->name);
+        DeleteFileW(tn);
+        goto finished;
+    }
+    n = GetFinalPathNameByHandleW(j->fd, pn, SVCBATCH_PATH_SIZ, VOLUME_NAME_DOS);
+    if ((n == 0) || (n >= SVCBATCH_PATH_SIZ)) {
+        rc = n ? ERROR_BAD_PATHNAME : GetLastError();
+        DeleteFileW(tn);
+        goto finished;
+    }
+    gn = xwcsconcat(pn, SVCBATCH_LOGGZIP);
+    if (!MoveFileExW(tn, gn, MOVEFILE_REPLACE_EXISTING)) {
+        rc = GetLastError();
+        DeleteFileW(tn);
+        goto finished;
+    }
+    /**
+     * Log file is opened with FILE_SHARE_DELETE,
+     * and it will be removed when the handle is closed
+     */
+    DeleteFileW(pn);
+    zipqueue->files++;
+    zipqueue->ibytes += ib;
+    zipqueue->obytes += ob;
+    DBG_PRINTF("%S %llu -> %llu bytes", gn, ib, ob);
+
+finished:
+    SVCBATCH_CS_LEAVE(zipqueue);
+    xfree(gn);
+    xfree(tn);
+    return rc;
+}
+
+static DWORD WINAPI zipthread(void *unused)
+{
+    LPSVCBATCH_DEFLATE z;
+    LPSVCBATCH_ZIPJOB  j;
+    LPBYTE    b;
+    DWORD     rc;
+    ULONGLONG ts;
+
+    /**
+     * Lower both CPU and I/O priority so that
+     * compression never competes with the writer
+     */
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+    z = xzinit();
+    b = (LPBYTE)xmmalloc(SVCBATCH_DEFLATE_LEN);
+    DBG_PRINTF("started %ld queued", zipqueue->count);
+    while (InterlockedCompareExchange(&zipqueue->state, 0, 0)) {
+        SVCBATCH_CS_ENTER(zipqueue);
+        j = zipqueue->head;
+        if (j) {
+            zipqueue->head = j->next;
+            if (zipqueue->head == NULL)
+                zipqueue->tail = NULL;
+        }
+        SVCBATCH_CS_LEAVE(zipqueue);
+        if (j == NULL) {
+            WaitForSingleObject(zipqueue->event, INFINITE);
+            continue;
+        }
+        ts = GetTickCount64();
+        rc = logzipfile(z, b, j);
+        zipqueue->ticks += GetTickCount64() - ts;
+        if (rc)
+            DBG_PRINTF("failed %lu %S", rc, j->name);
+        InterlockedDecrement(&zipqueue->count);
+        DBG_PRINTF("backlog %ld", zipqueue->count);
+        CloseHandle(j->fd);
+        xfree(j->name);
+        xfree(j);
+    }
+    /**
+     * Files that were not compressed are left as they are
+     */
+    SVCBATCH_CS_ENTER(zipqueue);
+    while ((j = zipqueue->head) != NULL) {
+        zipqueue->head = j->next;
+        CloseHandle(j->fd);
+        xfree(j->name);
+        xfree(j);
+    }
+    zipqueue->tail = NULL;
+    SVCBATCH_CS_LEAVE(zipqueue);
+    DBG_PRINTF("done %llu files %llu -> %llu bytes %llu KB/s %ld left",
+               zipqueue->files, zipqueue->ibytes, zipqueue->obytes,
+               zipqueue->ticks ? zipqueue->ibytes / zipqueue->ticks : 0,
+               zipqueue->count);
+    xfree(b);
+    xzfree(z);
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+    return 0;
+}
+
+/**
+ * Log retention.
+ *
+ * The retainthread keeps the catalog of the log files
+ * in the service->logs directory. The directory is scanned
+ * only on startup or on notification buffer overflow.
+ * Otherwise the catalog is updated from the directory
+ * change notifications.
+ */
+static LPWSTR logretainpattern(LPCWSTR name)
+{
+    LPCWSTR s;
+    LPWSTR  p;
+    LPWSTR  d;
+
+    s = xwcsrchr(name, L'\\');
+    s = s ? s + 1 : name;
+    p = xwmalloc(xwcslen(s) + 2);
+    for (d = p; *s; s++) {
+        if (*s == L'@') {
+            s++;
+            if (*s == L'@')
+                *(d++) = L'@';
+            else if (d == p || *(d - 1) != L'*')
+                *(d++) = L'*';
+            if (*s == WNUL)
+                break;
+        }
+        else {
+            *(d++) = *s;
+        }
+    }
+    *(d++) = L'*';
+    *d = WNUL;
+    return p;
+}
+
+static BOOL logretainmatch(LPCWSTR name)
+{
+    int i;
+
+    if (xwcsendswith(name, SVCBATCH_LOGMANIFEST) ||
+        xwcsendswith(name, SVCBATCH_LOGGZTMP))
+        return FALSE;
+    for (i = 0; i < logretain->npatterns; i++) {
+        if (xwcsmatch(logretain->patterns[i], name))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/**
+ * Returns TRUE if the file is the current
+ * log file or its index
+ */
+static BOOL logretainlive(LPSVCBATCH_LOG log, LPCWSTR name)
+{
+    LPCWSTR fn;
+    LPCWSTR sp = NULL;
+
+    if (log == NULL)
+        return FALSE;
+    SVCBATCH_CS_ENTER(log);
+    if (log->logFile) {
+        fn = xwcsrchr(log->logFile, L'\\');
+        sp = xwcsbegins(name, fn ? fn + 1 : log->logFile);
+        if (sp && *sp && !xwcsequals(sp, SVCBATCH_LOGINDEX))
+            sp = NULL;
+    }
+    SVCBATCH_CS_LEAVE(log);
+    return sp != NULL;
+}
+
+static int logretainfind(LPCWSTR name)
+{
+    DWORD i;
+
+    for (i = 0; i < logretain->count; i++) {
+        if (xwcsequals(logretain->files[i].name, name))
+            return (int)i;
+    }
+    return -1;
+}
+
+static void logretainadd(LPCWSTR name, WIN32_FIND_DATAW *fd)
+{
+    LPSVCBATCH_RETAIN_FILE f;
+    int i;
+
+    if (!logretainmatch(name))
+        return;
+    i = logretainfind(name);
+    if (i < 0) {
+        if (logretain->count == logretain->size) {
+            logretain->size  = logretain->size ? logretain->size * 2 : 64;
+            logretain->files = (LPSVCBATCH_RETAIN_FILE)xrealloc(logretain->files,
+                                    logretain->size * sizeof(SVCBATCH_RETAIN_FILE));
+        }
+        i = logretain->count++;
+        logretain->files[i].name = xwcsdup(name);
+    }
+    f = logretain->files + i;
+    f->dirty = TRUE;
+    if (fd) {
+        f->size  = ((ULONGLONG)fd->nFileSizeHigh << 32) | fd->nFileSizeLow;
+        f->time  = ((ULONGLONG)fd->ftLastWriteTime.dwHighDateTime << 32) |
+                   fd->ftLastWriteTime.dwLowDateTime;
+        f->dirty = FALSE;
+    }
+}
+
+static void logretainremove(LPCWSTR name)
+{
+    int i = logretainfind(name);
+
+    if (i < 0)
+        return;
+    xfree(logretain->files[i].name);
+    logretain->count--;
+    if ((DWORD)i < logretain->count)
+        logretain->files[i] = logretain->files[logretain->count];
+}
+
+static void logretainscan(void)
+{
+    WIN32_FIND_DATAW fd;
+    HANDLE fh;
+    LPWSTR fp;
+    DWORD  i;
+
+    for (i = 0; i < logretain->count; i++)
+        xfree(logretain->files[i].name);
+    logretain->count = 0;
+    logretain->rescans++;
+    fp = xwmakepath(service->logs, L"*", NULL);
+    fh = FindFirstFileExW(fp, FindExInfoBasic, &fd, FindExSearchNameMatch,
+                          NULL, FIND_FIRST_EX_LARGE_FETCH);
+    xfree(fp);
+    if (IS_INVALID_HANDLE(fh))
+        return;
+    do {
+        if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0)
+            logretainadd(fd.cFileName, &fd);
+    } while (FindNextFileW(fh, &fd));
+    FindClose(fh);
+    DBG_PRINTF("%lu files", logretain->count);
+}
+
+static void logretainnotify(LPBYTE buf)
+{
+    PFILE_NOTIFY_INFORMATION ni;
+    LPWSTR nm;
+
+    for (;;) {
+        ni = (PFILE_NOTIFY_INFORMATION)buf;
+        nm = xwcsndup(ni->FileName, ni->FileNameLength / sizeof(WCHAR));
+        switch (ni->Action) {
+            case FILE_ACTION_ADDED:
+            case FILE_ACTION_RENAMED_NEW_NAME:
+                logretainadd(nm, NULL);
+            break;
+            case FILE_ACTION_REMOVED:
+            case FILE_ACTION_RENAMED_OLD_NAME:
+                logretainremove(nm);
+            break;
+            default:
+            break;
+        }
+        xfree(nm);
+        if (ni->NextEntryOffset == 0)
+            break;
+        buf += ni->NextEntryOffset;
+    }
+}
+
+/**
+ * Remove the oldest files above the size or age limit
+ */
+static void logretainrun(void)
+{
+    WIN32_FILE_ATTRIBUTE_DATA ad;
+    LPSVCBATCH_RETAIN_FILE f;
+    FILETIME  ft;
+    ULONGLONG ct;
+    LPWSTR    fp;
+    BOOL      expired;
+    DWORD     i;
+    DWORD     n = 0;
+
+    GetSystemTimeAsFileTime(&ft);
+    ct = ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    logretain->total = 0;
+    for (i = 0; i < logretain->count; i++) {
+        f = logretain->files + i;
+        f->live = logretainlive(outputlog, f->name) ||
+                  logretainlive(errorlog,  f->name);
+        if (f->live)
+            continue;
+        if (f->dirty) {
+            fp = xwmakepath(service->logs, f->name, NULL);
+            if (!GetFileAttributesExW(fp, GetFileExInfoStandard, &ad)) {
+                xfree(fp);
+                logretainremove(f->name);
+                i--;
+                continue;
+            }
+            xfree(fp);
+            f->size  = ((ULONGLONG)ad.nFileSizeHigh << 32) | ad.nFileSizeLow;
+            f->time  = ((ULONGLONG)ad.ftLastWriteTime.dwHighDateTime << 32) |
+                       ad.ftLastWriteTime.dwLowDateTime;
+            f->dirty = FALSE;
+        }
+        logretain->total += f->size;
+    }
+    if (logretain->count == 0)
+        return;
+    qsort(logretain->files, logretain->count,
+          sizeof(SVCBATCH_RETAIN_FILE), xretaincmp);
+    for (i = 0; ; i++) {
+        i = xretainnext(logretain->files, logretain->count, i,
+                        logretain->total, logretain->bytes,
+                        logretain->days, ct, &expired);
+        if (i == logretain->count)
+            break;
+        f = logretain->files + i;
+        if (n++) {
+            /**
+             * Limit the rate of the file deletions
+             */
+            if (WaitForSingleObject(logretain->event,
+                                    ONE_SECOND / SVCBATCH_RETAIN_RATE) == WAIT_OBJECT_0)
+                break;
+        }
+        if (!InterlockedCompareExchange(&logretain->state, 0, 0))
+            break;
+        fp = xwmakepath(service->logs, f->name, NULL);
+        if (DeleteFileW(fp) || (GetLastError() == ERROR_FILE_NOT_FOUND)) {
+            DBG_PRINTF("%S %llu bytes%s", f->name, f->size, expired ? " expired" : "");
+            logretain->total -= f->size;
+            logretain->freed += f->size;
+            logretain->removed++;
+            xfree(f->name);
+            f->name = NULL;
+        }
+        else {
+            DBG_PRINTF("failed %lu %S", GetLastError(), f->name);
+        }
+        xfree(fp);
+    }
+    logretain->count = xretaincompact(logretain->files, logretain->count);
+}
+
+static DWORD WINAPI retainthread(void *unused)
+{
+    OVERLAPPED o;
+    HANDLE     dh;
+    HANDLE     wh[2];
+    LPBYTE     buf  = NULL;
+    BOOL       scan = TRUE;
+    BOOL       busy = FALSE;
+    DWORD      rc   = 0;
+    DWORD      rd;
+    DWORD      ws;
+    DWORD      i;
+
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+    DBG_PRINTF("started %llu bytes %lu days", logretain->bytes, logretain->days);
+    xmemzero(&o, 1, sizeof(OVERLAPPED));
+    logretain->patterns[logretain->npatterns++] = logretainpattern(outputlog->logName);
+    if (errorlog)
+        logretain->patterns[logretain->npatterns++] = logretainpattern(errorlog->logName);
+    if (stoplogname)
+        logretain->patterns[logretain->npatterns++] = logretainpattern(stoplogname);
+    dh = CreateFileW(service->logs, FILE_LIST_DIRECTORY,
+                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                     NULL, OPEN_EXISTING,
+                     FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    if (IS_INVALID_HANDLE(dh)) {
+        rc = GetLastError();
+        xsyserror(rc, service->logs, NULL);
+        goto finished;
+    }
+    o.hEvent = CreateEventExW(NULL, NULL, CREATE_EVENT_MANUAL_RESET,
+                              EVENT_MODIFY_STATE | SYNCHRONIZE);
+    if (IS_INVALID_HANDLE(o.hEvent)) {
+        rc = GetLastError();
+        xsyserror(rc, L"CreateEvent", NULL);
+        CloseHandle(dh);
+        goto finished;
+    }
+    buf   = (LPBYTE)xmmalloc(SVCBATCH_RETAIN_BUFSIZ);
+    wh[0] = logretain->event;
+    wh[1] = o.hEvent;
+    while (InterlockedCompareExchange(&logretain->state, 0, 0)) {
+        if (!busy) {
+            /**
+             * Start watching before the scan, so that
+             * no change is lost
+             */
+            if (!ReadDirectoryChangesW(dh, buf, SVCBATCH_RETAIN_BUFSIZ, FALSE,
+                                       FILE_NOTIFY_CHANGE_FILE_NAME,
+                                       NULL, &o, NULL)) {
+                rc = GetLastError();
+                xsyserror(rc, L"ReadDirectoryChanges", service->logs);
+                break;
+            }
+            busy = TRUE;
+        }
+        if (scan) {
+            logretainscan();
+            logretainrun();
+            scan = FALSE;
+        }
+        ws = WaitForMultipleObjects(2, wh, FALSE, SVCBATCH_RETAIN_CHECK);
+        if (ws == WAIT_OBJECT_0)
+            continue;
+        if (ws == WAIT_OBJECT_1) {
+            busy = FALSE;
+            if (!GetOverlappedResult(dh, &o, &rd, FALSE)) {
+                rc = GetLastError();
+                if (rc != ERROR_NOTIFY_ENUM_DIR)
+                    break;
+                rd = 0;
+                rc = 0;
+            }
+            if (rd == 0) {
+                /**
+                 * Notification buffer overflow
+                 */
+                scan = TRUE;
+                continue;
+            }
+            logretainnotify(buf);
+        }
+        logretainrun();
+    }
+    if (busy) {
+        CancelIoEx(dh, &o);
+        GetOverlappedResult(dh, &o, &rd, TRUE);
+    }
+    CloseHandle(o.hEvent);
+    CloseHandle(dh);
+
+finished:
+    DBG_PRINTF("done %lu files %llu bytes removed %lu scans %llu bytes retained",
+               logretain->removed, logretain->freed, logretain->rescans,
+               logretain->total);
+    for (i = 0; i < logretain->count; i++)
+        xfree(logretain->files[i].name);
+    xfree(logretain->files);
+    xfree(buf);
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+    return rc;
+}
+
+static DWORD logwrblock(LPVOID ctx, LPBYTE buf, DWORD len)
+{
+    LPSVCBATCH_FLUSH cb = (LPSVCBATCH_FLUSH)ctx;
+    DWORD rc = 0;
+    DWORD n;
+    LARGE_INTEGER cs;
+    LARGE_INTEGER ce;
+
+    if (cb->zip == NULL)
+        return logwrdata(cb->log, buf, len);
+    while ((rc == 0) && len) {
+        n = len > SVCBATCH_DEFLATE_LEN ? SVCBATCH_DEFLATE_LEN : len;
+        QueryPerformanceCounter(&cs);
+        xzmember(cb->zip, buf, n);
+        QueryPerformanceCounter(&ce);
+        cb->ztime += ce.QuadPart - cs.QuadPart;
+        cb->zin   += n;
+        cb->zout  += cb->zip->len;
+        rc   = logwrdata(cb->log, cb->zip->data, cb->zip->len);
+        buf += n;
+        len -= n;
+    }
+    return rc;
+}
+
+static DWORD logflushdata(LPSVCBATCH_FLUSH cb)
+{
+    return xcoalesceflush(&cb->co, GetTickCount64());
+}
+
+/**
+ * Gather the chunk with the pending data.
+ * The cb->now is the tick count taken when
+ * the writer started with the current buffer.
+ */
+static __inline DWORD logcoalesce(LPSVCBATCH_FLUSH cb, LPBYTE buf, DWORD len)
+{
+    return xcoalesce(&cb->co, buf, len, cb->now);
+}
+
+static DWORD logwreol(LPSVCBATCH_FLUSH cb, DWORD eol)
+{
+    if (eol == SVCBATCH_EOL_NONE)
+        return 0;
+    if (eol == SVCBATCH_EOL_LF)
+        return logcoalesce(cb, CRLFA + 1, 1);
+    else
+        return logcoalesce(cb, CRLFA, 2);
+}
+
+/**
+ * Render the timestamp prefix for the
+ * file time t.
+ * The formatted date and time are cached, and only
+ * the milliseconds are rendered within the same second.
+ */
+static LPBYTE logtimestamp(ULONGLONG t)
+{
+    static ULONGLONG ls = 0;
+    static int       ms = 0;
+    static char      ts[SVCBATCH_TIMESTAMP_LEN + 4];
+    ULONGLONG        cs = t / ONE_FTSECOND;
+
+    if (cs != ls) {
+        FILETIME   ft;
+        SYSTEMTIME st;
+        SYSTEMTIME lt;
+        int        i = 0;
+
+        ft.dwLowDateTime  = (DWORD)t;
+        ft.dwHighDateTime = (DWORD)(t >> 32);
+        FileTimeToSystemTime(&ft, &st);
+        if (IS_OPT_SET(SVCBATCH_OPT_LOCALTIME)) {
+            if (SystemTimeToTzSpecificLocalTime(NULL, &st, &lt))
+                st = lt;
+        }
+        i += xsetdigits(ts + i, st.wYear,   4);
+        ts[i++] = '-';
+        i += xsetdigits(ts + i, st.wMonth,  2);
+        ts[i++] = '-';
+        i += xsetdigits(ts + i, st.wDay,    2);
+        ts[i++] = ' ';
+        i += xsetdigits(ts + i, st.wHour,   2);
+        ts[i++] = ':';
+        i += xsetdigits(ts + i, st.wMinute, 2);
+        ts[i++] = ':';
+        i += xsetdigits(ts + i, st.wSecond, 2);
+        ts[i++] = '.';
+        ts[i + 3] = ' ';
+        ms = i;
+        ls = cs;
+    }
+    xsetdigits(ts + ms, (int)(t / 10000 % 1000), 3);
+    return (LPBYTE)ts;
+}
+
+/**
+ * Create the constant part of JSON records
+ * for each stream
+ */
+static void logjsoninit(void)
+{
+    char   sn[SVCBATCH_NAME_MAX * 4];
+    LPBYTE es;
+    int    n;
+    int    i;
+    int    x = 0;
+
+    n = WideCharToMultiByte(CP_UTF8, 0, service->name ? service->name : CPP_WIDEN(SVCBATCH_NAME),
+                            -1, sn, SVCBATCH_NAME_MAX * 4, NULL, NULL);
+    if (n > 0)
+        n--;
+    es = (LPBYTE)xmmalloc(n * 6 + 2);
+    for (i = 0; i < n; i++) {
+        if (((BYTE)sn[i] < 32) || (sn[i] == '"') || (sn[i] == '\\'))
+            x += xjsonesc(es + x, (BYTE)sn[i]);
+        else
+            es[x++] = sn[i];
+    }
+    es[x] = 0;
+    for (i = 1; i < 3; i++) {
+        n = x + 64;
+        jsontails[i]   = (LPSTR)xmmalloc(n);
+        jsontaillen[i] = xsnprintf(jsontails[i], n,
+                                   ",\"stream\":\"%s\",\"pid\":%lu,\"service\":\"%s\",\"line\":\"",
+                                   jsonstreams[i], cmdproc->pInfo.dwProcessId, es);
+    }
+    xfree(es);
+}
+
+static void logjsonfree(void)
+{
+    int i;
+
+    for (i = 1; i < 3; i++) {
+        xfree(jsontails[i]);
+        jsontails[i] = NULL;
+    }
+}
+
+/**
+ * Start new JSON record
+ */
+static DWORD logjsonhead(LPSVCBATCH_FLUSH cb, LPSVCBATCH_BUFFER b)
+{
+    char      hd[64];
+    char      sq[24];
+    LPBYTE    p;
+    DWORD     rc;
+    ULONGLONG v;
+    int       n = 0;
+    int       i = 0;
+
+    if (jsontails[b->stream] == NULL) {
+        /**
+         * The child process id is known only after
+         * the process was created, so the constant
+         * part is rendered for the first record
+         */
+        logjsoninit();
+    }
+    memcpy(hd, "{\"time\":\"", 9);
+    n = 9;
+    memcpy(hd + n, logtimestamp(b->time), SVCBATCH_TIMESTAMP_LEN - 1);
+    hd[n + 10] = 'T';
+    n += SVCBATCH_TIMESTAMP_LEN - 1;
+    if (IS_NOT_OPT(SVCBATCH_OPT_LOCALTIME))
+        hd[n++] = 'Z';
+    memcpy(hd + n, "\",\"seq\":", 8);
+    n += 8;
+    v = ++jsonsequence;
+    do {
+        sq[i++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    while (i > 0)
+        hd[n++] = sq[--i];
+    cb->co.chunks++;
+    p = xcoalescereserve(&cb->co, n + jsontaillen[b->stream], cb->now, &rc);
+    if (p == NULL)
+        return rc;
+    memcpy(p, hd, n);
+    memcpy(p + n, jsontails[b->stream], jsontaillen[b->stream]);
+    return 0;
+}
+
+/**
+ * Write the line data as JSON string.
+ * Runs without escapes are copied as they are
+ */
+static DWORD logjsondata(LPSVCBATCH_FLUSH cb, LPBYTE s, DWORD len)
+{
+    DWORD  rc = 0;
+    LPBYTE e  = s + len;
+    LPBYTE p;
+    BYTE   es[8];
+
+    while ((rc == 0) && (s < e)) {
+        p = xmemjson(s, e);
+        if (p == NULL)
+            return logcoalesce(cb, s, (DWORD)(e - s));
+        if (p > s)
+            rc = logcoalesce(cb, s, (DWORD)(p - s));
+        if (rc == 0)
+            rc = logcoalesce(cb, es, xjsonesc(es, *p));
+        s = p + 1;
+    }
+    return rc;
+}
+
+static DWORD logwrjson(LPSVCBATCH_FLUSH cb, LPSVCBATCH_BUFFER b)
+{
+    DWORD rc = 0;
+    SVCBATCH_LINE ln;
+
+    if (xframerpartial(&cb->frame) && (cb->stream != b->stream)) {
+        /**
+         * Close the record of the partial
+         * line from the other stream
+         */
+        rc = logcoalesce(cb, JSONEOR, 4);
+        xframerinit(&cb->frame);
+    }
+    cb->stream = b->stream;
+    xframerfeed(&cb->frame, b->data, b->len);
+    while ((rc == 0) && xframernext(&cb->frame, &ln)) {
+        if (ln.sol)
+            rc = logjsonhead(cb, b);
+        if ((rc == 0) && ln.len)
+            rc = logjsondata(cb, ln.data, ln.len);
+        if ((rc == 0) && (ln.eol != SVCBATCH_EOL_NONE))
+            rc = logcoalesce(cb, JSONEOR, 4);
+    }
+    return rc;
+}
+
+static DWORD logwrlines(LPSVCBATCH_FLUSH cb, LPSVCBATCH_BUFFER b)
+{
+    DWORD rc = 0;
+    SVCBATCH_LINE ln;
+
+    if (xframerpartial(&cb->frame) && (cb->stream != b->stream)) {
+        /**
+         * Terminate the partial line
+         * from the other stream
+         */
+        rc = logcoalesce(cb, CRLFA, 2);
+        xframerinit(&cb->frame);
+    }
+    cb->stream = b->stream;
+    xframerfeed(&cb->frame, b->data, b->len);
+    while ((rc == 0) && xframernext(&cb->frame, &ln)) {
+        if (ln.sol) {
+            /**
+             * Prefixes are gathered next to the
+             * line data in the output buffer
+             */
+            if (IS_OPT_SET(SVCBATCH_OPT_TIMESTAMP))
+                rc = logcoalesce(cb, logtimestamp(b->time), SVCBATCH_TIMESTAMP_LEN);
+            if ((rc == 0) && (stderrmode == SVCBATCH_STDERR_TAGGED))
+                rc = logcoalesce(cb, (LPBYTE)streamtags[b->stream], SVCBATCH_STREAM_TAGLEN);
+        }
+        if ((rc == 0) && ln.len)
+            rc = logcoalesce(cb, ln.data, ln.len);
+        if (rc == 0)
+            rc = logwreol(cb, ln.eol);
+    }
+    return rc;
+}
+
+static DWORD logwrbuffer(LPSVCBATCH_FLUSH cb, LPSVCBATCH_BUFFER b)
+{
+    DWORD rc;
+
+    if (cb->co.data == NULL)
+        return logwrdata(cb->log, b->data, b->len);
+    cb->now = GetTickCount64();
+    if (IS_OPT_SET(SVCBATCH_OPT_JSONLINES))
+        rc = logwrjson(cb, b);
+    else if ((stderrmode == SVCBATCH_STDERR_TAGGED) || IS_OPT_SET(SVCBATCH_OPT_TIMESTAMP))
+        rc = logwrlines(cb, b);
+    else
+        rc = logcoalesce(cb, b->data, b->len);
+    if ((rc == 0) && (logflushint == 0))
+        rc = logflushdata(cb);
+    return rc;
+}
+
+/**
+ * Check the LogRateBytes and LogRateLines limits
+ */
+static BOOL lograteallow(DWORD len)
+{
+    return xbuckettake(logratebytes ? &bytesbucket : NULL,
+                       logratelines ? &linesbucket : NULL,
+                       len, GetTickCount64());
+}
+
+/**
+ * Write a summary of the lines that were
+ * suppressed by the rate limit
+ */
+static DWORD logwrsuppressed(LPSVCBATCH_FLUSH cb, DWORD stream, ULONGLONG time)
+{
+    SVCBATCH_BUFFER n;
+    char  msg[128];
+
+    n.next   = NULL;
+    n.stream = stream;
+    n.time   = time;
+    n.data   = (LPBYTE)msg;
+    n.size   = sizeof(msg);
+    n.len    = xsnprintf(msg, sizeof(msg),
+                         SVCBATCH_NAME ": suppressed %lu lines / %I64u bytes\r\n",
+                         suppressedlines, suppressedbytes);
+    DBG_PRINTF("suppressed %lu lines %llu bytes", suppressedlines, suppressedbytes);
+    suppressedlines = 0;
+    suppressedbytes = 0;
+    return logwrbuffer(cb, &n);
+}
+
+/**
+ * Pass the line collected in cb->line to the log
+ * if it is not rejected by the line filters
+ * or by the rate limit.
+ *
+ * Lines longer than SVCBATCH_LINE_MAX are split by
+ * the framer. Only the first piece is matched, and
+ * the rest of the line follows its decision, so the
+ * long line is either written or filtered as a whole.
+ */
+static DWORD logfilterline(LPSVCBATCH_FLUSH cb, DWORD eol)
+{
+    LPSVCBATCH_BUFFER b = cb->line;
+    DWORD rc = 0;
+    BOOL  c = cb->split;
+
+    cb->split = eol == SVCBATCH_EOL_SPLIT;
+    if (c) {
+        if (cb->reject) {
+            b->len = 0;
+            return 0;
+        }
+    }
+    else {
+        cb->reject = FALSE;
+        if (!xfilterpass(loginclude, logexclude, b->data, b->len))
+            goto rejected;
+    }
+    if (eol == SVCBATCH_EOL_LF) {
+        b->data[b->len++] = '\n';
+    }
+    else if (eol == SVCBATCH_EOL_CRLF) {
+        b->data[b->len++] = '\r';
+        b->data[b->len++] = '\n';
+    }
+    if (logratebytes || logratelines) {
+        if (!lograteallow(b->len)) {
+            suppressedlines++;
+            suppressedbytes += b->len;
+            b->len = 0;
+            return 0;
+        }
+        if (suppressedlines)
+            rc = logwrsuppressed(cb, b->stream, b->time);
+    }
+    if (rc == 0)
+        rc = logwrbuffer(cb, b);
+    b->len = 0;
+    return rc;
+
+rejected:
+    cb->filtered++;
+    cb->reject = TRUE;
+    b->len = 0;
+    return 0;
+}
+
+static DWORD logwrfilter(LPSVCBATCH_FLUSH cb, LPSVCBATCH_BUFFER b)
+{
+    DWORD rc = 0;
+    SVCBATCH_LINE ln;
+
+    if (xframerpartial(&cb->filter) && (cb->line->stream != b->stream)) {
+        /**
+         * Filter the partial line
+         * from the other stream
+         */
+        if (cb->filter.cr)
+            cb->line->data[cb->line->len++] = '\r';
+        rc = logfilterline(cb, SVCBATCH_EOL_NONE);
+        xframerinit(&cb->filter);
+    }
+    xframerfeed(&cb->filter, b->data, b->len);
+    while ((rc == 0) && xframernext(&cb->filter, &ln)) {
+        if (ln.sol) {
+            if (cb->line->stream != b->stream) {
+                /**
+                 * Split line from the other
+                 * stream cannot continue here
+                 */
+                cb->split = FALSE;
+            }
+            cb->line->stream = b->stream;
+            cb->line->time   = b->time;
+        }
+        memcpy(cb->line->data + cb->line->len, ln.data, ln.len);
+        cb->line->len += ln.len;
+        if (ln.eol != SVCBATCH_EOL_NONE)
+            rc = logfilterline(cb, ln.eol);
+    }
+    return rc;
+}
+
+static void logfilterstats(LPCSTR name, LPSVCBATCH_FILTER f)
+{
+#if HAVE_DEBUG_TRACE
+    DWORD i;
+
+    if (f == NULL)
+        return;
+    for (i = 0; i < f->count; i++)
+        DBG_PRINTF("%s %S %llu hits", name, f->names[i], f->hits[i]);
+#endif
+}
+
+/**
+ * Write a note about the data that was discarded
+ * because the writer could not keep up with the reader
+ */
+static DWORD logwrdropped(LPSVCBATCH_FLUSH cb, LPSVCBATCH_BUFFER b)
+{
+    SVCBATCH_BUFFER n;
+    char  msg[128];
+
+    n.next   = NULL;
+    n.stream = b->stream;
+    n.time   = b->time;
+    n.data   = (LPBYTE)msg;
+    n.size   = sizeof(msg);
+    n.len    = xsnprintf(msg, sizeof(msg),
+                         "%s" SVCBATCH_NAME ": dropped %I64u bytes in %lu lines\r\n",
+                         xframerpartial(&cb->frame) ? "\r\n" : "",
+                         b->lostbytes, b->lost);
+    DBG_PRINTF("dropped %llu bytes %lu lines", b->lostbytes, b->lost);
+    return logwrbuffer(cb, &n);
+}
+
+static DWORD WINAPI writerthread(void *unused)
+{
+    DWORD rc = 0;
+    DWORD ws;
+    DWORD i;
+    LPSVCBATCH_BUFFER  b;
+    LPSVCBATCH_DEFLATE z = NULL;
+    LPSVCBATCH_ICONV   cv = NULL;
+    SVCBATCH_FLUSH     cb[2];
+
+    DBG_PRINTS("started");
+    xmemzero(cb, 2, sizeof(SVCBATCH_FLUSH));
+    if (IS_OPT_SET(SVCBATCH_OPT_COMPRESS))
+        z = xzinit();
+    cb[0].log = outputlog;
+    cb[1].log = errorlog;
+    for (i = 0; i < 2; i++) {
+        xframerinit(&cb[i].frame);
+        cb[i].zip = z;
+        if (cb[i].log && (logflushint || z ||
+                          (stderrmode == SVCBATCH_STDERR_TAGGED) ||
+                          IS_OPT_SET(SVCBATCH_OPT_TIMESTAMP) ||
+                          IS_OPT_SET(SVCBATCH_OPT_JSONLINES)))
+            xcoalesceinit(&cb[i].co, SVCBATCH_FLUSH_LEN, logwrblock, cb + i);
+    }
+    if (logencoding)
+        cv = xiconvinit(logencoding);
+    if (logratebytes)
+        xbucketinit(&bytesbucket, logratebytes, lograteburst,
+                    SVCBATCH_LINE_MAX + 2, GetTickCount64());
+    if (logratelines)
+        xbucketinit(&linesbucket, logratelines, lograteburst,
+                    1, GetTickCount64());
+    if (loginclude || logexclude || logratebytes || logratelines) {
+        for (i = 0; i < 2; i++) {
+            if (cb[i].log == NULL)
+                continue;
+            xframerinit(&cb[i].filter);
+            cb[i].line = xnewbuffer(SVCBATCH_LINE_MAX + 4);
+            cb[i].line->len = 0;
+        }
+    }
+    for (;;) {
+        if (svccontrol && svccontrol->flush &&
+            InterlockedExchange(&svccontrol->flush, 0)) {
+            for (i = 0; i < 2; i++) {
+                if (rc == 0)
+                    rc = logflushdata(cb + i);
+            }
+            if (rc)
+                InterlockedExchange(&logqueue->error, rc);
+            SetEvent(svccontrol->flushed);
+        }
+        ws = INFINITE;
+        if (logflushint) {
+            ULONGLONG t = GetTickCount64();
+
+            /**
+             * Check the deadlines of both streams
+             * before each buffer, so the steady output
+             * on one stream does not hold the other one
+             */
+            for (i = 0; i < 2; i++) {
+                if (rc)
+                    cb[i].co.len = 0;
+                else
+                    rc = xcoalescedue(&cb[i].co, logflushint, t, &ws);
+            }
+            if (rc)
+                InterlockedExchange(&logqueue->error, rc);
+        }
+        b = (LPSVCBATCH_BUFFER)xqueuepop(logqueue);
+        if (b == NULL) {
+            if (InterlockedCompareExchange(&logqueue->state, 0, 0)) {
+                /**
+                 * The reader closed the queue.
+                 * Check for the data pushed before closing
+                 */
+                b = (LPSVCBATCH_BUFFER)xqueuepop(logqueue);
+                if (b == NULL)
+                    break;
+            }
+            else {
+                WaitForSingleObject(logqueue->event, ws);
+                continue;
+            }
+        }
+        if (rc == 0) {
+            LPSVCBATCH_FLUSH f = cb;
+
+            if ((b->stream == SVCBATCH_STDERR_STREAM) && errorlog)
+                f = cb + 1;
+            if (b->lostbytes)
+                rc = logwrdropped(f, b);
+            if (rc == 0) {
+                LPSVCBATCH_BUFFER u = b;
+
+                if (cv)
+                    u = xiconv(cv, b);
+                if (f->line)
+                    rc = logwrfilter(f, u);
+                else
+                    rc = logwrbuffer(f, u);
+            }
+            if (rc)
+                InterlockedExchange(&logqueue->error, rc);
+        }
+        /**
+         * Give the buffer back to the reader
+         * even if the log cannot be written
+         */
+        if (!xqueuepush(freequeue, b)) {
+            /**
+             * Free queue is full with the
+             * buffers allocated for spilling
+             */
+            InterlockedDecrement(&logbuffers);
+            xfree(b);
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        if (cb[i].line == NULL)
+            continue;
+        if ((rc == 0) && xframerpartial(&cb[i].filter)) {
+            if (cb[i].filter.cr)
+                cb[i].line->data[cb[i].line->len++] = '\r';
+            rc = logfilterline(cb + i, SVCBATCH_EOL_NONE);
+        }
+        DBG_PRINTF("%lu filtered %llu lines", i, cb[i].filtered);
+        xfree(cb[i].line);
+    }
+    if ((rc == 0) && suppressedlines) {
+        FILETIME ft;
+
+        GetSystemTimeAsFileTime(&ft);
+        rc = logwrsuppressed(cb, SVCBATCH_STDOUT_STREAM,
+                             ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime);
+    }
+    logfilterstats("include", loginclude);
+    logfilterstats("exclude", logexclude);
+    for (i = 0; i < 2; i++) {
+        if (cb[i].co.data == NULL)
+            continue;
+        cb[i].now = GetTickCount64();
+        if ((rc == 0) && IS_OPT_SET(SVCBATCH_OPT_JSONLINES) && xframerpartial(&cb[i].frame))
+            rc = logcoalesce(cb + i, JSONEOR, 4);
+        if (rc == 0)
+            rc = logflushdata(cb + i);
+        DBG_PRINTF("%lu chunks %llu writes %llu saved %llu latency %llu ms", i,
+                   cb[i].co.chunks, cb[i].co.writes,
+                   cb[i].co.chunks > cb[i].co.writes ? cb[i].co.chunks - cb[i].co.writes : 0,
+                   cb[i].co.latency);
+#if HAVE_DEBUG_TRACE
+        if (cb[i].zin) {
+            LARGE_INTEGER f;
+
+            QueryPerformanceFrequency(&f);
+            DBG_PRINTF("%lu compressed %llu -> %llu bytes in %llu ms", i,
+                       cb[i].zin, cb[i].zout,
+                       cb[i].ztime * 1000 / f.QuadPart);
+        }
+#endif
+        xfree(cb[i].co.data);
     }
-    xsvcstatus(SERVICE_STOP_PENDING, 0);
-    SetEvent(svcstopdone);
-    DBG_PRINTS("done");
+    xzfree(z);
+    xiconvfree(cv);
+    logjsonfree();
+    DBG_PRINTF("done %lu", rc);
     return rc;
 }
 
-static void createstopthread(DWORD rc)
+/**
+ * Copy the crash ring content in the write order
+ */
+static LPBYTE logcrashcopy(LPDWORD len)
 {
-    DBG_PRINTF("status %lu", rc);
-    setsvcstatusexit(rc);
-    if (servicemode)
-        xcreatethread(SVCBATCH_STOP_THREAD, 0, stopthread, NULL);
+    LPBYTE  b = NULL;
+    DWORD   n = 0;
+
+    EnterCriticalSection(&crashsync);
+    if (crashring.data && crashring.used) {
+        b = (LPBYTE)xmmalloc(crashring.size);
+        n = xcrashget(&crashring, b);
+    }
+    LeaveCriticalSection(&crashsync);
+    *len = n;
+    return b;
 }
 
-static void stopshutdown(DWORD rt)
+static DWORD logcrashsave(LPBYTE b, DWORD n, LPWSTR fn)
 {
-    DWORD ws;
+    HANDLE  fh;
+    DWORD   rc = 0;
+    DWORD   wr;
 
-    DBG_PRINTS("started");
-    SetConsoleCtrlHandler(NULL, TRUE);
-    if (IS_OPT_SET(SVCBATCH_OPT_CTRL_BREAK)) {
-        DBG_PRINTS("generating CTRL_BREAK_EVENT");
-        GenerateConsoleCtrlEvent(CTRL_BREAK_EVENT, cmdproc->pInfo.dwProcessId);
-    }
-    else {
-        DBG_PRINTS("generating CTRL_C_EVENT");
-        GenerateConsoleCtrlEvent(CTRL_C_EVENT, 0);
+    fh = CreateFileW(fn, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                     CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (IS_INVALID_HANDLE(fh)) {
+        rc = GetLastError();
+        DBG_PRINTF("cannot create %S %lu", fn, rc);
+        return rc;
     }
-    ws = WaitForSingleObject(workerended, rt);
-    SetConsoleCtrlHandler(NULL, FALSE);
-    if (ws != WAIT_OBJECT_0) {
-        DBG_PRINTS("worker process is still running ... terminating");
-        killprocess(cmdproc, ws);
+    if (!WriteFile(fh, b, n, &wr, NULL)) {
+        rc = GetLastError();
+        DBG_PRINTF("cannot write %S %lu", fn, rc);
     }
     else {
-        DBG_PRINTS("worker process ended");
-        cleanprocess(cmdproc);
+        DBG_PRINTF("saved %lu bytes to %S", wr, fn);
     }
-    DBG_PRINTS("done");
+    CloseHandle(fh);
+    return rc;
 }
 
-static DWORD logwrdata(LPSVCBATCH_LOG log, BYTE *buf, DWORD len)
+static LPWSTR logcrashname(void)
 {
-    DWORD  rc = 0;
-    DWORD  wr = 0;
-    HANDLE h;
+    return xwmakepath(service->logs ? service->logs : service->work,
+                      servicemode ? SVCBATCH_LOGCRASH : SVCBATCH_STOPCRASH, NULL);
+}
 
-    ASSERT_NULL(log, 0);
-    SVCBATCH_CS_ENTER(log);
-    h = InterlockedExchangePointer(&log->fd, NULL);
-    if (h == NULL) {
-        SVCBATCH_CS_LEAVE(log);
-        DBG_PRINTS("logfile closed");
-        return ERROR_NO_MORE_FILES;
+/**
+ * Save the crash ring content to the .crash file
+ * and keep its tail for the event log messages
+ */
+static void logcrashdump(void)
+{
+    LPWSTR  fn;
+    LPBYTE  b;
+    LPBYTE  t;
+    DWORD   n;
+    int     wn;
+
+    if (crashring.data == NULL)
+        return;
+    b = logcrashcopy(&n);
+    if (b == NULL)
+        return;
+    fn = logcrashname();
+    logcrashsave(b, n, fn);
+    xfree(fn);
+
+    t = xcrashtail(b, n, SVCBATCH_CRASH_TAIL);
+    wn = MultiByteToWideChar(logencoding ? logencoding : CP_ACP, 0,
+                             (LPCSTR)t, (int)(b + n - t), NULL, 0);
+    if (wn > 0) {
+        int i;
+
+        crashtail = xwmalloc(wn + 1);
+        wn = MultiByteToWideChar(logencoding ? logencoding : CP_ACP, 0,
+                                 (LPCSTR)t, (int)(b + n - t), crashtail, wn);
+        for (i = 0; i < wn; i++) {
+            if ((crashtail[i] < 32) && (crashtail[i] != L'\r') && (crashtail[i] != L'\n'))
+                crashtail[i] = L' ';
+        }
+        crashtail[wn] = WNUL;
     }
-    if (WriteFile(h, buf, len, &wr, NULL) && (wr != 0))
-        InterlockedAdd64(&log->size, wr);
-    else
-        rc = GetLastError();
+    xfree(b);
+}
 
-    InterlockedExchangePointer(&log->fd, h);
-    SVCBATCH_CS_LEAVE(log);
-    if (rc)
-        return xsyserror(rc, L"LogWrite", NULL);
-    if (IS_OPT_SET(SVCBATCH_OPT_ROTATE_BY_SIZE)) {
-        if (log->size >= rotatesize) {
-            if (canrotatelogs(log)) {
-                DBG_PRINTS("rotating by size");
-                SetEvent(dologrotate);
+static LPSVCBATCH_BUFFER lognewbuffer(BOOL wait)
+{
+    LPSVCBATCH_BUFFER b;
+
+    if (freequeue == NULL) {
+        /**
+         * Logging is disabled and the buffers
+         * are only used for the crash ring
+         */
+        b = xnewbuffer(readbufsize);
+        b->next      = NULL;
+        b->lost      = 0;
+        b->lostbytes = 0;
+        return b;
+    }
+    for (;;) {
+        b = (LPSVCBATCH_BUFFER)xqueuepop(freequeue);
+        if (b != NULL) {
+            if (b->size != readbufsize) {
+                /**
+                 * Adaptive read buffer size changed
+                 */
+                xfree(b);
+                b = xnewbuffer(readbufsize);
             }
+            break;
+        }
+        if (InterlockedCompareExchange(&logbuffers, 0, 0) < SVCBATCH_QUEUE_LEN) {
+            InterlockedIncrement(&logbuffers);
+            b = xnewbuffer(readbufsize);
+            break;
         }
+        if (!wait)
+            return NULL;
+        /**
+         * All buffers are owned by the writer
+         */
+        WaitForSingleObject(freequeue->event, INFINITE);
     }
-    return 0;
+    b->next      = NULL;
+    b->lost      = 0;
+    b->lostbytes = 0;
+    return b;
+}
+
+/**
+ * Buffer callback of the log queue backpressure
+ */
+static LPSVCBATCH_BUFFER logspillbuffer(LPVOID ctx, DWORD mode)
+{
+    LPSVCBATCH_BUFFER b;
+
+    if (mode != SVCBATCH_BUFFER_SPILL)
+        return lognewbuffer(mode == SVCBATCH_BUFFER_WAIT);
+    /**
+     * The writer frees the buffers that
+     * do not fit into the free queue
+     */
+    InterlockedIncrement(&logbuffers);
+    b = xnewbuffer(readbufsize);
+    b->next      = NULL;
+    b->lost      = 0;
+    b->lostbytes = 0;
+    return b;
+}
+
+static void logspillflush(void)
+{
+    while (!xspilldrain(&logspill)) {
+        if (InterlockedCompareExchange(&logqueue->error, 0, 0))
+            break;
+        WaitForSingleObject(freequeue->event, SVCBATCH_STOP_STEP / 10);
+    }
+    xspillfree(&logspill);
+}
+
+static DWORD logpushdata(LPSVCBATCH_PIPE op)
+{
+    DWORD rc;
+
+    if (crashring.data) {
+        EnterCriticalSection(&crashsync);
+        xcrashput(&crashring, op->buffer->data, op->read);
+        LeaveCriticalSection(&crashsync);
+    }
+    if (logqueue == NULL)
+        return 0;
+    rc = (DWORD)InterlockedCompareExchange(&logqueue->error, 0, 0);
+    if (rc)
+        return rc;
+    op->buffer->len    = op->read;
+    op->buffer->stream = op->stream;
+    if (IS_OPT_SET(SVCBATCH_OPT_TIMESTAMP) || IS_OPT_SET(SVCBATCH_OPT_JSONLINES)) {
+        FILETIME ft;
+
+        GetSystemTimeAsFileTime(&ft);
+        op->buffer->time = ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    }
+    return xspillpush(&logspill, &op->buffer, readbufsize);
 }
 
 static DWORD WINAPI stdinthread(void *unused)
@@ -4350,6 +7341,33 @@ static DWORD WINAPI stdinthread(void *unused)
     return rc;
 }
 
+static DWORD rotatelogfiles(void)
+{
+    DWORD rc = 0;
+    BOOL  ra = TRUE;
+
+    if (errorlog) {
+        /**
+         * Rotate by size only the log
+         * that reached the limit
+         */
+        if (outputlog->rotate || errorlog->rotate)
+            ra = FALSE;
+        /**
+         * The caller checked only the output log,
+         * so skip the error log if it is empty
+         * or already being rotated
+         */
+        if (InterlockedExchange(&errorlog->rotate, 0) || (ra && canrotatelogs(errorlog)))
+            rc = rotatelogs(errorlog);
+        if (rc)
+            return rc;
+    }
+    if (ra || InterlockedExchange(&outputlog->rotate, 0))
+        rc = rotatelogs(outputlog);
+    return rc;
+}
+
 static DWORD WINAPI rotatethread(void *wt)
 {
     HANDLE wh[4];
@@ -4382,7 +7400,11 @@ static DWORD WINAPI rotatethread(void *wt)
             break;
             case WAIT_OBJECT_2:
                 DBG_PRINTS("dologrotate signaled");
-                rc = rotatelogs(outputlog);
+                rc = rotatelogfiles();
+                if (svccontrol) {
+                    InterlockedExchange(&svccontrol->rotaterc, rc);
+                    SetEvent(svccontrol->rotated);
+                }
                 if (rc == 0) {
                     if (IS_VALID_HANDLE(wt) && (rotateinterval < 0)) {
                         CancelWaitableTimer(wt);
@@ -4396,7 +7418,7 @@ static DWORD WINAPI rotatethread(void *wt)
                 DBG_PRINTS("rotate timer signaled");
                 ResetEvent(dologrotate);
                 SVCBATCH_CS_ENTER(outputlog);
-                if (rotateinterval > 0)
+                if (rotateschedn)
                     InterlockedExchange(&outputlog->state, 1);
                 SVCBATCH_CS_LEAVE(outputlog);
                 if (canrotatelogs(outputlog)) {
@@ -4406,26 +7428,38 @@ static DWORD WINAPI rotatethread(void *wt)
                 else {
                     DBG_PRINTS("rotate is busy ... canceling timer");
                 }
+                if (errorlog && (rc == 0)) {
+                    SVCBATCH_CS_ENTER(errorlog);
+                    if (rotateschedn)
+                        InterlockedExchange(&errorlog->state, 1);
+                    SVCBATCH_CS_LEAVE(errorlog);
+                    if (canrotatelogs(errorlog))
+                        rc = rotatelogs(errorlog);
+                }
                 if (rc == 0) {
                     CancelWaitableTimer(wt);
-                    if (rotateinterval > 0)
-                        rotatetime.QuadPart += rotateinterval;
-                    SetWaitableTimer(wt, &rotatetime, 0, NULL, NULL, FALSE);
+                    if ((rotateschedn == 0) || resolverotatetime())
+                        SetWaitableTimer(wt, &rotatetime, 0, NULL, NULL, FALSE);
+                    else
+                        xsyserror(ERROR_INVALID_DATA, L"LogRotateTime", NULL);
                 }
                 rw = SVCBATCH_ROTATE_READY;
             break;
             case WAIT_TIMEOUT:
                 DBG_PRINTS("rotate ready");
-                SVCBATCH_CS_ENTER(outputlog);
-                InterlockedExchange(&outputlog->state, 1);
+                setrotatestate(1);
                 if (IS_OPT_SET(SVCBATCH_OPT_ROTATE_BY_SIZE)) {
-                    if (outputlog->size >= rotatesize) {
-                        InterlockedExchange(&outputlog->state, 0);
+                    if ((outputlog->size >= rotatesize) && canrotatelogs(outputlog)) {
                         DBG_PRINTS("rotating by size");
+                        InterlockedExchange(&outputlog->rotate, 1);
+                        SetEvent(dologrotate);
+                    }
+                    if (errorlog && (errorlog->size >= rotatesize) && canrotatelogs(errorlog)) {
+                        DBG_PRINTS("rotating stderr by size");
+                        InterlockedExchange(&errorlog->rotate, 1);
                         SetEvent(dologrotate);
                     }
                 }
-                SVCBATCH_CS_LEAVE(outputlog);
                 rw = INFINITE;
             break;
             default:
@@ -4436,6 +7470,8 @@ static DWORD WINAPI rotatethread(void *wt)
             rr = FALSE;
     }
     InterlockedExchange(&outputlog->state, 0);
+    if (errorlog)
+        InterlockedExchange(&errorlog->state, 0);
     if (rc)
         createstopthread(rc);
     if (IS_VALID_HANDLE(wt)) {
@@ -4446,39 +7482,110 @@ static DWORD WINAPI rotatethread(void *wt)
     return rc;
 }
 
-static DWORD logiodata(LPSVCBATCH_LOG log, LPSVCBATCH_PIPE op)
+static DWORD logrdpipe(LPSVCBATCH_PIPE op)
 {
-    DWORD rc = 0;
+    op->read = 0;
+    if (ReadFile(op->pipe, op->buffer->data, op->buffer->size,
+                 &op->read, (LPOVERLAPPED)op)) {
+        /**
+         * Read completed synchronously.
+         * The overlapped result is set, so it
+         * will be picked up in the issue order.
+         */
+        op->state = 0;
+    }
+    else {
+        op->state = GetLastError();
+        if (op->state != ERROR_IO_PENDING)
+            return op->state;
+    }
+    return 0;
+}
 
-    ASSERT_NULL(log, 0);
-    ASSERT_NULL(op,  0);
-    if (op->state == ERROR_IO_PENDING) {
-        if (!GetOverlappedResult(op->pipe, (LPOVERLAPPED)op,
-                                &op->read, FALSE)) {
-            op->state = GetLastError();
-        }
-        else {
-            op->state = 0;
-            rc = logwrdata(log, op->buffer, op->read);
-        }
+/**
+ * The read counters are kept by the first
+ * pipe of each stream's ring. The buffer size
+ * is shared, since all buffers come from one pool.
+ */
+static void logadaptsize(LPSVCBATCH_PIPE op, LPSVCBATCH_PIPE hp)
+{
+    DWORD size = readbufsize;
+
+    if (hp->read == hp->buffer->size) {
+        op->empty = 0;
+        if (++op->full < SVCBATCH_PIPE_ADAPT)
+            return;
+        if (size < readbufmax)
+            size = size * 2;
+    }
+    else if (hp->read < (hp->buffer->size / 4)) {
+        op->full = 0;
+        if (++op->empty < SVCBATCH_PIPE_ADAPT)
+            return;
+        if (size > readbufmin)
+            size = size / 2;
     }
     else {
-        if (ReadFile(op->pipe, op->buffer, SVCBATCH_PIPE_LEN,
-                    &op->read, (LPOVERLAPPED)op) && op->read) {
-            op->state = 0;
-            rc = logwrdata(log, op->buffer, op->read);
-            if (rc == 0)
-                SetEvent(op->o.hEvent);
-        }
-        else {
-            op->state = GetLastError();
-            if (op->state != ERROR_IO_PENDING)
-                rc = op->state;
-        }
+        op->full  = 0;
+        op->empty = 0;
+        return;
+    }
+    op->full  = 0;
+    op->empty = 0;
+    if (size != readbufsize) {
+        DBG_PRINTF("stream %lu read buffer %lu -> %lu", op->stream, readbufsize, size);
+        readbufsize = size;
+    }
+}
+
+/**
+ * Read ring callbacks.
+ * The ring context is the first pipe of the stream.
+ */
+static DWORD logrdresult(LPVOID ctx, DWORD i)
+{
+    LPSVCBATCH_PIPE hp = (LPSVCBATCH_PIPE)ctx + i;
+
+    if (hp->state && (hp->state != ERROR_IO_PENDING)) {
+        /**
+         * This read failed when it was issued
+         */
+        return hp->state;
     }
+    if (!GetOverlappedResult(hp->pipe, (LPOVERLAPPED)hp, &hp->read, FALSE))
+        return GetLastError();
+    hp->state = 0;
+    return 0;
+}
+
+static DWORD logrdconsume(LPVOID ctx, DWORD i)
+{
+    LPSVCBATCH_PIPE op = (LPSVCBATCH_PIPE)ctx;
+
+    if (readbufmin != readbufmax)
+        logadaptsize(op, op + i);
+    if (op[i].read)
+        return logpushdata(op + i);
+    return 0;
+}
+
+static DWORD logrdissue(LPVOID ctx, DWORD i)
+{
+    return logrdpipe((LPSVCBATCH_PIPE)ctx + i);
+}
+
+static DWORD logiodata(LPSVCBATCH_RING rg)
+{
+    LPSVCBATCH_PIPE op = (LPSVCBATCH_PIPE)rg->ctx;
+    DWORD rc;
+    DWORD i;
+
+    ASSERT_NULL(op,  0);
+    rc = xringrun(rg);
     if (rc) {
         CancelIo(op->pipe);
-        ResetEvent(op->o.hEvent);
+        for (i = 0; i < SVCBATCH_PIPE_BUFS; i++)
+            ResetEvent(op[i].o.hEvent);
         if ((rc == ERROR_BROKEN_PIPE) || (rc == ERROR_NO_DATA)) {
             DBG_PRINTS("pipe closed");
         }
@@ -4496,46 +7603,169 @@ static DWORD logiodata(LPSVCBATCH_LOG log, LPSVCBATCH_PIPE op)
     return rc;
 }
 
+static void logclosepipe(LPSVCBATCH_PIPE op)
+{
+    DWORD i;
+
+    if (op == NULL)
+        return;
+    for (i = 0; i < SVCBATCH_PIPE_BUFS; i++) {
+        /**
+         * Wait for canceled reads to complete
+         * before releasing their buffers
+         */
+        if ((op[i].state == ERROR_IO_PENDING) && IS_VALID_HANDLE(op[i].o.hEvent))
+            GetOverlappedResult(op[i].pipe, (LPOVERLAPPED)(op + i), &op[i].read, TRUE);
+        SAFE_CLOSE_HANDLE(op[i].o.hEvent);
+        xfree(op[i].buffer);
+    }
+    SAFE_CLOSE_HANDLE(op->pipe);
+    xfree(op);
+}
+
+static LPSVCBATCH_PIPE lognewpipe(HANDLE h, DWORD stream)
+{
+    DWORD i;
+    DWORD rc;
+    LPSVCBATCH_PIPE op;
+
+    op = (LPSVCBATCH_PIPE)xmcalloc(SVCBATCH_PIPE_BUFS * sizeof(SVCBATCH_PIPE));
+    for (i = 0; i < SVCBATCH_PIPE_BUFS; i++) {
+        op[i].pipe     = h;
+        op[i].stream   = stream;
+        op[i].buffer   = lognewbuffer(TRUE);
+        op[i].o.hEvent = CreateEventEx(NULL, NULL,
+                                       CREATE_EVENT_MANUAL_RESET,
+                                       EVENT_MODIFY_STATE | SYNCHRONIZE);
+        if (IS_INVALID_HANDLE(op[i].o.hEvent)) {
+            rc = GetLastError();
+            logclosepipe(op);
+            SetLastError(rc);
+            return NULL;
+        }
+    }
+    return op;
+}
+
+static DWORD logstartpipe(LPSVCBATCH_PIPE op)
+{
+    DWORD rc;
+    DWORD i;
+
+    /**
+     * Put all pipe reads in flight
+     */
+    for (i = 0; i < SVCBATCH_PIPE_BUFS; i++) {
+        rc = logrdpipe(op + i);
+        if (rc) {
+            DBG_PRINTF("pipe %lu read %lu failed with %lu", op->stream, i, rc);
+            /**
+             * Reads that are already in flight
+             * will report the failure in order
+             */
+            if (i == 0)
+                return rc;
+            break;
+        }
+    }
+    return 0;
+}
+
 static DWORD WINAPI workerthread(void *unused)
 {
     HANDLE   rd = NULL;
+    HANDLE   ed = NULL;
     HANDLE   wr = NULL;
     LPHANDLE rp = NULL;
+    LPHANDLE ep = NULL;
     LPHANDLE wp = NULL;
     DWORD    rc = 0;
     DWORD    ws = 0;
+    DWORD    np = 0;
+    DWORD    i;
     DWORD    cf = CREATE_SUSPENDED | CREATE_UNICODE_ENVIRONMENT;
-    LPSVCBATCH_PIPE op = NULL;
+    DWORD    os[2] = { 0, 0 };
+    SVCBATCH_RING   rg[2];
+    LPSVCBATCH_PIPE op[2] = { NULL, NULL };
 
     DBG_PRINTS("started");
     xsvcstatus(SERVICE_START_PENDING, SVCBATCH_START_HINT);
     InterlockedExchange(&cmdproc->state, SVCBATCH_PROCESS_STARTING);
 
-    if (outputlog)
+    if (outputlog) {
+        rp = &rd;
+        if (stderrmode != SVCBATCH_STDERR_SHARED)
+            ep = &ed;
+    }
+    else if (crashring.data) {
         rp = &rd;
+    }
     if (IS_OPT_SET(SVCBATCH_OPT_WRSTDIN))
         wp = &wr;
-    rc = createiopipes(&cmdproc->sInfo, wp, rp, FILE_FLAG_OVERLAPPED);
+    rc = createiopipes(&cmdproc->sInfo, wp, rp, ep, FILE_FLAG_OVERLAPPED);
     if (rc != 0) {
         DBG_PRINTF("createiopipes failed with %lu", rc);
+        SAFE_CLOSE_HANDLE(rd);
+        SAFE_CLOSE_HANDLE(ed);
         setsvcstatusexit(rc);
         cmdproc->exitCode = rc;
         goto finished;
     }
 
     if (outputlog) {
-        op = (LPSVCBATCH_PIPE)xmcalloc(sizeof(SVCBATCH_PIPE));
-        op->pipe     = rd;
-        op->o.hEvent = CreateEventEx(NULL, NULL,
-                                     CREATE_EVENT_MANUAL_RESET | CREATE_EVENT_INITIAL_SET,
-                                     EVENT_MODIFY_STATE | SYNCHRONIZE);
-        if (IS_INVALID_HANDLE(op->o.hEvent)) {
+        logqueue  = xqueueinit(SVCBATCH_QUEUE_LEN);
+        freequeue = xqueueinit(SVCBATCH_QUEUE_LEN);
+        if ((logqueue == NULL) || (freequeue == NULL)) {
+            rc = GetLastError();
+            SAFE_CLOSE_HANDLE(rd);
+            SAFE_CLOSE_HANDLE(ed);
+            setsvcstatusexit(rc);
+            xsyserror(rc, L"CreateEvent", NULL);
+            cmdproc->exitCode = rc;
+            goto finished;
+        }
+        xspillinit(&logspill, logqueue, backpressure, logspillmax,
+                   logspillbuffer, NULL);
+    }
+    if (rd) {
+        op[np] = lognewpipe(rd, SVCBATCH_STDOUT_STREAM);
+        if (op[np++] == NULL) {
             rc = GetLastError();
+            SAFE_CLOSE_HANDLE(ed);
             setsvcstatusexit(rc);
             xsyserror(rc, L"CreateEvent", NULL);
             cmdproc->exitCode = rc;
             goto finished;
         }
+        if (ed) {
+            op[np] = lognewpipe(ed, SVCBATCH_STDERR_STREAM);
+            if (op[np++] == NULL) {
+                rc = GetLastError();
+                setsvcstatusexit(rc);
+                xsyserror(rc, L"CreateEvent", NULL);
+                cmdproc->exitCode = rc;
+                goto finished;
+            }
+        }
+    }
+    if (outputlog) {
+        if (!xcreatethread(SVCBATCH_WRITER_THREAD, 0, writerthread, NULL)) {
+            rc = GetLastError();
+            setsvcstatusexit(rc);
+            xsyserror(rc, L"CreateThread", L"writerthread");
+            cmdproc->exitCode = rc;
+            goto finished;
+        }
+        if (IS_VALID_HANDLE(dologsync)) {
+            InterlockedExchange(&logsyncstate, 1);
+            if (!xcreatethread(SVCBATCH_SYNC_THREAD, 0, syncthread, NULL)) {
+                rc = GetLastError();
+                setsvcstatusexit(rc);
+                xsyserror(rc, L"CreateThread", L"syncthread");
+                cmdproc->exitCode = rc;
+                goto finished;
+            }
+        }
     }
     xsvcstatus(SERVICE_START_PENDING, SVCBATCH_START_HINT);
     DBG_PRINTF("cmdline %S", cmdproc->commandLine);
@@ -4561,6 +7791,9 @@ static DWORD WINAPI workerthread(void *unused)
      * Close our side of the pipes
      */
     SAFE_CLOSE_HANDLE(cmdproc->sInfo.hStdInput);
+    if (cmdproc->sInfo.hStdOutput != cmdproc->sInfo.hStdError) {
+        SAFE_CLOSE_HANDLE(cmdproc->sInfo.hStdOutput);
+    }
     SAFE_CLOSE_HANDLE(cmdproc->sInfo.hStdError);
 
     ResumeThread(cmdproc->pInfo.hThread);
@@ -4576,33 +7809,56 @@ static DWORD WINAPI workerthread(void *unused)
         ResumeThread(threads[SVCBATCH_ROTATE_THREAD].thread);
     }
     SAFE_CLOSE_HANDLE(cmdproc->pInfo.hThread);
-    if (outputlog) {
-        HANDLE wh[2];
-        DWORD  nw = 2;
+    if (np) {
+        HANDLE wh[3];
+        DWORD  wi[3];
+        DWORD  nw;
 
+        for (i = 0; i < np; i++) {
+            xringinit(rg + i, SVCBATCH_PIPE_BUFS, op[i],
+                      logrdresult, logrdconsume, logrdissue);
+            os[i] = logstartpipe(op[i]);
+        }
         wh[0] = cmdproc->pInfo.hProcess;
-        wh[1] = op->o.hEvent;
-        do {
+        for (;;) {
+            /**
+             * Wait for the process and for the
+             * read at the head of each open pipe, so
+             * that a blocked stream never stalls the other
+             */
+            for (nw = 1, i = 0; i < np; i++) {
+                if (os[i] == 0) {
+                    wi[nw]   = i;
+                    wh[nw++] = op[i][rg[i].head].o.hEvent;
+                }
+            }
             ws = WaitForMultipleObjects(nw, wh, FALSE, INFINITE);
-            switch (ws) {
-                case WAIT_OBJECT_0:
-                    nw = 0;
-                    DBG_PRINTS("process signaled");
-                break;
-                case WAIT_OBJECT_1:
-                    rc = logiodata(outputlog, op);
-                    if (rc)
-                        nw = 1;
+            if (ws == WAIT_OBJECT_0) {
+                DBG_PRINTS("process signaled");
+                for (i = 0; i < np; i++) {
+                    /**
+                     * Pick up the reads that completed
+                     * before the process exited
+                     */
+                    if (os[i] == 0)
+                        os[i] = logiodata(rg + i);
+                }
                 break;
-                default:
-                    nw = 0;
-                    DBG_PRINTF("wait failed %lu with %lu", ws, GetLastError());
+            }
+            else if ((ws > WAIT_OBJECT_0) && (ws < (WAIT_OBJECT_0 + nw))) {
+                i = wi[ws - WAIT_OBJECT_0];
+                os[i] = logiodata(rg + i);
+            }
+            else {
+                DBG_PRINTF("wait failed %lu with %lu", ws, GetLastError());
                 break;
             }
-        } while (nw);
-        if (rc == 0) {
-            DBG_PRINTS("cancel pipe");
-            CancelIo(op->pipe);
+        }
+        for (i = 0; i < np; i++) {
+            if (os[i] == 0) {
+                DBG_PRINTF("cancel pipe %lu", op[i]->stream);
+                CancelIo(op[i]->pipe);
+            }
         }
     }
     else {
@@ -4637,11 +7893,44 @@ static DWORD WINAPI workerthread(void *unused)
                cmdproc->exitCode);
 
 finished:
-    if (op != NULL) {
-        SAFE_CLOSE_HANDLE(op->pipe);
-        SAFE_CLOSE_HANDLE(op->o.hEvent);
-        xfree(op);
+    for (i = 0; i < np; i++)
+        logclosepipe(op[i]);
+    if (IS_VALID_HANDLE(threads[SVCBATCH_WRITER_THREAD].thread)) {
+        /**
+         * Close the queue and wait for the writer
+         * to flush the data that was already read
+         */
+        logspillflush();
+        InterlockedExchange(&logqueue->state, 1);
+        SetEvent(logqueue->event);
+        WaitForSingleObject(threads[SVCBATCH_WRITER_THREAD].thread, INFINITE);
+    }
+    if (IS_VALID_HANDLE(threads[SVCBATCH_SYNC_THREAD].thread)) {
+        InterlockedExchange(&logsyncstate, 0);
+        SetEvent(dologsync);
+        WaitForSingleObject(threads[SVCBATCH_SYNC_THREAD].thread, INFINITE);
+    }
+    if ((logqueue != NULL) && (freequeue != NULL)) {
+        LPVOID b;
+
+        while ((b = xqueuepop(freequeue)) != NULL)
+            xfree(b);
+        while ((b = xqueuepop(logqueue)) != NULL)
+            xfree(b);
+    }
+    if (logspill.dbytes) {
+        DBG_PRINTF("dropped %llu bytes in %lu lines", logspill.dbytes, logspill.dlines + logspill.lines);
     }
+    if (cmdproc->exitCode)
+        logcrashdump();
+    if (crashring.data) {
+        EnterCriticalSection(&crashsync);
+        xfree(crashring.data);
+        crashring.data = NULL;
+        LeaveCriticalSection(&crashsync);
+    }
+    xqueuefree(logqueue);
+    xqueuefree(freequeue);
     closeprocess(cmdproc);
     DBG_PRINTS("done");
     SetEvent(workerended);
@@ -4676,6 +7965,410 @@ static BOOL WINAPI consolehandler(DWORD ctrl)
     return rv;
 }
 
+/**
+ * Create the control pipe.
+ * Pipe is created before the worker starts, so that
+ * the service fails to start if the name is taken.
+ */
+static DWORD ctlcreatepipe(void)
+{
+    SECURITY_ATTRIBUTES  sa;
+    PSECURITY_DESCRIPTOR sd = NULL;
+
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(SVCBATCH_CTL_SDDL,
+                                                              SDDL_REVISION_1,
+                                                              &sd, NULL))
+        return GetLastError();
+    sa.nLength              = DSIZEOF(SECURITY_ATTRIBUTES);
+    sa.lpSecurityDescriptor = sd;
+    sa.bInheritHandle       = FALSE;
+
+    svccontrol->pipe = CreateNamedPipeW(svccontrol->name,
+                                        PIPE_ACCESS_DUPLEX |
+                                        FILE_FLAG_OVERLAPPED |
+                                        FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                        PIPE_TYPE_MESSAGE |
+                                        PIPE_READMODE_MESSAGE |
+                                        PIPE_REJECT_REMOTE_CLIENTS,
+                                        1,
+                                        SVCBATCH_CTL_BUFSIZ,
+                                        SVCBATCH_CTL_BUFSIZ,
+                                        0,
+                                        &sa);
+    LocalFree(sd);
+    if (IS_INVALID_HANDLE(svccontrol->pipe)) {
+        svccontrol->pipe = NULL;
+        return GetLastError();
+    }
+    return 0;
+}
+
+/**
+ * Wait for the event or until
+ * the service starts to stop
+ */
+static DWORD ctlwait(HANDLE h)
+{
+    HANDLE wh[3];
+
+    wh[0] = h;
+    wh[1] = workerended;
+    wh[2] = stopstarted;
+    switch (WaitForMultipleObjects(3, wh, FALSE, SVCBATCH_CTL_TIMEOUT)) {
+        case WAIT_OBJECT_0:
+            return 0;
+        case WAIT_TIMEOUT:
+            return ERROR_TIMEOUT;
+        default:
+        break;
+    }
+    return ERROR_OPERATION_ABORTED;
+}
+
+/**
+ * Overlapped read or write on the control pipe
+ */
+static DWORD ctlpipeio(LPOVERLAPPED ov, BOOL wr, LPVOID buf, DWORD len, LPDWORD n)
+{
+    DWORD rc = 0;
+    BOOL  rv;
+
+    *n = 0;
+    ResetEvent(ov->hEvent);
+    if (wr)
+        rv = WriteFile(svccontrol->pipe, buf, len, n, ov);
+    else
+        rv = ReadFile(svccontrol->pipe, buf, len, n, ov);
+    if (!rv) {
+        rc = GetLastError();
+        if (rc == ERROR_IO_PENDING) {
+            rc = ctlwait(ov->hEvent);
+            if (rc)
+                CancelIo(svccontrol->pipe);
+            if (!GetOverlappedResult(svccontrol->pipe, ov, n, TRUE) && (rc == 0))
+                rc = GetLastError();
+        }
+    }
+    return rc;
+}
+
+/**
+ * Return the malloc'd UTF-8 string with the
+ * characters that cannot be used inside
+ * the JSON string value replaced or escaped
+ */
+static LPSTR ctljsonstr(LPCWSTR s)
+{
+    LPSTR u;
+    LPSTR d;
+    int   n;
+    int   i;
+    int   x = 0;
+
+    n = WideCharToMultiByte(CP_UTF8, 0, s, -1, NULL, 0, NULL, NULL);
+    if (n < 1)
+        return (LPSTR)xmcalloc(1);
+    u = (LPSTR)xmmalloc(n);
+    WideCharToMultiByte(CP_UTF8, 0, s, -1, u, n, NULL, NULL);
+    d = (LPSTR)xmmalloc(n * 2);
+    for (i = 0; u[i] != CNUL; i++) {
+        if ((u[i] == '"') || (u[i] == '\\'))
+            d[x++] = '\\';
+        d[x++] = ((BYTE)u[i] < 32) ? ' ' : u[i];
+    }
+    d[x] = CNUL;
+    xfree(u);
+    return d;
+}
+
+static int ctllogstats(LPSTR b, int siz, LPCSTR name, LPSVCBATCH_LOG log)
+{
+    LPSTR     fn;
+    ULONGLONG sz;
+    int       n;
+
+    if (log == NULL)
+        return 0;
+    SVCBATCH_CS_ENTER(log);
+    sz = (ULONGLONG)log->size;
+    fn = ctljsonstr(log->logFile);
+    n  = xsnprintf(b, siz, ",\"%s\":{\"file\":\"%s\",\"size\":%I64u", name, fn, sz);
+    if (logsnapshot) {
+        n += xsnprintf(b + n, siz - n,
+                       ",\"snapshots\":%I64u,\"pause\":%I64u,\"maxpause\":%I64u",
+                       log->snaps, log->snaplast, log->snapmax);
+    }
+    SVCBATCH_CS_LEAVE(log);
+    n += xsnprintf(b + n, siz - n, "}");
+    xfree(fn);
+    return n;
+}
+
+static DWORD ctlrotate(void)
+{
+    DWORD rc;
+
+    if (IS_NOT_OPT(SVCBATCH_OPT_ROTATE) || (outputlog == NULL))
+        return ERROR_NOT_SUPPORTED;
+    if (!canrotatelogs(outputlog))
+        return ERROR_BUSY;
+    ResetEvent(svccontrol->rotated);
+    SetEvent(dologrotate);
+    rc = ctlwait(svccontrol->rotated);
+    if (rc == 0)
+        rc = (DWORD)InterlockedCompareExchange(&svccontrol->rotaterc, 0, 0);
+    return rc;
+}
+
+static DWORD ctlflush(void)
+{
+    DWORD rc = 0;
+
+    if (outputlog == NULL)
+        return ERROR_NOT_SUPPORTED;
+    if (logqueue && IS_VALID_HANDLE(threads[SVCBATCH_WRITER_THREAD].thread)) {
+        /**
+         * Ask the writer to write the coalesced data
+         */
+        ResetEvent(svccontrol->flushed);
+        InterlockedExchange(&svccontrol->flush, 1);
+        SetEvent(logqueue->event);
+        rc = ctlwait(svccontrol->flushed);
+    }
+    if (rc == 0)
+        rc = logsyncfile(outputlog);
+    if (rc == 0)
+        rc = logsyncfile(errorlog);
+    return rc;
+}
+
+static DWORD ctldumpring(LPSTR b, int siz, int *pos)
+{
+    LPBYTE r;
+    LPWSTR fn;
+    LPSTR  fs;
+    DWORD  n;
+    DWORD  rc;
+
+    if (crashring.data == NULL)
+        return ERROR_NOT_SUPPORTED;
+    r = logcrashcopy(&n);
+    if (r == NULL)
+        return ERROR_NO_DATA;
+    fn = logcrashname();
+    rc = logcrashsave(r, n, fn);
+    if (rc == 0) {
+        fs = ctljsonstr(fn);
+        *pos += xsnprintf(b + *pos, siz - *pos,
+                          ",\"file\":\"%s\",\"bytes\":%lu", fs, n);
+        xfree(fs);
+    }
+    xfree(fn);
+    xfree(r);
+    return rc;
+}
+
+static DWORD ctlloglevel(LPCSTR arg, LPSTR b, int siz, int *pos)
+{
+#if HAVE_DEBUG_TRACE
+    HANDLE h;
+    int    lv;
+    int    ov;
+
+    if ((arg == NULL) || (*arg < '0') || (*arg > '2') || (arg[1] != CNUL))
+        return ERROR_INVALID_PARAMETER;
+    lv = *arg - '0';
+    ov = xtraceservice;
+    /**
+     * Writer holds the trace handle only
+     * while inside the trace lock
+     */
+    EnterCriticalSection(&xtracesync);
+    h = xtracefhandle;
+    LeaveCriticalSection(&xtracesync);
+    xtraceservice = lv;
+    if (lv && (h == NULL))
+        xtracefopen();
+    *pos += xsnprintf(b + *pos, siz - *pos,
+                      ",\"level\":%d,\"previous\":%d", lv, ov);
+    return 0;
+#else
+    return ERROR_NOT_SUPPORTED;
+#endif
+}
+
+static DWORD ctlstats(LPSTR b, int siz, int *pos)
+{
+    *pos += xsnprintf(b + *pos, siz - *pos,
+                      ",\"pid\":%lu,\"uptime\":%I64u,\"commands\":%lu",
+                      cmdproc->pInfo.dwProcessId,
+                      GetTickCount64() - threads[SVCBATCH_WORKER_THREAD].duration,
+                      svccontrol->commands);
+    *pos += ctllogstats(b + *pos, siz - *pos, "output", outputlog);
+    *pos += ctllogstats(b + *pos, siz - *pos, "error",  errorlog);
+    *pos += xsnprintf(b + *pos, siz - *pos,
+                      ",\"dropped\":{\"bytes\":%I64u,\"lines\":%lu}",
+                      logspill.dbytes, logspill.dlines + logspill.lines);
+    if (zipqueue) {
+        SVCBATCH_CS_ENTER(zipqueue);
+        *pos += xsnprintf(b + *pos, siz - *pos,
+                          ",\"compress\":{\"pending\":%ld,\"files\":%I64u,"
+                          "\"in\":%I64u,\"out\":%I64u}",
+                          zipqueue->count, zipqueue->files,
+                          zipqueue->ibytes, zipqueue->obytes);
+        SVCBATCH_CS_LEAVE(zipqueue);
+    }
+    if (logretain) {
+        *pos += xsnprintf(b + *pos, siz - *pos,
+                          ",\"retain\":{\"total\":%I64u,\"removed\":%lu,\"freed\":%I64u}",
+                          logretain->total, logretain->removed, logretain->freed);
+    }
+    return 0;
+}
+
+/**
+ * Run the control command and write the reply.
+ * Reply is a single line JSON object with the status,
+ * command name and the command specific values.
+ */
+static int ctlcommand(LPSTR cmd, LPSTR b, int siz)
+{
+    LPCSTR nm  = NULL;
+    LPSTR  arg = NULL;
+    DWORD  rc  = ERROR_INVALID_FUNCTION;
+    int    n   = 0;
+    int    i;
+    char   vb[SVCBATCH_CTL_BUFSIZ];
+
+    vb[0] = CNUL;
+    for (i = xstrlen(cmd); (i > 0) && xisblank(cmd[i - 1]); i--)
+        cmd[i - 1] = CNUL;
+    for (i = 0; cmd[i] != CNUL; i++) {
+        if (xisblank(cmd[i])) {
+            cmd[i] = CNUL;
+            arg = cmd + i + 1;
+            while (xisblank(*arg))
+                arg++;
+            break;
+        }
+    }
+    if (_stricmp(cmd, "rotate") == 0) {
+        nm = "rotate";
+        rc = ctlrotate();
+    }
+    else if (_stricmp(cmd, "flush") == 0) {
+        nm = "flush";
+        rc = ctlflush();
+    }
+    else if (_stricmp(cmd, "stats") == 0) {
+        nm = "stats";
+        rc = ctlstats(vb, SVCBATCH_CTL_BUFSIZ, &n);
+    }
+    else if (_stricmp(cmd, "dump-ring") == 0) {
+        nm = "dump-ring";
+        rc = ctldumpring(vb, SVCBATCH_CTL_BUFSIZ, &n);
+    }
+    else if (_stricmp(cmd, "set-log-level") == 0) {
+        nm = "set-log-level";
+        rc = ctlloglevel(arg, vb, SVCBATCH_CTL_BUFSIZ, &n);
+    }
+    DBG_PRINTF("%s %lu", cmd, rc);
+    n = xsnprintf(b, siz, "{\"status\":\"%s\"", rc ? "error" : "ok");
+    if (nm)
+        n += xsnprintf(b + n, siz - n, ",\"command\":\"%s\"", nm);
+    if (rc)
+        n += xsnprintf(b + n, siz - n, ",\"error\":%lu", rc);
+    else
+        n += xsnprintf(b + n, siz - n, "%s", vb);
+    n += xsnprintf(b + n, siz - n, "}\n");
+    return n;
+}
+
+static DWORD WINAPI controlthread(void *unused)
+{
+    OVERLAPPED ov;
+    DWORD      rc = 0;
+    DWORD      n;
+    char       rb[SVCBATCH_CTL_BUFSIZ];
+    char       wb[SVCBATCH_CTL_BUFSIZ];
+
+    DBG_PRINTF("started %S", svccontrol->name);
+    xmemzero(&ov, 1, sizeof(OVERLAPPED));
+    ov.hEvent = svccontrol->event;
+    for (;;) {
+        ResetEvent(ov.hEvent);
+        if (!ConnectNamedPipe(svccontrol->pipe, &ov)) {
+            rc = GetLastError();
+            if (rc == ERROR_IO_PENDING) {
+                HANDLE wh[3];
+
+                wh[0] = ov.hEvent;
+                wh[1] = workerended;
+                wh[2] = stopstarted;
+                if (WaitForMultipleObjects(3, wh, FALSE, INFINITE) != WAIT_OBJECT_0) {
+                    CancelIo(svccontrol->pipe);
+                    GetOverlappedResult(svccontrol->pipe, &ov, &n, TRUE);
+                    rc = 0;
+                    break;
+                }
+                if (!GetOverlappedResult(svccontrol->pipe, &ov, &n, FALSE))
+                    rc = GetLastError();
+                else
+                    rc = 0;
+            }
+            else if (rc == ERROR_PIPE_CONNECTED) {
+                rc = 0;
+            }
+            else if (rc == ERROR_NO_DATA) {
+                /**
+                 * Client closed the pipe before
+                 * the connection was completed
+                 */
+                DisconnectNamedPipe(svccontrol->pipe);
+                continue;
+            }
+            if (rc) {
+                xsyserror(rc, L"ConnectNamedPipe", svccontrol->name);
+                break;
+            }
+        }
+        DBG_PRINTS("connected");
+        for (;;) {
+            rc = ctlpipeio(&ov, FALSE, rb, SVCBATCH_CTL_BUFSIZ - 1, &n);
+            if (rc == ERROR_MORE_DATA) {
+                /**
+                 * Discard the rest of the message
+                 */
+                while (rc == ERROR_MORE_DATA)
+                    rc = ctlpipeio(&ov, FALSE, rb, SVCBATCH_CTL_BUFSIZ - 1, &n);
+                if (rc)
+                    break;
+                n  = xsnprintf(wb, SVCBATCH_CTL_BUFSIZ,
+                               "{\"status\":\"error\",\"error\":%lu}\n",
+                               ERROR_MORE_DATA);
+            }
+            else {
+                if (rc || (n == 0))
+                    break;
+                rb[n] = CNUL;
+                svccontrol->commands++;
+                n = ctlcommand(rb, wb, SVCBATCH_CTL_BUFSIZ);
+            }
+            rc = ctlpipeio(&ov, TRUE, wb, n, &n);
+            if (rc)
+                break;
+        }
+        DBG_PRINTF("disconnected %lu", rc);
+        DisconnectNamedPipe(svccontrol->pipe);
+        if (rc == ERROR_OPERATION_ABORTED) {
+            rc = 0;
+            break;
+        }
+    }
+    DBG_PRINTF("done %lu commands", svccontrol->commands);
+    return rc;
+}
+
 static DWORD WINAPI servicehandler(DWORD ctrl, DWORD _xe, LPVOID _xd, LPVOID _xc)
 {
     switch (ctrl) {
@@ -4790,6 +8483,22 @@ static void __cdecl objectscleanup(void)
     SAFE_CLOSE_HANDLE(svcstopdone);
     SAFE_CLOSE_HANDLE(stopstarted);
     SAFE_CLOSE_HANDLE(dologrotate);
+    SAFE_CLOSE_HANDLE(dologsync);
+    SAFE_CLOSE_HANDLE(dologcut);
+    if (zipqueue) {
+        SAFE_CLOSE_HANDLE(zipqueue->event);
+    }
+    if (logretain) {
+        SAFE_CLOSE_HANDLE(logretain->event);
+    }
+    if (svccontrol) {
+        SAFE_CLOSE_HANDLE(svccontrol->pipe);
+        SAFE_CLOSE_HANDLE(svccontrol->event);
+        SAFE_CLOSE_HANDLE(svccontrol->flushed);
+        SAFE_CLOSE_HANDLE(svccontrol->rotated);
+    }
+    if (crashsize)
+        DeleteCriticalSection(&crashsync);
     SAFE_CLOSE_HANDLE(svclogmutex);
     if (sharedmem)
         UnmapViewOfFile(sharedmem);
@@ -4863,6 +8572,48 @@ static DWORD createevents(void)
         if (IS_INVALID_HANDLE(dologrotate))
             return GetLastError();
     }
+    if (logsync == SVCBATCH_SYNC_PERIODIC) {
+        dologsync = CreateEventExW(NULL, NULL, 0,
+                                   EVENT_MODIFY_STATE | SYNCHRONIZE);
+        if (IS_INVALID_HANDLE(dologsync))
+            return GetLastError();
+        xsyncinit(&logsyncgroup, logsyncsize);
+    }
+    if (zipqueue) {
+        zipqueue->event = CreateEventExW(NULL, NULL, 0,
+                                         EVENT_MODIFY_STATE | SYNCHRONIZE);
+        if (IS_INVALID_HANDLE(zipqueue->event))
+            return GetLastError();
+    }
+    if (logcutmode != SVCBATCH_CUT_NONE) {
+        dologcut = CreateEventExW(NULL, NULL, 0,
+                                  EVENT_MODIFY_STATE | SYNCHRONIZE);
+        if (IS_INVALID_HANDLE(dologcut))
+            return GetLastError();
+    }
+    if (logretain) {
+        logretain->event = CreateEventExW(NULL, NULL, 0,
+                                          EVENT_MODIFY_STATE | SYNCHRONIZE);
+        if (IS_INVALID_HANDLE(logretain->event))
+            return GetLastError();
+    }
+    if (svccontrol) {
+        svccontrol->event   = CreateEventExW(NULL, NULL,
+                                             CREATE_EVENT_MANUAL_RESET,
+                                             EVENT_MODIFY_STATE | SYNCHRONIZE);
+        if (IS_INVALID_HANDLE(svccontrol->event))
+            return GetLastError();
+        svccontrol->flushed = CreateEventExW(NULL, NULL,
+                                             CREATE_EVENT_MANUAL_RESET,
+                                             EVENT_MODIFY_STATE | SYNCHRONIZE);
+        if (IS_INVALID_HANDLE(svccontrol->flushed))
+            return GetLastError();
+        svccontrol->rotated = CreateEventExW(NULL, NULL,
+                                             CREATE_EVENT_MANUAL_RESET,
+                                             EVENT_MODIFY_STATE | SYNCHRONIZE);
+        if (IS_INVALID_HANDLE(svccontrol->rotated))
+            return GetLastError();
+    }
     return 0;
 }
 
@@ -5150,6 +8901,23 @@ static int parseoptions(int sargc, LPWSTR *sargv)
                 cmdproc->timeout = service->timeout  - SVCBATCH_STOP_WAIT;
         }
     }
+    if (hasconfvar(1, SVCBATCH_CFG_CRASHSIZE)) {
+        crashsize = getconfnum(1, SVCBATCH_CFG_CRASHSIZE);
+        if (crashsize && ((crashsize < SVCBATCH_MIN_CRASH) ||
+                          (crashsize > SVCBATCH_MAX_CRASH) ||
+                          (crashsize & (crashsize - 1))))
+            return xsyserrno(13, L"CrashBufferSize", xntowcs(crashsize));
+    }
+    if (crashsize) {
+        crashring.data = (LPBYTE)xmmalloc(crashsize);
+        crashring.size = crashsize;
+        InitializeCriticalSection(&crashsync);
+    }
+    if (servicemode && getconfnum(1, SVCBATCH_CFG_CTLPIPE)) {
+        svccontrol = (LPSVCBATCH_CONTROL)xmcalloc(sizeof(SVCBATCH_CONTROL));
+        svccontrol->name = xwcsconcat(SVCBATCH_CTLPIPE, service->name);
+        DBG_PRINTF("control pipe %S", svccontrol->name);
+    }
     if (getconfnum(1, SVCBATCH_CFG_NOLOGGING)) {
         SVCOPT_SET(SVCBATCH_OPT_QUIET);
     }
@@ -5164,8 +8932,185 @@ static int parseoptions(int sargc, LPWSTR *sargv)
                     return xsyserrno(13, L"StopMaxLogs",  xntowcs(stopmaxlogs));
             }
         }
-        if (getconfnum(1, SVCBATCH_CFG_TRUNCATE))
+        if (getconfnum(1, SVCBATCH_CFG_TRUNCATE)) {
             SVCOPT_SET(SVCBATCH_OPT_TRUNCATE);
+            if (getconfnum(1, SVCBATCH_CFG_SNAPSHOT)) {
+                logsnapshot = TRUE;
+                DBG_PRINTS("snapshot");
+            }
+        }
+        if (hasconfvar(1, SVCBATCH_CFG_PIPEBUFSIZE)) {
+            cx = getconfnum(1, SVCBATCH_CFG_PIPEBUFSIZE);
+            if ((cx < SVCBATCH_MIN_PIPE_SIZ) || (cx > SVCBATCH_MAX_PIPE_SIZ))
+                return xsyserrno(13, L"PipeBufferSize", xntowcs(cx));
+            pipebufsize = cx;
+        }
+        if (hasconfvar(1, SVCBATCH_CFG_READBUFSIZE)) {
+            cx = getconfnum(1, SVCBATCH_CFG_READBUFSIZE);
+            if ((cx < SVCBATCH_MIN_PIPE_LEN) || (cx > SVCBATCH_MAX_PIPE_LEN))
+                return xsyserrno(13, L"ReadBufferSize", xntowcs(cx));
+            readbufsize = cx;
+        }
+        readbufmin = readbufsize;
+        readbufmax = readbufsize;
+        if (getconfnum(1, SVCBATCH_CFG_READBUFADAPT)) {
+            /**
+             * Reads larger than the pipe buffer
+             * will rarely be filled.
+             */
+            readbufmin = SVCBATCH_MIN_PIPE_LEN;
+            readbufmax = pipebufsize < SVCBATCH_MAX_PIPE_LEN ? pipebufsize : SVCBATCH_MAX_PIPE_LEN;
+            if (readbufsize > readbufmax)
+                readbufmax = readbufsize;
+        }
+        DBG_PRINTF("pipe %lu read %lu [%lu - %lu]",
+                   pipebufsize, readbufsize, readbufmin, readbufmax);
+        if (hasconfvar(1, SVCBATCH_CFG_STDERR)) {
+            stderrmode = getconfnum(1, SVCBATCH_CFG_STDERR);
+            if (stderrmode > SVCBATCH_STDERR_SPLIT)
+                return xsyserrno(13, L"LogStdError", xntowcs(stderrmode));
+            DBG_PRINTF("stderr %lu", stderrmode);
+        }
+        if (stderrmode == SVCBATCH_STDERR_SPLIT)
+            errorlogname = getconfwcs(1, SVCBATCH_CFG_ELOGNAME);
+        if (getconfnum(1, SVCBATCH_CFG_TIMESTAMPS))
+            SVCOPT_SET(SVCBATCH_OPT_TIMESTAMP);
+        if (hasconfvar(1, SVCBATCH_CFG_ENCODING)) {
+            LPCWSTR le = getconfwcs(1, SVCBATCH_CFG_ENCODING);
+            CPINFO  ci;
+
+            if (xwcsequals(le, L"OEM"))
+                logencoding = GetOEMCP();
+            else if (xwcsequals(le, L"ANSI"))
+                logencoding = GetACP();
+            else if (xwcsequals(le, L"UTF-8") || xwcsequals(le, L"UTF8"))
+                logencoding = CP_UTF8;
+            else
+                logencoding = xwcstoi(le, NULL);
+            if (logencoding == CP_UTF8) {
+                /**
+                 * Data is already in UTF-8
+                 */
+                logencoding = 0;
+            }
+            else if ((logencoding == 0) || (logencoding == (UINT)-1) ||
+                     !GetCPInfo(logencoding, &ci) || (ci.MaxCharSize > 2)) {
+                return xsyserrno(12, L"LogEncoding", le);
+            }
+            DBG_PRINTF("encoding %u", logencoding);
+        }
+        if (hasconfvar(1, SVCBATCH_CFG_INDEX)) {
+            logindex = getconfnum(1, SVCBATCH_CFG_INDEX);
+            if (logindex > SVCBATCH_MAX_INDEX)
+                return xsyserrno(13, L"LogIndex", xntowcs(logindex));
+        }
+        logratebytes = getconfnum(1, SVCBATCH_CFG_RATEBYTES);
+        logratelines = getconfnum(1, SVCBATCH_CFG_RATELINES);
+        if (hasconfvar(1, SVCBATCH_CFG_RATEBURST)) {
+            lograteburst = getconfnum(1, SVCBATCH_CFG_RATEBURST);
+            if ((lograteburst < 1) || (lograteburst > SVCBATCH_MAX_BURST))
+                return xsyserrno(13, L"LogRateBurst", xntowcs(lograteburst));
+        }
+        if (logratebytes || logratelines) {
+            DBG_PRINTF("rate %lu bytes %lu lines burst %lu s",
+                       logratebytes, logratelines, lograteburst);
+        }
+        cp = getconfmsz(1, SVCBATCH_CFG_INCLUDE);
+        if (cp != NULL) {
+            loginclude = xfiltercompile(cp);
+            if (loginclude == NULL)
+                return xsyserror(GetLastError(), L"LogInclude", NULL);
+        }
+        cp = getconfmsz(1, SVCBATCH_CFG_EXCLUDE);
+        if (cp != NULL) {
+            logexclude = xfiltercompile(cp);
+            if (logexclude == NULL)
+                return xsyserror(GetLastError(), L"LogExclude", NULL);
+        }
+        if (hasconfvar(1, SVCBATCH_CFG_FORMAT)) {
+            LPCWSTR lf = getconfwcs(1, SVCBATCH_CFG_FORMAT);
+
+            if (xwcsequals(lf, L"jsonl") || xwcsequals(lf, L"JsonLines"))
+                SVCOPT_SET(SVCBATCH_OPT_JSONLINES);
+            else if (!xwcsequals(lf, L"Raw"))
+                return xsyserrno(12, L"LogFormat", lf);
+        }
+        if (getconfnum(1, SVCBATCH_CFG_COMPRESS)) {
+            SVCOPT_SET(SVCBATCH_OPT_COMPRESS);
+            /**
+             * Compress blocks larger than a single read
+             */
+            logflushint = SVCBATCH_DEF_FLUSH_INT;
+            if (logindex)
+                return xsyserrno(29, L"LogIndex and LogCompress parameters", NULL);
+        }
+        if (getconfnum(1, SVCBATCH_CFG_ZIPROTATED)) {
+            if (IS_OPT_SET(SVCBATCH_OPT_COMPRESS))
+                return xsyserrno(29, L"CompressRotatedLogs and LogCompress parameters", NULL);
+            if (logindex)
+                return xsyserrno(29, L"CompressRotatedLogs and LogIndex parameters", NULL);
+            zipqueue = (LPSVCBATCH_ZIPQUEUE)xmcalloc(sizeof(SVCBATCH_ZIPQUEUE));
+            SVCBATCH_CS_INIT(zipqueue);
+        }
+        if (hasconfvar(1, SVCBATCH_CFG_RETAINBYTES) || hasconfvar(1, SVCBATCH_CFG_RETAINDAYS)) {
+            ULONGLONG rb = 0;
+
+            cp = getconfwcs(1, SVCBATCH_CFG_RETAINBYTES);
+            if (cp && xwcstosize(cp, &rb))
+                return xsyserrno(12, L"LogRetainBytes", cp);
+            cx = getconfnum(1, SVCBATCH_CFG_RETAINDAYS);
+            if (cx > SVCBATCH_MAX_RETAIN_DAYS)
+                return xsyserrno(13, L"LogRetainDays", xntowcs(cx));
+            if (rb || cx) {
+                logretain = (LPSVCBATCH_RETAIN)xmcalloc(sizeof(SVCBATCH_RETAIN));
+                logretain->bytes = rb;
+                logretain->days  = cx;
+                DBG_PRINTF("retain %llu bytes %lu days", rb, cx);
+            }
+        }
+        if (hasconfvar(1, SVCBATCH_CFG_FLUSHINT)) {
+            cx = getconfnum(1, SVCBATCH_CFG_FLUSHINT);
+            if (cx > SVCBATCH_MAX_FLUSH_INT)
+                return xsyserrno(13, L"LogFlushInterval", xntowcs(cx));
+            logflushint = cx;
+        }
+        DBG_PRINTF("flush %lu ms", logflushint);
+        if (hasconfvar(1, SVCBATCH_CFG_BACKPRESSURE)) {
+            backpressure = getconfnum(1, SVCBATCH_CFG_BACKPRESSURE);
+            if (backpressure > SVCBATCH_BACKPRESSURE_SPILL)
+                return xsyserrno(13, L"LogBackpressure", xntowcs(backpressure));
+        }
+        if ((backpressure == SVCBATCH_BACKPRESSURE_SPILL) && hasconfvar(1, SVCBATCH_CFG_SPILLSIZE)) {
+            logspillmax = getconfnum(1, SVCBATCH_CFG_SPILLSIZE);
+            if ((logspillmax < SVCBATCH_MAX_PIPE_LEN * 2) || (logspillmax > SVCBATCH_MAX_SPILL))
+                return xsyserrno(13, L"LogSpillSize", xntowcs(logspillmax));
+        }
+        DBG_PRINTF("backpressure %lu", backpressure);
+        if (hasconfvar(1, SVCBATCH_CFG_SYNC)) {
+            logsync = getconfnum(1, SVCBATCH_CFG_SYNC);
+            if (logsync > SVCBATCH_SYNC_WRITE)
+                return xsyserrno(13, L"LogSync", xntowcs(logsync));
+        }
+        if (logsync == SVCBATCH_SYNC_PERIODIC) {
+            if (hasconfvar(1, SVCBATCH_CFG_SYNCINT)) {
+                logsyncint = getconfnum(1, SVCBATCH_CFG_SYNCINT);
+                if ((logsyncint < SVCBATCH_STOP_STEP / 10) || (logsyncint > SVCBATCH_MAX_SYNC_INT))
+                    return xsyserrno(13, L"LogSyncInterval", xntowcs(logsyncint));
+            }
+            logsyncsize = getconfnum(1, SVCBATCH_CFG_SYNCSIZE);
+            if (logsyncsize < 0)
+                return xsyserrno(13, L"LogSyncSize", xntowcs(logsyncsize));
+        }
+        DBG_PRINTF("sync %lu", logsync);
+        if (hasconfvar(1, SVCBATCH_CFG_SEGMENT)) {
+            cx = getconfnum(1, SVCBATCH_CFG_SEGMENT);
+            if ((cx < SVCBATCH_MIN_SEGMENT) || (cx > SVCBATCH_MAX_SEGMENT))
+                return xsyserrno(13, L"LogSegmentSize", xntowcs(cx));
+            cx = cx + ssysteminfo.dwAllocationGranularity - 1;
+            logsegsize = cx - cx % ssysteminfo.dwAllocationGranularity;
+            SVCOPT_SET(SVCBATCH_OPT_MAPPED);
+            DBG_PRINTF("segment %lu", logsegsize);
+        }
         if (getconfnum(1, SVCBATCH_CFG_LOGROTATE)) {
             SVCOPT_SET(SVCBATCH_OPT_ROTATE);
             DBG_PRINTS("rotate");
@@ -5192,6 +9137,45 @@ static int parseoptions(int sargc, LPWSTR *sargv)
             }
             if (getconfval(1, SVCBATCH_CFG_ROTATEBYSIG, 1))
                 SVCOPT_SET(SVCBATCH_OPT_ROTATE_BY_SIG);
+            if (IS_NOT_OPT(SVCBATCH_OPT_COMPRESS) && IS_NOT_OPT(SVCBATCH_OPT_TRUNCATE)) {
+                /**
+                 * Compressed data has no line boundaries
+                 */
+                logcutmode = SVCBATCH_CUT_LINE;
+            }
+            cp = getconfwcs(1, SVCBATCH_CFG_ROTATECUT);
+            if (cp) {
+                if (xwcsequals(cp, L"None")) {
+                    logcutmode = SVCBATCH_CUT_NONE;
+                }
+                else if (IS_OPT_SET(SVCBATCH_OPT_COMPRESS)) {
+                    return xsyserrno(29, L"LogRotateBoundary and LogCompress parameters", NULL);
+                }
+                else if (xwcsequals(cp, L"Line")) {
+                    logcutmode = SVCBATCH_CUT_LINE;
+                }
+                else if (xwcsequals(cp, L"BlankLine")) {
+                    logcutmode = SVCBATCH_CUT_BLANK;
+                }
+                else {
+                    UINT fc = logencoding ? CP_UTF8 : CP_ACP;
+                    int  n;
+
+                    n = WideCharToMultiByte(fc, 0, cp, -1, NULL, 0, NULL, NULL);
+                    if (n < 2)
+                        return xsyserrno(12, L"LogRotateBoundary", cp);
+                    logcutprefix = (LPSTR)xmmalloc(n);
+                    WideCharToMultiByte(fc, 0, cp, -1, logcutprefix, n, NULL, NULL);
+                    logcutplen = n - 1;
+                    logcutmode = SVCBATCH_CUT_RECORD;
+                }
+            }
+            if (hasconfvar(1, SVCBATCH_CFG_ROTATECUTMAX)) {
+                logcutmax = getconfnum(1, SVCBATCH_CFG_ROTATECUTMAX);
+                if ((logcutmax < SVCBATCH_MIN_CUT_SIZ) || (logcutmax > SVCBATCH_MAX_CUT_SIZ))
+                    return xsyserrno(13, L"LogRotateBoundaryMax", xntowcs(logcutmax));
+            }
+            DBG_PRINTF("boundary %lu max %lu", logcutmode, logcutmax);
             DBG_PRINTF("ctrl %s", IS_OPT_SET(SVCBATCH_OPT_ROTATE_BY_SIG) ? "Yes" : "No");
         }
     }
@@ -5321,14 +9305,32 @@ static int parseoptions(int sargc, LPWSTR *sargv)
         stoplogname  = NULL;
         svclogfname  = NULL;
         svclogsparam = NULL;
+        errorlogname = NULL;
         stopmaxlogs  = 0;
+        stderrmode   = SVCBATCH_STDERR_SHARED;
     }
     else {
         outputlog = (LPSVCBATCH_LOG)xmcalloc(sizeof(SVCBATCH_LOG));
         outputlog->logName = svclogfname ? svclogfname : SVCBATCH_LOGNAME;
+        if (hasconfvar(1, SVCBATCH_CFG_GENERATIONS)) {
+            loggenerations = getconfnum(1, SVCBATCH_CFG_GENERATIONS);
+            if (loggenerations > SVCBATCH_MAX_GENERATIONS)
+                return xsyserrno(13, L"LogGenerations", xntowcs(loggenerations));
+            if (loggenerations) {
+                if (hasconfvar(1, SVCBATCH_CFG_MAXLOGS))
+                    return xsyserrno(29, L"LogGenerations and MaxLogs parameters", NULL);
+                if (IS_OPT_SET(SVCBATCH_OPT_TRUNCATE))
+                    return xsyserrno(29, L"LogGenerations and TruncateLogs parameters", NULL);
+            }
+        }
         if (xwcschr(outputlog->logName, L'@')) {
             if (xchkftime(outputlog->logName))
                 return xsyserror(GetLastError(), outputlog->logName, NULL);
+            if (loggenerations)
+                return xsyserrno(29, L"LogGenerations and LogName parameters", NULL);
+        }
+        else if (loggenerations) {
+            outputlog->gen = (LPSVCBATCH_LOGGEN)xmcalloc(sizeof(SVCBATCH_LOGGEN));
         }
         else {
             outputlog->maxLogs = SVCBATCH_DEF_LOGS;
@@ -5339,6 +9341,23 @@ static int parseoptions(int sargc, LPWSTR *sargv)
             }
         }
         SVCBATCH_CS_INIT(outputlog);
+        if (stderrmode == SVCBATCH_STDERR_SPLIT) {
+            errorlog = (LPSVCBATCH_LOG)xmcalloc(sizeof(SVCBATCH_LOG));
+            errorlog->logName = errorlogname ? errorlogname : SVCBATCH_LOGERRS;
+            if (xwcschr(errorlog->logName, L'@')) {
+                if (xchkftime(errorlog->logName))
+                    return xsyserror(GetLastError(), errorlog->logName, NULL);
+                if (loggenerations)
+                    return xsyserrno(29, L"LogGenerations and StdErrorLogName parameters", NULL);
+            }
+            else if (loggenerations) {
+                errorlog->gen = (LPSVCBATCH_LOGGEN)xmcalloc(sizeof(SVCBATCH_LOGGEN));
+            }
+            else {
+                errorlog->maxLogs = outputlog->maxLogs;
+            }
+            SVCBATCH_CS_INIT(errorlog);
+        }
     }
     if (eprefixparam) {
         if (xwcschr(eprefixparam, L'$')) {
@@ -5630,6 +9649,18 @@ static int parseoptions(int sargc, LPWSTR *sargv)
                 return xsyserror(ERROR_INVALID_PARAMETER, SVCBATCH_MSG(23), outputlog->logName);
         }
     }
+    if (errorlog) {
+        if (xwcschr(errorlog->logName, L'$')) {
+            wp = xexpandenvstr(errorlog->logName, namevarset);
+            if (wp == NULL)
+                return xsyserror(GetLastError(), errorlog->logName, NULL);
+            errorlog->logName = wp;
+        }
+        if (xwcspbrk(errorlog->logName, INVALID_FILENAME_CHARS))
+            return xsyserror(ERROR_INVALID_PARAMETER, SVCBATCH_MSG(23), errorlog->logName);
+        if (xwcsequals(errorlog->logName, outputlog->logName))
+            return xsyserrno(31, L"LogName and StdErrorLogName", errorlog->logName);
+    }
     if (svcstop) {
         cp = getconfmsz(1, SVCBATCH_CFG_STOP);
         if (cp != NULL) {
@@ -5690,6 +9721,8 @@ static int parseoptions(int sargc, LPWSTR *sargv)
         if (stoplogname) {
             if (xwcsequals(stoplogname, outputlog->logName))
                 return xsyserrno(31, L"LogName and StopLogName", stoplogname);
+            if (errorlog && xwcsequals(stoplogname, errorlog->logName))
+                return xsyserrno(31, L"StdErrorLogName and StopLogName", stoplogname);
             if (xwcschr(stoplogname, L'@')) {
                 if (xchkftime(stoplogname))
                     return xsyserror(GetLastError(), stoplogname, NULL);
@@ -5717,6 +9750,9 @@ static int parseoptions(int sargc, LPWSTR *sargv)
         DBG_PRINTF("log %S", outputlog->logName);
         DBG_PRINTF("max %d", outputlog->maxLogs);
         }
+        if (errorlog) {
+        DBG_PRINTF("errlog %S", errorlog->logName);
+        }
         if (svcstop) {
         for (x = 0; x < svcstop->argc; x++)
         DBG_PRINTF("stop %d %S", x, svcstop->args[x]);
@@ -5838,6 +9874,15 @@ static void WINAPI servicemain(DWORD argc, LPWSTR *argv)
         }
         xsvcstatus(SERVICE_START_PENDING, 0);
     }
+    if (errorlog) {
+        rv = openlogfile(errorlog, TRUE);
+        if (rv) {
+            closelogfile(outputlog);
+            xsvcstatus(SERVICE_STOPPED, rv);
+            return;
+        }
+        xsvcstatus(SERVICE_START_PENDING, 0);
+    }
     cmdproc->commandLine = xappendarg(1, NULL, cmdproc->application);
     for (i = 1; i < cmdproc->optc; i++)
     cmdproc->commandLine = xappendarg(0, cmdproc->commandLine, cmdproc->opts[i]);
@@ -5861,6 +9906,11 @@ static void WINAPI servicemain(DWORD argc, LPWSTR *argv)
                 xsyserror(rv, L"CreateWaitableTimer", NULL);
                 goto finished;
             }
+            if (rotateschedn && !resolverotatetime()) {
+                rv = ERROR_INVALID_DATA;
+                xsyserror(rv, L"LogRotateTime", NULL);
+                goto finished;
+            }
             if (!SetWaitableTimer(wt, &rotatetime, 0, NULL, NULL, FALSE)) {
                 rv = GetLastError();
                 xsyserror(rv, L"SetWaitableTimer", NULL);
@@ -5874,6 +9924,34 @@ static void WINAPI servicemain(DWORD argc, LPWSTR *argv)
             goto finished;
         }
     }
+    if (zipqueue) {
+        InterlockedExchange(&zipqueue->state, 1);
+        if (!xcreatethread(SVCBATCH_ZIP_THREAD,
+                           0, zipthread, NULL)) {
+            rv = xsyserror(GetLastError(), L"ZipThread", NULL);
+            goto finished;
+        }
+    }
+    if (logretain) {
+        InterlockedExchange(&logretain->state, 1);
+        if (!xcreatethread(SVCBATCH_RETAIN_THREAD,
+                           0, retainthread, NULL)) {
+            rv = xsyserror(GetLastError(), L"RetainThread", NULL);
+            goto finished;
+        }
+    }
+    if (svccontrol) {
+        rv = ctlcreatepipe();
+        if (rv) {
+            xsyserror(rv, L"ControlPipe", svccontrol->name);
+            goto finished;
+        }
+        if (!xcreatethread(SVCBATCH_CONTROL_THREAD,
+                           0, controlthread, NULL)) {
+            rv = xsyserror(GetLastError(), L"ControlThread", NULL);
+            goto finished;
+        }
+    }
     if (!xcreatethread(SVCBATCH_WORKER_THREAD,
                        0, workerthread, NULL)) {
         rv = xsyserror(GetLastError(), L"WorkerThread", NULL);
@@ -5891,11 +9969,24 @@ static void WINAPI servicemain(DWORD argc, LPWSTR *argv)
     SVCBATCH_CS_LEAVE(service);
     DBG_PRINTS("waiting for stop to finish");
     WaitForSingleObject(svcstopdone, cmdproc->timeout);
+    if (IS_VALID_HANDLE(threads[SVCBATCH_CONTROL_THREAD].thread))
+        WaitForSingleObject(threads[SVCBATCH_CONTROL_THREAD].thread, SVCBATCH_CTL_TIMEOUT);
+    if (IS_VALID_HANDLE(threads[SVCBATCH_ZIP_THREAD].thread)) {
+        InterlockedExchange(&zipqueue->state, 0);
+        SetEvent(zipqueue->event);
+        WaitForSingleObject(threads[SVCBATCH_ZIP_THREAD].thread, INFINITE);
+    }
+    if (IS_VALID_HANDLE(threads[SVCBATCH_RETAIN_THREAD].thread)) {
+        InterlockedExchange(&logretain->state, 0);
+        SetEvent(logretain->event);
+        WaitForSingleObject(threads[SVCBATCH_RETAIN_THREAD].thread, INFINITE);
+    }
     waitforthreads(SVCBATCH_STOP_STEP);
 
     DBG_PRINTS("closing");
 finished:
     closelogfile(outputlog);
+    closelogfile(errorlog);
     threadscleanup();
     xsvcstatus(SERVICE_STOPPED, rv);
     DBG_PRINTS("done");
@@ -90,6 +90,15 @@
 #define SHUTDOWN_APPNAME        SVCBATCH_PROGRAM_NAME " Shutdown"
 #define SVCBATCH_LOGNAME        CPP_WIDEN(SVCBATCH_PROGRAM_NAME) L".log"
 #define SVCBATCH_LOGSTOP        CPP_WIDEN(SVCBATCH_PROGRAM_NAME) L".stop.log"
+#define SVCBATCH_LOGERRS        CPP_WIDEN(SVCBATCH_PROGRAM_NAME) L".err.log"
+#define SVCBATCH_LOGCRASH       CPP_WIDEN(SVCBATCH_PROGRAM_NAME) L".crash"
+#define SVCBATCH_LOGINDEX       L".idx"
+#define SVCBATCH_LOGMANIFEST    L".manifest"
+#define SVCBATCH_LOGGZIP        L".gz"
+#define SVCBATCH_LOGGZTMP       L".gz.tmp"
+#define SVCBATCH_LOGSNAP        L".snap"
+#define SVCBATCH_STOPCRASH      CPP_WIDEN(SVCBATCH_PROGRAM_NAME) L".stop.crash"
+#define SVCBATCH_CTLPIPE        L"\\\\.\\pipe\\" CPP_WIDEN(SVCBATCH_PROGRAM_NAME) L"."
 #define SVCBATCH_LOGSDIR        L"Logs"
 #define SVCBATCH_MMAPPFX        L"Local\\mm-"
 
@@ -160,9 +169,169 @@
 #define SVCBATCH_NAME_MAX       256
 
 /**
- * Size of the pipe read buffer in bytes.
+ * Default size of the pipe read buffer in bytes.
+ * The size can be set by ReadBufferSize parameter
+ * within the [MIN, MAX] range.
  */
 #define SVCBATCH_PIPE_LEN       8192
+#define SVCBATCH_MIN_PIPE_LEN   512
+#define SVCBATCH_MAX_PIPE_LEN   1048576
+
+/**
+ * Default size of the pipe inbound buffer in bytes.
+ * The size can be set by PipeBufferSize parameter
+ * within the [MIN, MAX] range.
+ */
+#define SVCBATCH_PIPE_SIZ       65536
+#define SVCBATCH_MIN_PIPE_SIZ   4096
+#define SVCBATCH_MAX_PIPE_SIZ   4194304
+
+/**
+ * Number of consecutive full or nearly empty
+ * reads before adaptive read buffer
+ * is resized.
+ */
+#define SVCBATCH_PIPE_ADAPT     8
+
+/**
+ * Number of overlapped pipe reads
+ * kept in flight by the capture loop.
+ */
+#define SVCBATCH_PIPE_BUFS      4
+
+/**
+ * Maximum number of pipe buffers owned
+ * by the log writer queue.
+ * This value must be power of two.
+ */
+#define SVCBATCH_QUEUE_LEN      64
+
+/**
+ * Size of the log writer coalescing buffer in bytes.
+ * Data is flushed when the buffer is full or when
+ * LogFlushInterval milliseconds elapsed since the
+ * first byte was buffered.
+ */
+#define SVCBATCH_FLUSH_LEN      65536
+#define SVCBATCH_MAX_FLUSH_INT  60000
+
+/**
+ * Default flush interval in milliseconds
+ * for compressed logs.
+ */
+#define SVCBATCH_DEF_FLUSH_INT  2000
+
+/**
+ * Default and maximum periodic log
+ * sync interval in milliseconds.
+ */
+#define SVCBATCH_DEF_SYNC_INT   1000
+#define SVCBATCH_MAX_SYNC_INT   300000
+
+/**
+ * Log index file starts with the 8 byte magic,
+ * followed by the 24 byte records of the file time,
+ * zero based line number and byte offset of the line.
+ * Records are added every SVCBATCH_CFG_INDEX lines
+ * or at least once per second.
+ */
+#define SVCBATCH_INDEX_MAGIC    "SVCBIDX1"
+#define SVCBATCH_INDEX_BATCH    64
+#define SVCBATCH_MAX_INDEX      1000000
+
+/**
+ * Log retention limits.
+ * Files are removed at most SVCBATCH_RETAIN_RATE
+ * per second and the file age is checked at least
+ * every SVCBATCH_RETAIN_CHECK milliseconds.
+ */
+#define SVCBATCH_MAX_RETAIN_DAYS 3650
+#define SVCBATCH_RETAIN_RATE     10
+#define SVCBATCH_RETAIN_CHECK    600000
+#define SVCBATCH_RETAIN_BUFSIZ   16384
+
+/**
+ * Maximum number of the live log generations.
+ * The manifest is rewritten when it contains
+ * twice the number of the live generations.
+ */
+#define SVCBATCH_MAX_GENERATIONS 10000
+
+/**
+ * LogSnapshot copy buffer size and the number of
+ * copy passes made without holding the log lock.
+ * The lock is held once the remaining data is smaller
+ * than SVCBATCH_SNAP_TAIL. Block cloned ranges are
+ * aligned to SVCBATCH_SNAP_ALIGN.
+ */
+#define SVCBATCH_SNAP_BUFSIZ    1048576
+#define SVCBATCH_SNAP_PASSES    4
+#define SVCBATCH_SNAP_TAIL      65536
+#define SVCBATCH_SNAP_ALIGN     65536
+
+/**
+ * Control pipe buffer size and the maximum
+ * time in milliseconds to wait for the client
+ * command or for the command to finish.
+ * Only the local system and administrators
+ * can open the pipe.
+ */
+#define SVCBATCH_CTL_BUFSIZ     4096
+#define SVCBATCH_CTL_TIMEOUT    30000
+#define SVCBATCH_CTL_SDDL       L"D:P(A;;GA;;;SY)(A;;GA;;;BA)"
+
+/**
+ * Maximum number of the LogRotateTime
+ * schedule entries.
+ */
+#define SVCBATCH_MAX_SCHEDULE   32
+
+/**
+ * Maximum total length of the
+ * LogInclude or LogExclude patterns.
+ */
+#define SVCBATCH_MAX_FILTER     8192
+
+/**
+ * Default and maximum rate limit
+ * burst in seconds.
+ */
+#define SVCBATCH_DEF_BURST      5
+#define SVCBATCH_MAX_BURST      3600
+
+/**
+ * Crash ring size limits in bytes and the
+ * number of characters added to the event log.
+ * Ring size must be power of two.
+ */
+#define SVCBATCH_CRASH_LEN      65536
+#define SVCBATCH_MIN_CRASH      4096
+#define SVCBATCH_MAX_CRASH      1048576
+#define SVCBATCH_CRASH_TAIL     1024
+
+/**
+ * Default and maximum backpressure
+ * spill size in bytes.
+ */
+#define SVCBATCH_DEF_SPILL      16777216
+#define SVCBATCH_MAX_SPILL      268435456
+
+/**
+ * Mapped log segment size limits in bytes.
+ * The size is rounded up to the multiple
+ * of system allocation granularity.
+ */
+#define SVCBATCH_MIN_SEGMENT    65536
+#define SVCBATCH_MAX_SEGMENT    268435456
+
+/**
+ * Maximum input size of a single gzip member,
+ * hash table size and the maximum number of
+ * hash chain entries checked for each match.
+ */
+#define SVCBATCH_DEFLATE_LEN    32768
+#define SVCBATCH_DEFLATE_HSIZ   32768
+#define SVCBATCH_DEFLATE_CHAIN  16
 
 /**
  * Maximum number of characters in one line
@@ -204,6 +373,16 @@
  */
 #define SVCBATCH_MIN_ROTATE_SIZ 1000
 
+/**
+ * Maximum number of bytes written to the rotated
+ * log while waiting for the line or record boundary,
+ * and the time to wait for the boundary in milliseconds.
+ */
+#define SVCBATCH_DEF_CUT_SIZ    1048576
+#define SVCBATCH_MIN_CUT_SIZ    4096
+#define SVCBATCH_MAX_CUT_SIZ    268435456
+#define SVCBATCH_CUT_WAIT       5000
+
 /**
  * Minimum time between two log
  * rotations in minutes
@@ -229,6 +408,7 @@
 #define MS_IN_SECOND            CPP_INT64_C(1000)
 #define MS_IN_MINUTE            CPP_INT64_C(60000)
 #define MS_IN_HOUR              CPP_INT64_C(3600000)
+#define ONE_FTSECOND            CPP_INT64_C(10000000)
 #define ONE_MINUTE              CPP_INT64_C(600000000)
 #define ONE_HOUR                CPP_INT64_C(36000000000)
 #define ONE_DAY                 CPP_INT64_C(864000000000)
@@ -271,11 +451,47 @@
 #define SVCBATCH_OPT_ROTATE_BY_SIG  0x00001000   /* Rotate by signal            */
 #define SVCBATCH_OPT_ROTATE_BY_SIZE 0x00002000   /* Rotate by size              */
 #define SVCBATCH_OPT_ROTATE_BY_TIME 0x00004000   /* Rotate by time              */
+#define SVCBATCH_OPT_TIMESTAMP      0x00010000   /* Prefix log lines with time  */
+#define SVCBATCH_OPT_COMPRESS       0x00020000   /* Write gzip compressed logs  */
+#define SVCBATCH_OPT_MAPPED         0x00040000   /* Write logs using file views */
+#define SVCBATCH_OPT_JSONLINES      0x00080000   /* Write logs as JSON records  */
 
 #define SVCBATCH_FAIL_NONE      0   /* Do not set error if run ends without stop        */
 #define SVCBATCH_FAIL_ERROR     1   /* Set service error if run endeded without stop    */
 #define SVCBATCH_FAIL_EXIT      2   /* Call exit() on stop without scm CTRL_STOP        */
 
+#define SVCBATCH_STDERR_SHARED  0   /* Stdout and stderr share the same pipe            */
+#define SVCBATCH_STDERR_TAGGED  1   /* Separate pipes, tagged lines in the same log     */
+#define SVCBATCH_STDERR_SPLIT   2   /* Separate pipes, stderr has its own log file      */
+
+#define SVCBATCH_SYNC_NONE      0   /* Leave flushing to the system cache manager       */
+#define SVCBATCH_SYNC_PERIODIC  1   /* Flush by interval or written bytes               */
+#define SVCBATCH_SYNC_WRITE     2   /* Open log files in write-through mode             */
+
+#define SVCBATCH_CUT_NONE       0   /* Rotate at any byte                               */
+#define SVCBATCH_CUT_LINE       1   /* Rotate after the end of line                     */
+#define SVCBATCH_CUT_BLANK      2   /* Rotate after the empty line                      */
+#define SVCBATCH_CUT_RECORD     3   /* Rotate before the line starting with the prefix  */
+
+#define SVCBATCH_BACKPRESSURE_BLOCK 0   /* Wait for the writer to catch up          */
+#define SVCBATCH_BACKPRESSURE_DROP  1   /* Discard the data that cannot be queued   */
+#define SVCBATCH_BACKPRESSURE_SPILL 2   /* Queue the data in memory up to the limit */
+
+#define SVCBATCH_STDOUT_STREAM  1
+#define SVCBATCH_STDERR_STREAM  2
+#define SVCBATCH_STREAM_TAGLEN  6
+
+/**
+ * Length of the log line timestamp prefix
+ * YYYY-MM-DD HH:MM:SS.sss followed by space
+ */
+#define SVCBATCH_TIMESTAMP_LEN  24
+
+#define SVCBATCH_EOL_NONE       0   /* Partial line, continued by the next span         */
+#define SVCBATCH_EOL_LF         1   /* Line terminated by LF                            */
+#define SVCBATCH_EOL_CRLF       2   /* Line terminated by CRLF                          */
+#define SVCBATCH_EOL_SPLIT      3   /* Line split at SVCBATCH_LINE_MAX characters       */
+
 
 /**
  * Helper macros
@@ -0,0 +1,2290 @@
+/**
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _SVCUTIL_H_INCLUDED_
+#define _SVCUTIL_H_INCLUDED_
+
+/**
+ * Self contained building blocks of the capture path.
+ *
+ * The code here does not call into the rest of svcbatch.c,
+ * so the unit tests in test/unittest can build it on Linux.
+ * The including file provides the Win32 types and the
+ * xmmalloc, xmcalloc and xfree allocators.
+ */
+
+#if !defined(HAVE_AVX2_INTRIN)
+# if defined(__AVX2__)
+#  define HAVE_AVX2_INTRIN      1
+# else
+#  define HAVE_AVX2_INTRIN      0
+# endif
+#endif
+#if !defined(HAVE_SSE2_INTRIN)
+# if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#  define HAVE_SSE2_INTRIN      1
+# else
+#  define HAVE_SSE2_INTRIN      0
+# endif
+#endif
+
+#if HAVE_AVX2_INTRIN
+#include <immintrin.h>
+#elif HAVE_SSE2_INTRIN
+#include <emmintrin.h>
+#endif
+
+/**
+ * Ring of overlapped reads kept in flight.
+ * The reads can complete in any order, but their
+ * data is consumed in the order they were issued.
+ * The result callback returns zero for the completed
+ * read, ERROR_IO_INCOMPLETE if the read is pending,
+ * or the error that failed it.
+ */
+typedef DWORD (*LPSVCBATCH_RINGFN)(LPVOID, DWORD);
+
+typedef struct _SVCBATCH_RING {
+    DWORD                   head;
+    DWORD                   size;
+    LPVOID                  ctx;
+    LPSVCBATCH_RINGFN       result;
+    LPSVCBATCH_RINGFN       consume;
+    LPSVCBATCH_RINGFN       issue;
+} SVCBATCH_RING, *LPSVCBATCH_RING;
+
+static void xringinit(LPSVCBATCH_RING r, DWORD size, LPVOID ctx,
+                      LPSVCBATCH_RINGFN result, LPSVCBATCH_RINGFN consume,
+                      LPSVCBATCH_RINGFN issue)
+{
+    r->head    = 0;
+    r->size    = size;
+    r->ctx     = ctx;
+    r->result  = result;
+    r->consume = consume;
+    r->issue   = issue;
+}
+
+/**
+ * Consume the reads that completed after the ring
+ * head, in the issue order, up to the first read that
+ * is still pending or failed.
+ * Used before the pending reads are canceled, so
+ * that the data already read is not lost.
+ * Returns the number of consumed reads.
+ */
+static DWORD xringdrain(LPSVCBATCH_RING r)
+{
+    DWORD i;
+    DWORD n = 0;
+
+    for (i = 1; i < r->size; i++) {
+        DWORD s = (r->head + i) % r->size;
+
+        if ((*r->result)(r->ctx, s))
+            break;
+        n++;
+        if ((*r->consume)(r->ctx, s))
+            break;
+    }
+    return n;
+}
+
+/**
+ * Consume the completed reads and issue each of
+ * them again, until the read at the ring head
+ * is pending. Returns zero if the head is pending.
+ */
+static DWORD xringrun(LPSVCBATCH_RING r)
+{
+    DWORD rc;
+
+    for (;;) {
+        rc = (*r->result)(r->ctx, r->head);
+        if (rc == ERROR_IO_INCOMPLETE)
+            return 0;
+        if (rc)
+            return rc;
+        rc = (*r->consume)(r->ctx, r->head);
+        if (rc)
+            return rc;
+        rc = (*r->issue)(r->ctx, r->head);
+        if (rc) {
+            xringdrain(r);
+            return rc;
+        }
+        r->head = (r->head + 1) % r->size;
+    }
+}
+
+/**
+ * Single producer, single consumer queue.
+ * The head is only modified by the consumer
+ * and the tail only by the producer.
+ */
+typedef struct _SVCBATCH_QUEUE {
+    volatile LONG           head;
+    volatile LONG           tail;
+    volatile LONG           state;
+    volatile LONG           error;
+    LONG                    mask;
+    HANDLE                  event;
+    LPVOID                 *data;
+} SVCBATCH_QUEUE, *LPSVCBATCH_QUEUE;
+
+static LPSVCBATCH_QUEUE xqueueinit(LONG size)
+{
+    LPSVCBATCH_QUEUE q;
+
+    q = (LPSVCBATCH_QUEUE)xmcalloc(sizeof(SVCBATCH_QUEUE));
+    q->event = CreateEventEx(NULL, NULL, 0,
+                             EVENT_MODIFY_STATE | SYNCHRONIZE);
+    if (IS_INVALID_HANDLE(q->event)) {
+        xfree(q);
+        return NULL;
+    }
+    q->mask = size - 1;
+    q->data = (LPVOID *)xmcalloc(size * sizeof(LPVOID));
+    return q;
+}
+
+static void xqueuefree(LPSVCBATCH_QUEUE q)
+{
+    if (q == NULL)
+        return;
+    SAFE_CLOSE_HANDLE(q->event);
+    xfree(q->data);
+    xfree(q);
+}
+
+/**
+ * The head and tail counters run freely and
+ * wrap around at 2^32. Their difference is the
+ * number of queued items even after the wrap.
+ */
+static BOOL xqueuepush(LPSVCBATCH_QUEUE q, LPVOID p)
+{
+    LONG t = q->tail;
+    LONG h = InterlockedCompareExchange(&q->head, 0, 0);
+
+    if (((DWORD)t - (DWORD)h) > (DWORD)q->mask)
+        return FALSE;
+    q->data[t & q->mask] = p;
+    /**
+     * Publish the slot before moving the tail
+     */
+    InterlockedExchange(&q->tail, (LONG)((DWORD)t + 1));
+    SetEvent(q->event);
+    return TRUE;
+}
+
+static LPVOID xqueuepop(LPSVCBATCH_QUEUE q)
+{
+    LPVOID p;
+    LONG   h = q->head;
+
+    if (h == InterlockedCompareExchange(&q->tail, 0, 0))
+        return NULL;
+    p = q->data[h & q->mask];
+    InterlockedExchange(&q->head, (LONG)((DWORD)h + 1));
+    return p;
+}
+
+/**
+ * Write coalescing.
+ * Small chunks are gathered in the buffer and written
+ * together when the buffer fills up, or when the oldest
+ * pending chunk reaches the flush deadline.
+ * Chunks of at least half the buffer size are written
+ * directly, after the data that is already pending.
+ */
+typedef DWORD (*LPSVCBATCH_WRITEFN)(LPVOID, LPBYTE, DWORD);
+
+typedef struct _SVCBATCH_COALESCE {
+    LPBYTE                  data;
+    DWORD                   size;
+    DWORD                   len;
+    ULONGLONG               first;
+    ULONGLONG               latency;
+    ULONGLONG               chunks;
+    ULONGLONG               writes;
+    LPSVCBATCH_WRITEFN      write;
+    LPVOID                  ctx;
+} SVCBATCH_COALESCE, *LPSVCBATCH_COALESCE;
+
+static void xcoalesceinit(LPSVCBATCH_COALESCE c, DWORD size,
+                          LPSVCBATCH_WRITEFN wr, LPVOID ctx)
+{
+    c->data    = (LPBYTE)xmmalloc(size);
+    c->size    = size;
+    c->len     = 0;
+    c->first   = 0;
+    c->latency = 0;
+    c->chunks  = 0;
+    c->writes  = 0;
+    c->write   = wr;
+    c->ctx     = ctx;
+}
+
+/**
+ * Write the pending data.
+ * The buffer is emptied even if the write fails.
+ */
+static DWORD xcoalesceflush(LPSVCBATCH_COALESCE c, ULONGLONG t)
+{
+    DWORD rc;
+
+    if (c->len == 0)
+        return 0;
+    rc = (*c->write)(c->ctx, c->data, c->len);
+    if ((t - c->first) > c->latency)
+        c->latency = t - c->first;
+    c->writes++;
+    c->len = 0;
+    return rc;
+}
+
+/**
+ * Reserve len bytes at the end of the pending data.
+ * The pending data is written first if there is no room.
+ * The len must not be larger then the buffer size.
+ */
+static LPBYTE xcoalescereserve(LPSVCBATCH_COALESCE c, DWORD len,
+                               ULONGLONG t, LPDWORD rc)
+{
+    LPBYTE p;
+
+    *rc = 0;
+    if ((c->len + len) > c->size) {
+        *rc = xcoalesceflush(c, t);
+        if (*rc)
+            return NULL;
+    }
+    if (c->len == 0)
+        c->first = t;
+    p = c->data + c->len;
+    c->len += len;
+    return p;
+}
+
+static DWORD xcoalesce(LPSVCBATCH_COALESCE c, LPBYTE buf, DWORD len, ULONGLONG t)
+{
+    DWORD  rc;
+    LPBYTE p;
+
+    c->chunks++;
+    if (len >= (c->size / 2)) {
+        rc = xcoalesceflush(c, t);
+        if (rc)
+            return rc;
+        c->writes++;
+        return (*c->write)(c->ctx, buf, len);
+    }
+    p = xcoalescereserve(c, len, t, &rc);
+    if (p == NULL)
+        return rc;
+    memcpy(p, buf, len);
+    if (c->len == c->size)
+        rc = xcoalesceflush(c, t);
+    return rc;
+}
+
+/**
+ * Write the pending data if the oldest chunk reached
+ * the deadline of interval milliseconds.
+ * Otherwise lower the wait to the time left.
+ */
+static DWORD xcoalescedue(LPSVCBATCH_COALESCE c, ULONGLONG interval,
+                          ULONGLONG t, LPDWORD wait)
+{
+    ULONGLONG ms;
+
+    if ((c->len == 0) || (interval == 0))
+        return 0;
+    ms = t - c->first;
+    if (ms >= interval)
+        return xcoalesceflush(c, t);
+    ms = interval - ms;
+    if (ms < *wait)
+        *wait = (DWORD)ms;
+    return 0;
+}
+
+/**
+ * LogSync group commit.
+ * The writers add the written bytes and wake up the
+ * sync thread when the total reaches the size.
+ * The sync thread starts each flush by clearing the
+ * total and records the flush latency when done.
+ */
+typedef struct _SVCBATCH_SYNC {
+    volatile LONG           bytes;
+    LONG                    size;
+    ULONGLONG               flushes;
+    ULONGLONG               total;
+    ULONGLONG               max;
+} SVCBATCH_SYNC, *LPSVCBATCH_SYNC;
+
+static void xsyncinit(LPSVCBATCH_SYNC s, LONG size)
+{
+    s->bytes   = 0;
+    s->size    = size;
+    s->flushes = 0;
+    s->total   = 0;
+    s->max     = 0;
+}
+
+/**
+ * Returns TRUE only for the write that made
+ * the total reach the size, so that the writes
+ * done while the flush is pending do not signal
+ * the sync thread again.
+ */
+static BOOL xsyncadd(LPSVCBATCH_SYNC s, DWORD len)
+{
+    LONG n;
+
+    if (s->size == 0)
+        return FALSE;
+    n = InterlockedAdd(&s->bytes, (LONG)len);
+    return (n >= s->size) && ((n - (LONG)len) < s->size);
+}
+
+static __inline void xsyncstart(LPSVCBATCH_SYNC s)
+{
+    InterlockedExchange(&s->bytes, 0);
+}
+
+static void xsyncdone(LPSVCBATCH_SYNC s, ULONGLONG us)
+{
+    s->flushes++;
+    s->total += us;
+    if (us > s->max)
+        s->max = us;
+}
+
+/**
+ * Mapped log file segments.
+ * The map callback replaces the view with the segment
+ * at the file offset base, extending the file to the
+ * segment end. The view is NULL if the map fails.
+ * The optional flush callback is called for each
+ * chunk copied to the view.
+ */
+typedef DWORD (*LPSVCBATCH_MAPFN)(LPVOID, LONGLONG, LPBYTE *);
+
+typedef struct _SVCBATCH_SEGMENT {
+    LPBYTE                  view;
+    LONGLONG                base;
+    DWORD                   size;
+    LPSVCBATCH_MAPFN        map;
+    LPSVCBATCH_WRITEFN      flush;
+} SVCBATCH_SEGMENT, *LPSVCBATCH_SEGMENT;
+
+static void xsegmentinit(LPSVCBATCH_SEGMENT sg, DWORD size,
+                         LPSVCBATCH_MAPFN map, LPSVCBATCH_WRITEFN flush)
+{
+    sg->view  = NULL;
+    sg->base  = 0;
+    sg->size  = size;
+    sg->map   = map;
+    sg->flush = flush;
+}
+
+static DWORD xsegmentmap(LPSVCBATCH_SEGMENT sg, LPVOID ctx, LONGLONG base)
+{
+    sg->base = base;
+    return (*sg->map)(ctx, base, &sg->view);
+}
+
+/**
+ * Copy the data after the *pos bytes already written
+ * and map the next segment when the view is full.
+ * The *pos is updated after each copied chunk.
+ */
+static DWORD xsegmentwrite(LPSVCBATCH_SEGMENT sg, LPVOID ctx, volatile LONGLONG *pos,
+                           const BYTE *buf, DWORD len)
+{
+    DWORD    rc;
+    DWORD    n;
+    LONGLONG x;
+
+    while (len) {
+        x = *pos - sg->base;
+        if (x >= sg->size) {
+            rc = xsegmentmap(sg, ctx, sg->base + sg->size);
+            if (rc)
+                return rc;
+            x = 0;
+        }
+        n = sg->size - (DWORD)x;
+        if (n > len)
+            n = len;
+        memcpy(sg->view + x, buf, n);
+        if (sg->flush)
+            (*sg->flush)(ctx, sg->view + x, n);
+        InterlockedAdd64(pos, n);
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Line span produced by the line framer.
+ * The data points inside the pipe buffer and
+ * does not include the line terminator.
+ */
+typedef struct _SVCBATCH_LINE {
+    LPBYTE                  data;
+    DWORD                   len;
+    DWORD                   eol;
+    BOOL                    sol;
+} SVCBATCH_LINE, *LPSVCBATCH_LINE;
+
+typedef struct _SVCBATCH_FRAMER {
+    LPBYTE                  pos;
+    LPBYTE                  end;
+    DWORD                   line;
+    BOOL                    cr;
+} SVCBATCH_FRAMER, *LPSVCBATCH_FRAMER;
+
+/**
+ * Find the first LF character in the [s, e) range
+ */
+static LPBYTE xmemlf(LPBYTE s, LPBYTE e)
+{
+    DWORD m;
+    DWORD i;
+
+#if HAVE_AVX2_INTRIN
+    if ((e - s) >= 32) {
+        const __m256i lf = _mm256_set1_epi8('\n');
+
+        while ((e - s) >= 32) {
+            m = (DWORD)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)s), lf));
+            if (m) {
+                BitScanForward(&i, m);
+                return s + i;
+            }
+            s += 32;
+        }
+    }
+#endif
+#if HAVE_SSE2_INTRIN
+    if ((e - s) >= 16) {
+        const __m128i lf = _mm_set1_epi8('\n');
+
+        while ((e - s) >= 16) {
+            m = (DWORD)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)s), lf));
+            if (m) {
+                BitScanForward(&i, m);
+                return s + i;
+            }
+            s += 16;
+        }
+    }
+#endif
+    for (i = 0, m = (DWORD)(e - s); i < m; i++) {
+        if (s[i] == '\n')
+            return s + i;
+    }
+    return NULL;
+}
+
+static BYTE xframercr[] = { 13, 0 };
+
+static void xframerinit(LPSVCBATCH_FRAMER f)
+{
+    f->pos  = NULL;
+    f->end  = NULL;
+    f->line = 0;
+    f->cr   = FALSE;
+}
+
+static __inline BOOL xframerpartial(LPSVCBATCH_FRAMER f)
+{
+    return (f->line || f->cr);
+}
+
+static __inline void xframerfeed(LPSVCBATCH_FRAMER f, LPBYTE buf, DWORD len)
+{
+    f->pos = buf;
+    f->end = buf + len;
+}
+
+/**
+ * Return the next line span from the data
+ * passed to xframerfeed.
+ *
+ * The line state is kept across calls, so the
+ * spans of a line that spans multiple reads have
+ * the sol flag set only for the first one.
+ * Lines longer than SVCBATCH_LINE_MAX are split.
+ * A line of exactly SVCBATCH_LINE_MAX characters
+ * keeps its line terminator, no matter how the
+ * data is divided between the reads.
+ */
+static BOOL xframernext(LPSVCBATCH_FRAMER f, LPSVCBATCH_LINE ln)
+{
+    LPBYTE e;
+    LPBYTE x;
+    DWORD  m;
+    DWORD  n;
+
+    if (f->pos >= f->end)
+        return FALSE;
+    ln->sol = f->line == 0;
+    if (f->cr) {
+        /**
+         * The previous data ended with CR
+         */
+        ln->data = f->pos;
+        ln->len  = 0;
+        if (*f->pos == '\n') {
+            ln->eol  = SVCBATCH_EOL_CRLF;
+            f->cr    = FALSE;
+            f->line  = 0;
+            f->pos++;
+        }
+        else if (f->line >= SVCBATCH_LINE_MAX) {
+            /**
+             * No room left for the CR.
+             * It starts the next line
+             */
+            ln->eol  = SVCBATCH_EOL_SPLIT;
+            f->line  = 0;
+        }
+        else {
+            ln->data = xframercr;
+            ln->len  = 1;
+            ln->eol  = SVCBATCH_EOL_NONE;
+            f->cr    = FALSE;
+            f->line++;
+        }
+        return TRUE;
+    }
+    /**
+     * Room left in the current line, and the
+     * search range that also covers the CRLF
+     * right after a full line
+     */
+    n = SVCBATCH_LINE_MAX - f->line;
+    m = (DWORD)(f->end - f->pos);
+    e = f->end;
+    if (m > (n + 2))
+        e = f->pos + n + 2;
+    x = xmemlf(f->pos, e);
+    ln->data = f->pos;
+    if (x != NULL) {
+        DWORD k = (DWORD)(x - f->pos);
+
+        ln->eol = SVCBATCH_EOL_LF;
+        if (k && (x[-1] == '\r')) {
+            ln->eol = SVCBATCH_EOL_CRLF;
+            k--;
+        }
+        if (k <= n) {
+            ln->len = k;
+            f->line = 0;
+            f->pos  = x + 1;
+            return TRUE;
+        }
+    }
+    if ((m <= n) || ((m == (n + 1)) && (f->end[-1] == '\r'))) {
+        /**
+         * The rest of the data fits in the line
+         */
+        f->pos = f->end;
+        if (f->end[-1] == '\r') {
+            /**
+             * Keep the CR until the next data
+             * tells if it is a part of CRLF
+             */
+            f->cr = TRUE;
+            m--;
+            if (m == 0)
+                return FALSE;
+        }
+        ln->len  = m;
+        ln->eol  = SVCBATCH_EOL_NONE;
+        f->line += m;
+        return TRUE;
+    }
+    ln->len = n;
+    ln->eol = SVCBATCH_EOL_SPLIT;
+    f->line = 0;
+    f->pos += n;
+    return TRUE;
+}
+
+/**
+ * Crash ring of the most recent output.
+ * The size is a power of two and the used counter
+ * runs freely, so the write position is the used
+ * counter modulo the size.
+ */
+typedef struct _SVCBATCH_CRASH {
+    LPBYTE                  data;
+    DWORD                   size;
+    ULONGLONG               used;
+} SVCBATCH_CRASH, *LPSVCBATCH_CRASH;
+
+/**
+ * Only the last size bytes of the chunk are kept,
+ * with at most two memcpy calls. The used counter
+ * includes the skipped bytes.
+ */
+static void xcrashput(LPSVCBATCH_CRASH c, LPBYTE buf, DWORD len)
+{
+    DWORD x;
+    DWORD n;
+
+    if (len > c->size) {
+        c->used += len - c->size;
+        buf     += len - c->size;
+        len  = c->size;
+    }
+    x = (DWORD)(c->used & (c->size - 1));
+    n = c->size - x;
+    if (n > len)
+        n = len;
+    memcpy(c->data + x, buf, n);
+    if (n < len)
+        memcpy(c->data, buf + n, len - n);
+    c->used += len;
+}
+
+/**
+ * Copy the ring content in the write order to b,
+ * which must have room for the ring size.
+ * Returns the number of bytes copied.
+ */
+static DWORD xcrashget(LPSVCBATCH_CRASH c, LPBYTE b)
+{
+    DWORD n;
+    DWORD x;
+    DWORD m;
+
+    n = c->used < c->size ? (DWORD)c->used : c->size;
+    x = (DWORD)((c->used - n) & (c->size - 1));
+    m = c->size - x;
+    if (m > n)
+        m = n;
+    memcpy(b, c->data + x, m);
+    if (m < n)
+        memcpy(b + m, c->data, n - m);
+    return n;
+}
+
+/**
+ * Find the start of the last max bytes of the data.
+ * The start is moved to the next line if there is
+ * one, so that the tail does not begin inside a line.
+ */
+static LPBYTE xcrashtail(LPBYTE b, DWORD n, DWORD max)
+{
+    LPBYTE e = b + n;
+    LPBYTE t;
+    LPBYTE p;
+
+    if (n <= max)
+        return b;
+    t = e - max;
+    p = xmemlf(t, e);
+    if ((p != NULL) && (++p < e))
+        t = p;
+    return t;
+}
+
+/**
+ * LogIndex record.
+ * The .idx file starts with SVCBATCH_INDEX_MAGIC
+ * followed by the records in the native layout.
+ */
+typedef struct _SVCBATCH_INDEX {
+    ULONGLONG               time;
+    ULONGLONG               line;
+    ULONGLONG               offset;
+} SVCBATCH_INDEX, *LPSVCBATCH_INDEX;
+
+typedef DWORD (*LPSVCBATCH_INDEXFN)(LPVOID, LPSVCBATCH_INDEX, DWORD);
+
+typedef struct _SVCBATCH_INDEXER {
+    ULONGLONG               lines;
+    ULONGLONG               iline;
+    ULONGLONG               itime;
+    DWORD                   every;
+    LPSVCBATCH_INDEXFN      write;
+} SVCBATCH_INDEXER, *LPSVCBATCH_INDEXER;
+
+static void xindexreset(LPSVCBATCH_INDEXER x)
+{
+    x->lines = 0;
+    x->iline = 0;
+    x->itime = 0;
+}
+
+static void xindexinit(LPSVCBATCH_INDEXER x, DWORD every, LPSVCBATCH_INDEXFN write)
+{
+    xindexreset(x);
+    x->every = every;
+    x->write = write;
+}
+
+/**
+ * Add index records for the lines that start
+ * inside the data written at the offset off.
+ * The first line, and the first line after every
+ * lines or after a second are indexed.
+ * The records are written in batches.
+ */
+static DWORD xindexdata(LPSVCBATCH_INDEXER x, LPVOID ctx, BOOL sol,
+                        ULONGLONG t, LONGLONG off, LPBYTE buf, DWORD len)
+{
+    SVCBATCH_INDEX ir[SVCBATCH_INDEX_BATCH];
+    LPBYTE s = buf;
+    LPBYTE e = buf + len;
+    LPBYTE p;
+    DWORD  n  = 0;
+    DWORD  rc = 0;
+
+    p = sol ? s : NULL;
+    for (;;) {
+        if (p != NULL) {
+            if (((x->lines - x->iline) >= x->every) ||
+                ((t - x->itime) >= ONE_FTSECOND) || (x->lines == 0)) {
+                ir[n].time   = t;
+                ir[n].line   = x->lines;
+                ir[n].offset = off + (p - buf);
+                x->iline     = x->lines;
+                x->itime     = t;
+                if (++n == SVCBATCH_INDEX_BATCH) {
+                    rc = (*x->write)(ctx, ir, n);
+                    if (rc)
+                        return rc;
+                    n = 0;
+                }
+            }
+        }
+        p = xmemlf(s, e);
+        if (p == NULL)
+            break;
+        x->lines++;
+        s = p + 1;
+        p = s < e ? s : NULL;
+    }
+    if (n)
+        rc = (*x->write)(ctx, ir, n);
+    return rc;
+}
+
+/**
+ * LogGenerations list.
+ * The generations from first to last are live
+ * and the manifest has lines records.
+ */
+typedef struct _SVCBATCH_GENLIST {
+    ULONGLONG               first;
+    ULONGLONG               last;
+    DWORD                   lines;
+} SVCBATCH_GENLIST, *LPSVCBATCH_GENLIST;
+
+/**
+ * Find the live generations in the manifest data.
+ * Generations are listed in increasing order, so the
+ * records that are not above the last one are skipped.
+ */
+static void xgenparse(LPSVCBATCH_GENLIST gl, LPBYTE b, DWORD len)
+{
+    LPBYTE    p = b;
+    LPBYTE    e = b + len;
+    ULONGLONG g;
+
+    while (p < e) {
+        for (g = 0; (p < e) && (*p >= '0') && (*p <= '9'); p++)
+            g = g * 10 + (*p - '0');
+        if (g > gl->last) {
+            if (gl->first == 0)
+                gl->first = g;
+            gl->last = g;
+            gl->lines++;
+        }
+        p = xmemlf(p, e);
+        if (p == NULL)
+            break;
+        p++;
+    }
+}
+
+/**
+ * Make the next generation live.
+ * Returns the first generation to remove.
+ * The generations from there up to the new first
+ * one are above the limit.
+ */
+static ULONGLONG xgennext(LPSVCBATCH_GENLIST gl, DWORD max)
+{
+    ULONGLONG f;
+
+    gl->last++;
+    if (gl->first == 0)
+        gl->first = gl->last;
+    f = gl->first;
+    while ((gl->last - gl->first) >= max)
+        gl->first++;
+    return f;
+}
+
+/**
+ * Format the manifest record of the generation g,
+ * "g name.g" followed by CRLF, into b of size s.
+ * Returns the record length or zero if it does not fit.
+ */
+static int xgenrecord(LPSTR b, int s, LPCSTR name, ULONGLONG g)
+{
+    char  d[24];
+    int   n = 0;
+    int   i = 0;
+    int   k;
+    DWORD x;
+
+    do {
+        d[i++] = (char)('0' + g % 10);
+        g /= 10;
+    } while (g);
+    x = (DWORD)strlen(name);
+    if ((i * 2 + x + 4) >= (DWORD)s)
+        return 0;
+    for (k = i; k > 0; k--)
+        b[n++] = d[k - 1];
+    b[n++] = ' ';
+    memcpy(b + n, name, x);
+    n += x;
+    b[n++] = '.';
+    for (k = i; k > 0; k--)
+        b[n++] = d[k - 1];
+    b[n++] = '\r';
+    b[n++] = '\n';
+    b[n]   = 0;
+    return n;
+}
+
+/**
+ * Format the records of the last generation,
+ * or of all live generations if compact is set.
+ * Returns the data length.
+ */
+static int xgenformat(LPSVCBATCH_GENLIST gl, LPCSTR name, BOOL compact,
+                      LPSTR b, int s)
+{
+    ULONGLONG i;
+    int       n = 0;
+
+    i = compact ? gl->first : gl->last;
+    if (compact)
+        gl->lines = 0;
+    for (; i <= gl->last; i++, gl->lines++)
+        n += xgenrecord(b + n, s - n, name, i);
+    return n;
+}
+
+/**
+ * Data read from the pipe.
+ * The next pointer links the buffers
+ * in the spill list.
+ */
+typedef struct _SVCBATCH_BUFFER {
+    struct _SVCBATCH_BUFFER *next;
+    DWORD                   size;
+    DWORD                   len;
+    DWORD                   stream;
+    DWORD                   lost;
+    ULONGLONG               lostbytes;
+    ULONGLONG               time;
+    LPBYTE                  data;
+} SVCBATCH_BUFFER, *LPSVCBATCH_BUFFER;
+
+/**
+ * Log queue backpressure.
+ * The buffer callback returns a free buffer, or NULL
+ * if the writer owns all of them. With SVCBATCH_BUFFER_WAIT
+ * it waits for the writer to give one back, and with
+ * SVCBATCH_BUFFER_SPILL it allocates a new one.
+ */
+#define SVCBATCH_BUFFER_FREE    0
+#define SVCBATCH_BUFFER_WAIT    1
+#define SVCBATCH_BUFFER_SPILL   2
+
+typedef LPSVCBATCH_BUFFER (*LPSVCBATCH_BUFFERFN)(LPVOID, DWORD);
+
+typedef struct _SVCBATCH_SPILL {
+    LPSVCBATCH_QUEUE        queue;
+    DWORD                   policy;
+    DWORD                   max;
+    DWORD                   size;
+    LPSVCBATCH_BUFFER       head;
+    LPSVCBATCH_BUFFER       tail;
+    DWORD                   lines;
+    ULONGLONG               bytes;
+    DWORD                   dlines;
+    ULONGLONG               dbytes;
+    LPSVCBATCH_BUFFERFN     buffer;
+    LPVOID                  ctx;
+} SVCBATCH_SPILL, *LPSVCBATCH_SPILL;
+
+static void xspillinit(LPSVCBATCH_SPILL s, LPSVCBATCH_QUEUE q, DWORD policy,
+                       DWORD max, LPSVCBATCH_BUFFERFN fn, LPVOID ctx)
+{
+    s->queue  = q;
+    s->policy = policy;
+    s->max    = max;
+    s->size   = 0;
+    s->head   = NULL;
+    s->tail   = NULL;
+    s->lines  = 0;
+    s->bytes  = 0;
+    s->dlines = 0;
+    s->dbytes = 0;
+    s->buffer = fn;
+    s->ctx    = ctx;
+}
+
+/**
+ * Move the spilled buffers to the queue.
+ * Returns FALSE if the queue got full.
+ */
+static BOOL xspilldrain(LPSVCBATCH_SPILL s)
+{
+    while (s->head != NULL) {
+        LPSVCBATCH_BUFFER b = s->head;
+
+        if (!xqueuepush(s->queue, b))
+            return FALSE;
+        s->head  = b->next;
+        s->size -= b->size;
+        b->next  = NULL;
+    }
+    s->tail = NULL;
+    return TRUE;
+}
+
+static void xspillfree(LPSVCBATCH_SPILL s)
+{
+    while (s->head != NULL) {
+        LPSVCBATCH_BUFFER b = s->head;
+
+        s->head = b->next;
+        xfree(b);
+    }
+    s->tail = NULL;
+    s->size = 0;
+}
+
+/**
+ * Count the discarded data. The total is reported
+ * with the next buffer that makes it to the queue.
+ */
+static void xspilldrop(LPSVCBATCH_SPILL s, LPSVCBATCH_BUFFER b)
+{
+    LPBYTE p = b->data;
+    LPBYTE e = b->data + b->len;
+
+    while ((p = xmemlf(p, e)) != NULL) {
+        s->lines++;
+        p++;
+    }
+    s->bytes  += b->len;
+    s->dbytes += b->len;
+}
+
+/**
+ * Queue the filled buffer *pb and replace it with the
+ * buffer for the next read of next bytes.
+ *
+ * SVCBATCH_BACKPRESSURE_BLOCK waits for a free buffer.
+ * SVCBATCH_BACKPRESSURE_DROP discards the data and reuses
+ * the buffer if there is no free one.
+ * SVCBATCH_BACKPRESSURE_SPILL keeps the buffers in the spill
+ * list until the queue has room, as long as both the current
+ * and the next buffer fit into the max total.
+ */
+static DWORD xspillpush(LPSVCBATCH_SPILL s, LPSVCBATCH_BUFFER *pb, DWORD next)
+{
+    LPSVCBATCH_BUFFER b;
+    LPSVCBATCH_BUFFER n = *pb;
+
+    if (s->policy == SVCBATCH_BACKPRESSURE_BLOCK) {
+        if (!xqueuepush(s->queue, n))
+            return ERROR_BUFFER_OVERFLOW;
+        *pb = (*s->buffer)(s->ctx, SVCBATCH_BUFFER_WAIT);
+        return 0;
+    }
+    b = (*s->buffer)(s->ctx, SVCBATCH_BUFFER_FREE);
+    if ((b == NULL) && (s->policy == SVCBATCH_BACKPRESSURE_SPILL)) {
+        if ((s->size + n->size + next) <= s->max)
+            b = (*s->buffer)(s->ctx, SVCBATCH_BUFFER_SPILL);
+    }
+    if (b == NULL) {
+        /**
+         * Writer is behind and there is no room
+         * left. Discard the data and reuse the buffer
+         */
+        xspilldrop(s, n);
+        return 0;
+    }
+    if (s->bytes) {
+        n->lost      = s->lines;
+        n->lostbytes = s->bytes;
+        s->dlines   += s->lines;
+        s->lines     = 0;
+        s->bytes     = 0;
+    }
+    if (!xspilldrain(s) || !xqueuepush(s->queue, n)) {
+        n->next = NULL;
+        if (s->tail)
+            s->tail->next = n;
+        else
+            s->head = n;
+        s->tail  = n;
+        s->size += n->size;
+    }
+    *pb = b;
+    return 0;
+}
+
+typedef struct _SVCBATCH_DEFLATE {
+    LPBYTE                  data;
+    DWORD                   size;
+    DWORD                   len;
+    DWORD                   bits;
+    int                     nbits;
+    int                    *head;
+    int                    *prev;
+} SVCBATCH_DEFLATE, *LPSVCBATCH_DEFLATE;
+
+/**
+ * Gzip stream compressor.
+ *
+ * Each block of the log data is written as a complete
+ * gzip member using the fixed Huffman deflate codes.
+ * Concatenated members form a valid gzip file, so
+ * every block that reached the disk can be decoded
+ * even if the service terminates unexpectedly.
+ */
+static const WORD xzlbase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const BYTE xzlext[29]  = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const WORD xzdbase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+static const BYTE xzdext[30]  = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static DWORD xcrc32table[256];
+
+static void xcrc32init(void)
+{
+    DWORD c;
+    int   i;
+    int   k;
+
+    for (i = 0; i < 256; i++) {
+        c = (DWORD)i;
+        for (k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        xcrc32table[i] = c;
+    }
+}
+
+static DWORD xcrc32(DWORD crc, const BYTE *p, DWORD n)
+{
+    crc = ~crc;
+    while (n--)
+        crc = xcrc32table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static LPSVCBATCH_DEFLATE xzinit(void)
+{
+    LPSVCBATCH_DEFLATE z;
+
+    xcrc32init();
+    z = (LPSVCBATCH_DEFLATE)xmcalloc(sizeof(SVCBATCH_DEFLATE));
+    z->size = SVCBATCH_DEFLATE_LEN * 2;
+    z->data = (LPBYTE)xmmalloc(z->size);
+    z->head = (int *)xmmalloc(SVCBATCH_DEFLATE_HSIZ * sizeof(int));
+    z->prev = (int *)xmmalloc(SVCBATCH_DEFLATE_LEN  * sizeof(int));
+    return z;
+}
+
+static void xzfree(LPSVCBATCH_DEFLATE z)
+{
+    if (z == NULL)
+        return;
+    xfree(z->data);
+    xfree(z->head);
+    xfree(z->prev);
+    xfree(z);
+}
+
+static __inline void xzputbits(LPSVCBATCH_DEFLATE z, DWORD v, int n)
+{
+    z->bits  |= v << z->nbits;
+    z->nbits += n;
+    while (z->nbits >= 8) {
+        z->data[z->len++] = (BYTE)z->bits;
+        z->bits  >>= 8;
+        z->nbits  -= 8;
+    }
+}
+
+static __inline void xzputcode(LPSVCBATCH_DEFLATE z, DWORD c, int n)
+{
+    DWORD r = 0;
+    int   i;
+
+    /**
+     * Huffman codes are packed
+     * starting with the most significant bit
+     */
+    for (i = 0; i < n; i++) {
+        r = (r << 1) | (c & 1);
+        c >>= 1;
+    }
+    xzputbits(z, r, n);
+}
+
+static __inline void xzputlit(LPSVCBATCH_DEFLATE z, int v)
+{
+    if (v < 144)
+        xzputcode(z, 0x30  + v, 8);
+    else if (v < 256)
+        xzputcode(z, 0x190 + v - 144, 9);
+    else if (v < 280)
+        xzputcode(z, v - 256, 7);
+    else
+        xzputcode(z, 0xC0  + v - 280, 8);
+}
+
+static void xzputmatch(LPSVCBATCH_DEFLATE z, int len, int dist)
+{
+    int i;
+
+    for (i = 28; xzlbase[i] > len; i--)
+        ;
+    xzputlit(z, 257 + i);
+    if (xzlext[i])
+        xzputbits(z, len - xzlbase[i], xzlext[i]);
+    for (i = 29; xzdbase[i] > dist; i--)
+        ;
+    xzputcode(z, i, 5);
+    if (xzdext[i])
+        xzputbits(z, dist - xzdbase[i], xzdext[i]);
+}
+
+static __inline DWORD xzhash(const BYTE *p)
+{
+    return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & (SVCBATCH_DEFLATE_HSIZ - 1);
+}
+
+static void xzdeflate(LPSVCBATCH_DEFLATE z, const BYTE *in, int n)
+{
+    int i = 0;
+    int k;
+
+    memset(z->head, 0xFF, SVCBATCH_DEFLATE_HSIZ * sizeof(int));
+    /**
+     * Single final block with fixed Huffman codes
+     */
+    xzputbits(z, 1, 1);
+    xzputbits(z, 1, 2);
+    while (i < n) {
+        int best = 0;
+        int dist = 0;
+
+        if ((i + 3) <= n) {
+            int h = xzhash(in + i);
+            int p = z->head[h];
+            int c = SVCBATCH_DEFLATE_CHAIN;
+            int m = n - i;
+
+            if (m > 258)
+                m = 258;
+            z->prev[i] = p;
+            z->head[h] = i;
+            while ((p >= 0) && c--) {
+                if (in[p + best] == in[i + best]) {
+                    for (k = 0; (k < m) && (in[p + k] == in[i + k]); k++)
+                        ;
+                    if (k > best) {
+                        best = k;
+                        dist = i - p;
+                        if (best == m)
+                            break;
+                    }
+                }
+                p = z->prev[p];
+            }
+        }
+        if (best >= 3) {
+            xzputmatch(z, best, dist);
+            for (k = 1; k < best; k++) {
+                if ((i + k + 3) <= n) {
+                    int h = xzhash(in + i + k);
+
+                    z->prev[i + k] = z->head[h];
+                    z->head[h]     = i + k;
+                }
+            }
+            i += best;
+        }
+        else {
+            xzputlit(z, in[i++]);
+        }
+    }
+    xzputlit(z, 256);
+    if (z->nbits)
+        z->data[z->len++] = (BYTE)z->bits;
+    z->bits  = 0;
+    z->nbits = 0;
+}
+
+/**
+ * Compress up to SVCBATCH_DEFLATE_LEN bytes
+ * into a single gzip member
+ */
+static void xzmember(LPSVCBATCH_DEFLATE z, const BYTE *in, DWORD n)
+{
+    static const BYTE gh[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 11 };
+    DWORD crc;
+
+    memcpy(z->data, gh, 10);
+    z->len = 10;
+    xzdeflate(z, in, (int)n);
+    if ((z->len - 10) > (n + 5)) {
+        /**
+         * Incompressible data.
+         * Use the stored block instead
+         */
+        z->len = 10;
+        z->data[z->len++] = 1;
+        z->data[z->len++] = (BYTE)(n);
+        z->data[z->len++] = (BYTE)(n >> 8);
+        z->data[z->len++] = (BYTE)(~n);
+        z->data[z->len++] = (BYTE)(~n >> 8);
+        memcpy(z->data + z->len, in, n);
+        z->len += n;
+    }
+    crc = xcrc32(0, in, n);
+    z->data[z->len++] = (BYTE)(crc);
+    z->data[z->len++] = (BYTE)(crc >> 8);
+    z->data[z->len++] = (BYTE)(crc >> 16);
+    z->data[z->len++] = (BYTE)(crc >> 24);
+    z->data[z->len++] = (BYTE)(n);
+    z->data[z->len++] = (BYTE)(n >> 8);
+    z->data[z->len++] = (BYTE)(n >> 16);
+    z->data[z->len++] = (BYTE)(n >> 24);
+}
+
+typedef struct _SVCBATCH_INFLATE {
+    const BYTE             *in;
+    DWORD                   len;
+    DWORD                   pos;
+    DWORD                   bits;
+    int                     nbits;
+} SVCBATCH_INFLATE, *LPSVCBATCH_INFLATE;
+
+/**
+ * Read n bits starting with the least significant one.
+ * Returns -1 at the end of the input.
+ */
+static int xzgetbits(LPSVCBATCH_INFLATE s, int n)
+{
+    int v;
+
+    while (s->nbits < n) {
+        if (s->pos >= s->len)
+            return -1;
+        s->bits  |= (DWORD)s->in[s->pos++] << s->nbits;
+        s->nbits += 8;
+    }
+    v = (int)(s->bits & ((1UL << n) - 1));
+    s->bits  >>= n;
+    s->nbits  -= n;
+    return v;
+}
+
+/**
+ * Read the Huffman code of n bits
+ * starting with the most significant one
+ */
+static int xzgetcode(LPSVCBATCH_INFLATE s, int c, int n)
+{
+    while (n--) {
+        int b = xzgetbits(s, 1);
+
+        if (b < 0)
+            return -1;
+        c = (c << 1) | b;
+    }
+    return c;
+}
+
+/**
+ * Decode the fixed Huffman literal or length symbol
+ */
+static int xzgetlit(LPSVCBATCH_INFLATE s)
+{
+    int c = xzgetcode(s, 0, 7);
+
+    if (c < 0)
+        return -1;
+    if (c < 24)
+        return 256 + c;
+    c = xzgetcode(s, c, 1);
+    if (c < 0)
+        return -1;
+    if ((c >= 48) && (c < 192))
+        return c - 48;
+    if ((c >= 192) && (c < 200))
+        return 280 + c - 192;
+    c = xzgetcode(s, c, 1);
+    if (c < 400)
+        return -1;
+    return 144 + c - 400;
+}
+
+/**
+ * Decode the single gzip member written by xzmember.
+ * Only the stored and fixed Huffman blocks are supported.
+ *
+ * Returns FALSE if the member is not valid, if it does
+ * not fit into the size bytes, or if the CRC32 and ISIZE
+ * from the trailer do not match the decoded data.
+ * On success used holds the member length and olen
+ * the length of the decoded data.
+ */
+static BOOL xzinflate(const BYTE *in, DWORD len, LPBYTE out, DWORD size,
+                      LPDWORD used, LPDWORD olen)
+{
+    SVCBATCH_INFLATE s;
+    const BYTE *t;
+    DWORD n = 0;
+    int   last;
+
+    if ((len < 18) || (in[0] != 0x1F) || (in[1] != 0x8B) ||
+        (in[2] != 8) || (in[3] != 0))
+        return FALSE;
+    s.in    = in;
+    s.len   = len - 8;
+    s.pos   = 10;
+    s.bits  = 0;
+    s.nbits = 0;
+    do {
+        int type;
+
+        last = xzgetbits(&s, 1);
+        type = xzgetbits(&s, 2);
+        if ((last < 0) || (type < 0))
+            return FALSE;
+        if (type == 0) {
+            DWORD k;
+
+            s.bits  = 0;
+            s.nbits = 0;
+            if ((s.pos + 4) > s.len)
+                return FALSE;
+            k = in[s.pos] | (in[s.pos + 1] << 8);
+            if ((k ^ 0xFFFF) != (DWORD)(in[s.pos + 2] | (in[s.pos + 3] << 8)))
+                return FALSE;
+            s.pos += 4;
+            if (((s.pos + k) > s.len) || ((n + k) > size))
+                return FALSE;
+            memcpy(out + n, in + s.pos, k);
+            s.pos += k;
+            n     += k;
+        }
+        else if (type == 1) {
+            for (;;) {
+                int c = xzgetlit(&s);
+                int l;
+                int d;
+
+                if (c < 0)
+                    return FALSE;
+                if (c < 256) {
+                    if (n >= size)
+                        return FALSE;
+                    out[n++] = (BYTE)c;
+                    continue;
+                }
+                if (c == 256)
+                    break;
+                c -= 257;
+                if (c > 28)
+                    return FALSE;
+                l = xzgetbits(&s, xzlext[c]);
+                d = xzgetcode(&s, 0, 5);
+                if ((l < 0) || (d < 0) || (d > 29))
+                    return FALSE;
+                l += xzlbase[c];
+                c  = xzgetbits(&s, xzdext[d]);
+                if (c < 0)
+                    return FALSE;
+                d  = xzdbase[d] + c;
+                if (((DWORD)d > n) || ((n + l) > size))
+                    return FALSE;
+                while (l--) {
+                    out[n] = out[n - d];
+                    n++;
+                }
+            }
+        }
+        else {
+            return FALSE;
+        }
+    } while (last == 0);
+
+    t = in + s.pos;
+    if ((t[0] | (t[1] << 8) | (t[2] << 16) | ((DWORD)t[3] << 24)) != xcrc32(0, out, n))
+        return FALSE;
+    if ((t[4] | (t[5] << 8) | (t[6] << 16) | ((DWORD)t[7] << 24)) != n)
+        return FALSE;
+    *used = s.pos + 8;
+    *olen = n;
+    return TRUE;
+}
+
+/**
+ * Find the first non ASCII byte in the [s, e) range
+ */
+static LPBYTE xmemascii(LPBYTE s, LPBYTE e)
+{
+    DWORD m;
+    DWORD i;
+
+#if HAVE_AVX2_INTRIN
+    while ((e - s) >= 32) {
+        m = (DWORD)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)s));
+        if (m) {
+            BitScanForward(&i, m);
+            return s + i;
+        }
+        s += 32;
+    }
+#endif
+#if HAVE_SSE2_INTRIN
+    while ((e - s) >= 16) {
+        m = (DWORD)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)s));
+        if (m) {
+            BitScanForward(&i, m);
+            return s + i;
+        }
+        s += 16;
+    }
+#endif
+    for (i = 0, m = (DWORD)(e - s); i < m; i++) {
+        if (s[i] & 0x80)
+            return s + i;
+    }
+    return NULL;
+}
+
+/**
+ * Code page state of the streams.
+ * The lead callback tells if the byte is the lead
+ * byte of a double byte character in the code page.
+ */
+typedef BOOL (*LPSVCBATCH_LEADFN)(UINT, BYTE);
+
+typedef struct _SVCBATCH_DBCS {
+    UINT                    cp;
+    BOOL                    dbcs;
+    BOOL                    ascii;
+    BYTE                    lead[4];
+    LPSVCBATCH_LEADFN       islead;
+} SVCBATCH_DBCS, *LPSVCBATCH_DBCS;
+
+/**
+ * Find the next byte that may start a non ASCII
+ * character. Every byte is a candidate if the code
+ * page is not ASCII compatible.
+ */
+static __inline LPBYTE xdbcsnext(LPSVCBATCH_DBCS d, LPBYTE s, LPBYTE e)
+{
+    if (d->ascii)
+        return xmemascii(s, e);
+    else
+        return s < e ? s : NULL;
+}
+
+/**
+ * Split the [*ps, *pe) data of the stream at the
+ * character boundaries.
+ *
+ * The lead byte kept from the previous buffer is
+ * copied to pc, followed by the trail byte at *ps.
+ * Returns the number of bytes copied to pc.
+ * The *pe is moved before the unpaired lead byte at
+ * the end, which is kept for the next buffer.
+ *
+ * Control characters are never trail bytes, so the
+ * lead byte followed by one is a character on its own.
+ * This keeps the line feed out of an invalid sequence,
+ * also when the lead byte was kept from the previous
+ * buffer.
+ */
+static DWORD xdbcssplit(LPSVCBATCH_DBCS d, DWORD stream,
+                        LPBYTE *ps, LPBYTE *pe, LPBYTE pc)
+{
+    LPBYTE s = *ps;
+    LPBYTE e = *pe;
+    LPBYTE p;
+    DWORD  n = 0;
+
+    if (d->lead[stream]) {
+        if (s == e)
+            return 0;
+        pc[n++] = d->lead[stream];
+        if (*s >= 0x20)
+            pc[n++] = *(s++);
+        d->lead[stream] = 0;
+    }
+    if (d->dbcs) {
+        /**
+         * Walk the characters to find the
+         * unpaired lead byte at the end.
+         * ASCII runs are skipped at once
+         */
+        p = s;
+        while ((p = xdbcsnext(d, p, e)) != NULL) {
+            if ((*d->islead)(d->cp, *p)) {
+                if ((p + 1) == e) {
+                    d->lead[stream] = *p;
+                    e = p;
+                    break;
+                }
+                p += p[1] < 0x20 ? 1 : 2;
+            }
+            else {
+                p++;
+            }
+        }
+    }
+    *ps = s;
+    *pe = e;
+    return n;
+}
+
+/**
+ * Find the first byte in the [s, e) range that
+ * has to be escaped inside JSON string.
+ * Those are quotation mark, reverse solidus and
+ * control characters.
+ */
+static LPBYTE xmemjson(LPBYTE s, LPBYTE e)
+{
+    DWORD m;
+    DWORD i;
+
+#if HAVE_AVX2_INTRIN
+    if ((e - s) >= 32) {
+        const __m256i qm = _mm256_set1_epi8('"');
+        const __m256i bs = _mm256_set1_epi8('\\');
+        const __m256i cc = _mm256_set1_epi8(0x1F);
+
+        while ((e - s) >= 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)s);
+            __m256i r = _mm256_or_si256(_mm256_cmpeq_epi8(v, qm),
+                                        _mm256_cmpeq_epi8(v, bs));
+
+            r = _mm256_or_si256(r, _mm256_cmpeq_epi8(_mm256_max_epu8(v, cc), cc));
+            m = (DWORD)_mm256_movemask_epi8(r);
+            if (m) {
+                BitScanForward(&i, m);
+                return s + i;
+            }
+            s += 32;
+        }
+    }
+#endif
+#if HAVE_SSE2_INTRIN
+    if ((e - s) >= 16) {
+        const __m128i qm = _mm_set1_epi8('"');
+        const __m128i bs = _mm_set1_epi8('\\');
+        const __m128i cc = _mm_set1_epi8(0x1F);
+
+        while ((e - s) >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)s);
+            __m128i r = _mm_or_si128(_mm_cmpeq_epi8(v, qm),
+                                     _mm_cmpeq_epi8(v, bs));
+
+            r = _mm_or_si128(r, _mm_cmpeq_epi8(_mm_max_epu8(v, cc), cc));
+            m = (DWORD)_mm_movemask_epi8(r);
+            if (m) {
+                BitScanForward(&i, m);
+                return s + i;
+            }
+            s += 16;
+        }
+    }
+#endif
+    for (i = 0, m = (DWORD)(e - s); i < m; i++) {
+        if ((s[i] < 32) || (s[i] == '"') || (s[i] == '\\'))
+            return s + i;
+    }
+    return NULL;
+}
+
+/**
+ * Store JSON escape sequence for character c
+ * and return its length
+ */
+static int xjsonesc(LPBYTE d, BYTE c)
+{
+    static const char hx[] = "0123456789abcdef";
+
+    d[0] = '\\';
+    switch (c) {
+        case '"':
+        case '\\':
+            d[1] = c;
+        break;
+        case '\b':
+            d[1] = 'b';
+        break;
+        case '\f':
+            d[1] = 'f';
+        break;
+        case '\n':
+            d[1] = 'n';
+        break;
+        case '\r':
+            d[1] = 'r';
+        break;
+        case '\t':
+            d[1] = 't';
+        break;
+        default:
+            d[1] = 'u';
+            d[2] = '0';
+            d[3] = '0';
+            d[4] = hx[c >> 4];
+            d[5] = hx[c & 15];
+            return 6;
+        break;
+    }
+    return 2;
+}
+
+typedef struct _SVCBATCH_FILTER {
+    DWORD                   count;
+    DWORD                   states;
+    DWORD                   classes;
+    LPDWORD                 next;
+    LPDWORD                 match;
+    LPCWSTR                *names;
+    ULONGLONG              *hits;
+    BYTE                    cmap[256];
+} SVCBATCH_FILTER, *LPSVCBATCH_FILTER;
+
+/**
+ * Build the Aho-Corasick automaton for the
+ * f->count patterns in pv.
+ *
+ * Missing transitions are resolved at build time,
+ * so matching needs a single table lookup per byte.
+ * Bytes are mapped to equivalence classes of pattern
+ * characters, and ASCII letters match ignoring case.
+ * Returns FALSE if the patterns are longer than
+ * SVCBATCH_MAX_FILTER bytes in total.
+ */
+static BOOL xfilterbuild(LPSVCBATCH_FILTER f, LPCSTR *pv)
+{
+    LPDWORD  fl;
+    LPDWORD  fq;
+    DWORD    np = f->count;
+    DWORD    nb = 0;
+    DWORD    nc;
+    DWORD    qh = 0;
+    DWORD    qt = 0;
+    DWORD    c;
+    DWORD    i;
+    DWORD    r;
+    DWORD    s;
+    int      n;
+
+    f->classes = 1;
+    for (i = 0; i < np; i++) {
+        for (n = 0; pv[i][n]; n++) {
+            c = (BYTE)pv[i][n];
+            if ((c >= 'A') && (c <= 'Z'))
+                c += 32;
+            if (f->cmap[c] == 0)
+                f->cmap[c] = (BYTE)f->classes++;
+        }
+        nb += n;
+    }
+    for (c = 'A'; c <= 'Z'; c++)
+        f->cmap[c] = f->cmap[c + 32];
+    if (nb > SVCBATCH_MAX_FILTER)
+        return FALSE;
+    nc       = f->classes;
+    f->next  = (LPDWORD)xmcalloc((nb + 1) * nc * sizeof(DWORD));
+    f->match = (LPDWORD)xmcalloc((nb + 1) * sizeof(DWORD));
+    f->states = 1;
+    /**
+     * Build the trie
+     */
+    for (i = 0; i < np; i++) {
+        s = 0;
+        for (n = 0; pv[i][n]; n++) {
+            DWORD x = s * nc + f->cmap[(BYTE)pv[i][n]];
+
+            if (f->next[x] == 0)
+                f->next[x] = f->states++;
+            s = f->next[x];
+        }
+        if (f->match[s] == 0)
+            f->match[s] = i + 1;
+    }
+    /**
+     * Breadth-first pass sets the failure links
+     * and fills in the missing transitions
+     */
+    fl = (LPDWORD)xmcalloc(f->states * sizeof(DWORD));
+    fq = (LPDWORD)xmcalloc(f->states * sizeof(DWORD));
+    for (c = 0; c < nc; c++) {
+        s = f->next[c];
+        if (s)
+            fq[qt++] = s;
+    }
+    while (qh < qt) {
+        r = fq[qh++];
+        if (f->match[r] == 0)
+            f->match[r] = f->match[fl[r]];
+        for (c = 0; c < nc; c++) {
+            s = f->next[r * nc + c];
+            if (s) {
+                fl[s] = f->next[fl[r] * nc + c];
+                fq[qt++] = s;
+            }
+            else {
+                f->next[r * nc + c] = f->next[fl[r] * nc + c];
+            }
+        }
+    }
+    xfree(fl);
+    xfree(fq);
+    return TRUE;
+}
+
+/**
+ * Return the index of the first pattern
+ * found in data plus one, or zero if there
+ * is no match.
+ */
+static DWORD xfiltermatch(LPSVCBATCH_FILTER f, LPBYTE s, DWORD len)
+{
+    LPDWORD nx = f->next;
+    LPBYTE  cm = f->cmap;
+    DWORD   nc = f->classes;
+    DWORD   st = 0;
+    DWORD   i;
+
+    for (i = 0; i < len; i++) {
+        st = nx[st * nc + cm[s[i]]];
+        if (f->match[st])
+            return f->match[st];
+    }
+    return 0;
+}
+
+/**
+ * Return TRUE if the line passes the filters.
+ * The line has to match one of the include
+ * patterns, if any, and none of the exclude
+ * patterns. Exclude patterns take precedence.
+ */
+static BOOL xfilterpass(LPSVCBATCH_FILTER inc, LPSVCBATCH_FILTER exc, LPBYTE s, DWORD len)
+{
+    DWORD m;
+
+    if (inc) {
+        m = xfiltermatch(inc, s, len);
+        if (m == 0)
+            return FALSE;
+        inc->hits[m - 1]++;
+    }
+    if (exc) {
+        m = xfiltermatch(exc, s, len);
+        if (m) {
+            exc->hits[m - 1]++;
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * Token bucket holds up to burst seconds of rate.
+ * Tokens are kept in thousands, so that they can be
+ * refilled with millisecond resolution.
+ * The bucket is never smaller then min tokens.
+ */
+typedef struct _SVCBATCH_BUCKET {
+    ULONGLONG               rate;
+    ULONGLONG               size;
+    ULONGLONG               tokens;
+    ULONGLONG               time;
+} SVCBATCH_BUCKET, *LPSVCBATCH_BUCKET;
+
+static void xbucketinit(LPSVCBATCH_BUCKET k, DWORD rate, DWORD burst,
+                        DWORD min, ULONGLONG t)
+{
+    k->rate   = rate;
+    k->size   = (ULONGLONG)rate * burst;
+    if (k->size < min)
+        k->size = min;
+    k->size  *= 1000;
+    k->tokens = k->size;
+    k->time   = t;
+}
+
+/**
+ * Refill the bucket up to the time t
+ * in milliseconds. Long idle time fills the
+ * bucket without multiplying the whole interval.
+ */
+static __inline void xbucketfill(LPSVCBATCH_BUCKET k, ULONGLONG t)
+{
+    if (t > k->time) {
+        ULONGLONG d = t - k->time;
+
+        if (k->rate && (d <= (k->size - k->tokens) / k->rate))
+            k->tokens += d * k->rate;
+        else if (k->rate)
+            k->tokens  = k->size;
+        k->time = t;
+    }
+}
+
+/**
+ * Take len bytes and one line from the buckets.
+ * Nothing is taken unless both buckets
+ * have enough tokens. Either bucket can be NULL.
+ */
+static BOOL xbuckettake(LPSVCBATCH_BUCKET bytes, LPSVCBATCH_BUCKET lines,
+                        DWORD len, ULONGLONG t)
+{
+    if (bytes) {
+        xbucketfill(bytes, t);
+        if (bytes->tokens < (ULONGLONG)len * 1000)
+            return FALSE;
+    }
+    if (lines) {
+        xbucketfill(lines, t);
+        if (lines->tokens < 1000)
+            return FALSE;
+        lines->tokens -= 1000;
+    }
+    if (bytes)
+        bytes->tokens -= (ULONGLONG)len * 1000;
+    return TRUE;
+}
+
+/**
+ * LogRetainBytes and LogRetainDays selection.
+ *
+ * The catalog is sorted from the oldest file, and the
+ * files are removed in that order while they are older
+ * than the days limit or the total is above the bytes limit.
+ * Live files and the files already removed are skipped.
+ */
+typedef struct _SVCBATCH_RETAIN_FILE {
+    ULONGLONG               size;
+    ULONGLONG               time;
+    BOOL                    dirty;
+    BOOL                    live;
+    LPWSTR                  name;
+} SVCBATCH_RETAIN_FILE, *LPSVCBATCH_RETAIN_FILE;
+
+static int __cdecl xretaincmp(const void *a, const void *b)
+{
+    const SVCBATCH_RETAIN_FILE *fa = (const SVCBATCH_RETAIN_FILE *)a;
+    const SVCBATCH_RETAIN_FILE *fb = (const SVCBATCH_RETAIN_FILE *)b;
+
+    if (fa->time < fb->time)
+        return -1;
+    else
+        return fa->time > fb->time;
+}
+
+/**
+ * Returns the index of the next file to remove,
+ * starting at the index i, or count if there is none.
+ */
+static DWORD xretainnext(LPSVCBATCH_RETAIN_FILE files, DWORD count, DWORD i,
+                         ULONGLONG total, ULONGLONG bytes, DWORD days,
+                         ULONGLONG ct, BOOL *expired)
+{
+    for (; i < count; i++) {
+        LPSVCBATCH_RETAIN_FILE f = files + i;
+
+        if (f->live || (f->name == NULL))
+            continue;
+        *expired = days && (ct > f->time) && ((ct - f->time) > (days * ONE_DAY));
+        if (!*expired && ((bytes == 0) || (total <= bytes)))
+            return count;
+        return i;
+    }
+    return count;
+}
+
+/**
+ * Drop the removed files from the catalog.
+ * Returns the new count.
+ */
+static DWORD xretaincompact(LPSVCBATCH_RETAIN_FILE files, DWORD count)
+{
+    DWORD i;
+    DWORD n = 0;
+
+    for (i = 0; i < count; i++) {
+        if (files[i].name)
+            files[n++] = files[i];
+    }
+    return n;
+}
+
+/**
+ * LogRotateTime schedule.
+ *
+ * Times are kept in FILETIME units. The schedule is matched
+ * against the wall clock time, and the caller converts the
+ * wall clock time to UTC, so that the rotation stays at the
+ * same hour across daylight saving changes.
+ */
+typedef struct _SVCBATCH_SCHEDULE {
+    ULONGLONG               secs;
+    ULONGLONG               mins;
+    ULONGLONG               hours;
+    DWORD                   days;
+} SVCBATCH_SCHEDULE, *LPSVCBATCH_SCHEDULE;
+
+/**
+ * Convert the wall clock time to UTC.
+ * Returns FALSE if the time cannot be converted.
+ */
+typedef BOOL (*LPSVCBATCH_SCHEDTOUTC)(ULONGLONG, ULONGLONG *);
+
+static __inline int xschedblank(WCHAR c)
+{
+    return (c > 0) && (c < 33);
+}
+
+static int xschednum(LPCWSTR *sp)
+{
+    LPCWSTR p = *sp;
+    int     v = 0;
+
+    if ((*p < L'0') || (*p > L'9'))
+        return -1;
+    while ((*p >= L'0') && (*p <= L'9')) {
+        v = v * 10 + (*p++ - L'0');
+        if (v > 9999)
+            return -1;
+    }
+    *sp = p;
+    return v;
+}
+
+/**
+ * Parse the schedule field
+ * '*', 'n' or 'n-m' optionally followed by '/step'
+ */
+static BOOL xschedfield(LPCWSTR *sp, int n, ULONGLONG *m)
+{
+    LPCWSTR p = *sp;
+    int     lo;
+    int     hi;
+    int     st = 1;
+
+    if (*p == L'*') {
+        lo = 0;
+        hi = n - 1;
+        p++;
+    }
+    else {
+        lo = xschednum(&p);
+        if ((lo < 0) || (lo >= n))
+            return FALSE;
+        hi = lo;
+        if (*p == L'-') {
+            p++;
+            hi = xschednum(&p);
+            if ((hi < lo) || (hi >= n))
+                return FALSE;
+        }
+    }
+    if (*p == L'/') {
+        p++;
+        st = xschednum(&p);
+        if ((st < 1) || (st >= n))
+            return FALSE;
+        if (lo == hi)
+            hi = n - 1;
+    }
+    for (; lo <= hi; lo += st)
+        *m |= CPP_UINT64_C(1) << lo;
+    *sp = p;
+    return TRUE;
+}
+
+static int xschedwday(LPCWSTR *sp)
+{
+    static const char *wd = "sunmontuewedthufrisat";
+    LPCWSTR p = *sp;
+    int     i;
+    int     k;
+
+    for (i = 0; i < 7; i++) {
+        for (k = 0; k < 3; k++) {
+            WCHAR c = p[k];
+
+            if ((c >= L'A') && (c <= L'Z'))
+                c += 32;
+            if (c != wd[i * 3 + k])
+                break;
+        }
+        if (k == 3) {
+            *sp = p + 3;
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Parse the LogRotateTime schedule.
+ *
+ * Schedule is a list of times separated by
+ * blanks or commas. Each time has the form
+ * hh:mm[:ss] where each field is '*', 'n' or
+ * 'n-m' optionally followed by '/step'.
+ * Times can be preceded by the weekday list
+ * (Sun ... Sat or day ranges like Mon-Fri)
+ * that applies to the times following it.
+ *
+ * Returns the number of entries, or zero
+ * if the schedule is not valid.
+ *
+ * Examples:
+ *   08:00,12:00,18:00
+ *   Mon-Fri 08:00 Sat,Sun 10:30
+ *   *:00
+ *   *:0/15
+ */
+static DWORD xschedparse(LPCWSTR rp, LPSVCBATCH_SCHEDULE sv, DWORD sn)
+{
+    LPCWSTR tp;
+    DWORD   n  = 0;
+    DWORD   wd = 0;
+    BOOL    dt = FALSE;
+
+    while (*rp) {
+        BOOL ct = FALSE;
+
+        while (xschedblank(*rp) || (*rp == L','))
+            rp++;
+        if (*rp == 0)
+            break;
+        for (tp = rp; *tp && !xschedblank(*tp) && (*tp != L','); tp++) {
+            if (*tp == L':')
+                ct = TRUE;
+        }
+        if (ct) {
+            LPSVCBATCH_SCHEDULE s;
+
+            if (n >= sn)
+                return 0;
+            s = sv + n;
+            memset(s, 0, sizeof(SVCBATCH_SCHEDULE));
+            s->days = wd ? wd : 0x7F;
+            if (!xschedfield(&rp, 24, &s->hours) || (*rp++ != L':'))
+                return 0;
+            if (!xschedfield(&rp, 60, &s->mins))
+                return 0;
+            if (*rp == L':') {
+                rp++;
+                if (!xschedfield(&rp, 60, &s->secs))
+                    return 0;
+            }
+            else {
+                s->secs = 1;
+            }
+            if (rp != tp)
+                return 0;
+            n++;
+            dt = FALSE;
+        }
+        else {
+            int d1;
+            int d2;
+
+            if (!dt)
+                wd = 0;
+            dt = TRUE;
+            if (*rp == L'*') {
+                wd = 0x7F;
+                rp++;
+            }
+            else {
+                d1 = xschedwday(&rp);
+                if (d1 < 0)
+                    return 0;
+                d2 = d1;
+                if (*rp == L'-') {
+                    rp++;
+                    d2 = xschedwday(&rp);
+                    if (d2 < 0)
+                        return 0;
+                }
+                /**
+                 * Ranges like Sat-Mon wrap
+                 * over the end of the week
+                 */
+                for (;;) {
+                    wd |= 1 << d1;
+                    if (d1 == d2)
+                        break;
+                    d1 = (d1 + 1) % 7;
+                }
+            }
+            if (rp != tp)
+                return 0;
+        }
+    }
+    if (dt)
+        return 0;
+    return n;
+}
+
+static int xschedbit(ULONGLONG m, int b, int n)
+{
+    for (; b < n; b++) {
+        if (m & (CPP_UINT64_C(1) << b))
+            return b;
+    }
+    return -1;
+}
+
+/**
+ * Find the first second of the day at or
+ * after the second t matching the entry
+ */
+static int xschedday(LPSVCBATCH_SCHEDULE s, int wday, int t)
+{
+    int h0 = t / 3600;
+    int m0 = (t / 60) % 60;
+    int hh;
+    int mm;
+    int ss;
+
+    if ((s->days & (1 << wday)) == 0)
+        return -1;
+    for (hh = xschedbit(s->hours, h0, 24); hh >= 0;
+         hh = xschedbit(s->hours, hh + 1, 24)) {
+        for (mm = xschedbit(s->mins, hh == h0 ? m0 : 0, 60); mm >= 0;
+             mm = xschedbit(s->mins, mm + 1, 60)) {
+            ss = xschedbit(s->secs, ((hh == h0) && (mm == m0)) ? t % 60 : 0, 60);
+            if (ss >= 0)
+                return hh * 3600 + mm * 60 + ss;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Return the first scheduled wall clock time
+ * after the wall clock time w, or zero if there
+ * is none within a week.
+ * January 1, 1601 was Monday.
+ */
+static ULONGLONG xschednext(LPSVCBATCH_SCHEDULE sv, DWORD sn, ULONGLONG w)
+{
+    ULONGLONG s = w / ONE_FTSECOND + 1;
+    ULONGLONG d = s / 86400;
+    int       t = (int)(s % 86400);
+    int       i;
+    DWORD     k;
+
+    for (i = 0; i < 8; i++, d++, t = 0) {
+        int bt = -1;
+
+        for (k = 0; k < sn; k++) {
+            int e = xschedday(sv + k, (int)((d + 1) % 7), t);
+
+            if ((e >= 0) && ((bt < 0) || (e < bt)))
+                bt = e;
+        }
+        if (bt >= 0)
+            return (d * 86400 + bt) * ONE_FTSECOND;
+    }
+    return 0;
+}
+
+/**
+ * Return the UTC time of the first scheduled time after
+ * the current UTC time now, with the wall clock time w.
+ * Returns zero if the time cannot be resolved.
+ *
+ * Wall clock time inside the daylight saving gap, or
+ * the repeated hour, can map at or before the current
+ * time. The search then continues after the
+ * wall clock time that maps to now.
+ */
+static ULONGLONG xschedresolve(LPSVCBATCH_SCHEDULE sv, DWORD sn,
+                               ULONGLONG now, ULONGLONG w,
+                               LPSVCBATCH_SCHEDTOUTC toutc)
+{
+    ULONGLONG u;
+    int       i;
+
+    for (i = 0; i < 8; i++) {
+        w = xschednext(sv, sn, w);
+        if (w == 0)
+            break;
+        if (toutc == NULL)
+            u = w;
+        else if (!(*toutc)(w, &u))
+            break;
+        if (u > now)
+            return u;
+        w += now - u;
+    }
+    return 0;
+}
+
+#endif /* _SVCUTIL_H_INCLUDED_ */
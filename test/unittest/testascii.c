@@ -0,0 +1,182 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * LogEncoding ASCII fast path tests
+ *
+ * The same source is built as testascii, testascii_scalar
+ * and testascii_avx2, so each xmemascii code path is checked
+ * against the plain byte search.
+ *
+ * Usage: testascii [-b]
+ *        -b  run the ASCII search throughput benchmark
+ */
+
+#if HAVE_AVX2_INTRIN
+# define ASCII_VARIANT  "avx2"
+#elif HAVE_SSE2_INTRIN
+# define ASCII_VARIANT  "sse2"
+#else
+# define ASCII_VARIANT  "scalar"
+#endif
+
+static unsigned int xtestseed = 1;
+
+static unsigned int xtestrand(void)
+{
+    xtestseed = xtestseed * 1103515245 + 12345;
+    return (xtestseed >> 8) & 0xFFFFFF;
+}
+
+static LPBYTE reference(LPBYTE s, LPBYTE e)
+{
+    for (; s < e; s++) {
+        if (*s >= 0x80)
+            return s;
+    }
+    return NULL;
+}
+
+/**
+ * Check xmemascii against the byte search for
+ * every byte value at every position
+ */
+static void testposition(void)
+{
+    BYTE  b[96];
+    DWORD c;
+    DWORD i;
+    DWORD j;
+
+    for (c = 0; c < 256; c++) {
+        memset(b, 'a', sizeof(b));
+        for (i = 0; i < sizeof(b); i++) {
+            b[i] = (BYTE)c;
+            for (j = 0; j < 40; j++) {
+                LPBYTE r = NULL;
+
+                if ((j <= i) && (c >= 0x80))
+                    r = b + i;
+                XTEST(xmemascii(b + j, b + sizeof(b)) == r);
+                if (j <= i)
+                    XTEST(xmemascii(b + j, b + i) == NULL);
+            }
+            b[i] = 'a';
+        }
+    }
+    XTEST(xmemascii(b, b) == NULL);
+}
+
+/**
+ * Random ranges with a few high bytes, including
+ * the UTF-8 and DBCS lead and trail bytes
+ */
+static void testrandom(void)
+{
+    BYTE  b[200];
+    DWORD i;
+    DWORD j;
+
+    for (i = 0; i < 5000; i++) {
+        DWORD s = xtestrand() % 64;
+        DWORD e = s + xtestrand() % (sizeof(b) - s + 1);
+
+        for (j = 0; j < sizeof(b); j++)
+            b[j] = (BYTE)(xtestrand() % 128);
+        for (j = 0; j < 3; j++) {
+            if (xtestrand() & 1)
+                b[xtestrand() % sizeof(b)] = (BYTE)(0x80 + xtestrand() % 128);
+        }
+        XTEST(xmemascii(b + s, b + e) == reference(b + s, b + e));
+    }
+}
+
+/**
+ * Walk the data the same way xiconv walks the DBCS
+ * data, and check that every high byte is visited
+ */
+static void testwalk(void)
+{
+    BYTE  b[512];
+    DWORD i;
+    DWORD k;
+
+    for (k = 0; k < 500; k++) {
+        DWORD  len = xtestrand() % sizeof(b);
+        DWORD  n   = 0;
+        DWORD  m   = 0;
+        LPBYTE p   = b;
+
+        for (i = 0; i < len; i++) {
+            b[i] = (BYTE)((xtestrand() % 10) ? xtestrand() % 128 : 0x80 + xtestrand() % 128);
+            if (b[i] >= 0x80)
+                n++;
+        }
+        while ((p = xmemascii(p, b + len)) != NULL) {
+            XTEST(*p >= 0x80);
+            m++;
+            p++;
+        }
+        XTEST(m == n);
+    }
+}
+
+static void benchmark(void)
+{
+    DWORD     size = 16 * 1024 * 1024;
+    LPBYTE    s    = (LPBYTE)xmmalloc(size);
+    DWORD     i;
+    int       k;
+    ULONGLONG t;
+
+    for (i = 0; i < size; i++)
+        s[i] = (BYTE)(' ' + i % 95);
+    t = xtestnsec();
+    for (k = 0; k < 16; k++) {
+        if (xmemascii(s, s + size) != NULL)
+            abort();
+    }
+    t = xtestnsec() - t;
+    printf("ascii %-6s: %6.2f GB/s\n",
+           ASCII_VARIANT, (double)size * 16.0 / (double)t);
+    xfree(s);
+}
+
+int main(int argc, char **argv)
+{
+#if HAVE_AVX2_INTRIN
+    if (!__builtin_cpu_supports("avx2")) {
+        printf("testascii: skipped, AVX2 is not supported\n");
+        return 0;
+    }
+#endif
+    testposition();
+    testrandom();
+    testwalk();
+
+    if (xtestfailed) {
+        fprintf(stderr, "testascii %s: %d checks failed\n",
+                ASCII_VARIANT, xtestfailed);
+        return 1;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+        benchmark();
+    printf("testascii %s: passed\n", ASCII_VARIANT);
+    return 0;
+}
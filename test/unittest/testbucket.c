@@ -0,0 +1,232 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * LogRateBytes and LogRateLines token bucket tests
+ *
+ * Time is given in milliseconds by the test,
+ * so the results do not depend on the clock.
+ *
+ * Usage: testbucket [-b]
+ *        -b  run the bucket throughput benchmark
+ */
+
+static unsigned int xtestseed = 1;
+
+static unsigned int xtestrand(void)
+{
+    xtestseed = xtestseed * 1103515245 + 12345;
+    return (xtestseed >> 8) & 0xFFFFFF;
+}
+
+/**
+ * Count the lines allowed in one millisecond steps
+ */
+static DWORD drain(LPSVCBATCH_BUCKET l, ULONGLONG t, ULONGLONG e)
+{
+    DWORD n = 0;
+
+    for (; t < e; t++) {
+        while (xbuckettake(NULL, l, 0, t))
+            n++;
+    }
+    return n;
+}
+
+/**
+ * The full bucket allows the burst at once, and
+ * then only the rate
+ */
+static void testrate(void)
+{
+    SVCBATCH_BUCKET l;
+    DWORD n;
+
+    xbucketinit(&l, 100, 5, 1, 1000);
+    n = drain(&l, 1000, 1001);
+    XTEST(n == 500);
+    n = drain(&l, 1001, 11001);
+    XTEST(n == 1000);
+    /**
+     * 100 lines per second is one line every 10 ms
+     */
+    XTEST(!xbuckettake(NULL, &l, 0, 11001));
+    XTEST(!xbuckettake(NULL, &l, 0, 11009));
+    XTEST(xbuckettake(NULL, &l, 0, 11010));
+    XTEST(!xbuckettake(NULL, &l, 0, 11010));
+
+    /**
+     * Time that goes back does not refill
+     */
+    XTEST(!xbuckettake(NULL, &l, 0, 5000));
+    XTEST(l.time == 11010);
+}
+
+/**
+ * Idle time never fills the bucket
+ * above the burst size
+ */
+static void testburst(void)
+{
+    SVCBATCH_BUCKET l;
+    SVCBATCH_BUCKET b;
+
+    xbucketinit(&l, 10, 3, 1, 0);
+    XTEST(drain(&l, 0, 1) == 30);
+    XTEST(drain(&l, 60000, 60001) == 30);
+
+    /**
+     * Days of idle time at the maximum rate
+     * must not overflow the tokens
+     */
+    xbucketinit(&b, 0xFFFFFFFF, SVCBATCH_MAX_BURST, 1, 0);
+    XTEST(xbuckettake(&b, NULL, 0xFFFFFFFF, 0));
+    xbucketfill(&b, 86400000ULL * 365);
+    XTEST(b.tokens == b.size);
+    XTEST(b.size == 0xFFFFFFFFULL * SVCBATCH_MAX_BURST * 1000);
+
+    xbucketinit(&l, 1, 1, 1, 0);
+    XTEST(drain(&l, 0, 1) == 1);
+    xbucketfill(&l, 0xFFFFFFFFFFFFFFFFULL);
+    XTEST(l.tokens == l.size);
+}
+
+/**
+ * The byte bucket always holds at least
+ * one full line
+ */
+static void testmin(void)
+{
+    SVCBATCH_BUCKET b;
+
+    xbucketinit(&b, 10, 1, SVCBATCH_LINE_MAX + 2, 0);
+    XTEST(b.size == (SVCBATCH_LINE_MAX + 2) * 1000ULL);
+    XTEST(xbuckettake(&b, NULL, SVCBATCH_LINE_MAX + 2, 0));
+    XTEST(!xbuckettake(&b, NULL, 1, 0));
+    XTEST(!xbuckettake(&b, NULL, 1, 99));
+    XTEST(xbuckettake(&b, NULL, 1, 100));
+
+    xbucketinit(&b, 100000, 2, SVCBATCH_LINE_MAX + 2, 0);
+    XTEST(b.size == 200000000ULL);
+}
+
+/**
+ * Nothing is taken unless both buckets
+ * have enough tokens
+ */
+static void testboth(void)
+{
+    SVCBATCH_BUCKET b;
+    SVCBATCH_BUCKET l;
+
+    xbucketinit(&b, 1000, 1, 1, 0);
+    xbucketinit(&l, 2, 1, 1, 0);
+
+    XTEST(xbuckettake(&b, &l, 100, 0));
+    XTEST(xbuckettake(&b, &l, 100, 0));
+    XTEST(b.tokens == 800000);
+    XTEST(!xbuckettake(&b, &l, 100, 0));
+    XTEST(b.tokens == 800000);
+    XTEST(l.tokens == 0);
+
+    /**
+     * Line that is too long for the byte bucket
+     * leaves the line bucket untouched
+     */
+    XTEST(!xbuckettake(&b, &l, 1001, 500));
+    XTEST(b.tokens == 1000000);
+    XTEST(l.tokens == 0);
+    XTEST(xbuckettake(&b, &l, 1000, 500));
+    XTEST((b.tokens == 0) && (l.tokens == 0));
+}
+
+/**
+ * Random traffic must never pass more than
+ * the burst plus the rate over the elapsed time
+ */
+static void testrandom(void)
+{
+    DWORD k;
+
+    for (k = 0; k < 200; k++) {
+        SVCBATCH_BUCKET b;
+        SVCBATCH_BUCKET l;
+        DWORD     rb = 100 + xtestrand() % 100000;
+        DWORD     rl = 1 + xtestrand() % 1000;
+        DWORD     bs = 1 + xtestrand() % 10;
+        ULONGLONG t  = xtestrand();
+        ULONGLONG s  = t;
+        ULONGLONG nb = 0;
+        ULONGLONG nl = 0;
+        DWORD     i;
+
+        xbucketinit(&b, rb, bs, SVCBATCH_LINE_MAX + 2, t);
+        xbucketinit(&l, rl, bs, 1, t);
+        for (i = 0; i < 5000; i++) {
+            DWORD len = xtestrand() % (SVCBATCH_LINE_MAX + 3);
+
+            t += xtestrand() % 20;
+            if (xbuckettake(&b, &l, len, t)) {
+                nb += len;
+                nl++;
+            }
+        }
+        XTEST(nb * 1000 <= b.size + (t - s) * rb);
+        XTEST(nl * 1000 <= l.size + (t - s) * rl);
+    }
+}
+
+static void benchmark(void)
+{
+    SVCBATCH_BUCKET b;
+    SVCBATCH_BUCKET l;
+    DWORD     count = 100000000;
+    DWORD     pass  = 0;
+    DWORD     i;
+    ULONGLONG t;
+
+    xbucketinit(&b, 1024 * 1024, 5, SVCBATCH_LINE_MAX + 2, 0);
+    xbucketinit(&l, 10000, 5, 1, 0);
+    t = xtestnsec();
+    for (i = 0; i < count; i++) {
+        if (xbuckettake(&b, &l, 80, i / 1000))
+            pass++;
+    }
+    t = xtestnsec() - t;
+    printf("bucket: %6.2f ns per line, %u lines passed\n",
+           (double)t / (double)count, pass);
+}
+
+int main(int argc, char **argv)
+{
+    testrate();
+    testburst();
+    testmin();
+    testboth();
+    testrandom();
+
+    if (xtestfailed) {
+        fprintf(stderr, "testbucket: %d checks failed\n", xtestfailed);
+        return 1;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+        benchmark();
+    printf("testbucket: passed\n");
+    return 0;
+}
@@ -0,0 +1,308 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * Write coalescing tests
+ *
+ * The sink counts the write calls, which are
+ * the WriteFile calls made by the log writer.
+ *
+ * Usage: testcoalesce [-b]
+ *        -b  run the writes per record benchmark
+ */
+
+static unsigned int xtestseed = 1;
+
+static unsigned int xtestrand(void)
+{
+    xtestseed = xtestseed * 1103515245 + 12345;
+    return (xtestseed >> 8) & 0xFFFFFF;
+}
+
+typedef struct _SINK {
+    LPBYTE    data;
+    DWORD     size;
+    DWORD     len;
+    DWORD     writes;
+    DWORD     fail;
+} SINK;
+
+static DWORD sinkwrite(LPVOID ctx, LPBYTE buf, DWORD len)
+{
+    SINK *k = (SINK *)ctx;
+
+    k->writes++;
+    if (k->fail && (k->writes >= k->fail))
+        return 112;
+    if ((k->len + len) <= k->size)
+        memcpy(k->data + k->len, buf, len);
+    k->len += len;
+    return 0;
+}
+
+static void sinkinit(SINK *k, DWORD size)
+{
+    k->data   = (LPBYTE)xmmalloc(size);
+    k->size   = size;
+    k->len    = 0;
+    k->writes = 0;
+    k->fail   = 0;
+}
+
+/**
+ * Small records are written once per full buffer
+ */
+static void testbatch(void)
+{
+    SVCBATCH_COALESCE c;
+    SINK  k;
+    BYTE  r[20];
+    DWORD i;
+
+    sinkinit(&k, 1024 * 1024);
+    xcoalesceinit(&c, 8192, sinkwrite, &k);
+    for (i = 0; i < 1000; i++) {
+        memset(r, 'a' + i % 26, sizeof(r));
+        XTEST(xcoalesce(&c, r, sizeof(r), 0) == 0);
+    }
+    /**
+     * 409 records fit in the buffer
+     */
+    XTEST(k.writes == 2);
+    XTEST(xcoalesceflush(&c, 0) == 0);
+    XTEST(k.writes == 3);
+    XTEST(k.len == 20000);
+    XTEST((c.chunks == 1000) && (c.writes == 3));
+    for (i = 0; i < 1000; i++)
+        XTEST(k.data[i * 20] == (BYTE)('a' + i % 26));
+    XTEST(xcoalesceflush(&c, 0) == 0);
+    XTEST(k.writes == 3);
+
+    /**
+     * Exactly full buffer is written at once
+     */
+    for (i = 0; i < 8192 / 16; i++)
+        xcoalesce(&c, r, 16, 0);
+    XTEST((k.writes == 4) && (c.len == 0));
+    xfree(c.data);
+    xfree(k.data);
+}
+
+/**
+ * Large chunks are written directly after the pending data
+ */
+static void testlarge(void)
+{
+    SVCBATCH_COALESCE c;
+    SINK   k;
+    LPBYTE s = (LPBYTE)xmmalloc(65536);
+    LPBYTE d = (LPBYTE)xmmalloc(4 * 1024 * 1024);
+    DWORD  n = 0;
+    DWORD  i;
+
+    sinkinit(&k, 4 * 1024 * 1024);
+    xcoalesceinit(&c, 8192, sinkwrite, &k);
+    for (i = 0; i < 65536; i++)
+        s[i] = (BYTE)xtestrand();
+    XTEST(xcoalesce(&c, s, 100, 0) == 0);
+    XTEST(xcoalesce(&c, s + 100, 4096, 0) == 0);
+    XTEST((k.writes == 2) && (k.len == 4196) && (c.len == 0));
+    XTEST(xcoalesce(&c, s + 4196, 4095, 0) == 0);
+    XTEST((k.writes == 2) && (c.len == 4095));
+    XTEST(xcoalesce(&c, s + 8291, 10000, 0) == 0);
+    XTEST((k.writes == 4) && (k.len == 18291));
+    XTEST(memcmp(k.data, s, k.len) == 0);
+
+    /**
+     * Random chunk sizes keep the order
+     */
+    k.len    = 0;
+    k.writes = 0;
+    for (i = 0; i < 20000; i++) {
+        DWORD m = (xtestrand() % 8) ? xtestrand() % 200 : xtestrand() % 12000;
+
+        if ((n + m) > (4 * 1024 * 1024))
+            break;
+        XTEST(xcoalesce(&c, s + (i % 50000), m, 0) == 0);
+        memcpy(d + n, s + (i % 50000), m);
+        n += m;
+    }
+    XTEST(xcoalesceflush(&c, 0) == 0);
+    XTEST(k.len == n);
+    XTEST(memcmp(k.data, d, n) == 0);
+    xfree(c.data);
+    xfree(k.data);
+    xfree(d);
+    xfree(s);
+}
+
+/**
+ * Pending data is written when the oldest
+ * chunk reaches the deadline
+ */
+static void testdeadline(void)
+{
+    SVCBATCH_COALESCE c;
+    SINK  k;
+    DWORD w;
+
+    sinkinit(&k, 65536);
+    xcoalesceinit(&c, 8192, sinkwrite, &k);
+    w = 0xFFFFFFFF;
+    XTEST(xcoalescedue(&c, 50, 1000, &w) == 0);
+    XTEST(w == 0xFFFFFFFF);
+    xcoalesce(&c, (LPBYTE)"abc", 3, 1000);
+    xcoalesce(&c, (LPBYTE)"def", 3, 1030);
+    XTEST(c.first == 1000);
+    XTEST(xcoalescedue(&c, 50, 1030, &w) == 0);
+    XTEST((w == 20) && (k.writes == 0));
+    w = 5;
+    XTEST(xcoalescedue(&c, 50, 1030, &w) == 0);
+    XTEST(w == 5);
+    w = 0xFFFFFFFF;
+    XTEST(xcoalescedue(&c, 50, 1050, &w) == 0);
+    XTEST((k.writes == 1) && (k.len == 6) && (c.len == 0));
+    XTEST(c.latency == 50);
+    XTEST(w == 0xFFFFFFFF);
+
+    /**
+     * Zero interval never writes
+     */
+    xcoalesce(&c, (LPBYTE)"abc", 3, 2000);
+    XTEST(xcoalescedue(&c, 0, 9000, &w) == 0);
+    XTEST(k.writes == 1);
+    xfree(c.data);
+    xfree(k.data);
+}
+
+/**
+ * Steady output on one stream must not hold
+ * the data of the other one past the deadline.
+ * Both deadlines are checked before each buffer,
+ * the same as the writer does.
+ */
+static void teststreams(void)
+{
+    SVCBATCH_COALESCE c[2];
+    SINK      k[2];
+    ULONGLONG t;
+    ULONGLONG late = 0;
+    BYTE      r[64];
+    DWORD     i;
+
+    memset(r, 'x', sizeof(r));
+    for (i = 0; i < 2; i++) {
+        sinkinit(&k[i], 65536);
+        xcoalesceinit(&c[i], 65536, sinkwrite, &k[i]);
+    }
+    xcoalesce(&c[1], r, 10, 0);
+    for (t = 0; t < 1000; t++) {
+        DWORD w = 0xFFFFFFFF;
+
+        for (i = 0; i < 2; i++)
+            XTEST(xcoalescedue(&c[i], 50, t, &w) == 0);
+        if ((c[1].len != 0) && ((t - c[1].first) > late))
+            late = t - c[1].first;
+        xcoalesce(&c[0], r, sizeof(r), t);
+        if ((t % 100) == 0)
+            xcoalesce(&c[1], r, 10, t);
+    }
+    XTEST(late < 50);
+    XTEST(c[1].latency == 50);
+    XTEST(c[0].latency == 50);
+    XTEST(k[1].writes == 10);
+    for (i = 0; i < 2; i++) {
+        xfree(c[i].data);
+        xfree(k[i].data);
+    }
+}
+
+/**
+ * Failed write is reported and the
+ * pending data is discarded
+ */
+static void testfailure(void)
+{
+    SVCBATCH_COALESCE c;
+    SINK  k;
+    BYTE  r[100];
+    DWORD i;
+    DWORD rc = 0;
+
+    memset(r, 'e', sizeof(r));
+    sinkinit(&k, 65536);
+    k.fail = 2;
+    xcoalesceinit(&c, 1024, sinkwrite, &k);
+    for (i = 0; (rc == 0) && (i < 100); i++)
+        rc = xcoalesce(&c, r, sizeof(r), 0);
+    XTEST(rc == 112);
+    XTEST((k.writes == 2) && (c.len == 0));
+    XTEST(xcoalesce(&c, r, 600, 0) == 112);
+    XTEST(k.writes == 3);
+    xfree(c.data);
+    xfree(k.data);
+}
+
+static void benchmark(void)
+{
+    DWORD sizes[] = { 16, 80, 200, 1000 };
+    DWORD count   = 4000000;
+    BYTE  r[1000];
+    DWORD i;
+    DWORD j;
+
+    memset(r, 'b', sizeof(r));
+    for (j = 0; j < 4; j++) {
+        SVCBATCH_COALESCE c;
+        SINK      k;
+        ULONGLONG t;
+
+        sinkinit(&k, 0);
+        xcoalesceinit(&c, SVCBATCH_FLUSH_LEN, sinkwrite, &k);
+        t = xtestnsec();
+        for (i = 0; i < count; i++)
+            xcoalesce(&c, r, sizes[j], 0);
+        xcoalesceflush(&c, 0);
+        t = xtestnsec() - t;
+        printf("coalesce %4u byte records: %lu writes for %lu records, "
+               "%6.1f records per write, %5.2f ns per record\n",
+               sizes[j], (unsigned long)k.writes, (unsigned long)count,
+               (double)count / (double)k.writes, (double)t / (double)count);
+        xfree(c.data);
+        xfree(k.data);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    testbatch();
+    testlarge();
+    testdeadline();
+    teststreams();
+    testfailure();
+
+    if (xtestfailed) {
+        fprintf(stderr, "testcoalesce: %d checks failed\n", xtestfailed);
+        return 1;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+        benchmark();
+    printf("testcoalesce: passed\n");
+    return 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * CrashLog ring tests
+ *
+ * Every chunk is also appended to a flat copy of
+ * the whole output, and the ring must always hold
+ * the last ring size bytes of it.
+ *
+ * Usage: testcrash [-b]
+ *        -b  run the ring put benchmark
+ */
+
+static unsigned int xtestseed = 1;
+
+static unsigned int xtestrand(void)
+{
+    xtestseed = xtestseed * 1103515245 + 12345;
+    return (xtestseed >> 8) & 0xFFFFFF;
+}
+
+static void crashinit(LPSVCBATCH_CRASH c, DWORD size)
+{
+    c->data = (LPBYTE)xmmalloc(size);
+    c->size = size;
+    c->used = 0;
+}
+
+static void testempty(void)
+{
+    SVCBATCH_CRASH c;
+    BYTE b[16];
+
+    crashinit(&c, 16);
+    XTEST(xcrashget(&c, b) == 0);
+    xcrashput(&c, (LPBYTE)"abc", 3);
+    XTEST(xcrashget(&c, b) == 3);
+    XTEST(memcmp(b, "abc", 3) == 0);
+    xfree(c.data);
+}
+
+/**
+ * Small ring checked byte by byte
+ */
+static void testwrap(void)
+{
+    SVCBATCH_CRASH c;
+    BYTE b[8];
+
+    crashinit(&c, 8);
+    xcrashput(&c, (LPBYTE)"012345", 6);
+    xcrashput(&c, (LPBYTE)"6789", 4);
+    XTEST(c.used == 10);
+    XTEST(memcmp(c.data, "89234567", 8) == 0);
+    XTEST(xcrashget(&c, b) == 8);
+    XTEST(memcmp(b, "23456789", 8) == 0);
+
+    /**
+     * Chunk larger than the ring keeps its end
+     */
+    xcrashput(&c, (LPBYTE)"abcdefghijklm", 13);
+    XTEST(c.used == 23);
+    XTEST(xcrashget(&c, b) == 8);
+    XTEST(memcmp(b, "fghijklm", 8) == 0);
+
+    /**
+     * Chunk of the ring size at an odd position
+     */
+    xcrashput(&c, (LPBYTE)"x", 1);
+    xcrashput(&c, (LPBYTE)"ABCDEFGH", 8);
+    XTEST(xcrashget(&c, b) == 8);
+    XTEST(memcmp(b, "ABCDEFGH", 8) == 0);
+    xfree(c.data);
+}
+
+/**
+ * Random chunks against the flat copy
+ */
+static void testrandom(void)
+{
+    SVCBATCH_CRASH c;
+    DWORD  len  = 4 * 1024 * 1024;
+    LPBYTE flat = (LPBYTE)xmmalloc(len);
+    LPBYTE b    = (LPBYTE)xmmalloc(4096);
+    DWORD  pos  = 0;
+    DWORD  bad  = 0;
+
+    crashinit(&c, 4096);
+    while (pos < len) {
+        DWORD n;
+        DWORD m;
+        DWORD i;
+
+        n = (xtestrand() % 8) ? xtestrand() % 512 : xtestrand() % 10000;
+        if ((pos + n) > len)
+            n = len - pos;
+        for (i = 0; i < n; i++)
+            flat[pos + i] = (BYTE)xtestrand();
+        xcrashput(&c, flat + pos, n);
+        pos += n;
+        m = xcrashget(&c, b);
+        if (m != (pos < 4096 ? pos : 4096))
+            bad++;
+        else if (memcmp(b, flat + pos - m, m))
+            bad++;
+    }
+    XTEST(bad == 0);
+    XTEST(c.used == len);
+    xfree(c.data);
+    xfree(b);
+    xfree(flat);
+}
+
+typedef struct _TAIL {
+    const char         *data;
+    DWORD               max;
+    const char         *tail;
+} TAIL;
+
+static const TAIL tails[] = {
+    { "",                   4,  ""              },
+    { "abc",                4,  "abc"           },
+    { "abcd",               4,  "abcd"          },
+    { "ab\ncdefg",          4,  "defg"          },
+    { "abc\ndefg",          4,  "defg"          },
+    { "abcd\nefg",          4,  "efg"           },
+    { "abcdefg\n",          4,  "efg\n"         },
+    { "line1\nline2\nl3",   8,  "l3"            },
+    { "line1\nline2\nl3\n", 8,  "l3\n"          },
+    { "a\nb\nc\nd\n",       5,  "c\nd\n"        },
+    { NULL,                 0,  NULL            }
+};
+
+/**
+ * Tail starts after the first line feed of the
+ * last max bytes, unless that is the end
+ */
+static void testtail(void)
+{
+    DWORD i;
+
+    for (i = 0; tails[i].data != NULL; i++) {
+        LPBYTE b = (LPBYTE)tails[i].data;
+        DWORD  n = (DWORD)strlen(tails[i].data);
+        LPBYTE t = xcrashtail(b, n, tails[i].max);
+
+        if (((DWORD)(b + n - t) != strlen(tails[i].tail)) ||
+            memcmp(t, tails[i].tail, b + n - t)) {
+            fprintf(stderr, "testcrash: tail %u failed\n", i);
+            XTEST(0);
+        }
+    }
+}
+
+static void benchmark(void)
+{
+    DWORD  sizes[] = { 64, 512, 4096, 65536 };
+    DWORD  total   = 512 * 1024 * 1024;
+    LPBYTE d       = (LPBYTE)xmmalloc(65536);
+    DWORD  i;
+
+    memset(d, 'c', 65536);
+    for (i = 0; i < 4; i++) {
+        SVCBATCH_CRASH c;
+        ULONGLONG t;
+        DWORD     n;
+
+        crashinit(&c, SVCBATCH_CRASH_LEN);
+        t = xtestnsec();
+        for (n = 0; n < total; n += sizes[i])
+            xcrashput(&c, d, sizes[i]);
+        t = xtestnsec() - t;
+        printf("crash put %5u byte chunks: %6.1f ns per chunk, %7.1f MB/s\n",
+               sizes[i], (double)t * sizes[i] / (double)total,
+               (double)total * 1000.0 / (double)t);
+        xfree(c.data);
+    }
+    xfree(d);
+}
+
+int main(int argc, char **argv)
+{
+    testempty();
+    testwrap();
+    testrandom();
+    testtail();
+
+    if (xtestfailed) {
+        fprintf(stderr, "testcrash: %d checks failed\n", xtestfailed);
+        return 1;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+        benchmark();
+    printf("testcrash: passed\n");
+    return 0;
+}
@@ -0,0 +1,311 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * LogEncoding double byte code page split tests
+ *
+ * The lead bytes are the ones of the code page 932.
+ * Every table is run with the ASCII search and with
+ * the byte by byte walk used for the code pages that
+ * are not ASCII compatible.
+ *
+ * Usage: testdbcs [-b]
+ *        -b  run the split benchmark
+ */
+
+static unsigned int xtestseed = 1;
+
+static unsigned int xtestrand(void)
+{
+    xtestseed = xtestseed * 1103515245 + 12345;
+    return (xtestseed >> 8) & 0xFFFFFF;
+}
+
+static BOOL cp932lead(UINT cp, BYTE c)
+{
+    return ((c >= 0x81) && (c <= 0x9F)) || ((c >= 0xE0) && (c <= 0xFC));
+}
+
+/**
+ * Each step feeds one buffer of the stream and
+ * expects the bytes copied to pc, the remaining
+ * run and the lead byte kept for the next buffer.
+ */
+typedef struct _STEP {
+    DWORD               stream;
+    const char         *data;
+    const char         *pc;
+    const char         *run;
+    BYTE                lead;
+} STEP;
+
+typedef struct _TABLE {
+    const char         *name;
+    STEP                steps[4];
+} TABLE;
+
+static const TABLE tables[] = {
+    { "ascii", {
+        { 0, "abc\n",           "",             "abc\n",            0    },
+        { 0, NULL,              NULL,           NULL,               0    } } },
+    { "pair inside the buffer", {
+        { 0, "a\x82\xA0" "b",   "",             "a\x82\xA0" "b",    0    },
+        { 0, NULL,              NULL,           NULL,               0    } } },
+    { "lead byte at the end", {
+        { 0, "ab\x82",          "",             "ab",               0x82 },
+        { 0, "\xA0" "cd\n",     "\x82\xA0",     "cd\n",             0    },
+        { 0, NULL,              NULL,           NULL,               0    } } },
+    { "lead byte is the whole buffer", {
+        { 0, "\x82",            "",             "",                 0x82 },
+        { 0, "\xA0",            "\x82\xA0",     "",                 0    },
+        { 0, NULL,              NULL,           NULL,               0    } } },
+    { "trail byte with the lead byte value", {
+        { 0, "x\x82",           "",             "x",                0x82 },
+        { 0, "\x82\x82",        "\x82\x82",     "",                 0x82 },
+        { 0, "\x40" "z",        "\x82\x40",     "z",                0    },
+        { 0, NULL,              NULL,           NULL,               0    } } },
+    { "odd run of lead bytes", {
+        { 0, "\x82\x82\x82",    "",             "\x82\x82",         0x82 },
+        { 0, "\x82\x82",        "\x82\x82",     "",                 0x82 },
+        { 0, NULL,              NULL,           NULL,               0    } } },
+    { "empty buffer keeps the lead byte", {
+        { 0, "\xE0",            "",             "",                 0xE0 },
+        { 0, "",                "",             "",                 0xE0 },
+        { 0, "\x9F\n",          "\xE0\x9F",     "\n",               0    },
+        { 0, NULL,              NULL,           NULL,               0    } } },
+    { "streams are split separately", {
+        { 1, "a\x82",           "",             "a",                0x82 },
+        { 2, "\xA0" "b",        "",             "\xA0" "b",         0    },
+        { 1, "\xA0",            "\x82\xA0",     "",                 0    },
+        { 0, NULL,              NULL,           NULL,               0    } } },
+    { "invalid line feed after the kept lead byte", {
+        { 0, "ab\x82",          "",             "ab",               0x82 },
+        { 0, "\ncd",            "\x82",         "\ncd",             0    },
+        { 0, NULL,              NULL,           NULL,               0    } } },
+    { "invalid carriage return after the kept lead byte", {
+        { 0, "\x82",            "",             "",                 0x82 },
+        { 0, "\r\n",            "\x82",         "\r\n",             0    },
+        { 0, NULL,              NULL,           NULL,               0    } } },
+    { "invalid line feed after the lead byte", {
+        { 0, "\x82\nab\x83",    "",             "\x82\nab",         0x83 },
+        { 0, "\x82\n\x83",      "\x83\x82",     "\n",               0x83 },
+        { 0, NULL,              NULL,           NULL,               0    } } },
+    { "invalid trail byte is not checked", {
+        { 0, "\x82",            "",             "",                 0x82 },
+        { 0, "\xFF\x82" " ",    "\x82\xFF",     "\x82 ",            0    },
+        { 0, NULL,              NULL,           NULL,               0    } } }
+};
+
+static void testtables(BOOL ascii)
+{
+    DWORD i;
+    DWORD j;
+
+    for (i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+        SVCBATCH_DBCS d;
+        DWORD bad = 0;
+
+        memset(&d, 0, sizeof(d));
+        d.cp     = 932;
+        d.dbcs   = TRUE;
+        d.ascii  = ascii;
+        d.islead = cp932lead;
+        for (j = 0; tables[i].steps[j].data != NULL; j++) {
+            const STEP *t = &tables[i].steps[j];
+            BYTE   b[64];
+            BYTE   pc[2];
+            LPBYTE s = b;
+            LPBYTE e = b + strlen(t->data);
+            DWORD  n;
+
+            memcpy(b, t->data, e - s);
+            n = xdbcssplit(&d, t->stream, &s, &e, pc);
+            if ((n != strlen(t->pc)) || memcmp(pc, t->pc, n))
+                bad++;
+            if (((DWORD)(e - s) != strlen(t->run)) || memcmp(s, t->run, e - s))
+                bad++;
+            if (d.lead[t->stream] != t->lead)
+                bad++;
+        }
+        if (bad)
+            fprintf(stderr, "testdbcs: %s ascii %d failed\n", tables[i].name, ascii);
+        XTEST(bad == 0);
+    }
+}
+
+/**
+ * Single byte code page is never split
+ */
+static void testsbcs(void)
+{
+    SVCBATCH_DBCS d;
+    BYTE   b[4] = { 'a', 'b', 0x82, 0 };
+    BYTE   pc[2];
+    LPBYTE s = b;
+    LPBYTE e = b + 3;
+
+    memset(&d, 0, sizeof(d));
+    d.cp     = 1252;
+    d.ascii  = TRUE;
+    d.islead = cp932lead;
+    XTEST(xdbcssplit(&d, 0, &s, &e, pc) == 0);
+    XTEST((s == b) && (e == b + 3));
+    XTEST(d.lead[0] == 0);
+}
+
+/**
+ * Character boundaries of the whole stream
+ */
+static void boundaries(LPBYTE data, DWORD len, LPBYTE cb)
+{
+    DWORD i = 0;
+
+    memset(cb, 0, len + 1);
+    while (i < len) {
+        cb[i] = 1;
+        if (cp932lead(0, data[i]) && ((i + 1) < len) && (data[i + 1] >= 0x20))
+            i += 2;
+        else
+            i++;
+    }
+    cb[len] = 1;
+}
+
+/**
+ * Random streams split at random points give the
+ * same characters as the whole stream
+ */
+static void testrandom(BOOL ascii)
+{
+    static const BYTE alphabet[] = { 'a', ' ', '\n', 0x82, 0xA0, 0x40, 0xE0, 0xFC };
+    DWORD  len = 100000;
+    LPBYTE data = (LPBYTE)xmmalloc(len);
+    LPBYTE out  = (LPBYTE)xmmalloc(len);
+    LPBYTE cb   = (LPBYTE)xmmalloc(len + 1);
+    DWORD  pos  = 0;
+    DWORD  on   = 0;
+    DWORD  bad  = 0;
+    DWORD  i;
+    SVCBATCH_DBCS d;
+
+    for (i = 0; i < len; i++) {
+        if (xtestrand() % 3)
+            data[i] = alphabet[xtestrand() % sizeof(alphabet)];
+        else
+            data[i] = 'a' + xtestrand() % 26;
+    }
+    boundaries(data, len, cb);
+    memset(&d, 0, sizeof(d));
+    d.cp     = 932;
+    d.dbcs   = TRUE;
+    d.ascii  = ascii;
+    d.islead = cp932lead;
+    while (pos < len) {
+        DWORD  n = xtestrand() % 40;
+        BYTE   pc[2];
+        LPBYTE s;
+        LPBYTE e;
+        DWORD  k;
+
+        if ((pos + n) > len)
+            n = len - pos;
+        s = data + pos;
+        e = data + pos + n;
+        k = xdbcssplit(&d, 0, &s, &e, pc);
+        if (k) {
+            if (!cb[on] || !cb[on + k])
+                bad++;
+            memcpy(out + on, pc, k);
+            on += k;
+        }
+        if (s < e) {
+            if (!cb[on] || !cb[on + (e - s)])
+                bad++;
+            memcpy(out + on, s, e - s);
+            on += (DWORD)(e - s);
+        }
+        pos += n;
+    }
+    if (d.lead[0])
+        out[on++] = d.lead[0];
+    XTEST(bad == 0);
+    XTEST(on == len);
+    XTEST(memcmp(out, data, len) == 0);
+    xfree(cb);
+    xfree(out);
+    xfree(data);
+}
+
+static void benchmark(void)
+{
+    DWORD  len   = 65536;
+    DWORD  count = 4000;
+    LPBYTE data  = (LPBYTE)xmmalloc(len);
+    DWORD  m;
+    DWORD  i;
+
+    for (m = 0; m < 4; m++) {
+        SVCBATCH_DBCS d;
+        ULONGLONG     t;
+
+        for (i = 0; i < len; i++) {
+            if ((m & 1) && ((i % 8) < 2))
+                data[i] = (i % 8) ? 0xA0 : 0x82;
+            else
+                data[i] = (i % 80) ? 'a' + i % 26 : '\n';
+        }
+        memset(&d, 0, sizeof(d));
+        d.cp     = 932;
+        d.dbcs   = TRUE;
+        d.ascii  = m < 2;
+        d.islead = cp932lead;
+        t = xtestnsec();
+        for (i = 0; i < count; i++) {
+            BYTE   pc[2];
+            LPBYTE s = data;
+            LPBYTE e = data + len - (i & 1);
+
+            xdbcssplit(&d, 0, &s, &e, pc);
+        }
+        t = xtestnsec() - t;
+        printf("dbcs %-5s search, %-15s text: %8.1f MB/s\n",
+               m < 2 ? "ascii" : "byte",
+               (m & 1) ? "25% double byte" : "ascii",
+               (double)len * count * 1000.0 / (double)t);
+    }
+    xfree(data);
+}
+
+int main(int argc, char **argv)
+{
+    testtables(TRUE);
+    testtables(FALSE);
+    testsbcs();
+    testrandom(TRUE);
+    testrandom(FALSE);
+
+    if (xtestfailed) {
+        fprintf(stderr, "testdbcs: %d checks failed\n", xtestfailed);
+        return 1;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+        benchmark();
+    printf("testdbcs: passed\n");
+    return 0;
+}
@@ -0,0 +1,314 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * Line filter automaton tests
+ *
+ * Usage: testfilter [-b]
+ *        -b  run the matching throughput benchmark
+ */
+
+static unsigned int xtestseed = 1;
+
+static unsigned int xtestrand(void)
+{
+    xtestseed = xtestseed * 1103515245 + 12345;
+    return (xtestseed >> 8) & 0xFFFFFF;
+}
+
+static LPSVCBATCH_FILTER build(LPCSTR *pv, DWORD np)
+{
+    LPSVCBATCH_FILTER f;
+
+    f = (LPSVCBATCH_FILTER)xmcalloc(sizeof(SVCBATCH_FILTER));
+    f->count = np;
+    f->hits  = (ULONGLONG *)xmcalloc(np * sizeof(ULONGLONG));
+    if (!xfilterbuild(f, pv)) {
+        xfree(f->hits);
+        xfree(f);
+        return NULL;
+    }
+    return f;
+}
+
+static void release(LPSVCBATCH_FILTER f)
+{
+    if (f == NULL)
+        return;
+    xfree(f->next);
+    xfree(f->match);
+    xfree(f->hits);
+    xfree(f);
+}
+
+static DWORD match(LPSVCBATCH_FILTER f, LPCSTR s)
+{
+    return xfiltermatch(f, (LPBYTE)s, (DWORD)strlen(s));
+}
+
+static BYTE fold(BYTE c)
+{
+    return ((c >= 'A') && (c <= 'Z')) ? c + 32 : c;
+}
+
+/**
+ * Reference matcher.
+ * Returns the pattern that ends first in the line.
+ * If several patterns end at the same position the
+ * longest one wins, and the first one of the equal
+ * patterns.
+ */
+static DWORD reference(LPCSTR *pv, DWORD np, LPBYTE s, DWORD len)
+{
+    DWORD e;
+    DWORD i;
+
+    for (e = 1; e <= len; e++) {
+        DWORD best = 0;
+        DWORD blen = 0;
+
+        for (i = 0; i < np; i++) {
+            DWORD n = (DWORD)strlen(pv[i]);
+            DWORD k;
+
+            if ((n > e) || (n <= blen))
+                continue;
+            for (k = 0; k < n; k++) {
+                if (fold(s[e - n + k]) != fold((BYTE)pv[i][k]))
+                    break;
+            }
+            if (k == n) {
+                best = i + 1;
+                blen = n;
+            }
+        }
+        if (best)
+            return best;
+    }
+    return 0;
+}
+
+/**
+ * Patterns that share prefixes and suffixes, so the
+ * matches are found through the failure links
+ */
+static void testoverlap(void)
+{
+    LPCSTR p1[] = { "he", "she", "his", "hers" };
+    LPCSTR p2[] = { "abcd", "bc" };
+    LPCSTR p3[] = { "aab", "ab", "b" };
+    LPCSTR p4[] = { "error", "ERROR", "err" };
+    LPCSTR p5[] = { "abcabd", "cab" };
+    LPSVCBATCH_FILTER f;
+
+    f = build(p1, 4);
+    XTEST(match(f, "ushers") == 2);
+    XTEST(match(f, "ahishers") == 3);
+    XTEST(match(f, "xhex") == 1);
+    XTEST(match(f, "xhhex") == 1);
+    XTEST(match(f, "hrs his") == 3);
+    XTEST(match(f, "nothing") == 0);
+    XTEST(match(f, "") == 0);
+    release(f);
+
+    /**
+     * Shorter pattern inside the longer one ends first
+     */
+    f = build(p2, 2);
+    XTEST(match(f, "abcd") == 2);
+    XTEST(match(f, "xabxbcx") == 2);
+    release(f);
+
+    /**
+     * Longest pattern wins at the same position
+     */
+    f = build(p3, 3);
+    XTEST(match(f, "aab") == 1);
+    XTEST(match(f, "xab") == 2);
+    XTEST(match(f, "xxb") == 3);
+    release(f);
+
+    /**
+     * Case insensitive duplicates map to the first one
+     */
+    f = build(p4, 3);
+    XTEST(match(f, "Some Error here") == 3);
+    XTEST(match(f, "ERRO") == 3);
+    XTEST(match(f, "ER") == 0);
+    XTEST(f->classes == 4);
+    release(f);
+
+    /**
+     * Failure from the deep state
+     * into the middle of other pattern
+     */
+    f = build(p5, 2);
+    XTEST(match(f, "abcabcabd") == 2);
+    XTEST(match(f, "xabcabx") == 2);
+    XTEST(match(f, "abcab") == 2);
+    release(f);
+}
+
+/**
+ * Random patterns over a small alphabet against
+ * the reference matcher
+ */
+static void testrandom(void)
+{
+    static const char al[] = "abAB\xe9.";
+    char   pat[16][12];
+    LPCSTR pv[16];
+    BYTE   s[200];
+    DWORD  k;
+    DWORD  i;
+    DWORD  j;
+
+    for (k = 0; k < 2000; k++) {
+        DWORD np = 1 + xtestrand() % 16;
+        LPSVCBATCH_FILTER f;
+
+        for (i = 0; i < np; i++) {
+            DWORD n = 1 + xtestrand() % 6;
+
+            for (j = 0; j < n; j++)
+                pat[i][j] = al[xtestrand() % 6];
+            pat[i][n] = 0;
+            pv[i] = pat[i];
+        }
+        f = build(pv, np);
+        for (i = 0; i < 20; i++) {
+            DWORD len = xtestrand() % sizeof(s);
+
+            for (j = 0; j < len; j++)
+                s[j] = (BYTE)al[xtestrand() % 6];
+            XTEST(xfiltermatch(f, s, len) == reference(pv, np, s, len));
+        }
+        release(f);
+    }
+}
+
+static void testlimit(void)
+{
+    static char big[SVCBATCH_MAX_FILTER + 2];
+    LPCSTR pv[2];
+    LPSVCBATCH_FILTER f;
+
+    memset(big, 'a', SVCBATCH_MAX_FILTER);
+    big[SVCBATCH_MAX_FILTER] = 0;
+    pv[0] = big;
+    f = build(pv, 1);
+    XTEST(f != NULL);
+    release(f);
+    pv[1] = "b";
+    f = build(pv, 2);
+    XTEST(f == NULL);
+}
+
+/**
+ * Exclude patterns take precedence over the include ones
+ */
+static void testprecedence(void)
+{
+    LPCSTR ip[] = { "error", "warn" };
+    LPCSTR ep[] = { "healthcheck" };
+    LPSVCBATCH_FILTER inc = build(ip, 2);
+    LPSVCBATCH_FILTER exc = build(ep, 1);
+
+#define PASS(_i, _e, _s) xfilterpass(_i, _e, (LPBYTE)(_s), (DWORD)strlen(_s))
+
+    XTEST(PASS(NULL, NULL, "anything"));
+    XTEST(PASS(inc,  NULL, "ERROR: disk full"));
+    XTEST(!PASS(inc, NULL, "info: started"));
+    XTEST(PASS(NULL, exc,  "info: started"));
+    XTEST(!PASS(NULL, exc, "GET /healthcheck"));
+    XTEST(PASS(inc,  exc,  "warn: slow request"));
+    XTEST(!PASS(inc, exc,  "warn: slow /healthcheck"));
+    XTEST(!PASS(inc, exc,  "info: /healthcheck"));
+    XTEST(!PASS(inc, exc,  "info: started"));
+
+    /**
+     * Lines rejected by the include filter
+     * are not counted by the exclude one
+     */
+    XTEST(inc->hits[0] == 1);
+    XTEST(inc->hits[1] == 2);
+    XTEST(exc->hits[0] == 2);
+
+#undef PASS
+    release(inc);
+    release(exc);
+}
+
+static void benchmark(void)
+{
+    static const char *words[] = {
+        "connection", "request", "started", "pool", "returned",
+        "handler", "session", "timeout", "items", "cleanup"
+    };
+    LPCSTR    pv[] = { "exception", "fatal", "out of memory", "deadlock",
+                       "timeout", "refused", "denied", "corrupt" };
+    DWORD     size = 64 * 1024 * 1024;
+    LPBYTE    s    = (LPBYTE)xmmalloc(size);
+    DWORD     len  = 0;
+    DWORD     hits = 0;
+    DWORD     i;
+    ULONGLONG t;
+    LPSVCBATCH_FILTER f = build(pv, 8);
+
+    while (len < (size - 16)) {
+        LPCSTR w = words[xtestrand() % 10];
+        DWORD  n = (DWORD)strlen(w);
+
+        memcpy(s + len, w, n);
+        len += n;
+        s[len++] = (xtestrand() % 12) ? ' ' : '\n';
+    }
+    t = xtestnsec();
+    for (i = 0; i < len; ) {
+        LPBYTE p = s + i;
+        LPBYTE e = memchr(p, '\n', len - i);
+        DWORD  n = e ? (DWORD)(e - p) : len - i;
+
+        if (xfiltermatch(f, p, n))
+            hits++;
+        i += n + 1;
+    }
+    t = xtestnsec() - t;
+    printf("filter 8 patterns %lu states: %6.2f GB/s, %u matching lines\n",
+           (unsigned long)f->states, (double)len / (double)t, hits);
+    release(f);
+    xfree(s);
+}
+
+int main(int argc, char **argv)
+{
+    testoverlap();
+    testrandom();
+    testlimit();
+    testprecedence();
+
+    if (xtestfailed) {
+        fprintf(stderr, "testfilter: %d checks failed\n", xtestfailed);
+        return 1;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+        benchmark();
+    printf("testfilter: passed\n");
+    return 0;
+}
@@ -0,0 +1,411 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * Line framer tests
+ *
+ * The same source is built as testframe, testframe_scalar
+ * and testframe_avx2, so each xmemlf code path is checked
+ * against the plain byte search.
+ *
+ * Usage: testframe [-b]
+ *        -b  run the throughput benchmark
+ */
+
+#if HAVE_AVX2_INTRIN
+# define FRAME_VARIANT  "avx2"
+#elif HAVE_SSE2_INTRIN
+# define FRAME_VARIANT  "sse2"
+#else
+# define FRAME_VARIANT  "scalar"
+#endif
+
+#define MAX_RECORDS     65536
+
+/**
+ * Record produced either by the framer or by the
+ * reference splitter
+ */
+typedef struct {
+    DWORD   off;
+    DWORD   len;
+    DWORD   eol;
+} RECORD;
+
+typedef struct {
+    LPBYTE  data;
+    DWORD   size;
+    DWORD   used;
+    RECORD  rec[MAX_RECORDS];
+    DWORD   nrec;
+    BOOL    open;
+} OUTPUT;
+
+static unsigned int xtestseed = 1;
+
+static unsigned int xtestrand(void)
+{
+    xtestseed = xtestseed * 1103515245 + 12345;
+    return (xtestseed >> 8) & 0xFFFFFF;
+}
+
+static void outinit(OUTPUT *o, DWORD size)
+{
+    o->data = (LPBYTE)xmmalloc(size);
+    o->size = size;
+    o->used = 0;
+    o->nrec = 0;
+    o->open = FALSE;
+}
+
+/**
+ * Append the span to the current record.
+ * The record is closed by any line terminator.
+ */
+static void outspan(OUTPUT *o, LPCSTR data, DWORD len, DWORD eol, BOOL sol)
+{
+    RECORD *r;
+
+    XTEST(sol == !o->open);
+    if (!o->open) {
+        XTEST(o->nrec < MAX_RECORDS);
+        if (o->nrec >= MAX_RECORDS)
+            return;
+        r = &o->rec[o->nrec++];
+        r->off  = o->used;
+        r->len  = 0;
+        r->eol  = SVCBATCH_EOL_NONE;
+        o->open = TRUE;
+    }
+    r = &o->rec[o->nrec - 1];
+    XTEST(o->used + len <= o->size);
+    memcpy(o->data + o->used, data, len);
+    o->used += len;
+    r->len  += len;
+    r->eol   = eol;
+    if (eol != SVCBATCH_EOL_NONE)
+        o->open = FALSE;
+}
+
+/**
+ * Reference splitter.
+ * Lines end at LF, a CR right before the LF is a part
+ * of the terminator, and the line content is divided
+ * into SVCBATCH_LINE_MAX pieces.
+ */
+static void reference(OUTPUT *o, LPCSTR s, DWORD len)
+{
+    DWORD i = 0;
+
+    while (i < len) {
+        DWORD j = i;
+        DWORD e;
+        DWORD n;
+
+        while ((j < len) && (s[j] != '\n'))
+            j++;
+        e = SVCBATCH_EOL_LF;
+        n = j - i;
+        if (n && (s[j - 1] == '\r')) {
+            e = SVCBATCH_EOL_CRLF;
+            n--;
+        }
+        while (n > SVCBATCH_LINE_MAX) {
+            outspan(o, s + i, SVCBATCH_LINE_MAX, SVCBATCH_EOL_SPLIT, TRUE);
+            i += SVCBATCH_LINE_MAX;
+            n -= SVCBATCH_LINE_MAX;
+        }
+        outspan(o, s + i, n, e, TRUE);
+        i = j + 1;
+    }
+}
+
+/**
+ * Run the framer over the data divided at the
+ * given offsets. Each chunk is copied to its own
+ * buffer, so spans cannot reach across the reads.
+ */
+static void frame(OUTPUT *o, LPCSTR s, DWORD len, const DWORD *cuts, DWORD ncuts)
+{
+    SVCBATCH_FRAMER f;
+    SVCBATCH_LINE   ln;
+    DWORD           p = 0;
+    DWORD           i;
+
+    xframerinit(&f);
+    for (i = 0; i <= ncuts; i++) {
+        DWORD  q = i < ncuts ? cuts[i] : len;
+        LPBYTE b;
+
+        if (q <= p)
+            continue;
+        b = (LPBYTE)xmmalloc(q - p);
+        memcpy(b, s + p, q - p);
+        xframerfeed(&f, b, q - p);
+        while (xframernext(&f, &ln)) {
+            XTEST(ln.len <= SVCBATCH_LINE_MAX);
+            XTEST(!((ln.len == 0) && (ln.eol == SVCBATCH_EOL_NONE)));
+            outspan(o, (LPCSTR)ln.data, ln.len, ln.eol, ln.sol);
+        }
+        XTEST(f.pos == f.end);
+        xfree(b);
+        p = q;
+    }
+    XTEST(!xframerpartial(&f));
+}
+
+static BOOL compare(OUTPUT *a, OUTPUT *b)
+{
+    DWORD i;
+
+    if (a->nrec != b->nrec)
+        return FALSE;
+    for (i = 0; i < a->nrec; i++) {
+        RECORD *x = &a->rec[i];
+        RECORD *y = &b->rec[i];
+
+        if ((x->len != y->len) || (x->eol != y->eol))
+            return FALSE;
+        if (x->len > SVCBATCH_LINE_MAX)
+            return FALSE;
+        if (memcmp(a->data + x->off, b->data + y->off, x->len))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void check(LPCSTR name, LPCSTR s, DWORD len, const DWORD *cuts, DWORD ncuts)
+{
+    OUTPUT *a = (OUTPUT *)xmmalloc(sizeof(OUTPUT));
+    OUTPUT *b = (OUTPUT *)xmmalloc(sizeof(OUTPUT));
+
+    outinit(a, len + 1);
+    outinit(b, len + 1);
+    reference(a, s, len);
+    frame(b, s, len, cuts, ncuts);
+    if (!compare(a, b)) {
+        fprintf(stderr, "%s: framer output differs (%u/%u records)\n",
+                name, a->nrec, b->nrec);
+        xtestfailed++;
+    }
+    xfree(a->data);
+    xfree(b->data);
+    xfree(a);
+    xfree(b);
+}
+
+/**
+ * Check xmemlf against the byte search for
+ * every start offset and length
+ */
+static void testmemlf(void)
+{
+    BYTE  b[160];
+    DWORD i;
+    DWORD j;
+    DWORD k;
+
+    for (k = 0; k < 100; k++) {
+        for (i = 0; i < sizeof(b); i++)
+            b[i] = (BYTE)xtestrand();
+        for (i = 0; i < (k % 4); i++)
+            b[xtestrand() % sizeof(b)] = '\n';
+        for (i = 0; i < 70; i++) {
+            for (j = i; j <= sizeof(b); j++) {
+                LPBYTE r = NULL;
+                DWORD  n;
+
+                for (n = i; n < j; n++) {
+                    if (b[n] == '\n') {
+                        r = b + n;
+                        break;
+                    }
+                }
+                XTEST(xmemlf(b + i, b + j) == r);
+            }
+        }
+    }
+}
+
+/**
+ * Line terminators and line limits at every
+ * position relative to the read boundary
+ */
+static void testedges(void)
+{
+    static const char *tails[] = { "\n", "\r\n", "\r", "x\n", "\rx\n", "\r\r\n" };
+    char   s[SVCBATCH_LINE_MAX * 3];
+    DWORD  sizes[] = { 0, 1, 15, 16, 17, 31, 32, 33,
+                       SVCBATCH_LINE_MAX - 2, SVCBATCH_LINE_MAX - 1,
+                       SVCBATCH_LINE_MAX, SVCBATCH_LINE_MAX + 1,
+                       SVCBATCH_LINE_MAX * 2 - 1, SVCBATCH_LINE_MAX * 2 };
+    DWORD  i;
+    DWORD  t;
+    DWORD  c;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (t = 0; t < sizeof(tails) / sizeof(tails[0]); t++) {
+            DWORD len;
+
+            memset(s, 'a', sizes[i]);
+            strcpy(s + sizes[i], tails[t]);
+            len = sizes[i] + (DWORD)strlen(tails[t]);
+            /**
+             * Add a short line so the next record
+             * starts right after the terminator
+             */
+            strcpy(s + len, "next\n");
+            len += 5;
+            check("edges", s, len, NULL, 0);
+            for (c = 1; c < len; c++) {
+                check("edges", s, len, &c, 1);
+            }
+            {
+                /**
+                 * Single byte reads
+                 */
+                DWORD *cuts = (DWORD *)xmmalloc(len * sizeof(DWORD));
+
+                for (c = 0; c < len; c++)
+                    cuts[c] = c + 1;
+                check("edges", s, len, cuts, len);
+                xfree(cuts);
+            }
+        }
+    }
+}
+
+/**
+ * Random line lengths, terminators and read sizes
+ */
+static void testrandom(void)
+{
+    DWORD  size = 1024 * 1024;
+    char  *s    = (char *)xmmalloc(size);
+    DWORD  cuts[512];
+    DWORD  k;
+
+    for (k = 0; k < 40; k++) {
+        DWORD len = 0;
+        DWORD n;
+        DWORD i;
+
+        while (len < (size - SVCBATCH_LINE_MAX * 4)) {
+            DWORD r = xtestrand() % 16;
+
+            if (r < 10)
+                n = xtestrand() % 80;
+            else if (r < 14)
+                n = SVCBATCH_LINE_MAX - 3 + xtestrand() % 6;
+            else
+                n = xtestrand() % (SVCBATCH_LINE_MAX * 3);
+            for (i = 0; i < n; i++) {
+                r = xtestrand() % 64;
+                s[len++] = r == 0 ? '\r' : (char)('a' + (r % 26));
+            }
+            if (xtestrand() & 1)
+                s[len++] = '\r';
+            s[len++] = '\n';
+        }
+        n = 1 + xtestrand() % 512;
+        for (i = 0; i < n; i++) {
+            DWORD m = xtestrand() % 4;
+
+            if (m == 0)
+                cuts[i] = xtestrand() % len;
+            else
+                cuts[i] = (i ? cuts[i - 1] : 0) + 1 + (xtestrand() % (4096 << m));
+            if (cuts[i] > len)
+                cuts[i] = len;
+            if (i && (cuts[i] < cuts[i - 1]))
+                cuts[i] = cuts[i - 1];
+        }
+        check("random", s, len, cuts, n);
+    }
+    xfree(s);
+}
+
+/**
+ * Framer throughput for the mixed line lengths
+ * fed in ReadBufferSize chunks
+ */
+static void benchmark(void)
+{
+    DWORD     size = 64 * 1024 * 1024;
+    LPBYTE    s    = (LPBYTE)xmmalloc(size);
+    DWORD     rdsz[] = { 8192, 65536 };
+    DWORD     len  = 0;
+    DWORD     i;
+    DWORD     r;
+
+    while (len < (size - SVCBATCH_LINE_MAX)) {
+        DWORD n = xtestrand() % 8 ? 20 + xtestrand() % 120 : xtestrand() % 1200;
+
+        for (i = 0; i < n; i++)
+            s[len++] = (BYTE)('a' + (i % 26));
+        s[len++] = '\r';
+        s[len++] = '\n';
+    }
+    for (r = 0; r < 2; r++) {
+        SVCBATCH_FRAMER f;
+        SVCBATCH_LINE   ln;
+        ULONGLONG       t;
+        ULONGLONG       lines = 0;
+        int             k;
+
+        t = xtestnsec();
+        for (k = 0; k < 4; k++) {
+            xframerinit(&f);
+            for (i = 0; i < len; i += rdsz[r]) {
+                xframerfeed(&f, s + i, len - i < rdsz[r] ? len - i : rdsz[r]);
+                while (xframernext(&f, &ln))
+                    lines += ln.eol != SVCBATCH_EOL_NONE;
+            }
+        }
+        t = xtestnsec() - t;
+        printf("framer %-6s %5u byte reads: %6.2f GB/s, %5.1f M lines/s\n",
+               FRAME_VARIANT, rdsz[r],
+               (double)len * 4.0 / (double)t,
+               (double)lines * 1000.0 / (double)t);
+    }
+    xfree(s);
+}
+
+int main(int argc, char **argv)
+{
+#if HAVE_AVX2_INTRIN
+    if (!__builtin_cpu_supports("avx2")) {
+        printf("testframe: skipped, AVX2 is not supported\n");
+        return 0;
+    }
+#endif
+    testmemlf();
+    testedges();
+    testrandom();
+
+    if (xtestfailed) {
+        fprintf(stderr, "testframe %s: %d checks failed\n",
+                FRAME_VARIANT, xtestfailed);
+        return 1;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+        benchmark();
+    printf("testframe %s: passed\n", FRAME_VARIANT);
+    return 0;
+}
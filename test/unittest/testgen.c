@@ -0,0 +1,231 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * LogGenerations naming and manifest tests
+ *
+ * The manifest is kept in memory. It is appended to
+ * on every rotation and rewritten when it has twice
+ * as many records as the limit, the same as loggencommit.
+ *
+ * Usage: testgen [-b]
+ *        -b  run the manifest write benchmark
+ */
+
+typedef struct _MANIFEST {
+    char                data[65536];
+    int                 len;
+    ULONGLONG           written;
+    DWORD               compacts;
+    BOOL                restarted;
+} MANIFEST;
+
+static void testrecord(void)
+{
+    char b[64];
+
+    XTEST(xgenrecord(b, 64, "service.log", 12) == 19);
+    XTEST(strcmp(b, "12 service.log.12\r\n") == 0);
+    XTEST(xgenrecord(b, 64, "s", 0) == 7);
+    XTEST(strcmp(b, "0 s.0\r\n") == 0);
+    XTEST(xgenrecord(b, 64, "s", CPP_UINT64_C(18446744073709551615)) == 45);
+    XTEST(strcmp(b, "18446744073709551615 s.18446744073709551615\r\n") == 0);
+    /**
+     * Record and the terminating zero must fit
+     */
+    XTEST(xgenrecord(b, 8, "s", 0) == 7);
+    XTEST(xgenrecord(b, 7, "s", 0) == 0);
+}
+
+static void parse(LPSVCBATCH_GENLIST gl, const char *s)
+{
+    memset(gl, 0, sizeof(SVCBATCH_GENLIST));
+    xgenparse(gl, (LPBYTE)s, (DWORD)strlen(s));
+}
+
+static void testparse(void)
+{
+    SVCBATCH_GENLIST gl;
+
+    parse(&gl, "");
+    XTEST((gl.first == 0) && (gl.last == 0) && (gl.lines == 0));
+    parse(&gl, "4 a.4\r\n5 a.5\r\n6 a.6\r\n");
+    XTEST((gl.first == 4) && (gl.last == 6) && (gl.lines == 3));
+    parse(&gl, "4 a.4\n5 a.5\n6 a.6");
+    XTEST((gl.first == 4) && (gl.last == 6) && (gl.lines == 3));
+    /**
+     * Records out of order and broken lines are skipped
+     */
+    parse(&gl, "7 a.7\r\n3 a.3\r\n\r\nxx\r\n9 a.9\r\n9 a.9\r\n12");
+    XTEST((gl.first == 7) && (gl.last == 12) && (gl.lines == 3));
+}
+
+static void testnext(void)
+{
+    SVCBATCH_GENLIST gl;
+
+    memset(&gl, 0, sizeof(gl));
+    XTEST(xgennext(&gl, 3) == 1);
+    XTEST((gl.first == 1) && (gl.last == 1));
+    XTEST(xgennext(&gl, 3) == 1);
+    XTEST(xgennext(&gl, 3) == 1);
+    XTEST((gl.first == 1) && (gl.last == 3));
+    XTEST(xgennext(&gl, 3) == 1);
+    XTEST((gl.first == 2) && (gl.last == 4));
+
+    /**
+     * Lower limit after a restart removes
+     * all generations above it at once
+     */
+    gl.first = 10;
+    gl.last  = 20;
+    XTEST(xgennext(&gl, 2) == 10);
+    XTEST((gl.first == 20) && (gl.last == 21));
+}
+
+static void commit(MANIFEST *m, LPSVCBATCH_GENLIST gl, DWORD max,
+                   BYTE *removed, DWORD *bad)
+{
+    ULONGLONG g;
+    BOOL      compact;
+    int       n;
+
+    for (g = xgennext(gl, max); g < gl->first; g++) {
+        if (removed[g] && !m->restarted)
+            (*bad)++;
+        removed[g] = 1;
+    }
+    m->restarted = FALSE;
+    compact = gl->lines >= max * 2;
+    if (compact) {
+        m->len = 0;
+        m->compacts++;
+    }
+    n = xgenformat(gl, "service.log", compact,
+                   m->data + m->len, sizeof(m->data) - m->len);
+    m->len     += n;
+    m->written += n;
+}
+
+/**
+ * The manifest read at any point gives the live
+ * generations. Until it is rewritten it also lists
+ * the removed ones, so they are removed again after
+ * a restart. Otherwise every generation that is not
+ * live anymore is removed exactly once.
+ */
+static void testrotate(DWORD max)
+{
+    SVCBATCH_GENLIST gl;
+    SVCBATCH_GENLIST rl;
+    MANIFEST *m       = (MANIFEST *)xmcalloc(sizeof(MANIFEST));
+    BYTE     *removed = (BYTE *)xmcalloc(2000);
+    DWORD     bad     = 0;
+    DWORD     i;
+
+    memset(&gl, 0, sizeof(gl));
+    for (i = 0; i < 1000; i++) {
+        commit(m, &gl, max, removed, &bad);
+        memset(&rl, 0, sizeof(rl));
+        xgenparse(&rl, (LPBYTE)m->data, m->len);
+        if ((rl.last != gl.last) || (rl.lines != gl.lines))
+            bad++;
+        if (rl.first != gl.last - gl.lines + 1)
+            bad++;
+        if ((gl.last - gl.first + 1) > max)
+            bad++;
+        if (gl.lines > max * 2)
+            bad++;
+        /**
+         * Restart from the manifest every 100 rotations
+         */
+        if ((i % 100) == 99) {
+            gl = rl;
+            m->restarted = TRUE;
+        }
+    }
+    for (i = 1; i < gl.first; i++) {
+        if (!removed[i])
+            bad++;
+    }
+    XTEST(bad == 0);
+    XTEST(gl.last == 1000);
+    XTEST(m->compacts > 0);
+    xfree(removed);
+    xfree(m);
+}
+
+/**
+ * Bytes written to the manifest per rotation,
+ * compared to rewriting all live generations
+ */
+static void benchmark(void)
+{
+    DWORD max[] = { 4, 32, 256 };
+    DWORD count = 100000;
+    DWORD i;
+    DWORD j;
+
+    for (j = 0; j < 3; j++) {
+        SVCBATCH_GENLIST gl;
+        MANIFEST *m       = (MANIFEST *)xmcalloc(sizeof(MANIFEST));
+        BYTE     *removed = (BYTE *)xmcalloc(count + 1);
+        ULONGLONG rewrite = 0;
+        ULONGLONG t;
+        DWORD     bad = 0;
+
+        memset(&gl, 0, sizeof(gl));
+        t = xtestnsec();
+        for (i = 0; i < count; i++)
+            commit(m, &gl, max[j], removed, &bad);
+        t = xtestnsec() - t;
+        XTEST(bad == 0);
+        memset(&gl, 0, sizeof(gl));
+        for (i = 0; i < count; i++) {
+            xgennext(&gl, max[j]);
+            rewrite += xgenformat(&gl, "service.log", TRUE,
+                                  m->data, sizeof(m->data));
+        }
+        printf("generations %3u: %7.1f bytes per rotation, "
+               "%8.1f with a full rewrite, %6.1f ns per commit\n", max[j],
+               (double)m->written / count, (double)rewrite / count,
+               (double)t / count);
+        xfree(removed);
+        xfree(m);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    testrecord();
+    testparse();
+    testnext();
+    testrotate(1);
+    testrotate(3);
+    testrotate(64);
+
+    if (xtestfailed) {
+        fprintf(stderr, "testgen: %d checks failed\n", xtestfailed);
+        return 1;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+        benchmark();
+    printf("testgen: passed\n");
+    return 0;
+}
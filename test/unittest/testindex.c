@@ -0,0 +1,289 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include <stddef.h>
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * LogIndex record encoding tests
+ *
+ * The records are appended to a memory copy of the
+ * .idx file, and decoded from it the same way the
+ * svcidx utility reads them.
+ *
+ * Usage: testindex [-b]
+ *        -b  run the indexing cost benchmark
+ */
+
+static unsigned int xtestseed = 1;
+
+static unsigned int xtestrand(void)
+{
+    xtestseed = xtestseed * 1103515245 + 12345;
+    return (xtestseed >> 8) & 0xFFFFFF;
+}
+
+typedef struct _IDXFILE {
+    LPBYTE              data;
+    DWORD               size;
+    DWORD               len;
+    DWORD               calls;
+    DWORD               fail;
+} IDXFILE;
+
+static DWORD idxwrite(LPVOID ctx, LPSVCBATCH_INDEX ir, DWORD n)
+{
+    IDXFILE *f = (IDXFILE *)ctx;
+    DWORD    b = n * sizeof(SVCBATCH_INDEX);
+
+    f->calls++;
+    if (f->fail && (f->calls >= f->fail))
+        return ERROR_DISK_FULL;
+    if ((f->len + b) > f->size) {
+        f->size = (f->len + b) * 2;
+        f->data = (LPBYTE)realloc(f->data, f->size);
+    }
+    memcpy(f->data + f->len, ir, b);
+    f->len += b;
+    return 0;
+}
+
+static void idxopen(IDXFILE *f, LPSVCBATCH_INDEXER x, DWORD every)
+{
+    memset(f, 0, sizeof(IDXFILE));
+    f->size = 4096;
+    f->data = (LPBYTE)malloc(f->size);
+    f->len  = 8;
+    memcpy(f->data, SVCBATCH_INDEX_MAGIC, 8);
+    xindexinit(x, every, idxwrite);
+}
+
+static DWORD idxcount(IDXFILE *f)
+{
+    return (f->len - 8) / sizeof(SVCBATCH_INDEX);
+}
+
+/**
+ * Decode the record i from the file bytes
+ */
+static void idxrecord(IDXFILE *f, DWORD i, ULONGLONG *r)
+{
+    memcpy(r, f->data + 8 + i * 24, 24);
+}
+
+/**
+ * The svcidx reader depends on this layout
+ */
+static void testlayout(void)
+{
+    XTEST(strlen(SVCBATCH_INDEX_MAGIC) == 8);
+    XTEST(sizeof(SVCBATCH_INDEX) == 24);
+    XTEST(offsetof(SVCBATCH_INDEX, time)   == 0);
+    XTEST(offsetof(SVCBATCH_INDEX, line)   == 8);
+    XTEST(offsetof(SVCBATCH_INDEX, offset) == 16);
+}
+
+static void testlines(void)
+{
+    SVCBATCH_INDEXER x;
+    IDXFILE   f;
+    ULONGLONG r[3];
+
+    idxopen(&f, &x, 2);
+    XTEST(xindexdata(&x, &f, TRUE, 1000, 0, (LPBYTE)"a\nb\nc\n", 6) == 0);
+    XTEST(x.lines == 3);
+    XTEST(idxcount(&f) == 2);
+    XTEST(memcmp(f.data, SVCBATCH_INDEX_MAGIC, 8) == 0);
+    idxrecord(&f, 0, r);
+    XTEST((r[0] == 1000) && (r[1] == 0) && (r[2] == 0));
+    idxrecord(&f, 1, r);
+    XTEST((r[0] == 1000) && (r[1] == 2) && (r[2] == 4));
+    free(f.data);
+
+    /**
+     * Line that continues from the previous write
+     * is not indexed at the start of the data
+     */
+    idxopen(&f, &x, 1);
+    xindexdata(&x, &f, TRUE, 1000, 0, (LPBYTE)"ab", 2);
+    xindexdata(&x, &f, FALSE, 1000, 2, (LPBYTE)"c\nde", 4);
+    xindexdata(&x, &f, FALSE, 1000, 6, (LPBYTE)"f", 1);
+    xindexdata(&x, &f, FALSE, 1000, 7, (LPBYTE)"\n", 1);
+    XTEST(idxcount(&f) == 2);
+    idxrecord(&f, 1, r);
+    XTEST((r[1] == 1) && (r[2] == 4));
+    xindexdata(&x, &f, TRUE, 1000, 8, (LPBYTE)"g", 1);
+    XTEST(idxcount(&f) == 3);
+    idxrecord(&f, 2, r);
+    XTEST((r[1] == 2) && (r[2] == 8));
+    free(f.data);
+}
+
+/**
+ * Line after a second is indexed even when
+ * there were less lines than the interval
+ */
+static void testtime(void)
+{
+    SVCBATCH_INDEXER x;
+    IDXFILE   f;
+    ULONGLONG r[3];
+    ULONGLONG t = 5 * ONE_FTSECOND;
+    DWORD     i;
+
+    idxopen(&f, &x, 1000);
+    for (i = 0; i < 10; i++) {
+        xindexdata(&x, &f, TRUE, t, i * 2, (LPBYTE)"x\n", 2);
+        t += ONE_FTSECOND / 2;
+    }
+    XTEST(idxcount(&f) == 5);
+    for (i = 0; i < 5; i++) {
+        idxrecord(&f, i, r);
+        XTEST(r[1] == i * 2);
+        XTEST(r[2] == i * 4);
+        XTEST(r[0] == (ULONGLONG)(5 + i) * ONE_FTSECOND);
+    }
+    free(f.data);
+}
+
+/**
+ * Records are written in batches and a write
+ * error stops the indexing of the data
+ */
+static void testbatch(void)
+{
+    SVCBATCH_INDEXER x;
+    IDXFILE f;
+    BYTE    b[400];
+    DWORD   i;
+
+    for (i = 0; i < 400; i += 2) {
+        b[i]     = 'l';
+        b[i + 1] = '\n';
+    }
+    idxopen(&f, &x, 1);
+    XTEST(xindexdata(&x, &f, TRUE, 0, 0, b, 400) == 0);
+    XTEST(idxcount(&f) == 200);
+    XTEST(f.calls == 4);
+    free(f.data);
+
+    idxopen(&f, &x, 1);
+    xindexdata(&x, &f, TRUE, 0, 0, b, 2);
+    XTEST(f.calls == 1);
+    f.fail = 3;
+    XTEST(xindexdata(&x, &f, TRUE, 0, 2, b, 400) == ERROR_DISK_FULL);
+    XTEST(idxcount(&f) == 1 + SVCBATCH_INDEX_BATCH);
+    free(f.data);
+}
+
+/**
+ * Random writes of random lines. With a fixed time
+ * every record points to the start of the line
+ * numbered by a multiple of the interval.
+ */
+static void testrandom(DWORD every)
+{
+    SVCBATCH_INDEXER x;
+    IDXFILE   f;
+    DWORD     len   = 1024 * 1024;
+    LPBYTE    data  = (LPBYTE)xmmalloc(len);
+    DWORD    *start = (DWORD *)xmmalloc(len * sizeof(DWORD));
+    DWORD     lines = 0;
+    DWORD     pos   = 0;
+    DWORD     bad   = 0;
+    BOOL      sol   = TRUE;
+    ULONGLONG r[3];
+    DWORD     i;
+
+    for (i = 0; i < len; i++) {
+        if ((i == 0) || (data[i - 1] == '\n'))
+            start[lines++] = i;
+        data[i] = (xtestrand() % 40) ? 'a' + i % 26 : '\n';
+    }
+    idxopen(&f, &x, every);
+    while (pos < len) {
+        DWORD n = 1 + xtestrand() % 300;
+
+        if ((pos + n) > len)
+            n = len - pos;
+        xindexdata(&x, &f, sol, 1000, pos, data + pos, n);
+        sol  = data[pos + n - 1] == '\n';
+        pos += n;
+    }
+    XTEST(idxcount(&f) == (lines + every - 1) / every);
+    for (i = 0; i < idxcount(&f); i++) {
+        idxrecord(&f, i, r);
+        if ((r[1] != (ULONGLONG)i * every) || (r[2] != start[r[1]]))
+            bad++;
+    }
+    XTEST(bad == 0);
+    free(f.data);
+    xfree(start);
+    xfree(data);
+}
+
+static void benchmark(void)
+{
+    DWORD  every[] = { 1, 100, 10000 };
+    DWORD  len     = 65536;
+    DWORD  count   = 4000;
+    LPBYTE data    = (LPBYTE)xmmalloc(len);
+    DWORD  i;
+    DWORD  j;
+
+    for (i = 0; i < len; i++)
+        data[i] = ((i % 80) == 79) ? '\n' : 'a' + i % 26;
+    for (j = 0; j < 3; j++) {
+        SVCBATCH_INDEXER x;
+        IDXFILE   f;
+        ULONGLONG t;
+
+        idxopen(&f, &x, every[j]);
+        t = xtestnsec();
+        for (i = 0; i < count; i++) {
+            f.len = 8;
+            xindexdata(&x, &f, TRUE, 1000, (LONGLONG)i * len, data, len);
+        }
+        t = xtestnsec() - t;
+        printf("index every %5u lines: %8.1f MB/s, %6u records per MB\n",
+               every[j], (double)len * count * 1000.0 / (double)t,
+               (DWORD)((ULONGLONG)x.lines / every[j] * 1048576 /
+                       ((ULONGLONG)len * count)));
+        free(f.data);
+    }
+    xfree(data);
+}
+
+int main(int argc, char **argv)
+{
+    testlayout();
+    testlines();
+    testtime();
+    testbatch();
+    testrandom(1);
+    testrandom(7);
+    testrandom(1000);
+
+    if (xtestfailed) {
+        fprintf(stderr, "testindex: %d checks failed\n", xtestfailed);
+        return 1;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+        benchmark();
+    printf("testindex: passed\n");
+    return 0;
+}
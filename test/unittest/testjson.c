@@ -0,0 +1,282 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * JSON string escape tests
+ *
+ * The same source is built as testjson, testjson_scalar
+ * and testjson_avx2, so each xmemjson code path is checked
+ * against the plain byte search.
+ *
+ * Usage: testjson [-b]
+ *        -b  run the escape throughput benchmark
+ */
+
+#if HAVE_AVX2_INTRIN
+# define JSON_VARIANT   "avx2"
+#elif HAVE_SSE2_INTRIN
+# define JSON_VARIANT   "sse2"
+#else
+# define JSON_VARIANT   "scalar"
+#endif
+
+static unsigned int xtestseed = 1;
+
+static unsigned int xtestrand(void)
+{
+    xtestseed = xtestseed * 1103515245 + 12345;
+    return (xtestseed >> 8) & 0xFFFFFF;
+}
+
+static BOOL mustescape(BYTE c)
+{
+    return (c < 32) || (c == '"') || (c == '\\');
+}
+
+/**
+ * Escape the data the same way the log writer does
+ */
+static DWORD escape(LPBYTE d, LPBYTE s, DWORD len)
+{
+    LPBYTE e = s + len;
+    LPBYTE p;
+    DWORD  n = 0;
+
+    while (s < e) {
+        p = xmemjson(s, e);
+        if (p == NULL)
+            p = e;
+        memcpy(d + n, s, p - s);
+        n += (DWORD)(p - s);
+        if (p == e)
+            break;
+        n += xjsonesc(d + n, *p);
+        s = p + 1;
+    }
+    return n;
+}
+
+static int hexval(BYTE c)
+{
+    if ((c >= '0') && (c <= '9'))
+        return c - '0';
+    if ((c >= 'a') && (c <= 'f'))
+        return c - 'a' + 10;
+    return -1;
+}
+
+/**
+ * Decode the JSON string content.
+ * Returns the decoded length or -1 if the
+ * content is not a valid JSON string.
+ */
+static int unescape(LPBYTE d, LPBYTE s, DWORD len)
+{
+    DWORD i = 0;
+    int   n = 0;
+
+    while (i < len) {
+        BYTE c = s[i++];
+
+        if (c == '"' || c < 32)
+            return -1;
+        if (c != '\\') {
+            d[n++] = c;
+            continue;
+        }
+        if (i >= len)
+            return -1;
+        c = s[i++];
+        switch (c) {
+            case '"':
+            case '\\':
+            case '/':
+                d[n++] = c;
+            break;
+            case 'b':
+                d[n++] = '\b';
+            break;
+            case 'f':
+                d[n++] = '\f';
+            break;
+            case 'n':
+                d[n++] = '\n';
+            break;
+            case 'r':
+                d[n++] = '\r';
+            break;
+            case 't':
+                d[n++] = '\t';
+            break;
+            case 'u':
+                if (((i + 4) > len) || (s[i] != '0') || (s[i + 1] != '0') ||
+                    (hexval(s[i + 2]) < 0) || (hexval(s[i + 3]) < 0))
+                    return -1;
+                d[n++] = (BYTE)(hexval(s[i + 2]) * 16 + hexval(s[i + 3]));
+                i += 4;
+            break;
+            default:
+                return -1;
+            break;
+        }
+    }
+    return n;
+}
+
+/**
+ * Check xmemjson against the byte search for
+ * every byte value at every position
+ */
+static void testmemjson(void)
+{
+    BYTE  b[96];
+    DWORD c;
+    DWORD i;
+    DWORD j;
+
+    for (c = 0; c < 256; c++) {
+        memset(b, 'a', sizeof(b));
+        for (i = 0; i < sizeof(b); i++) {
+            b[i] = (BYTE)c;
+            for (j = 0; j < 40; j++) {
+                LPBYTE r = NULL;
+
+                if ((j <= i) && mustescape((BYTE)c))
+                    r = b + i;
+                XTEST(xmemjson(b + j, b + sizeof(b)) == r);
+                if (j <= i)
+                    XTEST(xmemjson(b + j, b + i) == NULL);
+            }
+            b[i] = 'a';
+        }
+    }
+    for (i = 0; i < 2000; i++) {
+        DWORD s = xtestrand() % 40;
+        DWORD e = s + xtestrand() % (sizeof(b) - s + 1);
+        LPBYTE r = NULL;
+
+        for (j = 0; j < sizeof(b); j++)
+            b[j] = (BYTE)(32 + xtestrand() % 224);
+        for (j = 0; j < 3; j++) {
+            if (xtestrand() & 1)
+                b[xtestrand() % sizeof(b)] = (BYTE)(xtestrand() % 32);
+        }
+        for (j = s; j < e; j++) {
+            if (mustescape(b[j])) {
+                r = b + j;
+                break;
+            }
+        }
+        XTEST(xmemjson(b + s, b + e) == r);
+    }
+}
+
+/**
+ * Every byte must survive the escape and decode
+ */
+static void testroundtrip(void)
+{
+    BYTE  s[4096];
+    BYTE  d[4096 * 6];
+    BYTE  u[4096];
+    DWORD n;
+    DWORD i;
+    DWORD k;
+    int   m;
+
+    for (i = 0; i < 256; i++)
+        s[i] = (BYTE)i;
+    n = escape(d, s, 256);
+    m = unescape(u, d, n);
+    XTEST(m == 256);
+    XTEST((m == 256) && (memcmp(u, s, 256) == 0));
+    for (i = 0; i < n; i++)
+        XTEST(d[i] >= 32);
+
+    n = escape(d, (LPBYTE)"a\"b\\c\td\x01", 8);
+    XTEST((n == 16) && (memcmp(d, "a\\\"b\\\\c\\td\\u0001", 16) == 0));
+    n = escape(d, (LPBYTE)"\x1f\x7f\b\f", 4);
+    XTEST((n == 11) && (memcmp(d, "\\u001f\x7f\\b\\f", 11) == 0));
+
+    for (k = 0; k < 500; k++) {
+        DWORD len = xtestrand() % sizeof(s);
+
+        for (i = 0; i < len; i++) {
+            DWORD r = xtestrand() % 100;
+
+            s[i] = r < 5 ? (BYTE)(xtestrand() % 32) :
+                   r < 8 ? '"' : r < 10 ? '\\' : (BYTE)(32 + xtestrand() % 224);
+        }
+        n = escape(d, s, len);
+        m = unescape(u, d, n);
+        XTEST((m == (int)len) && (memcmp(u, s, len) == 0));
+    }
+}
+
+static void benchmark(void)
+{
+    DWORD     size = 16 * 1024 * 1024;
+    LPBYTE    s    = (LPBYTE)xmmalloc(size);
+    LPBYTE    d    = (LPBYTE)xmmalloc(size * 2);
+    DWORD     rare[] = { 0, 200 };
+    LPCSTR    name[] = { "no escapes", "1 in 200 escaped" };
+    DWORD     i;
+    DWORD     r;
+
+    for (r = 0; r < 2; r++) {
+        ULONGLONG t;
+        int       k;
+
+        for (i = 0; i < size; i++) {
+            s[i] = (BYTE)('a' + i % 26);
+            if (rare[r] && ((xtestrand() % rare[r]) == 0))
+                s[i] = '"';
+        }
+        t = xtestnsec();
+        for (k = 0; k < 8; k++)
+            escape(d, s, size);
+        t = xtestnsec() - t;
+        printf("json %-6s %-16s: %6.2f GB/s\n",
+               JSON_VARIANT, name[r], (double)size * 8.0 / (double)t);
+    }
+    xfree(s);
+    xfree(d);
+}
+
+int main(int argc, char **argv)
+{
+#if HAVE_AVX2_INTRIN
+    if (!__builtin_cpu_supports("avx2")) {
+        printf("testjson: skipped, AVX2 is not supported\n");
+        return 0;
+    }
+#endif
+    testmemjson();
+    testroundtrip();
+
+    if (xtestfailed) {
+        fprintf(stderr, "testjson %s: %d checks failed\n",
+                JSON_VARIANT, xtestfailed);
+        return 1;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+        benchmark();
+    printf("testjson %s: passed\n", JSON_VARIANT);
+    return 0;
+}
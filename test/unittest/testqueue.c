@@ -0,0 +1,167 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include <pthread.h>
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * SPSC queue tests
+ *
+ * Usage: testqueue [-b]
+ *        -b  run the contention benchmark
+ */
+
+#define ITEM(_i)    ((LPVOID)(uintptr_t)((_i) + 1))
+
+typedef struct {
+    LPSVCBATCH_QUEUE    q;
+    ULONGLONG           count;
+    ULONGLONG           full;
+    ULONGLONG           empty;
+    ULONGLONG           bad;
+} STRESS;
+
+static void *producer(void *arg)
+{
+    STRESS   *s = (STRESS *)arg;
+    ULONGLONG i;
+
+    for (i = 0; i < s->count; i++) {
+        while (!xqueuepush(s->q, ITEM(i))) {
+            s->full++;
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    STRESS   *s = (STRESS *)arg;
+    ULONGLONG i;
+    LPVOID    p;
+
+    for (i = 0; i < s->count; i++) {
+        while ((p = xqueuepop(s->q)) == NULL) {
+            s->empty++;
+            sched_yield();
+        }
+        if (p != ITEM(i))
+            s->bad++;
+    }
+    return NULL;
+}
+
+static ULONGLONG stress(LONG size, LONG start, ULONGLONG count, STRESS *s)
+{
+    pthread_t pt;
+    pthread_t ct;
+    ULONGLONG t;
+
+    memset(s, 0, sizeof(STRESS));
+    s->q     = xqueueinit(size);
+    s->count = count;
+    s->q->head = start;
+    s->q->tail = start;
+    t = xtestnsec();
+    pthread_create(&ct, NULL, consumer, s);
+    pthread_create(&pt, NULL, producer, s);
+    pthread_join(pt, NULL);
+    pthread_join(ct, NULL);
+    t = xtestnsec() - t;
+    XTEST(xqueuepop(s->q) == NULL);
+    xqueuefree(s->q);
+    return t;
+}
+
+static void testfillempty(LONG start)
+{
+    LPSVCBATCH_QUEUE q;
+    LONG i;
+    LONG n;
+
+    q = xqueueinit(8);
+    q->head = start;
+    q->tail = start;
+    XTEST(xqueuepop(q) == NULL);
+    for (n = 0; n < 5; n++) {
+        /**
+         * Fill and drain the ring several times,
+         * so the counters cross the start value
+         */
+        for (i = 0; i < 8; i++)
+            XTEST(xqueuepush(q, ITEM(i)));
+        XTEST(!xqueuepush(q, ITEM(8)));
+        for (i = 0; i < 8; i++)
+            XTEST(xqueuepop(q) == ITEM(i));
+        XTEST(xqueuepop(q) == NULL);
+    }
+    /**
+     * Partial fill at an odd ring offset
+     */
+    for (i = 0; i < 3; i++)
+        XTEST(xqueuepush(q, ITEM(i)));
+    XTEST(xqueuepop(q) == ITEM(0));
+    for (i = 3; i < 9; i++)
+        XTEST(xqueuepush(q, ITEM(i)));
+    XTEST(!xqueuepush(q, ITEM(9)));
+    for (i = 1; i < 9; i++)
+        XTEST(xqueuepop(q) == ITEM(i));
+    XTEST(xqueuepop(q) == NULL);
+    xqueuefree(q);
+}
+
+int main(int argc, char **argv)
+{
+    STRESS    s;
+    ULONGLONG t;
+
+    testfillempty(0);
+    testfillempty(0x7FFFFFFC);
+    testfillempty(-4);
+
+    /**
+     * Small ring, so the producer runs into
+     * a full queue and the consumer into an empty one.
+     * The counters start just before they overflow.
+     */
+    stress(4, 0x7FFFFF00, 2000000, &s);
+    XTEST(s.bad == 0);
+    XTEST(s.full > 0);
+    XTEST(s.empty > 0);
+    stress(SVCBATCH_QUEUE_LEN, -1000, 2000000, &s);
+    XTEST(s.bad == 0);
+
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0)) {
+        LONG      sizes[] = { 4, 16, SVCBATCH_QUEUE_LEN, 1024 };
+        ULONGLONG n = 20000000;
+        int       i;
+
+        for (i = 0; i < 4; i++) {
+            t = stress(sizes[i], 0, n, &s);
+            printf("queue %4d: %7.2f M items/s, %llu full, %llu empty\n",
+                   (int)sizes[i], (double)n * 1000.0 / (double)t,
+                   (unsigned long long)s.full, (unsigned long long)s.empty);
+        }
+    }
+    if (xtestfailed) {
+        fprintf(stderr, "testqueue: %d checks failed\n", xtestfailed);
+        return 1;
+    }
+    printf("testqueue: passed\n");
+    return 0;
+}
@@ -0,0 +1,286 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * LogRetainBytes and LogRetainDays selection tests
+ *
+ * The removal pass is replayed the same way as
+ * logretainrun, without the rate limit. Names are
+ * only used as the removed marker.
+ *
+ * Usage: testretain [-b]
+ *        -b  run the catalog selection benchmark
+ */
+
+static unsigned int xtestseed = 1;
+
+static unsigned int xtestrand(void)
+{
+    xtestseed = xtestseed * 1103515245 + 12345;
+    return (xtestseed >> 8) & 0xFFFFFF;
+}
+
+static WCHAR name[] = { 'f', 0 };
+
+typedef struct _CATALOG {
+    SVCBATCH_RETAIN_FILE files[1024];
+    DWORD               count;
+    ULONGLONG           total;
+    DWORD               removed;
+    DWORD               locked;
+    SVCBATCH_RETAIN_FILE last;
+} CATALOG;
+
+static void catadd(CATALOG *c, ULONGLONG size, ULONGLONG time, BOOL live)
+{
+    LPSVCBATCH_RETAIN_FILE f = c->files + c->count++;
+
+    memset(f, 0, sizeof(SVCBATCH_RETAIN_FILE));
+    f->size = size;
+    f->time = time;
+    f->live = live;
+    f->name = name;
+}
+
+/**
+ * Files with the time of the locked value
+ * cannot be removed
+ */
+static void catrun(CATALOG *c, ULONGLONG bytes, DWORD days, ULONGLONG ct)
+{
+    BOOL  expired;
+    DWORD i;
+
+    c->total   = 0;
+    c->removed = 0;
+    for (i = 0; i < c->count; i++) {
+        if (!c->files[i].live)
+            c->total += c->files[i].size;
+    }
+    qsort(c->files, c->count, sizeof(SVCBATCH_RETAIN_FILE), xretaincmp);
+    for (i = 0; ; i++) {
+        i = xretainnext(c->files, c->count, i, c->total,
+                        bytes, days, ct, &expired);
+        if (i == c->count)
+            break;
+        if (c->locked && (c->files[i].time == c->locked))
+            continue;
+        c->total -= c->files[i].size;
+        c->last   = c->files[i];
+        c->files[i].name = NULL;
+        c->removed++;
+    }
+    c->count = xretaincompact(c->files, c->count);
+}
+
+static void testbytes(void)
+{
+    CATALOG c;
+    DWORD   i;
+
+    memset(&c, 0, sizeof(c));
+    for (i = 10; i > 0; i--)
+        catadd(&c, 100, i, FALSE);
+    catrun(&c, 450, 0, 100);
+    XTEST(c.removed == 6);
+    XTEST((c.count == 4) && (c.total == 400));
+    for (i = 0; i < 4; i++)
+        XTEST(c.files[i].time == 7 + i);
+
+    /**
+     * Total at the limit removes nothing
+     */
+    catrun(&c, 400, 0, 100);
+    XTEST((c.removed == 0) && (c.count == 4));
+
+    /**
+     * No limits
+     */
+    catrun(&c, 0, 0, 100);
+    XTEST((c.removed == 0) && (c.count == 4));
+}
+
+/**
+ * Live files are not counted and never removed,
+ * even if they are the oldest ones
+ */
+static void testlive(void)
+{
+    CATALOG c;
+
+    memset(&c, 0, sizeof(c));
+    catadd(&c, 1000, 1, TRUE);
+    catadd(&c, 100, 2, FALSE);
+    catadd(&c, 100, 3, FALSE);
+    catadd(&c, 100, 4, TRUE);
+    catadd(&c, 100, 5, FALSE);
+    catrun(&c, 150, 0, 100);
+    XTEST(c.removed == 2);
+    XTEST(c.count == 3);
+    XTEST(c.total == 100);
+    XTEST((c.files[0].time == 1) && (c.files[1].time == 4));
+    XTEST(c.files[2].time == 5);
+}
+
+static void testdays(void)
+{
+    CATALOG   c;
+    ULONGLONG ct = 10 * ONE_DAY;
+    DWORD     i;
+
+    memset(&c, 0, sizeof(c));
+    for (i = 1; i < 10; i++)
+        catadd(&c, 100, i * ONE_DAY, FALSE);
+    /**
+     * File from the future is never expired
+     */
+    catadd(&c, 100, 11 * ONE_DAY, FALSE);
+    catrun(&c, 0, 3, ct);
+    XTEST(c.removed == 6);
+    XTEST(c.files[0].time == 7 * ONE_DAY);
+    XTEST(c.count == 4);
+
+    /**
+     * Either limit removes the file
+     */
+    catrun(&c, 250, 3, ct);
+    XTEST(c.removed == 2);
+    XTEST(c.files[0].time == 9 * ONE_DAY);
+}
+
+/**
+ * File that cannot be removed stays in the catalog
+ * and the next ones are removed in its place
+ */
+static void testlocked(void)
+{
+    CATALOG c;
+    DWORD   i;
+
+    memset(&c, 0, sizeof(c));
+    for (i = 1; i <= 5; i++)
+        catadd(&c, 100, i, FALSE);
+    c.locked = 1;
+    catrun(&c, 300, 0, 100);
+    XTEST(c.removed == 2);
+    XTEST(c.count == 3);
+    XTEST((c.files[0].time == 1) && (c.files[1].time == 4));
+}
+
+/**
+ * Random catalogs. The removed files are the oldest
+ * ones that are not live, and what is left is within
+ * both limits.
+ */
+static void testrandom(void)
+{
+    DWORD run;
+    DWORD bad = 0;
+
+    for (run = 0; run < 1000; run++) {
+        CATALOG   c;
+        ULONGLONG ct    = 100 * ONE_DAY;
+        ULONGLONG bytes = xtestrand() % 3 ? xtestrand() % 100000 : 0;
+        DWORD     days  = xtestrand() % 3 ? xtestrand() % 100 : 0;
+        ULONGLONG kept  = 0;
+        DWORD     n     = 1 + xtestrand() % 200;
+        DWORD     i;
+
+        memset(&c, 0, sizeof(c));
+        for (i = 0; i < n; i++)
+            catadd(&c, xtestrand() % 4096, (ULONGLONG)(xtestrand() % 10000) *
+                   (ONE_DAY / 100), (xtestrand() % 20) == 0);
+        catrun(&c, bytes, days, ct);
+        if (c.count + c.removed != n)
+            bad++;
+        for (i = 0; i < c.count; i++) {
+            LPSVCBATCH_RETAIN_FILE f = c.files + i;
+
+            if ((i > 0) && (f->time < c.files[i - 1].time))
+                bad++;
+            if (f->live)
+                continue;
+            kept += f->size;
+            if (days && ((ct - f->time) > days * ONE_DAY))
+                bad++;
+        }
+        if (kept != c.total)
+            bad++;
+        if (bytes && (c.total > bytes))
+            bad++;
+        /**
+         * Keeping the last removed file would
+         * have been above a limit
+         */
+        if (c.removed) {
+            BOOL expired = days && ((ct - c.last.time) > days * ONE_DAY);
+
+            if (!expired &&
+                ((bytes == 0) || (c.total + c.last.size <= bytes)))
+                bad++;
+        }
+    }
+    XTEST(bad == 0);
+}
+
+static void benchmark(void)
+{
+    DWORD counts[] = { 100, 1000 };
+    DWORD loops    = 20000;
+    DWORD j;
+
+    for (j = 0; j < 2; j++) {
+        ULONGLONG t = 0;
+        DWORD     i;
+        DWORD     k;
+
+        for (k = 0; k < loops; k++) {
+            CATALOG   c;
+            ULONGLONG s;
+
+            c.count = 0;
+            for (i = 0; i < counts[j]; i++)
+                catadd(&c, 1024, xtestrand(), FALSE);
+            s = xtestnsec();
+            catrun(&c, (ULONGLONG)counts[j] * 1024 * 9 / 10, 0, 0);
+            t += xtestnsec() - s;
+        }
+        printf("retain %4u files: %8.1f us per pass, %6.1f ns per file\n",
+               counts[j], (double)t / loops / 1000.0,
+               (double)t / loops / counts[j]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    testbytes();
+    testlive();
+    testdays();
+    testlocked();
+    testrandom();
+
+    if (xtestfailed) {
+        fprintf(stderr, "testretain: %d checks failed\n", xtestfailed);
+        return 1;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+        benchmark();
+    printf("testretain: passed\n");
+    return 0;
+}
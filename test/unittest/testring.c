@@ -0,0 +1,351 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include <pthread.h>
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * Overlapped read ring tests
+ *
+ * The pipe is simulated. Each issued read gets the
+ * next sequence number, and must be consumed in
+ * that order, whatever order the reads complete in.
+ *
+ * Usage: testring [-b]
+ *        -b  run the bursty producer benchmark
+ */
+
+#define SLOT_PENDING    0
+#define SLOT_DONE       1
+#define SLOT_FAILED     2
+#define MAX_SLOTS       16
+
+static unsigned int xtestseed = 1;
+
+static unsigned int xtestrand(void)
+{
+    xtestseed = xtestseed * 1103515245 + 12345;
+    return (xtestseed >> 8) & 0xFFFFFF;
+}
+
+typedef struct {
+    int       state[MAX_SLOTS];
+    DWORD     seq[MAX_SLOTS];
+    DWORD     err[MAX_SLOTS];
+    DWORD     issued;
+    DWORD     next;
+    DWORD     bad;
+    DWORD     failissue;
+    DWORD     failconsume;
+} SIM;
+
+static DWORD simresult(LPVOID ctx, DWORD i)
+{
+    SIM *m = (SIM *)ctx;
+
+    if (m->state[i] == SLOT_PENDING)
+        return ERROR_IO_INCOMPLETE;
+    if (m->state[i] == SLOT_FAILED)
+        return m->err[i];
+    return 0;
+}
+
+static DWORD simconsume(LPVOID ctx, DWORD i)
+{
+    SIM *m = (SIM *)ctx;
+
+    if (m->seq[i] != m->next)
+        m->bad++;
+    m->next++;
+    if (m->failconsume && (m->seq[i] == m->failconsume))
+        return 112;
+    return 0;
+}
+
+static DWORD simissue(LPVOID ctx, DWORD i)
+{
+    SIM *m = (SIM *)ctx;
+
+    m->seq[i]   = m->issued++;
+    m->state[i] = SLOT_PENDING;
+    if (m->failissue && (m->seq[i] == m->failissue)) {
+        m->state[i] = SLOT_FAILED;
+        m->err[i]   = 109;
+        return 109;
+    }
+    return 0;
+}
+
+static void siminit(SIM *m, LPSVCBATCH_RING r, DWORD size)
+{
+    DWORD i;
+
+    memset(m, 0, sizeof(SIM));
+    xringinit(r, size, m, simresult, simconsume, simissue);
+    for (i = 0; i < size; i++)
+        simissue(m, i);
+}
+
+/**
+ * Reads complete in random order
+ */
+static void testorder(void)
+{
+    SVCBATCH_RING r;
+    SIM   m;
+    DWORD size;
+    DWORD i;
+
+    for (size = 1; size <= 8; size++) {
+        siminit(&m, &r, size);
+        for (i = 0; i < 20000; i++) {
+            DWORD s = xtestrand() % size;
+
+            if (m.state[s] == SLOT_PENDING)
+                m.state[s] = SLOT_DONE;
+            XTEST(xringrun(&r) == 0);
+            XTEST(m.state[r.head] == SLOT_PENDING);
+        }
+        XTEST(m.bad == 0);
+        XTEST(m.next > 5000);
+        XTEST(m.issued == m.next + size);
+    }
+
+    /**
+     * Nothing completed
+     */
+    siminit(&m, &r, 4);
+    XTEST(xringrun(&r) == 0);
+    XTEST((m.next == 0) && (r.head == 0));
+}
+
+/**
+ * Failed reissue drains the reads that completed
+ * after the head up to the first pending one
+ */
+static void testdrain(void)
+{
+    SVCBATCH_RING r;
+    SIM m;
+
+    siminit(&m, &r, 4);
+    m.state[0] = SLOT_DONE;
+    m.state[1] = SLOT_DONE;
+    m.state[3] = SLOT_DONE;
+    m.failissue = 4;
+    XTEST(xringrun(&r) == 109);
+    XTEST((m.next == 2) && (m.bad == 0));
+    XTEST(r.head == 0);
+
+    /**
+     * All the other reads completed
+     */
+    siminit(&m, &r, 4);
+    m.state[1] = SLOT_DONE;
+    m.state[2] = SLOT_DONE;
+    m.state[3] = SLOT_DONE;
+    m.state[0] = SLOT_DONE;
+    m.failissue = 4;
+    XTEST(xringrun(&r) == 109);
+    XTEST((m.next == 4) && (m.bad == 0));
+
+    /**
+     * Drain stops at the failed read
+     */
+    siminit(&m, &r, 4);
+    m.state[1] = SLOT_DONE;
+    m.state[2] = SLOT_FAILED;
+    m.err[2]   = 109;
+    m.state[3] = SLOT_DONE;
+    m.next     = 1;
+    XTEST(xringdrain(&r) == 1);
+    XTEST((m.next == 2) && (m.bad == 0));
+
+    /**
+     * Drain stops after the failed consume
+     */
+    siminit(&m, &r, 4);
+    m.state[1] = SLOT_DONE;
+    m.state[2] = SLOT_DONE;
+    m.state[3] = SLOT_DONE;
+    m.failconsume = 2;
+    m.next = 1;
+    XTEST(xringdrain(&r) == 2);
+    XTEST((m.next == 3) && (m.bad == 0));
+}
+
+/**
+ * Errors at the head are returned in the issue order
+ */
+static void testerrors(void)
+{
+    SVCBATCH_RING r;
+    SIM m;
+
+    /**
+     * Read failed when it was issued
+     * after the completed ones
+     */
+    siminit(&m, &r, 4);
+    m.state[0] = SLOT_DONE;
+    m.state[1] = SLOT_FAILED;
+    m.err[1]   = 109;
+    m.state[2] = SLOT_DONE;
+    XTEST(xringrun(&r) == 109);
+    XTEST((m.next == 1) && (r.head == 1));
+
+    /**
+     * Failed consume does not reissue the read
+     */
+    siminit(&m, &r, 4);
+    m.state[0] = SLOT_DONE;
+    m.state[1] = SLOT_DONE;
+    m.failconsume = 1;
+    XTEST(xringrun(&r) == 112);
+    XTEST((m.next == 2) && (m.issued == 5) && (r.head == 1));
+}
+
+/**
+ * Bursty producer and a log writer with the
+ * occasional slow write. The producer is the child
+ * writing to the pipe. It stalls when no read is
+ * in flight to take its data.
+ */
+#define CHUNK_LEN       4096
+#define BURST_CHUNKS    4
+#define BURST_IDLE      100000
+#define SLOW_EVERY      16
+#define SLOW_WRITE      200000
+
+typedef struct {
+    SVCBATCH_RING     r;
+    volatile LONG     state[MAX_SLOTS];
+    BYTE              data[MAX_SLOTS][CHUNK_LEN];
+    BYTE              sink[CHUNK_LEN];
+    ULONGLONG         chunks;
+    ULONGLONG         consumed;
+    ULONGLONG         stall;
+} BENCH;
+
+/**
+ * The child and the writer sleep, so the
+ * benchmark runs on a single CPU as well
+ */
+static void pause(long ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = 0;
+    ts.tv_nsec = ns;
+    nanosleep(&ts, NULL);
+}
+
+static DWORD benchresult(LPVOID ctx, DWORD i)
+{
+    BENCH *b = (BENCH *)ctx;
+
+    if (__atomic_load_n(&b->state[i], __ATOMIC_ACQUIRE) != SLOT_DONE)
+        return ERROR_IO_INCOMPLETE;
+    return 0;
+}
+
+static DWORD benchconsume(LPVOID ctx, DWORD i)
+{
+    BENCH *b = (BENCH *)ctx;
+
+    memcpy(b->sink, b->data[i], CHUNK_LEN);
+    if ((++b->consumed % SLOW_EVERY) == 0)
+        pause(SLOW_WRITE);
+    return 0;
+}
+
+static DWORD benchissue(LPVOID ctx, DWORD i)
+{
+    BENCH *b = (BENCH *)ctx;
+
+    __atomic_store_n(&b->state[i], SLOT_PENDING, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void *benchproducer(void *arg)
+{
+    BENCH    *b = (BENCH *)arg;
+    BYTE      src[CHUNK_LEN];
+    ULONGLONG i;
+    DWORD     p = 0;
+
+    memset(src, 'p', sizeof(src));
+    for (i = 0; i < b->chunks; i++) {
+        if (__atomic_load_n(&b->state[p], __ATOMIC_ACQUIRE) != SLOT_PENDING) {
+            ULONGLONG t = xtestnsec();
+
+            while (__atomic_load_n(&b->state[p], __ATOMIC_ACQUIRE) != SLOT_PENDING)
+                sched_yield();
+            b->stall += xtestnsec() - t;
+        }
+        memcpy(b->data[p], src, CHUNK_LEN);
+        __atomic_store_n(&b->state[p], SLOT_DONE, __ATOMIC_RELEASE);
+        p = (p + 1) % b->r.size;
+        if (((i + 1) % BURST_CHUNKS) == 0)
+            pause(BURST_IDLE);
+    }
+    return NULL;
+}
+
+static void benchmark(void)
+{
+    DWORD sizes[] = { 1, 2, 4, 8, 16 };
+    DWORD k;
+
+    for (k = 0; k < 5; k++) {
+        BENCH    *b = (BENCH *)xmcalloc(sizeof(BENCH));
+        pthread_t pt;
+        ULONGLONG t;
+
+        xringinit(&b->r, sizes[k], b, benchresult, benchconsume, benchissue);
+        b->chunks = 8192;
+        t = xtestnsec();
+        pthread_create(&pt, NULL, benchproducer, b);
+        while (b->consumed < b->chunks) {
+            XTEST(xringrun(&b->r) == 0);
+            sched_yield();
+        }
+        pthread_join(pt, NULL);
+        t = xtestnsec() - t;
+        printf("ring %2u reads: %7.1f MB/s, producer stalled %5.1f%% of %4llu ms\n",
+               sizes[k], (double)b->chunks * CHUNK_LEN * 1000.0 / (double)t,
+               (double)b->stall * 100.0 / (double)t,
+               (unsigned long long)(t / 1000000));
+        xfree(b);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    testorder();
+    testdrain();
+    testerrors();
+
+    if (xtestfailed) {
+        fprintf(stderr, "testring: %d checks failed\n", xtestfailed);
+        return 1;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+        benchmark();
+    printf("testring: passed\n");
+    return 0;
+}
@@ -0,0 +1,301 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * Log rotation stall tests
+ *
+ * The rotatelogs sequence is replayed with the POSIX
+ * file calls. The locked rotation flushes, closes,
+ * renames and opens the log while holding the log lock,
+ * the same as before the handle swap. The swap rotation
+ * renames the live log and opens the next one outside
+ * the lock, swaps the handle under the lock and flushes
+ * and closes the previous log after it is released.
+ *
+ * The longest stall includes the scheduling delay
+ * of the writer, the lock hold time does not.
+ *
+ * Usage: testrotate [-b]
+ *        -b  run the longest write stall benchmark
+ */
+
+#define RECORD_LEN  100
+#define MAX_LOGS    9
+
+typedef struct _ROTLOG {
+    pthread_mutex_t     lock;
+    int                 fd;
+    int                 swap;
+    char                name[256];
+    volatile LONG       done;
+    DWORD               records;
+    DWORD               rotations;
+    ULONGLONG           interval;
+    ULONGLONG           maxstall;
+    ULONGLONG           maxhold;
+    ULONGLONG           slow;
+    DWORD               bad;
+} ROTLOG;
+
+static int rotopen(ROTLOG *r)
+{
+    return open(r->name, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0644);
+}
+
+/**
+ * Rename the previous logs and the current one
+ * to the .0 file, the same as rotateprevlogs
+ */
+static void rotprevlogs(ROTLOG *r)
+{
+    char pn[300];
+    char nn[300];
+    int  i;
+
+    for (i = MAX_LOGS; i > 0; i--) {
+        snprintf(pn, sizeof(pn), "%s.%d", r->name, i - 1);
+        snprintf(nn, sizeof(nn), "%s.%d", r->name, i);
+        if ((rename(pn, nn) != 0) && (errno != ENOENT))
+            r->bad++;
+    }
+    snprintf(nn, sizeof(nn), "%s.0", r->name);
+    if (rename(r->name, nn) != 0)
+        r->bad++;
+}
+
+static void rotheld(ROTLOG *r, ULONGLONG t)
+{
+    t = xtestnsec() - t;
+    if (t > r->maxhold)
+        r->maxhold = t;
+}
+
+static void rotlocked(ROTLOG *r)
+{
+    ULONGLONG t;
+
+    pthread_mutex_lock(&r->lock);
+    t = xtestnsec();
+    fsync(r->fd);
+    close(r->fd);
+    rotprevlogs(r);
+    r->fd = rotopen(r);
+    if (r->fd < 0)
+        r->bad++;
+    rotheld(r, t);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void rotswap(ROTLOG *r)
+{
+    int       fd;
+    int       pd;
+    ULONGLONG t;
+
+    rotprevlogs(r);
+    fd = rotopen(r);
+    if (fd < 0) {
+        r->bad++;
+        return;
+    }
+    pthread_mutex_lock(&r->lock);
+    t     = xtestnsec();
+    pd    = r->fd;
+    r->fd = fd;
+    rotheld(r, t);
+    pthread_mutex_unlock(&r->lock);
+    fsync(pd);
+    close(pd);
+}
+
+static void *rotthread(void *arg)
+{
+    ROTLOG *r = (ROTLOG *)arg;
+
+    while (!InterlockedCompareExchange(&r->done, 0, 0)) {
+        struct timespec ts;
+
+        ts.tv_sec  = 0;
+        ts.tv_nsec = (long)r->interval * 1000000L;
+        nanosleep(&ts, NULL);
+        if (InterlockedCompareExchange(&r->done, 0, 0))
+            break;
+        if (r->swap)
+            rotswap(r);
+        else
+            rotlocked(r);
+        r->rotations++;
+    }
+    return NULL;
+}
+
+/**
+ * Write the records and measure the time each
+ * write waits for the log lock
+ */
+static void rotwrite(ROTLOG *r)
+{
+    char      b[RECORD_LEN];
+    DWORD     i;
+    ULONGLONG t;
+
+    for (i = 0; i < r->records; i++) {
+        int n = snprintf(b, sizeof(b), "%010u ", i);
+
+        memset(b + n, 'r', RECORD_LEN - n - 1);
+        b[RECORD_LEN - 1] = '\n';
+        t = xtestnsec();
+        pthread_mutex_lock(&r->lock);
+        if (write(r->fd, b, RECORD_LEN) != RECORD_LEN)
+            r->bad++;
+        pthread_mutex_unlock(&r->lock);
+        t = xtestnsec() - t;
+        if (t > r->maxstall)
+            r->maxstall = t;
+        if (t > 1000000)
+            r->slow++;
+    }
+}
+
+static void rotrun(ROTLOG *r, const char *dir, int swap,
+                   DWORD records, ULONGLONG interval)
+{
+    pthread_t rt;
+
+    memset(r, 0, sizeof(ROTLOG));
+    pthread_mutex_init(&r->lock, NULL);
+    snprintf(r->name, sizeof(r->name), "%s/service.log", dir);
+    r->swap     = swap;
+    r->records  = records;
+    r->interval = interval;
+    r->fd       = rotopen(r);
+    XTEST(r->fd >= 0);
+    pthread_create(&rt, NULL, rotthread, r);
+    rotwrite(r);
+    InterlockedExchange(&r->done, 1);
+    pthread_join(rt, NULL);
+    close(r->fd);
+    pthread_mutex_destroy(&r->lock);
+}
+
+/**
+ * Read the rotated logs from the oldest one and
+ * check that every record is there exactly once
+ */
+static DWORD rotverify(ROTLOG *r)
+{
+    char  fn[300];
+    char  b[RECORD_LEN];
+    DWORD next = 0;
+    int   i;
+
+    for (i = MAX_LOGS; i >= -1; i--) {
+        FILE *fp;
+
+        if (i < 0)
+            snprintf(fn, sizeof(fn), "%s", r->name);
+        else
+            snprintf(fn, sizeof(fn), "%s.%d", r->name, i);
+        fp = fopen(fn, "rb");
+        if (fp == NULL)
+            continue;
+        while (fread(b, 1, RECORD_LEN, fp) == RECORD_LEN) {
+            if ((DWORD)strtoul(b, NULL, 10) != next)
+                r->bad++;
+            next++;
+        }
+        fclose(fp);
+        unlink(fn);
+    }
+    return next;
+}
+
+/**
+ * No record is lost or duplicated by either
+ * rotation, while there are less rotations
+ * than the kept logs
+ */
+static void testrotate(const char *dir)
+{
+    ROTLOG r;
+    int    swap;
+
+    for (swap = 0; swap < 2; swap++) {
+        rotrun(&r, dir, swap, 200000, 20);
+        XTEST(r.rotations > 0);
+        if (r.rotations < MAX_LOGS)
+            XTEST(rotverify(&r) == 200000);
+        else
+            rotverify(&r);
+        XTEST(r.bad == 0);
+    }
+}
+
+static void benchmark(const char *dir)
+{
+    const char *name[] = { "locked", "swap" };
+    DWORD records      = 2000000;
+    int   swap;
+
+    for (swap = 0; swap < 2; swap++) {
+        ROTLOG    r;
+        ULONGLONG t;
+
+        t = xtestnsec();
+        rotrun(&r, dir, swap, records, 10);
+        t = xtestnsec() - t;
+        XTEST(r.bad == 0);
+        /**
+         * Only the last logs are kept
+         */
+        rotverify(&r);
+        printf("rotate %-6s: %4u rotations, lock held %8.1f us, "
+               "longest stall %8.1f us, %4llu writes over 1 ms, %5.1f MB/s\n",
+               name[swap], r.rotations, (double)r.maxhold / 1000.0,
+               (double)r.maxstall / 1000.0, (unsigned long long)r.slow,
+               (double)records * RECORD_LEN * 1000.0 / (double)t);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char dir[] = "/tmp/testrotateXXXXXX";
+
+    if (mkdtemp(dir) == NULL) {
+        fprintf(stderr, "testrotate: cannot create %s\n", dir);
+        return 1;
+    }
+    testrotate(dir);
+
+    if (xtestfailed == 0) {
+        if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+            benchmark(dir);
+    }
+    rmdir(dir);
+    if (xtestfailed) {
+        fprintf(stderr, "testrotate: %d checks failed\n", xtestfailed);
+        return 1;
+    }
+    printf("testrotate: passed\n");
+    return 0;
+}
@@ -0,0 +1,393 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * LogRotateTime schedule tests
+ *
+ * The local time is simulated by the test, with the
+ * daylight saving time starting on 2024-03-31 and
+ * ending on 2024-10-27.
+ *
+ * Usage: testsched [-b]
+ *        -b  run the next time throughput benchmark
+ */
+
+#define HOUR            (ONE_HOUR)
+#define SECOND          (ONE_FTSECOND)
+
+static unsigned int xtestseed = 1;
+
+static unsigned int xtestrand(void)
+{
+    xtestseed = xtestseed * 1103515245 + 12345;
+    return (xtestseed >> 8) & 0xFFFFFF;
+}
+
+/**
+ * Wall clock time in FILETIME units
+ */
+static ULONGLONG wall(int y, int m, int d, int hh, int mm, int ss)
+{
+    LONGLONG era;
+    LONGLONG yoe;
+    LONGLONG doy;
+    LONGLONG doe;
+    LONGLONG days;
+
+    y  -= m <= 2;
+    era = y / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    /**
+     * Days since 1970-01-01 plus the days
+     * from 1601-01-01 to 1970-01-01
+     */
+    days = era * 146097 + doe - 719468 + 134774;
+    return ((ULONGLONG)days * 86400 + hh * 3600 + mm * 60 + ss) * SECOND;
+}
+
+/**
+ * Simulated time zone one hour ahead of UTC,
+ * and two hours during the daylight saving time.
+ */
+static ULONGLONG dstbegin;
+static ULONGLONG dstend;
+static BOOL      dstearly;
+
+static ULONGLONG towall(ULONGLONG u)
+{
+    if ((u >= dstbegin - HOUR) && (u < dstend - 2 * HOUR))
+        return u + 2 * HOUR;
+    else
+        return u + HOUR;
+}
+
+/**
+ * The wall clock time inside the gap is treated as the
+ * standard time. The repeated hour maps to the earlier or
+ * later instance depending on the dstearly.
+ */
+static BOOL toutc(ULONGLONG w, ULONGLONG *u)
+{
+    if ((w >= dstbegin) && (w < dstbegin + HOUR))
+        *u = w - HOUR;
+    else if ((w >= dstend - HOUR) && (w < dstend))
+        *u = dstearly ? w - 2 * HOUR : w - HOUR;
+    else if ((w >= dstbegin + HOUR) && (w < dstend - HOUR))
+        *u = w - 2 * HOUR;
+    else
+        *u = w - HOUR;
+    return TRUE;
+}
+
+static BOOL badtoutc(ULONGLONG w, ULONGLONG *u)
+{
+    *u = 0;
+    return FALSE;
+}
+
+static DWORD parse(LPCWSTR s, LPSVCBATCH_SCHEDULE sv)
+{
+    return xschedparse(s, sv, SVCBATCH_MAX_SCHEDULE);
+}
+
+static ULONGLONG bits(int lo, int hi, int st)
+{
+    ULONGLONG m = 0;
+
+    for (; lo <= hi; lo += st)
+        m |= CPP_UINT64_C(1) << lo;
+    return m;
+}
+
+static void testparse(void)
+{
+    SVCBATCH_SCHEDULE sv[SVCBATCH_MAX_SCHEDULE];
+    WCHAR big[SVCBATCH_MAX_SCHEDULE * 8 + 16];
+    int   i;
+
+    XTEST(parse(L"08:00,12:00 18:00", sv) == 3);
+    XTEST((sv[0].hours == bits(8, 8, 1)) && (sv[0].mins == 1) && (sv[0].secs == 1));
+    XTEST((sv[2].hours == bits(18, 18, 1)) && (sv[2].days == 0x7F));
+
+    /**
+     * Ranges and steps
+     */
+    XTEST(parse(L"1-5:10-20/5:*/20", sv) == 1);
+    XTEST(sv[0].hours == bits(1, 5, 1));
+    XTEST(sv[0].mins  == bits(10, 20, 5));
+    XTEST(sv[0].secs  == bits(0, 59, 20));
+    XTEST(parse(L"*:0/15", sv) == 1);
+    XTEST((sv[0].hours == bits(0, 23, 1)) && (sv[0].mins == bits(0, 59, 15)));
+    XTEST(parse(L"9/4:07:59", sv) == 1);
+    XTEST((sv[0].hours == bits(9, 23, 4)) && (sv[0].secs == bits(59, 59, 1)));
+
+    /**
+     * Weekday lists apply to the following times
+     */
+    XTEST(parse(L"Mon-Fri 08:00 Sat,sun 10:30 *:00", sv) == 3);
+    XTEST(sv[0].days == 0x3E);
+    XTEST(sv[1].days == 0x41);
+    XTEST(sv[2].days == 0x41);
+    XTEST(parse(L"Sat-Mon 10:00", sv) == 1);
+    XTEST(sv[0].days == 0x43);
+    XTEST(parse(L"Fri-Thu 10:00", sv) == 1);
+    XTEST(sv[0].days == 0x7F);
+    XTEST(parse(L"WED 10:00 * 11:00", sv) == 2);
+    XTEST((sv[0].days == 0x08) && (sv[1].days == 0x7F));
+
+    /**
+     * Malformed schedules
+     */
+    XTEST(parse(L"", sv) == 0);
+    XTEST(parse(L" , ", sv) == 0);
+    XTEST(parse(L"24:00", sv) == 0);
+    XTEST(parse(L"12:60", sv) == 0);
+    XTEST(parse(L"12:00:60", sv) == 0);
+    XTEST(parse(L"12:00:00:00", sv) == 0);
+    XTEST(parse(L"12::00", sv) == 0);
+    XTEST(parse(L":00", sv) == 0);
+    XTEST(parse(L"12:", sv) == 0);
+    XTEST(parse(L"12:00x", sv) == 0);
+    XTEST(parse(L"-1:00", sv) == 0);
+    XTEST(parse(L"5-3:00", sv) == 0);
+    XTEST(parse(L"1-:00", sv) == 0);
+    XTEST(parse(L"*/0:00", sv) == 0);
+    XTEST(parse(L"*/24:00", sv) == 0);
+    XTEST(parse(L"*:*/60", sv) == 0);
+    XTEST(parse(L"99999999999:00", sv) == 0);
+    XTEST(parse(L"Mon", sv) == 0);
+    XTEST(parse(L"12:00 Mon", sv) == 0);
+    XTEST(parse(L"Mon-Xyz 12:00", sv) == 0);
+    XTEST(parse(L"Monday 12:00", sv) == 0);
+    XTEST(parse(L"Mo 12:00", sv) == 0);
+
+    for (i = 0; i < SVCBATCH_MAX_SCHEDULE; i++)
+        wmemcpy(big + i * 6, L"01:00,", 6);
+    big[i * 6] = 0;
+    XTEST(parse(big, sv) == SVCBATCH_MAX_SCHEDULE);
+    wmemcpy(big + i * 6, L"02:00", 6);
+    XTEST(parse(big, sv) == 0);
+}
+
+/**
+ * Reference next time, one second at a time
+ */
+static ULONGLONG reference(LPSVCBATCH_SCHEDULE sv, DWORD sn, ULONGLONG w)
+{
+    ULONGLONG s = w / SECOND + 1;
+    ULONGLONG e = s + 8 * 86400;
+    DWORD     k;
+
+    for (; s < e; s++) {
+        int t = (int)(s % 86400);
+        int d = (int)((s / 86400 + 1) % 7);
+
+        for (k = 0; k < sn; k++) {
+            if ((sv[k].days  & (1 << d)) &&
+                (sv[k].hours & (CPP_UINT64_C(1) << (t / 3600))) &&
+                (sv[k].mins  & (CPP_UINT64_C(1) << ((t / 60) % 60))) &&
+                (sv[k].secs  & (CPP_UINT64_C(1) << (t % 60))))
+                return s * SECOND;
+        }
+    }
+    return 0;
+}
+
+static void testnext(void)
+{
+    SVCBATCH_SCHEDULE sv[SVCBATCH_MAX_SCHEDULE];
+    DWORD sn;
+    int   i;
+
+    /**
+     * 2024-05-13 is Monday
+     */
+    sn = parse(L"08:00", sv);
+    XTEST(xschednext(sv, sn, wall(2024, 5, 13, 7, 59, 59)) == wall(2024, 5, 13, 8, 0, 0));
+    XTEST(xschednext(sv, sn, wall(2024, 5, 13, 8, 0, 0))   == wall(2024, 5, 14, 8, 0, 0));
+    XTEST(xschednext(sv, sn, wall(2024, 5, 13, 7, 59, 59) + SECOND - 1) ==
+          wall(2024, 5, 13, 8, 0, 0));
+    XTEST(xschednext(sv, sn, wall(2024, 12, 31, 9, 0, 0))  == wall(2025, 1, 1, 8, 0, 0));
+    XTEST(xschednext(sv, sn, wall(2024, 2, 28, 9, 0, 0))   == wall(2024, 2, 29, 8, 0, 0));
+
+    sn = parse(L"Mon-Fri 08:00", sv);
+    XTEST(xschednext(sv, sn, wall(2024, 5, 17, 9, 0, 0)) == wall(2024, 5, 20, 8, 0, 0));
+
+    sn = parse(L"Sat-Mon 10:00", sv);
+    XTEST(xschednext(sv, sn, wall(2024, 5, 14, 9, 0, 0))  == wall(2024, 5, 18, 10, 0, 0));
+    XTEST(xschednext(sv, sn, wall(2024, 5, 19, 10, 0, 0)) == wall(2024, 5, 20, 10, 0, 0));
+    XTEST(xschednext(sv, sn, wall(2024, 5, 20, 10, 0, 0)) == wall(2024, 5, 25, 10, 0, 0));
+
+    sn = parse(L"*:0/15", sv);
+    XTEST(xschednext(sv, sn, wall(2024, 5, 13, 10, 7, 30))  == wall(2024, 5, 13, 10, 15, 0));
+    XTEST(xschednext(sv, sn, wall(2024, 5, 13, 23, 45, 0))  == wall(2024, 5, 14, 0, 0, 0));
+
+    sn = parse(L"*:*:30", sv);
+    XTEST(xschednext(sv, sn, wall(2024, 5, 13, 10, 0, 30)) == wall(2024, 5, 13, 10, 1, 30));
+
+    /**
+     * Once a week at the last second of the week
+     */
+    sn = parse(L"Sat 23:59:59", sv);
+    XTEST(xschednext(sv, sn, wall(2024, 5, 18, 23, 59, 59)) == wall(2024, 5, 25, 23, 59, 59));
+
+    /**
+     * Earliest of several entries
+     */
+    sn = parse(L"Tue 18:00 Mon-Fri 12:00,06:30", sv);
+    XTEST(xschednext(sv, sn, wall(2024, 5, 14, 7, 0, 0))  == wall(2024, 5, 14, 12, 0, 0));
+    XTEST(xschednext(sv, sn, wall(2024, 5, 14, 12, 0, 0)) == wall(2024, 5, 14, 18, 0, 0));
+    XTEST(xschednext(sv, sn, wall(2024, 5, 17, 12, 0, 0)) == wall(2024, 5, 20, 6, 30, 0));
+
+    /**
+     * Random schedules against the reference
+     */
+    for (i = 0; i < 300; i++) {
+        WCHAR     s[64];
+        ULONGLONG w;
+        int       k;
+
+        swprintf(s, 64, L"%ls %u-%u/%u:%u/%u:%u",
+                 (xtestrand() & 1) ? L"Sat-Tue" : L"Wed,Fri",
+                 xtestrand() % 12, 12 + xtestrand() % 12, 1 + xtestrand() % 5,
+                 xtestrand() % 60, 1 + xtestrand() % 59, xtestrand() % 60);
+        sn = parse(s, sv);
+        XTEST(sn == 1);
+        w = wall(2024, 1 + xtestrand() % 12, 1 + xtestrand() % 28,
+                 xtestrand() % 24, xtestrand() % 60, xtestrand() % 60);
+        for (k = 0; k < 5; k++) {
+            ULONGLONG n = xschednext(sv, sn, w);
+
+            XTEST(n == reference(sv, sn, w));
+            w = n;
+        }
+    }
+}
+
+/**
+ * Follow the schedule the same way the rotate timer does,
+ * and count the rotations during the wall clock day
+ */
+static DWORD follow(LPCWSTR s, int m, int d, ULONGLONG *first)
+{
+    SVCBATCH_SCHEDULE sv[SVCBATCH_MAX_SCHEDULE];
+    DWORD     sn = parse(s, sv);
+    ULONGLONG b  = wall(2024, m, d, 0, 0, 0);
+    ULONGLONG e  = wall(2024, m, d + 1, 0, 0, 0);
+    ULONGLONG now;
+    ULONGLONG u;
+    DWORD     n = 0;
+
+    toutc(b - SECOND, &now);
+    *first = 0;
+    for (;;) {
+        u = xschedresolve(sv, sn, now, towall(now), toutc);
+        XTEST(u > now);
+        if ((u <= now) || (towall(u) >= e))
+            break;
+        if (*first == 0)
+            *first = u;
+        now = u;
+        n++;
+    }
+    return n;
+}
+
+static void testdst(void)
+{
+    SVCBATCH_SCHEDULE sv[SVCBATCH_MAX_SCHEDULE];
+    ULONGLONG f;
+    DWORD     sn;
+    int       i;
+
+    dstbegin = wall(2024, 3, 31, 2, 0, 0);
+    dstend   = wall(2024, 10, 27, 3, 0, 0);
+    XTEST(towall(wall(2024, 3, 31, 1, 0, 0)) == wall(2024, 3, 31, 3, 0, 0));
+    XTEST(towall(wall(2024, 10, 27, 0, 59, 59)) == wall(2024, 10, 27, 2, 59, 59));
+    XTEST(towall(wall(2024, 10, 27, 1, 0, 0)) == wall(2024, 10, 27, 2, 0, 0));
+
+    for (i = 0; i < 2; i++) {
+        dstearly = i;
+        /**
+         * Every wall clock hour rotates once,
+         * and the missing hour rotates with the next one
+         */
+        XTEST(follow(L"*:00", 3, 30, &f) == 24);
+        XTEST(follow(L"*:00", 3, 31, &f) == 23);
+        XTEST(follow(L"*:00", 10, 27, &f) == 24);
+        XTEST(follow(L"*:00", 10, 28, &f) == 24);
+        XTEST(follow(L"*:*/10", 10, 27, &f) == 24 * 6);
+        XTEST(follow(L"*:*/10", 3, 31, &f) == 23 * 6);
+
+        /**
+         * Time inside the gap is not skipped
+         */
+        XTEST(follow(L"02:30", 3, 31, &f) == 1);
+        XTEST(f == wall(2024, 3, 31, 1, 30, 0));
+        XTEST(follow(L"02:30", 10, 27, &f) == 1);
+        XTEST(f == (i ? wall(2024, 10, 27, 0, 30, 0) : wall(2024, 10, 27, 1, 30, 0)));
+        XTEST(follow(L"12:00", 10, 27, &f) == 1);
+        XTEST(f == wall(2024, 10, 27, 11, 0, 0));
+        XTEST(follow(L"12:00", 7, 1, &f) == 1);
+        XTEST(f == wall(2024, 7, 1, 10, 0, 0));
+    }
+
+    /**
+     * UTC schedule and failed conversion
+     */
+    sn = parse(L"12:00", sv);
+    XTEST(xschedresolve(sv, sn, wall(2024, 7, 1, 12, 0, 0), wall(2024, 7, 1, 12, 0, 0), NULL) ==
+          wall(2024, 7, 2, 12, 0, 0));
+    XTEST(xschedresolve(sv, sn, wall(2024, 7, 1, 12, 0, 0), wall(2024, 7, 1, 14, 0, 0),
+                        badtoutc) == 0);
+}
+
+static void benchmark(void)
+{
+    SVCBATCH_SCHEDULE sv[SVCBATCH_MAX_SCHEDULE];
+    DWORD     sn = parse(L"Mon-Fri 08:00,12:00,18:00 Sat,Sun 23:59:59", sv);
+    DWORD     count = 1000000;
+    DWORD     i;
+    ULONGLONG w = wall(2024, 1, 1, 0, 0, 0);
+    ULONGLONG t;
+
+    t = xtestnsec();
+    for (i = 0; i < count; i++)
+        w = xschednext(sv, sn, w);
+    t = xtestnsec() - t;
+    printf("schedule: %6.1f ns per next time\n", (double)t / (double)count);
+}
+
+int main(int argc, char **argv)
+{
+    testparse();
+    testnext();
+    testdst();
+
+    if (xtestfailed) {
+        fprintf(stderr, "testsched: %d checks failed\n", xtestfailed);
+        return 1;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+        benchmark();
+    printf("testsched: passed\n");
+    return 0;
+}
@@ -0,0 +1,278 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * LogSegmentSize tests
+ *
+ * The segments are mapped with mmap and the file
+ * is extended and trimmed with ftruncate, the same
+ * way CreateFileMapping and SetEndOfFile do it.
+ *
+ * Usage: testsegment [-b]
+ *        -b  run the mapped versus append benchmark
+ */
+
+static unsigned int xtestseed = 1;
+
+static unsigned int xtestrand(void)
+{
+    xtestseed = xtestseed * 1103515245 + 12345;
+    return (xtestseed >> 8) & 0xFFFFFF;
+}
+
+typedef struct _SEGFILE {
+    int                 fd;
+    DWORD               size;
+    DWORD               maps;
+    DWORD               fail;
+    LONGLONG            flushed;
+    DWORD               bad;
+    char                name[64];
+} SEGFILE;
+
+static DWORD segmap(LPVOID ctx, LONGLONG base, LPBYTE *view)
+{
+    SEGFILE *f = (SEGFILE *)ctx;
+    void    *p;
+
+    if (*view)
+        munmap(*view, f->size);
+    *view = NULL;
+    f->maps++;
+    if (f->fail && (f->maps >= f->fail))
+        return ENOSPC;
+    if (ftruncate(f->fd, base + f->size))
+        return errno;
+    p = mmap(NULL, f->size, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, base);
+    if (p == MAP_FAILED)
+        return errno;
+    *view = (LPBYTE)p;
+    return 0;
+}
+
+/**
+ * Chunks must be flushed in order and without gaps
+ */
+static DWORD segflush(LPVOID ctx, LPBYTE buf, DWORD len)
+{
+    SEGFILE *f = (SEGFILE *)ctx;
+
+    if (len == 0)
+        f->bad++;
+    f->flushed += len;
+    return 0;
+}
+
+static void segopen(SEGFILE *f, LPSVCBATCH_SEGMENT sg, DWORD size, BOOL flush)
+{
+    memset(f, 0, sizeof(SEGFILE));
+    strcpy(f->name, "/tmp/testsegmentXXXXXX");
+    f->fd   = mkstemp(f->name);
+    f->size = size;
+    XTEST(f->fd >= 0);
+    xsegmentinit(sg, size, segmap, flush ? segflush : NULL);
+}
+
+/**
+ * Unmap and trim the file to the written size
+ */
+static LONGLONG segclose(SEGFILE *f, LPSVCBATCH_SEGMENT sg, LONGLONG pos)
+{
+    struct stat st;
+
+    if (sg->view)
+        munmap(sg->view, f->size);
+    sg->view = NULL;
+    XTEST(ftruncate(f->fd, pos) == 0);
+    XTEST(fstat(f->fd, &st) == 0);
+    return st.st_size;
+}
+
+static void segremove(SEGFILE *f)
+{
+    close(f->fd);
+    unlink(f->name);
+}
+
+/**
+ * Random chunks across the segment boundaries
+ * end up in the file in order
+ */
+static void testwrite(void)
+{
+    SVCBATCH_SEGMENT sg;
+    SEGFILE  f;
+    LONGLONG pos = 0;
+    LPBYTE   d;
+    LPBYTE   r;
+    DWORD    n = 0;
+    DWORD    i;
+
+    d = (LPBYTE)xmmalloc(1024 * 1024);
+    r = (LPBYTE)xmmalloc(1024 * 1024);
+    for (i = 0; i < 1024 * 1024; i++)
+        d[i] = (BYTE)xtestrand();
+    segopen(&f, &sg, 65536, TRUE);
+    XTEST(xsegmentmap(&sg, &f, 0) == 0);
+    XTEST((sg.view != NULL) && (sg.base == 0));
+    while (n < 1000000) {
+        DWORD m = (xtestrand() % 4) ? xtestrand() % 300 : xtestrand() % 100000;
+
+        if ((n + m) > 1000000)
+            m = 1000000 - n;
+        XTEST(xsegmentwrite(&sg, &f, &pos, d + n, m) == 0);
+        n += m;
+        XTEST(pos == n);
+    }
+    /**
+     * The file is extended one segment at a time
+     */
+    XTEST(sg.base == 983040);
+    XTEST(f.maps == 16);
+    XTEST(f.flushed == 1000000);
+    XTEST(f.bad == 0);
+    XTEST(segclose(&f, &sg, pos) == 1000000);
+    XTEST(pread(f.fd, r, 1000000, 0) == 1000000);
+    XTEST(memcmp(r, d, 1000000) == 0);
+    segremove(&f);
+    xfree(r);
+    xfree(d);
+}
+
+/**
+ * Full view is replaced only by the next write
+ */
+static void testboundary(void)
+{
+    SVCBATCH_SEGMENT sg;
+    SEGFILE  f;
+    LONGLONG pos = 0;
+    LPBYTE   d;
+
+    d = (LPBYTE)xmmalloc(65536 * 2);
+    memset(d, 'x', 65536 * 2);
+    segopen(&f, &sg, 65536, FALSE);
+    xsegmentmap(&sg, &f, 0);
+    XTEST(xsegmentwrite(&sg, &f, &pos, d, 65536) == 0);
+    XTEST((pos == 65536) && (sg.base == 0) && (f.maps == 1));
+    XTEST(xsegmentwrite(&sg, &f, &pos, d, 0) == 0);
+    XTEST(f.maps == 1);
+    XTEST(xsegmentwrite(&sg, &f, &pos, d, 1) == 0);
+    XTEST((pos == 65537) && (sg.base == 65536) && (f.maps == 2));
+    XTEST(xsegmentwrite(&sg, &f, &pos, d, 65536 * 2) == 0);
+    XTEST((pos == 65537 + 65536 * 2) && (sg.base == 65536 * 3) && (f.maps == 4));
+    XTEST(segclose(&f, &sg, pos) == pos);
+
+    /**
+     * Truncating rotation maps the first segment again
+     */
+    pos = 0;
+    XTEST(xsegmentmap(&sg, &f, 0) == 0);
+    XTEST(xsegmentwrite(&sg, &f, &pos, (LPBYTE)"abc", 3) == 0);
+    XTEST(segclose(&f, &sg, pos) == 3);
+    segremove(&f);
+    xfree(d);
+}
+
+/**
+ * Failed map stops the write after the
+ * data that was already copied
+ */
+static void testfailure(void)
+{
+    SVCBATCH_SEGMENT sg;
+    SEGFILE  f;
+    LONGLONG pos = 0;
+    LPBYTE   d;
+
+    d = (LPBYTE)xmmalloc(65536 * 3);
+    memset(d, 'f', 65536 * 3);
+    segopen(&f, &sg, 65536, FALSE);
+    f.fail = 3;
+    xsegmentmap(&sg, &f, 0);
+    XTEST(xsegmentwrite(&sg, &f, &pos, d, 65536 * 3) == ENOSPC);
+    XTEST(pos == 65536 * 2);
+    XTEST(sg.view == NULL);
+    XTEST(sg.base == 65536 * 2);
+    XTEST(segclose(&f, &sg, pos) == 65536 * 2);
+    segremove(&f);
+    xfree(d);
+}
+
+static void benchmark(void)
+{
+    DWORD     sizes[] = { 100, 4096, 65536 };
+    ULONGLONG total   = 256 * 1024 * 1024;
+    LPBYTE    d;
+    DWORD     i;
+
+    d = (LPBYTE)xmmalloc(65536);
+    memset(d, 'b', 65536);
+    for (i = 0; i < 3; i++) {
+        SVCBATCH_SEGMENT sg;
+        SEGFILE   f;
+        LONGLONG  pos = 0;
+        ULONGLONG n;
+        ULONGLONG ta;
+        ULONGLONG tm;
+
+        segopen(&f, &sg, 16 * 1024 * 1024, FALSE);
+        ta = xtestnsec();
+        for (n = 0; n < total; n += sizes[i]) {
+            if (write(f.fd, d, sizes[i]) != (ssize_t)sizes[i])
+                break;
+        }
+        ta = xtestnsec() - ta;
+        XTEST(ftruncate(f.fd, 0) == 0);
+
+        tm = xtestnsec();
+        xsegmentmap(&sg, &f, 0);
+        for (n = 0; n < total; n += sizes[i])
+            xsegmentwrite(&sg, &f, &pos, d, sizes[i]);
+        segclose(&f, &sg, pos);
+        tm = xtestnsec() - tm;
+        printf("segment %5u byte writes: append %7.1f MB/s, "
+               "mapped %7.1f MB/s, %u segments\n", sizes[i],
+               (double)total * 1000.0 / (double)ta,
+               (double)total * 1000.0 / (double)tm, f.maps);
+        segremove(&f);
+    }
+    xfree(d);
+}
+
+int main(int argc, char **argv)
+{
+    testwrite();
+    testboundary();
+    testfailure();
+
+    if (xtestfailed) {
+        fprintf(stderr, "testsegment: %d checks failed\n", xtestfailed);
+        return 1;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+        benchmark();
+    printf("testsegment: passed\n");
+    return 0;
+}
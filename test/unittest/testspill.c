@@ -0,0 +1,390 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * LogBackpressure tests
+ *
+ * The simulated writer takes one buffer from the queue
+ * for every few buffers the reader pushes, and gives it
+ * back to the free list, the same as the log writer does.
+ *
+ * Usage: testspill [-b]
+ *        -b  run the slow consumer benchmark
+ */
+
+#define QUEUE_LEN   8
+#define BUFFER_LEN  256
+
+typedef struct _SIM {
+    LPSVCBATCH_QUEUE    queue;
+    LPSVCBATCH_BUFFER   free[QUEUE_LEN];
+    DWORD               nfree;
+    DWORD               buffers;
+    DWORD               peak;
+    DWORD               slow;
+    DWORD               pushed;
+    DWORD               waits;
+    DWORD               next;
+    DWORD               received;
+    DWORD               lines;
+    ULONGLONG           bytes;
+    DWORD               bad;
+} SIM;
+
+static DWORD seqlines(DWORD seq)
+{
+    return seq % 5;
+}
+
+static DWORD seqlen(DWORD seq)
+{
+    return 50 + (seq % 7) * 20;
+}
+
+static LPSVCBATCH_BUFFER simnew(SIM *m)
+{
+    LPSVCBATCH_BUFFER b;
+
+    b = (LPSVCBATCH_BUFFER)xmmalloc(sizeof(SVCBATCH_BUFFER) + BUFFER_LEN);
+    b->size = BUFFER_LEN;
+    b->data = (LPBYTE)(b + 1);
+    m->buffers++;
+    if (m->buffers > m->peak)
+        m->peak = m->buffers;
+    return b;
+}
+
+/**
+ * Fill the buffer the same way for the same seq,
+ * so that the dropped data can be accounted for.
+ */
+static void simfill(LPSVCBATCH_BUFFER b, DWORD seq)
+{
+    DWORD i;
+
+    b->len  = seqlen(seq);
+    b->time = seq;
+    memset(b->data, 'a' + seq % 26, b->len);
+    for (i = 0; i < seqlines(seq); i++)
+        b->data[i * 10 + 5] = '\n';
+}
+
+/**
+ * Writer takes one buffer from the queue.
+ * The dropped data must be reported by the first
+ * buffer after the gap.
+ */
+static BOOL simconsume(SIM *m)
+{
+    LPSVCBATCH_BUFFER b;
+    DWORD             lines = 0;
+    ULONGLONG         bytes = 0;
+
+    b = (LPSVCBATCH_BUFFER)xqueuepop(m->queue);
+    if (b == NULL)
+        return FALSE;
+    if (b->time < m->next)
+        m->bad++;
+    for (; m->next < b->time; m->next++) {
+        lines += seqlines(m->next);
+        bytes += seqlen(m->next);
+    }
+    if ((b->lost != lines) || (b->lostbytes != bytes))
+        m->bad++;
+    if (b->len != seqlen(m->next))
+        m->bad++;
+    m->next++;
+    m->received++;
+    m->lines += b->lost;
+    m->bytes += b->lostbytes;
+    if (m->nfree < QUEUE_LEN) {
+        m->free[m->nfree++] = b;
+    }
+    else {
+        /**
+         * Buffers allocated for spilling
+         */
+        m->buffers--;
+        xfree(b);
+    }
+    return TRUE;
+}
+
+static LPSVCBATCH_BUFFER simbuffer(LPVOID ctx, DWORD mode)
+{
+    SIM *m = (SIM *)ctx;
+    LPSVCBATCH_BUFFER b;
+
+    for (;;) {
+        if (mode == SVCBATCH_BUFFER_SPILL) {
+            b = simnew(m);
+            break;
+        }
+        if (m->nfree) {
+            b = m->free[--m->nfree];
+            break;
+        }
+        if (m->buffers < QUEUE_LEN) {
+            b = simnew(m);
+            break;
+        }
+        if (mode == SVCBATCH_BUFFER_FREE)
+            return NULL;
+        /**
+         * Blocked until the writer gives a buffer back
+         */
+        m->waits++;
+        if (!simconsume(m)) {
+            m->bad++;
+            return NULL;
+        }
+    }
+    b->next      = NULL;
+    b->lost      = 0;
+    b->lostbytes = 0;
+    return b;
+}
+
+static void siminit(SIM *m, LPSVCBATCH_SPILL s, DWORD policy, DWORD max, DWORD slow)
+{
+    memset(m, 0, sizeof(SIM));
+    m->queue = xqueueinit(QUEUE_LEN);
+    m->slow  = slow;
+    xspillinit(s, m->queue, policy, max, simbuffer, m);
+}
+
+/**
+ * Push count buffers, with the writer taking one
+ * buffer for every slow buffers pushed.
+ * Returns the largest spill list size.
+ */
+static DWORD simrun(SIM *m, LPSVCBATCH_SPILL s, DWORD count)
+{
+    LPSVCBATCH_BUFFER b = simbuffer(m, SVCBATCH_BUFFER_WAIT);
+    DWORD peak = 0;
+    DWORD i;
+
+    for (i = 0; i < count; i++) {
+        simfill(b, i);
+        if (xspillpush(s, &b, BUFFER_LEN) != 0)
+            m->bad++;
+        if (s->size > peak)
+            peak = s->size;
+        if (s->size > s->max)
+            m->bad++;
+        if ((++m->pushed % m->slow) == 0)
+            simconsume(m);
+    }
+    /**
+     * Writer catches up at the end
+     */
+    while (!xspilldrain(s))
+        simconsume(m);
+    while (simconsume(m))
+        ;
+    xfree(b);
+    return peak;
+}
+
+static void simfree(SIM *m)
+{
+    while (m->nfree)
+        xfree(m->free[--m->nfree]);
+    xqueuefree(m->queue);
+}
+
+/**
+ * Reader waits for the writer and nothing is lost
+ */
+static void testblock(void)
+{
+    SVCBATCH_SPILL s;
+    SIM m;
+
+    siminit(&m, &s, SVCBATCH_BACKPRESSURE_BLOCK, 0, 3);
+    simrun(&m, &s, 10000);
+    XTEST(m.bad == 0);
+    XTEST(m.received == 10000);
+    XTEST(m.waits > 6000);
+    XTEST((s.dbytes == 0) && (m.bytes == 0));
+    XTEST(m.peak <= QUEUE_LEN);
+    simfree(&m);
+
+    /**
+     * Full queue is an error with a blocking reader
+     */
+    {
+        LPSVCBATCH_BUFFER b;
+        DWORD i;
+
+        siminit(&m, &s, SVCBATCH_BACKPRESSURE_BLOCK, 0, 1);
+        for (i = 0; i < QUEUE_LEN; i++)
+            xqueuepush(m.queue, &m);
+        b = simbuffer(&m, SVCBATCH_BUFFER_FREE);
+        XTEST(xspillpush(&s, &b, BUFFER_LEN) == ERROR_BUFFER_OVERFLOW);
+        xfree(b);
+        xqueuefree(m.queue);
+    }
+}
+
+/**
+ * Reader never waits. The data that does not fit
+ * is counted and reported with the next buffer.
+ */
+static void testdrop(void)
+{
+    SVCBATCH_SPILL s;
+    SIM m;
+
+    siminit(&m, &s, SVCBATCH_BACKPRESSURE_DROP, 0, 3);
+    simrun(&m, &s, 10000);
+    XTEST(m.bad == 0);
+    XTEST(m.waits == 0);
+    XTEST((m.received > 3000) && (m.received < 4000));
+    XTEST(s.dbytes > 0);
+    XTEST(s.dbytes == m.bytes + s.bytes);
+    XTEST(s.dlines == m.lines);
+    XTEST(m.peak <= QUEUE_LEN);
+    XTEST(s.size == 0);
+    simfree(&m);
+
+    /**
+     * Fast writer drops nothing
+     */
+    siminit(&m, &s, SVCBATCH_BACKPRESSURE_DROP, 0, 1);
+    simrun(&m, &s, 10000);
+    XTEST((m.bad == 0) && (m.received == 10000));
+    XTEST(s.dbytes == 0);
+    simfree(&m);
+}
+
+/**
+ * Spill list absorbs the data while it fits into
+ * the limit, and drops the rest the same way
+ */
+static void testspill(void)
+{
+    SVCBATCH_SPILL s;
+    SIM   m;
+    DWORD peak;
+
+    siminit(&m, &s, SVCBATCH_BACKPRESSURE_SPILL, 1024 * 1024, 3);
+    peak = simrun(&m, &s, 1000);
+    XTEST(m.bad == 0);
+    XTEST(m.waits == 0);
+    XTEST(m.received == 1000);
+    XTEST(s.dbytes == 0);
+    XTEST(peak > 100 * BUFFER_LEN);
+    XTEST((s.size == 0) && (s.head == NULL) && (s.tail == NULL));
+    /**
+     * The full free list and the reader buffer
+     * are kept and the rest is freed
+     */
+    XTEST(m.buffers == QUEUE_LEN + 1);
+    simfree(&m);
+
+    /**
+     * Limit of 16 buffers
+     */
+    siminit(&m, &s, SVCBATCH_BACKPRESSURE_SPILL, 16 * BUFFER_LEN, 3);
+    peak = simrun(&m, &s, 10000);
+    XTEST(m.bad == 0);
+    XTEST(m.waits == 0);
+    XTEST(peak == 15 * BUFFER_LEN);
+    XTEST((m.received > 3000) && (m.received < 4000));
+    XTEST((s.dbytes > 0) && (s.dbytes == m.bytes + s.bytes));
+    XTEST(m.peak <= QUEUE_LEN + 16);
+    simfree(&m);
+
+    /**
+     * Spilled buffers are freed at the end
+     */
+    {
+        LPSVCBATCH_BUFFER b;
+        DWORD i;
+
+        siminit(&m, &s, SVCBATCH_BACKPRESSURE_SPILL, 1024 * 1024, 1);
+        b = simbuffer(&m, SVCBATCH_BUFFER_WAIT);
+        for (i = 0; i < 100; i++) {
+            simfill(b, i);
+            xspillpush(&s, &b, BUFFER_LEN);
+        }
+        XTEST(s.size == (100 - QUEUE_LEN) * BUFFER_LEN);
+        xspillfree(&s);
+        XTEST((s.size == 0) && (s.head == NULL));
+        xfree(b);
+        while ((b = (LPSVCBATCH_BUFFER)xqueuepop(m.queue)) != NULL)
+            xfree(b);
+        xqueuefree(m.queue);
+    }
+}
+
+static void benchmark(void)
+{
+    DWORD policy[] = { SVCBATCH_BACKPRESSURE_BLOCK,
+                       SVCBATCH_BACKPRESSURE_DROP,
+                       SVCBATCH_BACKPRESSURE_SPILL };
+    const char *name[] = { "block", "drop", "spill" };
+    DWORD slow[] = { 2, 4 };
+    DWORD count  = 4000000;
+    DWORD i;
+    DWORD j;
+
+    for (j = 0; j < 2; j++) {
+        for (i = 0; i < 3; i++) {
+            SVCBATCH_SPILL s;
+            SIM       m;
+            ULONGLONG t;
+            DWORD     peak;
+
+            siminit(&m, &s, policy[i], 64 * BUFFER_LEN, slow[j]);
+            t = xtestnsec();
+            peak = simrun(&m, &s, count);
+            t = xtestnsec() - t;
+            printf("%-5s writer 1/%u: %7lu waits, %5.1f%% dropped, "
+                   "%6lu bytes spilled, %5.2f ns per buffer\n",
+                   name[i], slow[j], (unsigned long)m.waits,
+                   100.0 * (double)(count - m.received) / (double)count,
+                   (unsigned long)peak, (double)t / (double)count);
+            XTEST(m.bad == 0);
+            simfree(&m);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    testblock();
+    testdrop();
+    testspill();
+
+    if (xtestfailed) {
+        fprintf(stderr, "testspill: %d checks failed\n", xtestfailed);
+        return 1;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0)) {
+        benchmark();
+        if (xtestfailed) {
+            fprintf(stderr, "testspill: %d checks failed\n", xtestfailed);
+            return 1;
+        }
+    }
+    printf("testspill: passed\n");
+    return 0;
+}
@@ -0,0 +1,243 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include <pthread.h>
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * LogSync group commit tests
+ *
+ * Usage: testsync [-b]
+ *        -b  run the sync thread wake up benchmark
+ */
+
+static unsigned int xtestseed = 1;
+
+static unsigned int xtestrand(void)
+{
+    xtestseed = xtestseed * 1103515245 + 12345;
+    return (xtestseed >> 8) & 0xFFFFFF;
+}
+
+/**
+ * Only the write that reaches the size signals
+ */
+static void testtrigger(void)
+{
+    SVCBATCH_SYNC s;
+
+    xsyncinit(&s, 1000);
+    XTEST(xsyncadd(&s, 300) == FALSE);
+    XTEST(xsyncadd(&s, 300) == FALSE);
+    XTEST(xsyncadd(&s, 300) == FALSE);
+    XTEST(xsyncadd(&s, 300) == TRUE);
+    XTEST(xsyncadd(&s, 300) == FALSE);
+    XTEST(xsyncadd(&s, 5000) == FALSE);
+    xsyncstart(&s);
+    XTEST(s.bytes == 0);
+    XTEST(xsyncadd(&s, 999) == FALSE);
+    XTEST(xsyncadd(&s, 1) == TRUE);
+    xsyncstart(&s);
+    XTEST(xsyncadd(&s, 1000) == TRUE);
+    xsyncstart(&s);
+    XTEST(xsyncadd(&s, 0) == FALSE);
+
+    /**
+     * Zero size flushes only by the interval
+     */
+    xsyncinit(&s, 0);
+    XTEST(xsyncadd(&s, 0x7FFFFFFF) == FALSE);
+    XTEST(s.bytes == 0);
+}
+
+static void testlatency(void)
+{
+    SVCBATCH_SYNC s;
+
+    xsyncinit(&s, 1000);
+    xsyncdone(&s, 40);
+    xsyncdone(&s, 900);
+    xsyncdone(&s, 20);
+    XTEST(s.flushes == 3);
+    XTEST(s.total == 960);
+    XTEST(s.max == 900);
+}
+
+typedef struct _GROUP {
+    SVCBATCH_SYNC       s;
+    volatile LONG       event;
+    volatile LONG       writers;
+    DWORD               count;
+    ULONGLONG           signals;
+    ULONGLONG           flushes;
+} GROUP;
+
+static void *writer(void *arg)
+{
+    GROUP *g = (GROUP *)arg;
+    DWORD  i;
+
+    for (i = 0; i < g->count; i++) {
+        if (xsyncadd(&g->s, 1 + (i * 7919) % 4096)) {
+            __atomic_add_fetch(&g->signals, 1, __ATOMIC_SEQ_CST);
+            InterlockedExchange(&g->event, 1);
+        }
+        if ((i % 64) == 0)
+            sched_yield();
+    }
+    __atomic_sub_fetch(&g->writers, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+/**
+ * Auto reset event of the sync thread
+ */
+static void *syncer(void *arg)
+{
+    GROUP *g = (GROUP *)arg;
+
+    for (;;) {
+        if (InterlockedExchange(&g->event, 0)) {
+            xsyncstart(&g->s);
+            g->flushes++;
+        }
+        else if (InterlockedCompareExchange(&g->writers, 0, 0) == 0) {
+            break;
+        }
+        else {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Stdout and stderr writers share the total.
+ * When they are done, either the total is below
+ * the size or the sync thread was signaled.
+ */
+static void testgroup(void)
+{
+    GROUP     g;
+    pthread_t wt[2];
+    pthread_t st;
+    int       i;
+
+    memset(&g, 0, sizeof(g));
+    xsyncinit(&g.s, 65536);
+    g.count   = 200000;
+    g.writers = 2;
+    for (i = 0; i < 2; i++)
+        pthread_create(&wt[i], NULL, writer, &g);
+    pthread_create(&st, NULL, syncer, &g);
+    for (i = 0; i < 2; i++)
+        pthread_join(wt[i], NULL);
+    pthread_join(st, NULL);
+    XTEST(g.signals > 0);
+    XTEST(g.flushes <= g.signals);
+    XTEST((g.s.bytes < g.s.size) || g.event);
+}
+
+/**
+ * Writes continue while the flush is pending.
+ * The sync thread starts the flush lag writes
+ * after it was signaled.
+ */
+static ULONGLONG simulate(LONG size, DWORD count, DWORD lag,
+                          BOOL every, ULONGLONG *flushes)
+{
+    SVCBATCH_SYNC s;
+    ULONGLONG     signals = 0;
+    DWORD         pending = 0;
+    DWORD         i;
+
+    xsyncinit(&s, size);
+    *flushes = 0;
+    for (i = 0; i < count; i++) {
+        DWORD len = 1 + xtestrand() % 512;
+        BOOL  sig = xsyncadd(&s, len);
+
+        if (every)
+            sig = s.bytes >= size;
+        if (sig) {
+            signals++;
+            if (pending == 0)
+                pending = lag;
+        }
+        if (pending && (--pending == 0)) {
+            xsyncstart(&s);
+            (*flushes)++;
+        }
+    }
+    return signals;
+}
+
+static void testlag(void)
+{
+    ULONGLONG flushes;
+    ULONGLONG signals;
+
+    signals = simulate(65536, 1000000, 100, FALSE, &flushes);
+    XTEST((signals == flushes) || (signals == flushes + 1));
+    XTEST(flushes > 2500);
+}
+
+static void benchmark(void)
+{
+    DWORD     lags[] = { 1, 16, 256 };
+    DWORD     count  = 10000000;
+    SVCBATCH_SYNC s;
+    ULONGLONG t;
+    DWORD     i;
+
+    xsyncinit(&s, 1048576);
+    t = xtestnsec();
+    for (i = 0; i < count; i++) {
+        if (xsyncadd(&s, 256))
+            xsyncstart(&s);
+    }
+    t = xtestnsec() - t;
+    printf("sync add: %5.2f ns per write\n", (double)t / (double)count);
+    for (i = 0; i < 3; i++) {
+        ULONGLONG f1;
+        ULONGLONG f2;
+        ULONGLONG s1 = simulate(65536, count, lags[i], FALSE, &f1);
+        ULONGLONG s2 = simulate(65536, count, lags[i], TRUE,  &f2);
+
+        printf("sync lag %3u writes: %8llu signals for %6llu flushes, "
+               "%8llu when every write over the size signals\n",
+               lags[i], (unsigned long long)s1, (unsigned long long)f1,
+               (unsigned long long)s2);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    testtrigger();
+    testlatency();
+    testgroup();
+    testlag();
+
+    if (xtestfailed) {
+        fprintf(stderr, "testsync: %d checks failed\n", xtestfailed);
+        return 1;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0))
+        benchmark();
+    printf("testsync: passed\n");
+    return 0;
+}
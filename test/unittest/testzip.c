@@ -0,0 +1,329 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include "unittest.h"
+#include <zlib.h>
+#include "svcbatch.h"
+#include "svcutil.h"
+
+/**
+ * Gzip member compressor tests
+ *
+ * Every member is decoded with zlib, which also
+ * verifies the CRC32 and ISIZE trailer, and with the
+ * xzinflate used to verify the compressed logs.
+ *
+ * Usage: testzip [-b]
+ *        -b  run the compression ratio and throughput benchmark
+ */
+
+static unsigned int xtestseed = 1;
+
+static unsigned int xtestrand(void)
+{
+    xtestseed = xtestseed * 1103515245 + 12345;
+    return (xtestseed >> 8) & 0xFFFFFF;
+}
+
+/**
+ * Generate the text that looks like a service log
+ */
+static DWORD logtext(LPBYTE s, DWORD size)
+{
+    static const char *msgs[] = {
+        "INFO  [main] org.example.Server - Started request handler",
+        "DEBUG [pool-1-thread-3] org.example.db.Pool - Connection returned to pool",
+        "WARN  [http-nio-8080-exec-7] org.example.web.Filter - Slow request /api/v1/items",
+        "INFO  [scheduler] org.example.jobs.Cleanup - Removed expired sessions",
+        "ERROR [http-nio-8080-exec-2] org.example.web.Api - Request failed: timeout"
+    };
+    DWORD len = 0;
+    DWORD t   = 0;
+
+    while (len < size) {
+        char  b[256];
+        int   n;
+
+        t += xtestrand() % 250;
+        n = snprintf(b, sizeof(b), "2024-05-14 09:%02u:%02u.%03u %s id=%u\r\n",
+                     (t / 60000) % 60, (t / 1000) % 60, t % 1000,
+                     msgs[xtestrand() % 5], xtestrand() % 100000);
+        if ((len + n) > size)
+            n = size - len;
+        memcpy(s + len, b, n);
+        len += n;
+    }
+    return len;
+}
+
+/**
+ * Decode the concatenated gzip members and
+ * compare the result with the source data
+ */
+static BOOL inflatemembers(LPBYTE z, DWORD zlen, LPBYTE src, DWORD len, DWORD *members)
+{
+    z_stream s;
+    LPBYTE   out = (LPBYTE)xmmalloc(len + 1);
+    BOOL     ok  = TRUE;
+    int      rc;
+
+    *members = 0;
+    memset(&s, 0, sizeof(s));
+    if (inflateInit2(&s, 16 + 15) != Z_OK)
+        abort();
+    s.next_in   = z;
+    s.avail_in  = zlen;
+    s.next_out  = out;
+    s.avail_out = len + 1;
+    while (s.avail_in) {
+        rc = inflate(&s, Z_NO_FLUSH);
+        if (rc != Z_STREAM_END) {
+            fprintf(stderr, "inflate: %d %s\n", rc, s.msg ? s.msg : "");
+            ok = FALSE;
+            break;
+        }
+        (*members)++;
+        inflateReset(&s);
+    }
+    if (ok) {
+        DWORD n = (DWORD)(s.next_out - out);
+
+        if ((n != len) || memcmp(out, src, len))
+            ok = FALSE;
+    }
+    inflateEnd(&s);
+    xfree(out);
+    return ok;
+}
+
+/**
+ * Compress the data in members of at most
+ * step bytes, the same as the log writer does
+ */
+static DWORD zmembers(LPSVCBATCH_DEFLATE z, LPBYTE src, DWORD len,
+                      DWORD step, LPBYTE out)
+{
+    DWORD i = 0;
+    DWORD n = 0;
+
+    do {
+        DWORD k = len - i < step ? len - i : step;
+
+        xzmember(z, src + i, k);
+        XTEST(z->len <= z->size);
+        memcpy(out + n, z->data, z->len);
+        n += z->len;
+        i += k;
+    } while (i < len);
+    return n;
+}
+
+/**
+ * Decode the members with xzinflate, the same
+ * as the log writer verifies the compressed file
+ */
+static BOOL xinflatemembers(LPBYTE z, DWORD zlen, LPBYTE src, DWORD len, DWORD step)
+{
+    LPBYTE out = (LPBYTE)xmmalloc(step);
+    DWORD  i = 0;
+    DWORD  n = 0;
+    BOOL   ok = TRUE;
+
+    while (ok && (i < zlen)) {
+        DWORD used;
+        DWORD olen;
+
+        ok = xzinflate(z + i, zlen - i, out, step, &used, &olen);
+        if (ok && (((n + olen) > len) || memcmp(out, src + n, olen)))
+            ok = FALSE;
+        if (ok) {
+            i += used;
+            n += olen;
+        }
+    }
+    xfree(out);
+    return ok && (n == len);
+}
+
+static void roundtrip(LPSVCBATCH_DEFLATE z, LPCSTR name, LPBYTE src, DWORD len, DWORD step)
+{
+    LPBYTE out = (LPBYTE)xmmalloc(len * 2 + 1024);
+    DWORD  n;
+    DWORD  m;
+    DWORD  expect = len ? (len + step - 1) / step : 1;
+
+    n = zmembers(z, src, len, step, out);
+    if (!inflatemembers(out, n, src, len, &m)) {
+        fprintf(stderr, "%s: %u bytes in %u byte members do not match\n",
+                name, len, step);
+        xtestfailed++;
+    }
+    XTEST(m == expect);
+    if (!xinflatemembers(out, n, src, len, step)) {
+        fprintf(stderr, "%s: %u bytes in %u byte members do not inflate\n",
+                name, len, step);
+        xtestfailed++;
+    }
+    xfree(out);
+}
+
+/**
+ * Damaged member must not pass the verification
+ */
+static void testdamage(LPSVCBATCH_DEFLATE z, LPBYTE src, DWORD len)
+{
+    LPBYTE out = (LPBYTE)xmmalloc(SVCBATCH_DEFLATE_LEN);
+    LPBYTE d   = (LPBYTE)xmmalloc(z->size);
+    DWORD  used;
+    DWORD  olen;
+    DWORD  i;
+
+    xzmember(z, src, len);
+    XTEST(xzinflate(z->data, z->len, out, SVCBATCH_DEFLATE_LEN, &used, &olen));
+    XTEST((used == z->len) && (olen == len));
+    XTEST(!xzinflate(z->data, z->len - 1, out, SVCBATCH_DEFLATE_LEN, &used, &olen));
+    XTEST(!xzinflate(z->data, z->len, out, len - 1, &used, &olen));
+    for (i = 0; i < 200; i++) {
+        DWORD k = xtestrand() % z->len;
+
+        memcpy(d, z->data, z->len);
+        d[k] ^= (BYTE)(1 << (xtestrand() % 8));
+        /**
+         * The header time and the padding bits
+         * are not covered by the checks, but they
+         * cannot change the decoded data
+         */
+        if (xzinflate(d, z->len, out, SVCBATCH_DEFLATE_LEN, &used, &olen))
+            XTEST((olen == len) && (memcmp(out, src, len) == 0));
+    }
+    xfree(d);
+    xfree(out);
+}
+
+/**
+ * The member trailer must hold the CRC32 and
+ * the length of the uncompressed data
+ */
+static void testtrailer(LPSVCBATCH_DEFLATE z, LPBYTE src, DWORD len)
+{
+    LPBYTE t;
+    DWORD  crc;
+
+    xzmember(z, src, len);
+    t   = z->data + z->len - 8;
+    crc = (DWORD)crc32(0, src, len);
+    XTEST(xcrc32(0, src, len) == crc);
+    XTEST((t[0] | (t[1] << 8) | (t[2] << 16) | ((DWORD)t[3] << 24)) == crc);
+    XTEST((t[4] | (t[5] << 8) | (t[6] << 16) | ((DWORD)t[7] << 24)) == len);
+    XTEST((z->data[0] == 0x1F) && (z->data[1] == 0x8B) && (z->data[2] == 8));
+}
+
+int main(int argc, char **argv)
+{
+    LPSVCBATCH_DEFLATE z;
+    DWORD  size = 1024 * 1024;
+    LPBYTE s    = (LPBYTE)xmmalloc(size);
+    DWORD  len;
+    DWORD  i;
+
+    z = xzinit();
+
+    /**
+     * Empty and tiny members
+     */
+    roundtrip(z, "empty", s, 0, SVCBATCH_DEFLATE_LEN);
+    s[0] = 'a'; s[1] = 'b'; s[2] = 'a';
+    for (i = 1; i <= 3; i++)
+        roundtrip(z, "tiny", s, i, SVCBATCH_DEFLATE_LEN);
+
+    /**
+     * Long runs use the maximum match length
+     * and the distance of one
+     */
+    memset(s, 'x', size);
+    roundtrip(z, "run", s, size, SVCBATCH_DEFLATE_LEN);
+    testtrailer(z, s, SVCBATCH_DEFLATE_LEN);
+
+    /**
+     * Random data falls back to the stored block
+     */
+    for (i = 0; i < size; i++)
+        s[i] = (BYTE)xtestrand();
+    roundtrip(z, "random", s, size, SVCBATCH_DEFLATE_LEN);
+    testtrailer(z, s, SVCBATCH_DEFLATE_LEN);
+    testtrailer(z, s, 12345);
+    testdamage(z, s, 12345);
+
+    /**
+     * Matches at the largest distances inside the member
+     */
+    for (i = 0; i < SVCBATCH_DEFLATE_LEN / 2; i++)
+        s[i] = (BYTE)xtestrand();
+    memcpy(s + SVCBATCH_DEFLATE_LEN / 2, s, SVCBATCH_DEFLATE_LEN / 2);
+    roundtrip(z, "distance", s, SVCBATCH_DEFLATE_LEN, SVCBATCH_DEFLATE_LEN);
+    s[SVCBATCH_DEFLATE_LEN - 1] = s[0];
+    memmove(s + 1, s, SVCBATCH_DEFLATE_LEN - 1);
+    roundtrip(z, "distance", s, SVCBATCH_DEFLATE_LEN, SVCBATCH_DEFLATE_LEN);
+
+    /**
+     * Log text in the member sizes used by the writer
+     */
+    len = logtext(s, size);
+    roundtrip(z, "text", s, len, SVCBATCH_DEFLATE_LEN);
+    roundtrip(z, "text", s, len, 4096);
+    roundtrip(z, "text", s, len, 1000);
+    for (i = 0; i < 200; i++) {
+        DWORD o = xtestrand() % len;
+        DWORD n = xtestrand() % SVCBATCH_DEFLATE_LEN + 1;
+
+        if ((o + n) > len)
+            n = len - o;
+        roundtrip(z, "text", s + o, n, SVCBATCH_DEFLATE_LEN);
+        testtrailer(z, s + o, n);
+    }
+    testdamage(z, s, SVCBATCH_DEFLATE_LEN);
+
+    if (xtestfailed) {
+        fprintf(stderr, "testzip: %d checks failed\n", xtestfailed);
+        return 1;
+    }
+    if ((argc > 1) && (strcmp(argv[1], "-b") == 0)) {
+        DWORD     bsize = 64 * 1024 * 1024;
+        LPBYTE    b     = (LPBYTE)xmmalloc(bsize);
+        LPBYTE    o     = (LPBYTE)xmmalloc(bsize + bsize / 8);
+        ULONGLONG t;
+        DWORD     n;
+        uLongf    zn;
+
+        len = logtext(b, bsize);
+        t = xtestnsec();
+        n = zmembers(z, b, len, SVCBATCH_DEFLATE_LEN, o);
+        t = xtestnsec() - t;
+        printf("xzmember log text: %5.2f:1, %7.1f MB/s\n",
+               (double)len / (double)n, (double)len * 1000.0 / (double)t);
+        zn = bsize + bsize / 8;
+        t  = xtestnsec();
+        compress2(o, &zn, b, len, 1);
+        t  = xtestnsec() - t;
+        printf("zlib level 1     : %5.2f:1, %7.1f MB/s (single stream)\n",
+               (double)len / (double)zn, (double)len * 1000.0 / (double)t);
+        xfree(b);
+        xfree(o);
+    }
+    xzfree(z);
+    xfree(s);
+    printf("testzip: passed\n");
+    return 0;
+}
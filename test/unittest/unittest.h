@@ -0,0 +1,134 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _UNITTEST_H_INCLUDED_
+#define _UNITTEST_H_INCLUDED_
+
+/**
+ * The subset of Win32 API used by svcutil.h,
+ * mapped to the C library and GCC builtins.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <wchar.h>
+#include <time.h>
+#include <sched.h>
+
+typedef int                 BOOL;
+typedef int                 INT;
+typedef unsigned int        UINT;
+typedef unsigned char       BYTE;
+typedef unsigned short      WORD;
+typedef uint32_t            DWORD;
+typedef int32_t             LONG;
+typedef int64_t             LONGLONG;
+typedef uint64_t            ULONGLONG;
+typedef wchar_t             WCHAR;
+typedef void               *HANDLE;
+typedef void               *LPVOID;
+typedef BYTE               *LPBYTE;
+typedef DWORD              *LPDWORD;
+typedef char               *LPSTR;
+typedef const char         *LPCSTR;
+typedef WCHAR              *LPWSTR;
+typedef const WCHAR        *LPCWSTR;
+
+#define TRUE                1
+#define FALSE               0
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+#define EVENT_MODIFY_STATE  0x0002
+#define ERROR_DISK_FULL     112
+#define ERROR_BUFFER_OVERFLOW 111
+#define ERROR_IO_INCOMPLETE 996
+#define SYNCHRONIZE         0x00100000
+#define __cdecl
+
+#define InterlockedCompareExchange(_d, _x, _c)  __sync_val_compare_and_swap((_d), (_c), (_x))
+#define InterlockedExchange(_d, _v)             __atomic_exchange_n((_d), (_v), __ATOMIC_SEQ_CST)
+#define InterlockedAdd(_d, _v)                  __atomic_add_fetch((_d), (_v), __ATOMIC_SEQ_CST)
+#define InterlockedAdd64(_d, _v)                __atomic_add_fetch((_d), (_v), __ATOMIC_SEQ_CST)
+
+/**
+ * Events are not waited for in the tests
+ */
+static int                  xunittestev;
+#define CreateEventEx(_a, _n, _f, _m)   ((HANDLE)&xunittestev)
+
+static __inline BOOL SetEvent(HANDLE h)
+{
+    return h != NULL;
+}
+
+static __inline BOOL CloseHandle(HANDLE h)
+{
+    return h != NULL;
+}
+
+static __inline BOOL BitScanForward(DWORD *i, DWORD m)
+{
+    if (m == 0)
+        return FALSE;
+    *i = (DWORD)__builtin_ctz(m);
+    return TRUE;
+}
+
+static __inline void *xmmalloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if (p == NULL)
+        abort();
+    return p;
+}
+
+static __inline void *xmcalloc(size_t size)
+{
+    void *p = calloc(1, size);
+
+    if (p == NULL)
+        abort();
+    return p;
+}
+
+static __inline void xfree(void *m)
+{
+    free(m);
+}
+
+static __inline ULONGLONG xtestnsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONGLONG)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Test result helpers
+ */
+static int xtestfailed = 0;
+
+#define XTEST(_c)                                                   \
+    do {                                                            \
+        if (!(_c)) {                                                \
+            fprintf(stderr, "%s:%d: check failed: %s\n",            \
+                    __FILE__, __LINE__, #_c);                       \
+            xtestfailed++;                                          \
+        }                                                           \
+    } while (0)
+
+#endif /* _UNITTEST_H_INCLUDED_ */
@@ -0,0 +1,461 @@
+/**
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <windows.h>
+
+/**
+ * Disable or reduce the frequency of...
+ *   C4100: unreferenced formal parameter
+ *   C4244: int to char/short - precision loss
+ *   C4389: signed/unsigned mismatch
+ *   C4702: unreachable code
+ *   C4996: function was declared deprecated
+ */
+#pragma warning(disable: 4100 4244 4389 4702 4996)
+
+#define IS_INVALID_HANDLE(_h)   (((_h) == NULL) || ((_h) == INVALID_HANDLE_VALUE))
+#define IS_VALID_HANDLE(_h)     (((_h) != NULL) && ((_h) != INVALID_HANDLE_VALUE))
+#define DSIZEOF(_s)             (DWORD)(sizeof(_s))
+
+/**
+ * Must match the SVCBATCH_INDEX_MAGIC
+ * and SVCBATCH_INDEX from svcbatch
+ */
+#define SVCIDX_MAGIC            "SVCBIDX1"
+#define SVCIDX_MAGIC_LEN        8
+#define SVCIDX_BUFSIZ           65536
+#define SVCIDX_DEF_LINES        10
+#define SVCIDX_MAX_ARGS         8
+
+typedef struct _SVCIDX_RECORD {
+    ULONGLONG               time;
+    ULONGLONG               line;
+    ULONGLONG               offset;
+} SVCIDX_RECORD, *LPSVCIDX_RECORD;
+
+static LPSVCIDX_RECORD      records = NULL;
+static DWORD                nrecords = 0;
+
+/** Intrinsic functions */
+void * __cdecl memset(void *, int, size_t);
+#pragma intrinsic(memset)
+#pragma function(memset)
+void * __cdecl memset(void *s, int c, size_t n)
+{
+    unsigned char *d = (unsigned char *)s;
+
+    while (n-- > 0)
+        *d++ = (unsigned char)c;
+    return s;
+}
+
+static LPBYTE xmemlf(LPBYTE s, LPBYTE e)
+{
+    while (s < e) {
+        if (*s == '\n')
+            return s;
+        s++;
+    }
+    return NULL;
+}
+
+static __inline int xisblank(int ch)
+{
+    if ((ch > 0) && (ch < 33))
+        return 1;
+    else
+        return 0;
+}
+
+static __inline int xisdigit(int ch)
+{
+    return ((ch >= L'0') && (ch <= L'9'));
+}
+
+static void *xmalloc(SIZE_T size)
+{
+    return HeapAlloc(GetProcessHeap(), 0, size);
+}
+
+static void xfree(void *mem)
+{
+    if (mem != NULL)
+        HeapFree(GetProcessHeap(), 0, mem);
+}
+
+/**
+ * Parse the decimal number.
+ * Returns the pointer after the last digit, or
+ * NULL if there are no digits or the value overflows.
+ */
+static LPCWSTR xwcstou64(LPCWSTR s, ULONGLONG *v)
+{
+    ULONGLONG n = 0;
+    LPCWSTR   b = s;
+
+    while (xisdigit(*s)) {
+        ULONGLONG d = *s - L'0';
+
+        if (n > (0xFFFFFFFFFFFFFFFFULL - d) / 10)
+            return NULL;
+        n = n * 10 + d;
+        s++;
+    }
+    if (s == b)
+        return NULL;
+    *v = n;
+    return s;
+}
+
+static LPWSTR xultow(DWORD n, LPWSTR e)
+{
+    *(--e) = L'\0';
+    do {
+        *(--e) = (WCHAR)(L'0' + n % 10);
+        n /= 10;
+    } while (n);
+    return e;
+}
+
+/**
+ * Write the strings to the standard error
+ * in the console output code page
+ */
+static void xwperror(LPCWSTR s1, LPCWSTR s2, DWORD rc)
+{
+    HANDLE eh = GetStdHandle(STD_ERROR_HANDLE);
+    LPCWSTR sv[5];
+    WCHAR  nb[16];
+    char   b[MAX_PATH * 4];
+    DWORD  wr;
+    int    i;
+
+    if (IS_INVALID_HANDLE(eh))
+        return;
+    sv[0] = s1;
+    sv[1] = s2;
+    sv[2] = rc ? L" (" : NULL;
+    sv[3] = rc ? xultow(rc, nb + 16) : NULL;
+    sv[4] = rc ? L")" : NULL;
+    for (i = 0; i < 5; i++) {
+        int n;
+
+        if (sv[i] == NULL)
+            continue;
+        n = WideCharToMultiByte(GetConsoleOutputCP(), 0, sv[i], -1,
+                                b, DSIZEOF(b), NULL, NULL);
+        if (n > 1)
+            WriteFile(eh, b, n - 1, &wr, NULL);
+    }
+    WriteFile(eh, "\r\n", 2, &wr, NULL);
+}
+
+static int usage(int rv)
+{
+    xwperror(L"Usage: svcidx <logfile> -t \"YYYY-MM-DD hh:mm:ss\" [lines]", NULL, 0);
+    xwperror(L"       svcidx <logfile> -l <line> [lines]", NULL, 0);
+    return rv;
+}
+
+/**
+ * Split the command line into arguments.
+ * Quotation marks group the blanks and are removed.
+ */
+static int xgetargs(LPWSTR s, LPWSTR *argv)
+{
+    int argc = 0;
+
+    while (*s) {
+        LPWSTR d;
+        BOOL   q = FALSE;
+
+        while (xisblank(*s))
+            s++;
+        if (*s == L'\0')
+            break;
+        if (argc == SVCIDX_MAX_ARGS)
+            break;
+        argv[argc++] = d = s;
+        while (*s && (q || !xisblank(*s))) {
+            if (*s == L'"')
+                q = !q;
+            else
+                *(d++) = *s;
+            s++;
+        }
+        if (*s)
+            s++;
+        *d = L'\0';
+    }
+    return argc;
+}
+
+static DWORD loadindex(LPCWSTR logfile)
+{
+    WCHAR  fn[MAX_PATH * 2];
+    HANDLE fh;
+    LARGE_INTEGER fs;
+    char   mg[SVCIDX_MAGIC_LEN];
+    DWORD  rd;
+    DWORD  rc = 0;
+    int    i;
+
+    if ((lstrlenW(logfile) + 5) > MAX_PATH * 2)
+        return ERROR_BAD_PATHNAME;
+    lstrcpyW(fn, logfile);
+    lstrcatW(fn, L".idx");
+    fh = CreateFileW(fn, GENERIC_READ,
+                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                     NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (IS_INVALID_HANDLE(fh))
+        return GetLastError();
+    if (!GetFileSizeEx(fh, &fs) || (fs.QuadPart < SVCIDX_MAGIC_LEN)) {
+        rc = ERROR_INVALID_DATA;
+        goto finished;
+    }
+    if (!ReadFile(fh, mg, SVCIDX_MAGIC_LEN, &rd, NULL) ||
+        (rd != SVCIDX_MAGIC_LEN)) {
+        rc = ERROR_INVALID_DATA;
+        goto finished;
+    }
+    for (i = 0; i < SVCIDX_MAGIC_LEN; i++) {
+        if (mg[i] != SVCIDX_MAGIC[i]) {
+            rc = ERROR_INVALID_DATA;
+            goto finished;
+        }
+    }
+    /**
+     * Partial record at the end can exist
+     * while the service is writing the index
+     */
+    nrecords = (DWORD)((fs.QuadPart - SVCIDX_MAGIC_LEN) / sizeof(SVCIDX_RECORD));
+    if (nrecords == 0) {
+        rc = ERROR_NO_DATA;
+        goto finished;
+    }
+    records = (LPSVCIDX_RECORD)xmalloc(nrecords * sizeof(SVCIDX_RECORD));
+    if (records == NULL) {
+        rc = ERROR_OUTOFMEMORY;
+        goto finished;
+    }
+    if (!ReadFile(fh, records, nrecords * DSIZEOF(SVCIDX_RECORD), &rd, NULL))
+        rc = GetLastError();
+    else
+        nrecords = rd / DSIZEOF(SVCIDX_RECORD);
+    if ((rc == 0) && (nrecords == 0))
+        rc = ERROR_NO_DATA;
+
+finished:
+    CloseHandle(fh);
+    return rc;
+}
+
+/**
+ * Find the last record with the time or
+ * line less or equal to the key
+ */
+static DWORD findrecord(ULONGLONG key, BOOL bytime)
+{
+    DWORD lo = 0;
+    DWORD hi = nrecords;
+
+    while (lo < hi) {
+        DWORD     m = lo + (hi - lo) / 2;
+        ULONGLONG v = bytime ? records[m].time : records[m].line;
+
+        if (v <= key)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+    return lo ? lo - 1 : 0;
+}
+
+/**
+ * Parse the YYYY-MM-DD [hh[:mm[:ss]]] local time
+ */
+static BOOL parsetime(LPCWSTR s, ULONGLONG *t)
+{
+    static const WCHAR sep[] = { L'-', L'-', L' ', L':', L':', L'\0' };
+    SYSTEMTIME lt;
+    SYSTEMTIME st;
+    FILETIME   ft;
+    WORD      *fv[6];
+    int        i;
+
+    memset(&lt, 0, sizeof(SYSTEMTIME));
+    fv[0] = &lt.wYear;
+    fv[1] = &lt.wMonth;
+    fv[2] = &lt.wDay;
+    fv[3] = &lt.wHour;
+    fv[4] = &lt.wMinute;
+    fv[5] = &lt.wSecond;
+    for (i = 0; i < 6; i++) {
+        ULONGLONG v;
+
+        s = xwcstou64(s, &v);
+        if ((s == NULL) || (v > 0xFFFF))
+            return FALSE;
+        *fv[i] = (WORD)v;
+        if (*s == L'\0')
+            break;
+        if (*s != sep[i])
+            return FALSE;
+        s++;
+    }
+    if (i < 2)
+        return FALSE;
+    if (!TzSpecificLocalTimeToSystemTime(NULL, &lt, &st))
+        return FALSE;
+    if (!SystemTimeToFileTime(&st, &ft))
+        return FALSE;
+    *t = ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return TRUE;
+}
+
+/**
+ * Print count lines starting skip lines
+ * after the line at the offset
+ */
+static DWORD printlines(LPCWSTR logfile, ULONGLONG offset,
+                        ULONGLONG skip, ULONGLONG count)
+{
+    HANDLE fh;
+    HANDLE so;
+    LARGE_INTEGER fp;
+    LPBYTE buf;
+    DWORD  rd;
+    DWORD  wr;
+    DWORD  rc = 0;
+
+    fh = CreateFileW(logfile, GENERIC_READ,
+                     FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                     NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (IS_INVALID_HANDLE(fh))
+        return GetLastError();
+    fp.QuadPart = (LONGLONG)offset;
+    if (!SetFilePointerEx(fh, fp, NULL, FILE_BEGIN)) {
+        rc = GetLastError();
+        CloseHandle(fh);
+        return rc;
+    }
+    buf = (LPBYTE)xmalloc(SVCIDX_BUFSIZ);
+    if (buf == NULL) {
+        CloseHandle(fh);
+        return ERROR_OUTOFMEMORY;
+    }
+    so = GetStdHandle(STD_OUTPUT_HANDLE);
+    while (count && ReadFile(fh, buf, SVCIDX_BUFSIZ, &rd, NULL) && rd) {
+        LPBYTE s = buf;
+        LPBYTE e = buf + rd;
+        LPBYTE p;
+
+        while (skip && (s < e)) {
+            p = xmemlf(s, e);
+            if (p == NULL) {
+                s = e;
+                break;
+            }
+            s = p + 1;
+            skip--;
+        }
+        p = s;
+        while (count && (p < e)) {
+            LPBYTE x = xmemlf(p, e);
+
+            if (x == NULL) {
+                p = e;
+                break;
+            }
+            p = x + 1;
+            count--;
+        }
+        if ((p > s) && !WriteFile(so, s, (DWORD)(p - s), &wr, NULL)) {
+            rc = GetLastError();
+            break;
+        }
+    }
+    xfree(buf);
+    CloseHandle(fh);
+    return rc;
+}
+
+int WINAPI svcidxMain(void)
+{
+    LPWSTR    argv[SVCIDX_MAX_ARGS];
+    ULONGLONG key   = 0;
+    ULONGLONG count = SVCIDX_DEF_LINES;
+    ULONGLONG skip  = 0;
+    BOOL      bytime;
+    DWORD     rc;
+    DWORD     i;
+    int       argc;
+
+    SetErrorMode(SEM_FAILCRITICALERRORS | SEM_NOOPENFILEERRORBOX | SEM_NOGPFAULTERRORBOX);
+    argc = xgetargs(GetCommandLineW(), argv);
+    if (argc < 4) {
+        rc = usage(ERROR_INVALID_PARAMETER);
+        goto finished;
+    }
+    if (lstrcmpW(argv[2], L"-t") == 0) {
+        bytime = TRUE;
+        if (!parsetime(argv[3], &key)) {
+            xwperror(L"Invalid time ", argv[3], 0);
+            rc = ERROR_INVALID_PARAMETER;
+            goto finished;
+        }
+    }
+    else if (lstrcmpW(argv[2], L"-l") == 0) {
+        LPCWSTR e;
+
+        bytime = FALSE;
+        e = xwcstou64(argv[3], &key);
+        if ((e == NULL) || *e) {
+            xwperror(L"Invalid line ", argv[3], 0);
+            rc = ERROR_INVALID_PARAMETER;
+            goto finished;
+        }
+    }
+    else {
+        rc = usage(ERROR_INVALID_PARAMETER);
+        goto finished;
+    }
+    if (argc > 4) {
+        LPCWSTR e = xwcstou64(argv[4], &count);
+
+        if ((e == NULL) || *e) {
+            xwperror(L"Invalid number of lines ", argv[4], 0);
+            rc = ERROR_INVALID_PARAMETER;
+            goto finished;
+        }
+    }
+
+    rc = loadindex(argv[1]);
+    if (rc) {
+        xwperror(L"Cannot load index for ", argv[1], rc);
+        goto finished;
+    }
+    i = findrecord(key, bytime);
+    if (!bytime && (key > records[i].line))
+        skip = key - records[i].line;
+    rc = printlines(argv[1], records[i].offset, skip, count);
+    if (rc)
+        xwperror(L"Cannot read ", argv[1], rc);
+
+finished:
+    xfree(records);
+    ExitProcess(rc);
+    return rc;
+}